@@ -0,0 +1,127 @@
+#include "chat_commands.h"
+
+#include <algorithm>
+#include <cstddef>
+
+using namespace std;
+
+namespace
+{
+  using Command = ChatCommands::Command;
+
+  struct Entry
+  {
+    std::string_view name;
+    Command command = Command::UNKNOWN;
+  };
+
+  constexpr Entry COMMANDS[] = {
+    {"nick", Command::NICK},
+    {"join", Command::JOIN},
+    {"part", Command::PART},
+    {"msg", Command::MSG},
+    {"who", Command::WHO},
+    {"history", Command::HISTORY},
+    {"resume", Command::RESUME},
+  };
+
+  constexpr size_t TABLE_SIZE = 16;     // power of two: the modulo is a mask
+
+  constexpr uint32_t hash(std::string_view name, uint32_t seed)
+  {
+    uint32_t h = seed;
+    for(char c : name)
+    {
+      h = (h ^ static_cast<unsigned char>(c)) * 16777619u;
+    }
+    return h;
+  }
+
+  constexpr bool collision_free(uint32_t seed)
+  {
+    bool used[TABLE_SIZE] = {};
+    for(const Entry& e : COMMANDS)
+    {
+      const size_t slot = hash(e.name, seed) % TABLE_SIZE;
+      if(used[slot])
+      {
+        return false;
+      }
+      used[slot] = true;
+    }
+    return true;
+  }
+
+  // The first seed from the FNV offset basis on that separates all names.
+  constexpr uint32_t find_seed()
+  {
+    for(uint32_t seed = 2166136261u; seed != 2166136261u + 100000; ++seed)
+    {
+      if(collision_free(seed))
+      {
+        return seed;
+      }
+    }
+    return 0;
+  }
+
+  constexpr uint32_t SEED = find_seed();
+  static_assert(SEED != 0, "no perfect hash seed for the command names");
+
+  struct Table
+  {
+    Entry slots[TABLE_SIZE];
+    size_t longest = 0;
+  };
+
+  constexpr Table build_table()
+  {
+    Table table{};
+    for(const Entry& e : COMMANDS)
+    {
+      table.slots[hash(e.name, SEED) % TABLE_SIZE] = e;
+      table.longest = e.name.size() > table.longest ? e.name.size() : table.longest;
+    }
+    return table;
+  }
+
+  constexpr Table TABLE = build_table();
+
+  constexpr Command lookup(std::string_view name)
+  {
+    if(name.size() > TABLE.longest)
+    {
+      return Command::UNKNOWN;
+    }
+    const Entry& e = TABLE.slots[hash(name, SEED) % TABLE_SIZE];
+    return e.name == name ? e.command : Command::UNKNOWN;
+  }
+
+  static_assert(lookup("history") == Command::HISTORY && lookup("msg") == Command::MSG
+    && lookup("mgs") == Command::UNKNOWN, "command table lookup");
+}
+
+ChatCommands::Parsed ChatCommands::parse(std::string_view line)
+{
+  Parsed parsed;
+  if(line.empty() || line[0] != '/')
+  {
+    return parsed;
+  }
+
+  line.remove_prefix(1);
+  parsed.name = next_word(line);
+  parsed.args = line;
+  parsed.command = lookup(parsed.name);
+  return parsed;
+}
+
+std::string_view ChatCommands::next_word(std::string_view& args)
+{
+  const size_t end = std::min(args.find(' '), args.size());
+  const std::string_view word = args.substr(0, end);
+  args.remove_prefix(end);
+  const size_t next = args.find_first_not_of(' ');
+  args.remove_prefix(next == std::string_view::npos ? args.size() : next);
+  return word;
+}
@@ -0,0 +1,53 @@
+#ifndef CHAT_COMMANDS_H
+#define CHAT_COMMANDS_H
+
+#include <cstdint>
+#include <string_view>
+
+/* Chat command parser.
+ * A line starting with '/' is a command, "/<name> <args>"; any other line
+ * is chat and costs parse() one byte compare.
+ *
+  | Command                | Args                                            |
+  | ---------------------- | ----------------------------------------------- |
+  | `/nick <name>`         | new nickname                                    |
+  | `/join <room>`         | room to enter                                   |
+  | `/part`                | none: back to the lobby                         |
+  | `/msg <nick> <text>`   | receiver, then the text                         |
+  | `/who`                 | none: members of the current room               |
+  | `/history [n]`         | how many recent messages, default 10            |
+  | `/history since <age>` | messages younger than <age>: 90s, 15m, 2h, 1d   |
+  | `/resume <room> <seq>` | room and the last sequence number seen          |
+ *
+ * The name is looked up in a perfect hash table built at compile time: a
+ * constexpr search picks the FNV-1a seed under which every name gets its
+ * own slot, so a lookup is one hash of the name, one slot and one length
+ * and byte check that rejects names not in the table. Nothing is copied:
+ * the name and the arguments are string_views into the caller's buffer,
+ * and next_word() splits arguments the same way.
+*/
+class ChatCommands
+{
+  public:
+    enum class Command : uint8_t
+    {
+      NONE,                           // not a command: chat
+      UNKNOWN,                        // '/' followed by no known name
+      NICK, JOIN, PART, MSG, WHO, HISTORY, RESUME
+    };
+
+    struct Parsed
+    {
+      Command command = Command::NONE;
+      std::string_view name;          // without the '/'
+      std::string_view args;          // leading spaces skipped
+    };
+
+    // `line` without its line ending.
+    static Parsed parse(std::string_view line);
+    // Removes the first space separated word from `args` and returns it;
+    // empty once `args` is.
+    static std::string_view next_word(std::string_view& args);
+};
+
+#endif
@@ -0,0 +1,520 @@
+#include "chat_federation.h"
+
+#include "tcp_server.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace
+{
+  const size_t HEADER_BYTES = 1 + 2 + 4;
+  // A peer sending more than this in one frame is broken.
+  const uint32_t MAX_TEXT_BYTES = 1 << 20;
+  // Frames queued on a link are sent in batches of up to this many bytes.
+  const size_t SEND_BATCH_BYTES = 64 * 1024;
+  const int RECONNECT_MS = 500;
+  // A node that does not answer a connect is retried like a refusing one.
+  const int CONNECT_TIMEOUT_MS = 1000;
+  // How often an idle link checks that its peer is still there.
+  const int LIVENESS_MS = 200;
+
+  void split_host_port(const std::string& name, std::string& host, int& port)
+  {
+    const size_t colon = name.rfind(':');
+    if(colon == std::string::npos || colon == 0 || colon + 1 == name.size())
+    {
+      throw std::invalid_argument("relay node \"" + name + "\" is not host:port");
+    }
+    host = name.substr(0, colon);
+    port = std::stoi(name.substr(colon + 1));
+  }
+
+  int connect_to(const std::string& host, int port)
+  {
+    addrinfo hints{};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* res = nullptr;
+    if(getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res) != 0)
+    {
+      return -1;
+    }
+
+    // Non-blocking only for the connect: an unreachable host would hold
+    // the link thread (and stop()) for the kernel's SYN retries.
+    int fd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK, res->ai_protocol);
+    bool ok = fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) == 0;
+    if(fd >= 0 && !ok && errno == EINPROGRESS)
+    {
+      pollfd pfd{fd, POLLOUT, 0};
+      int error = 0;
+      socklen_t length = sizeof(error);
+      ok = poll(&pfd, 1, CONNECT_TIMEOUT_MS) == 1 &&
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0;
+    }
+    freeaddrinfo(res);
+    if(!ok)
+    {
+      if(fd >= 0)
+      {
+        close(fd);
+      }
+      return -1;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    // A peer that stops reading must not stall the link forever.
+    timeval timeout{2, 0};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return fd;
+  }
+
+  bool send_all(int fd, const std::string& data)
+  {
+    size_t sent = 0;
+    while(sent < data.size())
+    {
+      const ssize_t n = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+      if(n < 0)
+      {
+        if(errno == EINTR)
+        {
+          continue;
+        }
+        return false;
+      }
+      sent += n;
+    }
+    return true;
+  }
+}
+
+// Reads frames from the incoming links, on the relay thread.
+class ChatFederation::Inbound : public IClientHandler
+{
+  public:
+    explicit Inbound(ChatFederation& owner) : owner(owner) {}
+
+    void on_client_connect(ConnectionHandle conn) override
+    {
+      peers[conn] = Peer();
+    }
+
+    void on_client_data(ConnectionHandle conn, const char* data, ssize_t len) override
+    {
+      Peer& peer = peers[conn];
+      if(peer.broken)
+      {
+        return;
+      }
+      peer.buffer.append(data, len);
+
+      size_t pos = 0;
+      while(peer.buffer.size() - pos >= HEADER_BYTES)
+      {
+        const char* p = peer.buffer.data() + pos;
+        uint16_t room_len;
+        uint32_t text_len;
+        memcpy(&room_len, p + 1, sizeof(room_len));
+        memcpy(&text_len, p + 3, sizeof(text_len));
+        room_len = ntohs(room_len);
+        text_len = ntohl(text_len);
+        if(text_len > MAX_TEXT_BYTES)
+        {
+          // Closed, not just ignored: its link sees the close and
+          // reconnects instead of filling our receive buffer forever.
+          std::cerr << "relay: oversized frame, closing the peer\n";
+          peer.broken = true;
+          peer.buffer.clear();
+          ConnectionTable::global().shutdown(conn);
+          return;
+        }
+        if(peer.buffer.size() - pos < HEADER_BYTES + room_len + text_len)
+        {
+          break;
+        }
+
+        const std::string room(p + HEADER_BYTES, room_len);
+        const std::string text(p + HEADER_BYTES + room_len, text_len);
+        handle(conn, peer, static_cast<FrameType>(p[0]), room, text);
+        pos += HEADER_BYTES + room_len + text_len;
+      }
+      peer.buffer.erase(0, pos);
+    }
+
+    void on_client_disconnect(ConnectionHandle conn) override
+    {
+      auto it = peers.find(conn);
+      if(it == peers.end())
+      {
+        return;
+      }
+      if(owns_interest(conn, it->second))
+      {
+        owner.drop_interest(it->second.link);
+        current.erase(it->second.link);
+      }
+      peers.erase(it);
+    }
+
+  private:
+    struct Peer
+    {
+      std::string buffer;
+      Link* link = nullptr;           // our link back to it, after HELLO
+      bool broken = false;
+    };
+
+    ChatFederation& owner;
+    std::unordered_map<ConnectionHandle, Peer> peers;
+    // Link -> the incoming connection its subscriptions came from. A peer
+    // that reconnects before its old connection is noticed dead must not
+    // lose its new subscriptions when the old one closes.
+    std::unordered_map<Link*, ConnectionHandle> current;
+
+    bool owns_interest(ConnectionHandle conn, const Peer& peer) const
+    {
+      auto it = current.find(peer.link);
+      return peer.link != nullptr && it != current.end() && it->second == conn;
+    }
+
+    void handle(ConnectionHandle conn, Peer& peer, FrameType type,
+      const std::string& room, const std::string& text)
+    {
+      switch(type)
+      {
+        case FrameType::HELLO:
+          // Unknown nodes may send us messages; we just never relay to them.
+          peer.link = owner.link_of(room);
+          if(peer.link != nullptr)
+          {
+            owner.drop_interest(peer.link);
+            current[peer.link] = conn;
+          }
+          break;
+        case FrameType::SUBSCRIBE:
+        case FrameType::UNSUBSCRIBE:
+          if(owns_interest(conn, peer))
+          {
+            owner.set_interest(peer.link, room, type == FrameType::SUBSCRIBE);
+          }
+          break;
+        case FrameType::MESSAGE:
+          owner.relay_in(peer.link, room, text);
+          break;
+        default:
+          std::cerr << "relay: unknown frame type " << int(type) << "\n";
+          break;
+      }
+    }
+};
+
+ChatFederation::ChatFederation(const std::string& self, std::vector<std::string> peers,
+  DeliverFn deliver) :
+  self(self), deliver(std::move(deliver))
+{
+  ring.add(self);
+
+  std::string host;
+  int port;
+  split_host_port(self, host, port);
+
+  // Every node may be given the same list; it skips its own name.
+  peers.erase(std::remove(peers.begin(), peers.end(), self), peers.end());
+  for(const auto& peer : peers)
+  {
+    auto link = std::make_unique<Link>();
+    link->peer = peer;
+    split_host_port(peer, link->host, link->port);
+    links.push_back(std::move(link));
+  }
+
+  inbound = std::make_shared<Inbound>(*this);
+  relay_server = std::make_unique<TcpServer>(port, inbound);
+  relay_thread = std::thread([this] { relay_server->run(); });
+  for(auto& link : links)
+  {
+    link->worker = std::thread(&ChatFederation::link_loop, this, std::ref(*link));
+  }
+}
+
+ChatFederation::~ChatFederation()
+{
+  stop();
+}
+
+void ChatFederation::stop()
+{
+  {
+    std::lock_guard<std::mutex> lk(stop_mutex);
+    if(stopping)
+    {
+      return;
+    }
+    stopping = true;
+  }
+  stop_cv.notify_all();
+
+  relay_server->stop();
+  relay_thread.join();
+  for(auto& link : links)
+  {
+    link->outbox.close();
+    link->worker.join();
+  }
+}
+
+void ChatFederation::subscribe(const std::string& room)
+{
+  std::lock_guard<std::mutex> lk(rooms_mutex);
+  if(local_rooms.insert(room).second)
+  {
+    send_to(ring.owner(room), frame(FrameType::SUBSCRIBE, room));
+  }
+}
+
+void ChatFederation::unsubscribe(const std::string& room)
+{
+  std::lock_guard<std::mutex> lk(rooms_mutex);
+  if(local_rooms.erase(room) > 0)
+  {
+    send_to(ring.owner(room), frame(FrameType::UNSUBSCRIBE, room));
+  }
+}
+
+void ChatFederation::publish(const std::string& room, const std::string& text)
+{
+  std::shared_lock<std::shared_mutex> lk(interest_mutex);
+  const std::string& owner = ring.owner(room);
+  if(owner != self)
+  {
+    send_to(owner, frame(FrameType::MESSAGE, room, text));
+    return;
+  }
+
+  auto it = interest.find(room);
+  if(it == interest.end())
+  {
+    return;
+  }
+
+  const std::string message = frame(FrameType::MESSAGE, room, text);
+  for(Link* link : it->second)
+  {
+    if(link->connected.load(std::memory_order_acquire))
+    {
+      link->outbox.push(message);
+    }
+  }
+}
+
+std::string ChatFederation::frame(FrameType type, const std::string& room,
+  const std::string& text)
+{
+  const uint16_t room_len = htons(static_cast<uint16_t>(std::min<size_t>(room.size(), UINT16_MAX)));
+  const uint32_t text_len = htonl(static_cast<uint32_t>(text.size()));
+
+  std::string out;
+  out.reserve(HEADER_BYTES + room.size() + text.size());
+  out += static_cast<char>(type);
+  out.append(reinterpret_cast<const char*>(&room_len), sizeof(room_len));
+  out.append(reinterpret_cast<const char*>(&text_len), sizeof(text_len));
+  out.append(room, 0, UINT16_MAX);
+  out += text;
+  return out;
+}
+
+void ChatFederation::relay_in(Link* from, const std::string& room, const std::string& text)
+{
+  deliver(room, text);
+
+  std::shared_lock<std::shared_mutex> lk(interest_mutex);
+  auto it = interest.find(room);
+  if(ring.owner(room) != self || it == interest.end())
+  {
+    return;
+  }
+
+  const std::string message = frame(FrameType::MESSAGE, room, text);
+  for(Link* link : it->second)
+  {
+    if(link != from && link->connected.load(std::memory_order_acquire))
+    {
+      link->outbox.push(message);
+    }
+  }
+}
+
+void ChatFederation::send_to(const std::string& node, const std::string& frame)
+{
+  if(node == self)
+  {
+    return;
+  }
+  Link* link = link_of(node);
+  if(link != nullptr && link->connected.load(std::memory_order_acquire))
+  {
+    link->outbox.push(frame);
+  }
+}
+
+void ChatFederation::update_ring(Link& link, bool up)
+{
+  const HashRing before = ring;
+  {
+    std::unique_lock<std::shared_mutex> lk(interest_mutex);
+    if(up)
+    {
+      ring.add(link.peer);
+    }
+    else
+    {
+      ring.remove(link.peer);
+    }
+  }
+
+  for(const auto& room : local_rooms)
+  {
+    const std::string& was = before.owner(room);
+    const std::string& now = ring.owner(room);
+    if(was != now)
+    {
+      send_to(was, frame(FrameType::UNSUBSCRIBE, room));
+      send_to(now, frame(FrameType::SUBSCRIBE, room));
+    }
+  }
+}
+
+void ChatFederation::link_loop(Link& link)
+{
+  while(true)
+  {
+    const int fd = connect_to(link.host, link.port);
+    if(fd < 0)
+    {
+      std::unique_lock<std::mutex> lk(stop_mutex);
+      if(stop_cv.wait_for(lk, std::chrono::milliseconds(RECONNECT_MS),
+        [this] { return stopping; }))
+      {
+        return;
+      }
+      continue;
+    }
+
+    // The room list, the ring and `connected` change together under
+    // rooms_mutex, so every subscription change after this snapshot is
+    // queued behind it. The peer's own subscriptions go in the snapshot;
+    // the other links get the moves away from their nodes.
+    std::string batch = frame(FrameType::HELLO, self);
+    {
+      std::lock_guard<std::mutex> lk(rooms_mutex);
+      update_ring(link, true);
+      for(const auto& room : local_rooms)
+      {
+        if(ring.owner(room) == link.peer)
+        {
+          batch += frame(FrameType::SUBSCRIBE, room);
+        }
+      }
+      link.connected.store(true, std::memory_order_release);
+    }
+
+    bool ok = send_all(fd, batch);
+    std::string next;
+    while(ok)
+    {
+      if(!link.outbox.wait_pop_for(next, std::chrono::milliseconds(LIVENESS_MS)))
+      {
+        if(link.outbox.is_closed())
+        {
+          break;
+        }
+        // The peer never writes on this link: readable means it closed or
+        // died. Noticing that while idle takes it off the ring before the
+        // next line is routed to it.
+        pollfd pfd{fd, POLLIN, 0};
+        ok = poll(&pfd, 1, 0) == 0;
+        continue;
+      }
+      batch = std::move(next);
+      while(batch.size() < SEND_BATCH_BYTES && link.outbox.try_pop(next))
+      {
+        batch += next;
+      }
+      ok = send_all(fd, batch);
+    }
+
+    {
+      std::lock_guard<std::mutex> lk(rooms_mutex);
+      link.connected.store(false, std::memory_order_release);
+      while(link.outbox.try_pop(next))
+      {
+      }
+      update_ring(link, false);
+    }
+    close(fd);
+
+    if(ok)
+    {
+      return;                         // outbox closed: stopping
+    }
+    std::cerr << "relay: lost link to " << link.peer << ", reconnecting\n";
+  }
+}
+
+ChatFederation::Link* ChatFederation::link_of(const std::string& peer)
+{
+  for(auto& link : links)
+  {
+    if(link->peer == peer)
+    {
+      return link.get();
+    }
+  }
+  return nullptr;
+}
+
+void ChatFederation::set_interest(Link* link, const std::string& room, bool interested)
+{
+  std::unique_lock<std::shared_mutex> lk(interest_mutex);
+  std::vector<Link*>& subscribers = interest[room];
+  auto it = std::find(subscribers.begin(), subscribers.end(), link);
+  if(interested && it == subscribers.end())
+  {
+    subscribers.push_back(link);
+  }
+  else if(!interested && it != subscribers.end())
+  {
+    subscribers.erase(it);
+  }
+  if(subscribers.empty())
+  {
+    interest.erase(room);
+  }
+}
+
+void ChatFederation::drop_interest(Link* link)
+{
+  std::unique_lock<std::shared_mutex> lk(interest_mutex);
+  for(auto it = interest.begin(); it != interest.end(); )
+  {
+    auto& subscribers = it->second;
+    subscribers.erase(std::remove(subscribers.begin(), subscribers.end(), link),
+      subscribers.end());
+    it = subscribers.empty() ? interest.erase(it) : std::next(it);
+  }
+}
@@ -0,0 +1,156 @@
+#ifndef CHAT_FEDERATION_H
+#define CHAT_FEDERATION_H
+
+#include "hash_ring.h"
+#include "mpsc_mailbox.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+class TcpServer;
+
+/* Chat rooms shared by several server processes.
+ * Every node (a chat server process) listens on a relay port and keeps one
+ * outgoing link to each peer it was given, so a full mesh of N nodes has
+ * N * (N - 1) one-way links. A node only ever writes to its outgoing links
+ * and only reads from the incoming ones:
+ *
+ *    node A  --- A's subscriptions, A's messages --->  node B
+ *    node A  <-- B's subscriptions, B's messages ----  node B
+ *
+ * Room placement: every room has an owner node, picked by a consistent
+ * HashRing over the nodes this one currently has a link to (and itself).
+ * The owner is the room's hub:
+ *
+ *   subscriber C --SUBSCRIBE room--> owner O <--SUBSCRIBE room-- subscriber D
+ *   C says a line:   C --MESSAGE--> O --MESSAGE--> D   (and O's own members)
+ *   O says a line:   O --MESSAGE--> C, D
+ *
+ * Interest propagation: a node subscribes to a room at the room's owner
+ * when the room gets its first local member and unsubscribes when the last
+ * one leaves; the owner never needs to subscribe anywhere. A link that
+ * (re)connects starts with HELLO and the node's rooms owned by that peer,
+ * so a restarted peer catches up.
+ *
+ * Relay: a chat line said on a node is fanned out to the node's own members
+ * as before and sent once, to the owner; the owner fans it out to its own
+ * members and sends it once to each other subscribed node, which only fan
+ * it out locally. Each room's traffic is thus handled by one node plus the
+ * nodes that hold its members; a node never sees a room it has no members
+ * in, and a room with members on one node only costs no relay traffic.
+ *
+ * Rebalancing: when a link comes up or goes down the ring gains or loses
+ * that node, and only the rooms whose owner changed (about 1/N of them)
+ * move their subscription from the old owner to the new one. Nodes may
+ * briefly disagree about an owner while a link is changing; lines relayed
+ * in that window can reach fewer nodes.
+ *
+  | Frame        | room field         | text field                       |
+  | ------------ | ------------------ | -------------------------------- |
+  | HELLO        | sender's node name | -                                |
+  | SUBSCRIBE    | room               | -                                |
+  | UNSUBSCRIBE  | room               | -                                |
+  | MESSAGE      | room               | chat line, as members receive it |
+ *
+ *   frame: | type u8 | room length u16 | text length u32 | room | text |
+ *
+ * Lengths are in network byte order. Sequence numbers are not relayed:
+ * each node numbers and records the room's lines, relayed ones included,
+ * in its own history, so /resume works against whichever node the client
+ * reconnects to, with that node's numbers.
+ *
+ * A node's name is the "host:port" of its relay listener, and peers are
+ * configured with the same strings. Messages published while a link is
+ * down are dropped; subscriptions are not lost, since the reconnect sends
+ * the full list.
+*/
+class ChatFederation
+{
+  public:
+    // Called on the relay thread for every MESSAGE a peer sends.
+    using DeliverFn = std::function<void(const std::string& room, const std::string& text)>;
+
+    // `self`: "host:port" this node listens on and is known by. `peers`:
+    // the other nodes' names. Throws if the relay port can not be bound.
+    ChatFederation(const std::string& self, std::vector<std::string> peers,
+      DeliverFn deliver);
+    // Calls stop().
+    ~ChatFederation();
+
+    ChatFederation(const ChatFederation&) = delete;
+    ChatFederation& operator=(const ChatFederation&) = delete;
+
+    // Ends relaying: no more deliver calls once this returns. The other
+    // calls stay safe and do nothing.
+    void stop();
+
+    // The room got its first / lost its last local member.
+    void subscribe(const std::string& room);
+    void unsubscribe(const std::string& room);
+    // Sends a locally said line to the room's owner, or, on the owner, to
+    // the nodes subscribed to it. Calls for one room must be serialized
+    // (they are: under its sequencing lock).
+    void publish(const std::string& room, const std::string& text);
+
+  private:
+    enum class FrameType : uint8_t { HELLO = 1, SUBSCRIBE, UNSUBSCRIBE, MESSAGE };
+
+    struct Link
+    {
+      std::string peer;
+      std::string host;
+      int port = 0;
+      MpscMailbox<std::string> outbox;
+      std::atomic<bool> connected{false};
+      std::thread worker;
+    };
+
+    class Inbound;
+
+    const std::string self;
+    const DeliverFn deliver;
+    std::vector<std::unique_ptr<Link>> links;
+
+    std::mutex rooms_mutex;           // local rooms; link (re)connects
+    std::unordered_set<std::string> local_rooms;
+
+    // Changed under both locks, so either one is enough to read it.
+    HashRing ring;
+    // Rooms owned here: room -> links of the nodes subscribed to it.
+    std::shared_mutex interest_mutex;
+    std::unordered_map<std::string, std::vector<Link*>> interest;
+
+    std::shared_ptr<Inbound> inbound;
+    std::unique_ptr<TcpServer> relay_server;
+    std::thread relay_thread;
+
+    std::mutex stop_mutex;
+    std::condition_variable stop_cv;
+    bool stopping = false;
+
+    static std::string frame(FrameType type, const std::string& room,
+      const std::string& text = "");
+    // Pushes to the node's link if it is connected; nothing for self.
+    void send_to(const std::string& node, const std::string& frame);
+    void link_loop(Link& link);
+    // Adds or removes the link's node and moves the subscriptions of the
+    // rooms whose owner changed. Caller holds rooms_mutex.
+    void update_ring(Link& link, bool up);
+    // A MESSAGE from `from`: fan out here and, on the owner, to the others.
+    void relay_in(Link* from, const std::string& room, const std::string& text);
+    Link* link_of(const std::string& peer);
+    void set_interest(Link* link, const std::string& room, bool interested);
+    void drop_interest(Link* link);
+};
+
+#endif
@@ -0,0 +1,1005 @@
+#include "chat_handlers.h"
+#include "chat_commands.h"
+
+#include <iostream>
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdlib>
+#include <iterator>
+#include <optional>
+#include <sys/socket.h>
+
+using namespace std;
+
+void EchoHandler::on_client_data(ConnectionHandle conn, const char* data, ssize_t len)
+{
+  std::string msg(data, len);
+  std::cout << "Client " << conn.slot << ": " << msg;
+  send(conn, data, len);
+}
+
+void EchoHandler::on_client_connect(ConnectionHandle conn)
+{
+  std::cout << "Client connected: FD = " << conn.slot << "\n";
+}
+
+void EchoHandler::on_client_disconnect(ConnectionHandle conn)
+{
+  std::cout << "Client disconnected: FD = " << conn.slot<< "\n";
+}
+
+namespace
+{
+  const char* const DEFAULT_ROOM = "lobby";
+  // resume_after of a sequenced JOIN that wants no replay.
+  const uint64_t NO_REPLAY = UINT64_MAX;
+  // "/history" without a count.
+  const uint64_t DEFAULT_HISTORY_LINES = 10;
+  // How often the moderation list file is checked for changes.
+  const unsigned MODERATION_CHECK_MS = 2000;
+
+  uint64_t now_us()
+  {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+  }
+
+  // "90", "90s", "15m", "2h" or "1d": an age in microseconds.
+  bool parse_age(std::string_view word, uint64_t& age_us)
+  {
+    uint64_t n = 0;
+    const char* end = word.data() + word.size();
+    const auto parsed = std::from_chars(word.data(), end, n);
+    if(parsed.ec != std::errc())
+    {
+      return false;
+    }
+    const std::string_view unit(parsed.ptr, end - parsed.ptr);
+    const uint64_t unit_sec = unit.empty() || unit == "s" ? 1 : unit == "m" ? 60
+      : unit == "h" ? 3600 : unit == "d" ? 86400 : 0;
+    if(unit_sec == 0 || n > UINT64_MAX / 1000000 / unit_sec)
+    {
+      return false;
+    }
+    age_us = n * unit_sec * 1000000;
+    return true;
+  }
+
+  std::string sequenced_line(uint64_t seq, const std::string& text)
+  {
+    return "#" + std::to_string(seq) + " " + text;
+  }
+}
+
+BroadCastChatHandler::BroadCastChatHandler(size_t shard_count,
+  const std::string& history_dir, RetentionPolicy retention) :
+  history(history_dir, HistoryStore::DEFAULT_RING_CAPACITY, retention)
+{
+  for(size_t i = 0; i < shard_count; ++i)
+  {
+    shards.push_back(std::make_unique<Shard>());
+  }
+  for(auto& shard : shards)
+  {
+    shard->worker = std::thread(&BroadCastChatHandler::shard_loop, this,
+      std::ref(*shard));
+  }
+}
+
+BroadCastChatHandler::~BroadCastChatHandler()
+{
+  moderation_watcher.reset();
+  delete moderation.load();
+  // No relayed lines may arrive once the shards are gone.
+  if(federation)
+  {
+    federation->stop();
+  }
+  for(auto& shard : shards)
+  {
+    shard->mailbox.close();
+    shard->worker.join();
+  }
+}
+
+void BroadCastChatHandler::federate(const std::string& self,
+  const std::vector<std::string>& peers)
+{
+  federation = std::make_unique<ChatFederation>(self, peers,
+    [this](const std::string& room, const std::string& text) {
+      RoomCommand cmd{RoomCommand::Kind::SAY, ConnectionHandle(), room, text};
+      cmd.relayed = true;
+      post(std::move(cmd));
+    });
+}
+
+void BroadCastChatHandler::replicate_to(const std::string& socket_path)
+{
+  replicator = std::make_unique<ChatReplicator>(socket_path,
+    [this](std::string& out) { snapshot(out); });
+}
+
+void BroadCastChatHandler::follow(const std::string& socket_path)
+{
+  std::cout << "standby: following the primary at " << socket_path << "\n";
+  auto sessions = ChatStandby(socket_path).follow(history);
+
+  std::lock_guard<std::mutex> lk(restored_mutex);
+  for(auto& entry : sessions)
+  {
+    restored[entry.second.nick] = std::move(entry.second);
+  }
+  std::cout << "standby: primary gone, taking over " << restored.size()
+            << " sessions\n";
+}
+
+void BroadCastChatHandler::snapshot_to(const std::string& path, unsigned interval_ms)
+{
+  const auto start = std::chrono::steady_clock::now();
+  size_t sessions = 0, rooms = 0, messages = 0;
+  {
+    MappedSnapshot saved(path);
+    for(size_t i = 0; i < saved.room_count(); ++i)
+    {
+      const MappedSnapshot::Room room = saved.room(i);
+      const std::shared_ptr<RoomHistory> room_history = history.room(std::string(room.name));
+      if(!room_history)
+      {
+        continue;
+      }
+      {
+        std::lock_guard<std::mutex> lk(room_history->mutex());
+        for(size_t r = room.first_record; r < room.first_record + room.record_count; ++r)
+        {
+          const MappedSnapshot::Record rec = saved.record(r);
+          messages += room_history->restore({rec.seq, rec.time_us, std::string(rec.text)});
+        }
+      }
+      room_history->flush();
+      ++rooms;
+    }
+
+    std::lock_guard<std::mutex> lk(restored_mutex);
+    for(size_t i = 0; i < saved.session_count(); ++i)
+    {
+      const MappedSnapshot::Session session = saved.session(i);
+      restored[std::string(session.nick)] =
+        {std::string(session.nick), std::string(session.room), session.sequenced};
+      ++sessions;
+    }
+  }
+  const auto ms = std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now() - start).count() / 1000.0;
+  std::cout << "snapshot: restored " << sessions << " sessions, " << rooms
+            << " rooms, " << messages << " messages in " << ms << " ms\n";
+
+  snapshots = std::make_unique<SnapshotWriter>(path, interval_ms,
+    [this] { return capture(); });
+}
+
+bool BroadCastChatHandler::save_snapshot()
+{
+  if(!snapshots)
+  {
+    return false;
+  }
+  snapshots->stop();
+  return snapshots->write_now();
+}
+
+void BroadCastChatHandler::moderate(const std::string& path)
+{
+  moderation_watcher = std::make_unique<KeywordListWatcher>(path, MODERATION_CHECK_MS,
+    [this, path](std::unique_ptr<KeywordFilter> filter) {
+      std::cout << "moderation: " << filter->size() << " words from " << path << "\n";
+      const KeywordFilter* old = moderation.exchange(filter.release(), std::memory_order_acq_rel);
+      if(old != nullptr)
+      {
+        epoch.retire(old);
+      }
+    });
+}
+
+bool BroadCastChatHandler::blocked(const std::string& line)
+{
+  EpochGuard guard(epoch);
+  const KeywordFilter* filter = moderation.load(std::memory_order_acquire);
+  return filter != nullptr && filter->matches(line);
+}
+
+void BroadCastChatHandler::on_client_connect(ConnectionHandle conn)
+{
+  {
+    SessionStripe& stripe = stripe_of(conn);
+    std::lock_guard<std::mutex> lk(stripe.mutex);
+    Session& session = stripe.sessions[conn];
+    session = Session();
+    session.room = DEFAULT_ROOM;
+  }
+
+  // Silent join: clients are lobby members (and see its traffic) before
+  // they have picked a nickname, as they always were.
+  Room* joined = post({RoomCommand::Kind::JOIN, conn, DEFAULT_ROOM, ""});
+  {
+    SessionStripe& stripe = stripe_of(conn);
+    std::lock_guard<std::mutex> lk(stripe.mutex);
+    stripe.sessions[conn].joined = joined;
+  }
+
+  const std::string& msg = " Enter your nickname: ";
+  //std::cout << msg;
+
+  send(conn, msg.c_str(), msg.length());
+}
+
+void BroadCastChatHandler::on_client_data(
+  ConnectionHandle conn, const char* data, ssize_t len)
+{
+  std::string_view line(data, len);
+  while(!line.empty() && (line.back() == '\n' || line.back() == '\r'))
+  {
+    line.remove_suffix(1);
+  }
+  const ChatCommands::Parsed cmd = ChatCommands::parse(line);
+
+  std::string nick, room;
+  bool named;
+  bool sequenced;
+  Room* joined;
+  {
+    SessionStripe& stripe = stripe_of(conn);
+    std::lock_guard<std::mutex> lk(stripe.mutex);
+    Session& session = stripe.sessions[conn];
+    named = session.named;
+    room = session.room;
+    nick = session.nick;
+    sequenced = session.sequenced;
+    joined = session.joined;
+  }
+
+  std::string msg;
+  if(!named || cmd.command == ChatCommands::Command::NONE)
+  {
+    msg.assign(data, len);
+    msg.erase(std::remove(msg.begin(), msg.end(), '\r'), msg.end());
+    msg.erase(std::remove(msg.begin(), msg.end(), '\n'), msg.end());
+  }
+
+  // check if nickname already set.
+  if(!named)
+  {
+    if(!claim_nick(msg, conn))
+    {
+      const std::string retry = " Nickname taken or invalid, enter another: ";
+      send(conn, retry.c_str(), retry.length());
+      return;
+    }
+    {
+      SessionStripe& stripe = stripe_of(conn);
+      std::lock_guard<std::mutex> lk(stripe.mutex);
+      Session& session = stripe.sessions[conn];
+      session.named = true;
+      session.nick = msg;
+    }
+    nick = msg;
+
+    const std::string& join_msg = msg + " joined the chat\n";
+    say(joined, {RoomCommand::Kind::NOTICE, conn, room, join_msg});
+    cout << join_msg;
+
+    // Back after a failover: return to the room it had on the primary.
+    ReplicatedSession previous;
+    bool returning = false;
+    {
+      std::lock_guard<std::mutex> lk(restored_mutex);
+      auto it = restored.find(nick);
+      if(it != restored.end())
+      {
+        previous = std::move(it->second);
+        restored.erase(it);
+        returning = previous.room != room || previous.sequenced;
+      }
+    }
+    if(returning)
+    {
+      {
+        SessionStripe& stripe = stripe_of(conn);
+        std::lock_guard<std::mutex> lk(stripe.mutex);
+        Session& session = stripe.sessions[conn];
+        session.room = previous.room;
+        session.sequenced = previous.sequenced;
+      }
+      switch_room(conn, nick, room, previous.room, previous.sequenced, NO_REPLAY);
+    }
+    replicate_session(conn);
+    return;
+  }
+
+  std::string_view args = cmd.args;
+  switch(cmd.command)
+  {
+    case ChatCommands::Command::NONE:
+      break;
+    case ChatCommands::Command::NICK:
+      rename(conn, nick, room, joined, args);
+      return;
+    case ChatCommands::Command::JOIN:
+    {
+      const std::string_view target = ChatCommands::next_word(args);
+      if(target.empty() || !args.empty())
+      {
+        const std::string usage = "usage: /join <room>\n";
+        send(conn, usage.c_str(), usage.length());
+        return;
+      }
+      enter_room(conn, nick, room, std::string(target), sequenced, false, NO_REPLAY);
+      return;
+    }
+    case ChatCommands::Command::RESUME:
+    {
+      const std::string_view target = ChatCommands::next_word(args);
+      const std::string_view seq = ChatCommands::next_word(args);
+      uint64_t resume_after = 0;
+      const auto parsed = std::from_chars(seq.data(), seq.data() + seq.size(), resume_after);
+      if(target.empty() || seq.empty() || parsed.ec != std::errc()
+        || parsed.ptr != seq.data() + seq.size() || !args.empty())
+      {
+        const std::string usage = "usage: /resume <room> <last seq>\n";
+        send(conn, usage.c_str(), usage.length());
+        return;
+      }
+      enter_room(conn, nick, room, std::string(target), true, true, resume_after);
+      return;
+    }
+    case ChatCommands::Command::PART:
+      if(room == DEFAULT_ROOM)
+      {
+        const std::string reply = "you are in the lobby\n";
+        send(conn, reply.c_str(), reply.length());
+        return;
+      }
+      enter_room(conn, nick, room, DEFAULT_ROOM, sequenced, false, NO_REPLAY);
+      return;
+    case ChatCommands::Command::MSG:
+      direct_message(conn, nick, args);
+      return;
+    case ChatCommands::Command::WHO:
+      who(conn, room);
+      return;
+    case ChatCommands::Command::HISTORY:
+      recent_history(conn, room, args);
+      return;
+    case ChatCommands::Command::UNKNOWN:
+    {
+      const std::string reply = "unknown command: /" + std::string(cmd.name) + "\n";
+      send(conn, reply.c_str(), reply.length());
+      return;
+    }
+  }
+
+  // normal message
+  if(blocked(msg))
+  {
+    const std::string reply = "message blocked by moderation\n";
+    send(conn, reply.c_str(), reply.length());
+    return;
+  }
+  const std::string& full_msg = nick + ": " + msg + "\n";
+  say(joined, {RoomCommand::Kind::SAY, conn, room, full_msg});
+  std::cout << full_msg;
+}
+
+void BroadCastChatHandler::enter_room(ConnectionHandle conn, const std::string& nick,
+  const std::string& room, const std::string& target, bool sequenced, bool resume,
+  uint64_t resume_after)
+{
+  // A resume into the current room re-enters it silently, as sequenced.
+  if(target == room && !resume)
+  {
+    return;
+  }
+  if(!HistoryStore::valid_room_name(target))
+  {
+    const std::string reply = "invalid room name\n";
+    send(conn, reply.c_str(), reply.length());
+    return;
+  }
+  {
+    SessionStripe& stripe = stripe_of(conn);
+    std::lock_guard<std::mutex> lk(stripe.mutex);
+    Session& session = stripe.sessions[conn];
+    session.room = target;
+    session.sequenced = sequenced;
+  }
+  switch_room(conn, nick, room, target, sequenced, resume_after);
+  replicate_session(conn);
+}
+
+void BroadCastChatHandler::rename(ConnectionHandle conn, const std::string& nick,
+  const std::string& room, Room* joined, std::string_view args)
+{
+  const std::string to(ChatCommands::next_word(args));
+  if(to.empty() || !args.empty())
+  {
+    const std::string usage = "usage: /nick <name>\n";
+    send(conn, usage.c_str(), usage.length());
+    return;
+  }
+  if(to == nick)
+  {
+    return;
+  }
+  if(!claim_nick(to, conn))
+  {
+    const std::string reply = "nickname taken or invalid: " + to + "\n";
+    send(conn, reply.c_str(), reply.length());
+    return;
+  }
+  {
+    SessionStripe& stripe = stripe_of(conn);
+    std::lock_guard<std::mutex> lk(stripe.mutex);
+    stripe.sessions[conn].nick = to;
+  }
+  release_nick(nick, conn);
+
+  const std::string notice = nick + " is now known as " + to + "\n";
+  say(joined, {RoomCommand::Kind::NOTICE, conn, room, notice});
+  send(conn, notice.c_str(), notice.length());
+  cout << notice;
+  replicate_session(conn);
+}
+
+void BroadCastChatHandler::who(ConnectionHandle conn, const std::string& room)
+{
+  std::vector<std::string> nicks;
+  for(auto& stripe : session_stripes)
+  {
+    std::lock_guard<std::mutex> lk(stripe.mutex);
+    for(const auto& entry : stripe.sessions)
+    {
+      if(entry.second.named && entry.second.room == room)
+      {
+        nicks.push_back(entry.second.nick);
+      }
+    }
+  }
+  std::sort(nicks.begin(), nicks.end());
+
+  std::string reply = "in " + room + ":";
+  for(size_t i = 0; i < nicks.size(); ++i)
+  {
+    reply += (i == 0 ? " " : ", ") + nicks[i];
+  }
+  reply += "\n";
+  send(conn, reply.c_str(), reply.length());
+}
+
+void BroadCastChatHandler::recent_history(ConnectionHandle conn, const std::string& room,
+  std::string_view args)
+{
+  uint64_t count = DEFAULT_HISTORY_LINES;
+  uint64_t age_us = 0;
+  std::string_view word = ChatCommands::next_word(args);
+  const bool by_time = word == "since";
+  bool valid = true;
+  if(by_time)
+  {
+    word = ChatCommands::next_word(args);
+    valid = parse_age(word, age_us);
+  }
+  else if(!word.empty())
+  {
+    const auto parsed = std::from_chars(word.data(), word.data() + word.size(), count);
+    valid = parsed.ec == std::errc() && parsed.ptr == word.data() + word.size();
+  }
+  if(!valid || !args.empty())
+  {
+    const std::string usage = "usage: /history [count] or /history since <n>[s|m|h|d]\n";
+    send(conn, usage.c_str(), usage.length());
+    return;
+  }
+  // What a memory-only history keeps: one ring.
+  const uint64_t ring = HistoryStore::DEFAULT_RING_CAPACITY;
+  count = std::min(count, ring);
+
+  // Copied under the locks, sent after: the client may be slow.
+  const std::shared_ptr<RoomHistory> room_history = history.room(room);
+  if(!room_history)
+  {
+    return;
+  }
+  std::vector<std::string> lines;
+  auto add = [&lines](const ChatRecord& rec) {
+    lines.push_back(sequenced_line(rec.seq, rec.text));
+  };
+  {
+    RoomHistory::ReadLock lk(*room_history);
+    const uint64_t last = room_history->last_seq();
+    if(by_time)
+    {
+      // The time index finds where the window starts; a long window is cut
+      // down to its newest ring, like a count is.
+      const uint64_t now = now_us();
+      uint64_t first = 0;
+      room_history->replay_between(now - std::min(now, age_us), UINT64_MAX, 1,
+        [&first](const ChatRecord& rec) { first = rec.seq; });
+      if(first != 0)
+      {
+        room_history->replay_after(std::max(first - 1, last - std::min(last, ring)), add);
+      }
+    }
+    else
+    {
+      room_history->replay_after(last - std::min(last, count), add);
+    }
+  }
+  for(const std::string& line : lines)
+  {
+    send(conn, line.c_str(), line.length());
+  }
+}
+
+void BroadCastChatHandler::on_client_disconnect(ConnectionHandle conn)
+{
+  Session session;
+  {
+    SessionStripe& stripe = stripe_of(conn);
+    std::lock_guard<std::mutex> lk(stripe.mutex);
+    auto it = stripe.sessions.find(conn);
+    if(it != stripe.sessions.end())
+    {
+      session = it->second;
+      stripe.sessions.erase(it);
+    }
+  }
+
+  const std::string& name =
+    session.named ? session.nick : "Client " + std::to_string(conn.slot);
+
+  std::string msg = name + " left the chat\n";
+  post({RoomCommand::Kind::LEAVE, conn,
+    session.room.empty() ? DEFAULT_ROOM : session.room, msg});
+  cout << msg;
+  if(session.named)
+  {
+    release_nick(session.nick, conn);
+  }
+  if(replicator && session.named)
+  {
+    replicator->session_closed(session_id(conn));
+  }
+}
+
+BroadCastChatHandler::SessionStripe& BroadCastChatHandler::stripe_of(ConnectionHandle conn)
+{
+  return session_stripes[conn.slot % SESSION_STRIPES];
+}
+
+uint64_t BroadCastChatHandler::session_id(ConnectionHandle conn)
+{
+  return uint64_t(conn.slot) << 32 | conn.generation;
+}
+
+BroadCastChatHandler::NickStripe& BroadCastChatHandler::nick_stripe_of(const std::string& nick)
+{
+  return nick_stripes[std::hash<std::string>()(nick) % SESSION_STRIPES];
+}
+
+bool BroadCastChatHandler::claim_nick(const std::string& nick, ConnectionHandle conn)
+{
+  if(nick.empty() || nick[0] == '/' || blocked(nick))
+  {
+    return false;
+  }
+  NickStripe& stripe = nick_stripe_of(nick);
+  std::lock_guard<std::mutex> lk(stripe.mutex);
+  return stripe.owners.emplace(nick, conn).second;
+}
+
+void BroadCastChatHandler::release_nick(const std::string& nick, ConnectionHandle conn)
+{
+  NickStripe& stripe = nick_stripe_of(nick);
+  std::lock_guard<std::mutex> lk(stripe.mutex);
+  auto it = stripe.owners.find(nick);
+  if(it != stripe.owners.end() && it->second == conn)
+  {
+    stripe.owners.erase(it);
+  }
+}
+
+void BroadCastChatHandler::direct_message(ConnectionHandle conn, const std::string& from,
+  std::string_view args)
+{
+  const std::string to(ChatCommands::next_word(args));
+  if(to.empty() || args.empty())
+  {
+    const std::string usage = "usage: /msg <nick> <text>\n";
+    send(conn, usage.c_str(), usage.length());
+    return;
+  }
+  const std::string text(args);
+  if(blocked(text))
+  {
+    const std::string reply = "message blocked by moderation\n";
+    send(conn, reply.c_str(), reply.length());
+    return;
+  }
+
+  ConnectionHandle target;
+  bool found;
+  {
+    NickStripe& stripe = nick_stripe_of(to);
+    std::lock_guard<std::mutex> lk(stripe.mutex);
+    auto it = stripe.owners.find(to);
+    found = it != stripe.owners.end();
+    if(found)
+    {
+      target = it->second;
+    }
+  }
+
+  // A target that just left is a stale handle: the send fails like a miss.
+  const std::string line = from + " (private): " + text + "\n";
+  if(!found || send(target, line.c_str(), line.length()) < 0)
+  {
+    const std::string missing = "no such user: " + to + "\n";
+    send(conn, missing.c_str(), missing.length());
+  }
+}
+
+void BroadCastChatHandler::switch_room(ConnectionHandle conn, const std::string& nick,
+  const std::string& from, const std::string& to, bool sequenced, uint64_t resume_after)
+{
+  const bool moved = to != from;
+  post({RoomCommand::Kind::LEAVE, conn, from,
+    moved ? nick + " left room " + from + "\n" : ""});
+  Room* joined = post({RoomCommand::Kind::JOIN, conn, to,
+    moved ? nick + " joined room " + to + "\n" : "",
+    sequenced, resume_after});
+
+  SessionStripe& stripe = stripe_of(conn);
+  std::lock_guard<std::mutex> lk(stripe.mutex);
+  stripe.sessions[conn].joined = joined;
+}
+
+void BroadCastChatHandler::replicate_session(ConnectionHandle conn)
+{
+  if(!replicator)
+  {
+    return;
+  }
+
+  ReplicatedSession state;
+  {
+    SessionStripe& stripe = stripe_of(conn);
+    std::lock_guard<std::mutex> lk(stripe.mutex);
+    auto it = stripe.sessions.find(conn);
+    if(it == stripe.sessions.end() || !it->second.named)
+    {
+      return;
+    }
+    state = {it->second.nick, it->second.room, it->second.sequenced};
+  }
+  replicator->session(session_id(conn), state);
+}
+
+// On the replication thread, when a standby connects.
+void BroadCastChatHandler::snapshot(std::string& out)
+{
+  for(auto& stripe : session_stripes)
+  {
+    std::lock_guard<std::mutex> lk(stripe.mutex);
+    for(const auto& entry : stripe.sessions)
+    {
+      if(entry.second.named)
+      {
+        ChatReplicator::encode_session(out, session_id(entry.first),
+          {entry.second.nick, entry.second.room, entry.second.sequenced});
+      }
+    }
+  }
+
+  for(const auto& entry : history.named_rooms())
+  {
+    RoomHistory& room = *entry.second;
+    RoomHistory::ReadLock lk(room);
+    const uint64_t last = room.last_seq();
+    const uint64_t after = last - std::min<uint64_t>(last, ChatReplicator::SNAPSHOT_MESSAGES);
+    room.replay_after(after, [&out, &entry](const ChatRecord& rec) {
+      ChatReplicator::encode_message(out, entry.first, rec.seq, rec.time_us, rec.text);
+    });
+  }
+}
+
+// On the snapshot thread: copies under the usual locks, one at a time.
+SnapshotData BroadCastChatHandler::capture()
+{
+  SnapshotData data;
+  for(auto& stripe : session_stripes)
+  {
+    std::lock_guard<std::mutex> lk(stripe.mutex);
+    for(const auto& entry : stripe.sessions)
+    {
+      if(entry.second.named)
+      {
+        data.sessions.push_back({session_id(entry.first),
+          {entry.second.nick, entry.second.room, entry.second.sequenced}});
+      }
+    }
+  }
+
+  // What a memory-only history keeps: one ring.
+  const uint64_t recent = HistoryStore::DEFAULT_RING_CAPACITY;
+  for(const auto& entry : history.named_rooms())
+  {
+    RoomHistory& room = *entry.second;
+    SnapshotRoom saved;
+    saved.name = entry.first;
+    RoomHistory::ReadLock lk(room);
+    saved.last_seq = room.last_seq();
+    room.replay_after(saved.last_seq - std::min(saved.last_seq, recent),
+      [&saved](const ChatRecord& rec) { saved.records.push_back(rec); });
+    data.rooms.push_back(std::move(saved));
+  }
+  return data;
+}
+
+BroadCastChatHandler::Room* BroadCastChatHandler::post(RoomCommand cmd)
+{
+  if(shards.empty())
+  {
+    std::lock_guard<std::mutex> lk(_mutex);
+    return apply(inline_rooms, cmd);
+  }
+
+  // Room-to-thread affinity: the owner of a room never changes.
+  const size_t owner = std::hash<std::string>()(cmd.room) % shards.size();
+  shards[owner]->mailbox.push(std::move(cmd));
+  return nullptr;
+}
+
+void BroadCastChatHandler::say(Room* joined, RoomCommand cmd)
+{
+  if(joined == nullptr)
+  {
+    post(std::move(cmd));
+    return;
+  }
+
+  // Inline fast path, no handler lock: the sender is a member, so the room
+  // cannot go away before this thread handles the sender's own LEAVE.
+  deliver(*joined, cmd);
+}
+
+void BroadCastChatHandler::deliver(Room& room, const RoomCommand& cmd)
+{
+  if(cmd.kind == RoomCommand::Kind::NOTICE)
+  {
+    broadcast(room, cmd.conn, cmd.text);
+    return;
+  }
+
+  // Number, store and queue under the sequencing lock, so the outbox,
+  // the standby and the peers all get the room's messages in order.
+  {
+    std::lock_guard<std::mutex> lk(room.history->mutex());
+    const uint64_t time_us = now_us();
+    const uint64_t seq = room.history->append(cmd.text, time_us);
+    enqueue(room, {cmd.conn, seq, cmd.text, {}});
+    if(replicator)
+    {
+      replicator->message(cmd.room, seq, time_us, cmd.text);
+    }
+    if(federation && !cmd.relayed)
+    {
+      federation->publish(cmd.room, cmd.text);
+    }
+  }
+  room.history->flush();
+  drain(room);
+}
+
+void BroadCastChatHandler::enqueue(Room& room, Outgoing out)
+{
+  std::lock_guard<std::mutex> lk(room.outbox_mutex);
+  room.outbox.push_back(std::move(out));
+}
+
+void BroadCastChatHandler::drain(Room& room)
+{
+  {
+    std::lock_guard<std::mutex> lk(room.outbox_mutex);
+    if(room.draining)
+    {
+      return;                         // the other thread sends ours too
+    }
+    room.draining = true;
+  }
+
+  std::vector<Outgoing> batch;
+  for(;;)
+  {
+    {
+      std::lock_guard<std::mutex> lk(room.outbox_mutex);
+      if(room.outbox.empty())
+      {
+        room.draining = false;
+        return;
+      }
+      batch.swap(room.outbox);
+    }
+    for(const Outgoing& out : batch)
+    {
+      if(out.seq != 0)
+      {
+        broadcast(room, out.conn, out.text, out.seq);
+        continue;
+      }
+      for(const std::string& line : out.replay)
+      {
+        send(out.conn, line.c_str(), line.length());
+      }
+    }
+    batch.clear();
+  }
+}
+
+BroadCastChatHandler::Room* BroadCastChatHandler::apply(
+  RoomMap& rooms, const RoomCommand& cmd)
+{
+  switch(cmd.kind)
+  {
+    case RoomCommand::Kind::JOIN:
+    {
+      std::unique_ptr<Room>& room = rooms[cmd.room];
+      if(!room)
+      {
+        std::shared_ptr<RoomHistory> room_history = history.room(cmd.room);
+        if(!room_history)
+        {
+          rooms.erase(cmd.room);
+          const std::string reply = "can not open room " + cmd.room + "\n";
+          send(cmd.conn, reply.c_str(), reply.length());
+          return nullptr;
+        }
+        room = std::make_unique<Room>();
+        room->history = std::move(room_history);
+        if(federation)
+        {
+          federation->subscribe(cmd.room);
+        }
+      }
+      broadcast(*room, cmd.conn, cmd.text);
+      if(!cmd.sequenced)
+      {
+        add_member(*room, {cmd.conn, false});
+        return room.get();
+      }
+
+      // Copy the replay and join under the sequencing lock: no message can
+      // fall in between the last replayed one and the first live one. The
+      // replay is queued ahead of later lines, and lines queued before it
+      // skip the new member.
+      {
+        RoomHistory::ReadLock lk(*room->history);
+        Outgoing replay{cmd.conn, 0, "", {}};
+        if(cmd.resume_after != NO_REPLAY)
+        {
+          room->history->replay_after(cmd.resume_after, [&replay](const ChatRecord& rec) {
+            replay.replay.push_back(sequenced_line(rec.seq, rec.text));
+          });
+        }
+        add_member(*room, {cmd.conn, true, room->history->last_seq()});
+        enqueue(*room, std::move(replay));
+      }
+      drain(*room);
+      return room.get();
+    }
+    case RoomCommand::Kind::LEAVE:
+    {
+      auto it = rooms.find(cmd.room);
+      if(it == rooms.end())
+      {
+        break;
+      }
+      Room& room = *it->second;
+      remove_member(room, cmd.conn);
+      broadcast(room, cmd.conn, cmd.text);
+      if(room.members.load(std::memory_order_relaxed)->empty())
+      {
+        // Readers that loaded the room pointer may still be in it.
+        epoch.retire(it->second.release());
+        rooms.erase(it);
+        if(federation)
+        {
+          federation->unsubscribe(cmd.room);
+        }
+      }
+      break;
+    }
+    case RoomCommand::Kind::SAY:
+    case RoomCommand::Kind::NOTICE:
+    {
+      auto it = rooms.find(cmd.room);
+      if(it != rooms.end())
+      {
+        deliver(*it->second, cmd);
+      }
+      break;
+    }
+  }
+  return nullptr;
+}
+
+void BroadCastChatHandler::shard_loop(Shard& shard)
+{
+  RoomCommand cmd;
+  while(shard.mailbox.wait_pop(cmd))
+  {
+    apply(shard.rooms, cmd);
+  }
+}
+
+// Writers are serialized (_mutex or the owner thread); readers are not.
+void BroadCastChatHandler::add_member(Room& room, Member member)
+{
+  const Members* old = room.members.load(std::memory_order_relaxed);
+  Members* next = new Members(*old);
+  next->push_back(member);
+  room.members.store(next, std::memory_order_release);
+  epoch.retire(old);
+}
+
+void BroadCastChatHandler::remove_member(Room& room, ConnectionHandle conn)
+{
+  const Members* old = room.members.load(std::memory_order_relaxed);
+  Members* next = new Members();
+  next->reserve(old->size());
+  std::copy_if(old->begin(), old->end(), std::back_inserter(*next),
+    [conn](const Member& member) { return member.conn != conn; });
+  room.members.store(next, std::memory_order_release);
+  epoch.retire(old);
+}
+
+void BroadCastChatHandler::broadcast(
+  const Room& room, ConnectionHandle sender, const std::string &msg, uint64_t seq)
+{
+  if(msg.empty())
+  {
+    return;
+  }
+
+  // Resuming clients get the numbered form, built once per message; each
+  // form is framed once for all WebSocket members.
+  WireMessage plain(msg);
+  std::string numbered;
+  std::optional<WireMessage> numbered_wire;
+  EpochGuard guard(epoch);
+  const Members* members = room.members.load(std::memory_order_acquire);
+  for(auto const& member: *members)
+  {
+    if(member.conn == sender)
+    {
+      continue;
+    }
+    if(seq != 0 && seq <= member.live_after)
+    {
+      continue;
+    }
+    // A member that is already gone is rejected by the table.
+    if(member.sequenced && seq != 0)
+    {
+      if(!numbered_wire)
+      {
+        numbered = sequenced_line(seq, msg);
+        numbered_wire.emplace(numbered);
+      }
+      send(member.conn, *numbered_wire);
+    }
+    else
+    {
+      send(member.conn, plain);
+    }
+  }
+}
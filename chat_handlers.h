@@ -0,0 +1,304 @@
+#ifndef CHAT_HANDLERS_H
+#define CHAT_HANDLERS_H
+
+#include "tcp_server.h"
+
+#include "chat_federation.h"
+#include "chat_history.h"
+#include "chat_replication.h"
+#include "chat_snapshot.h"
+#include "epoch_reclaimer.h"
+#include "keyword_filter.h"
+#include "mpsc_mailbox.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Echo chat server
+class EchoHandler : public IClientHandler
+{
+  public:
+    void on_client_data(ConnectionHandle conn, const char* data, ssize_t len) override;
+    void on_client_connect(ConnectionHandle conn) override;
+    void on_client_disconnect(ConnectionHandle conn) override;
+};
+
+/* BroadCast chat handler class
+ * The first line of a client is its nickname, every other line goes to the
+ * members of the client's room. Everybody starts in the "lobby" room, so
+ * without /join this is the classic broadcast-to-everyone chat.
+ *
+  | Line                   | Effect                                          |
+  | ---------------------- | ----------------------------------------------- |
+  | first line             | nickname; "<nick> joined the chat" to the lobby |
+  | `/nick <name>`         | rename; "<old> is now known as <name>" notice   |
+  | `/join <room>`         | leave the current room, enter <room>            |
+  | `/part`                | leave the current room, back to the lobby       |
+  | `/resume <room> <seq>` | enter <room>, replay its messages after <seq>   |
+  | `/msg <nick> <text>`   | "<nick> (private): <text>" to that client only  |
+  | `/who`                 | nicknames in the current room, on this node     |
+  | `/history [n]`         | the room's last n (10) lines, as "#<seq> ..."   |
+  | other `/<name>`        | "unknown command" to the client                 |
+  | anything else          | "<nick>: <line>" to everybody else in the room  |
+ *
+ * Commands are recognised by ChatCommands::parse(); a chat line costs it
+ * one byte compare and is handled as before.
+ *
+ * Room names are 1 to 64 printable characters (see HistoryStore); a room
+ * that can not be opened because too many are in use is refused.
+ *
+ * Nicknames are unique on a node and must not start with '/'; a taken or
+ * invalid one is refused and the client asked again (only one word ones
+ * can be named in /msg). A second index maps nicknames to connections, so
+ * /msg is a hash lookup and a send; it never goes through a room, its
+ * history or the federation.
+ *
+ * Every chat line of a room gets the room's next sequence number and is
+ * kept in a HistoryStore (ring in memory, spilled to per-room logs when a
+ * history directory is given). After a /resume the client receives chat
+ * lines as "#<seq> <nick>: <line>": it remembers the highest number seen and
+ * after a reconnect resumes from it, getting only what it missed. Join and
+ * leave notices are not numbered and not replayed; a client's own lines are
+ * not echoed to it, so they are part of its replay.
+ *
+ * Room sharding (shards > 0): each room is owned by one shard thread, picked
+ * by hashing the room name. Joins, leaves and messages are posted to the
+ * owner's lock-free mailbox and the owner does the fan-out, so room state is
+ * only ever touched by one thread and never locked, and rooms on different
+ * shards are served in parallel. One client's commands for one room all go
+ * through the same mailbox, which keeps them in order.
+ *
+ * With shards == 0 rooms are handled inline on the calling thread: the
+ * right choice for the single-threaded servers and for deterministic
+ * benchmarks, and usable from several reactor threads too. Joins and leaves
+ * take one mutex; messages do not. A room's member list is an immutable
+ * snapshot array: writers copy it, change the copy, publish it with one
+ * atomic store and retire the old array through an EpochDomain. Fan-out
+ * loads the current snapshot inside an epoch guard and walks a plain
+ * vector, so it never blocks on, or is blocked by, a join or leave on
+ * another thread. Sends from different threads to one receiver are
+ * serialized by the connection table, so lines never interleave.
+ *
+ * A chat line is numbered and queued in its room's outbox in one step under
+ * the room's history lock; the sends happen after the lock is released, by
+ * whichever thread finds the outbox idle. Members still get numbered lines
+ * in order, and a sender only waits for the append, not for the fan-out
+ * of other senders. A /resume replay is queued the same way, so it comes
+ * before the first live line.
+ *
+ * Per-connection session state (nickname, current room) stays with the
+ * caller; it lives in a table split into lock stripes so reactor threads
+ * rarely contend on it.
+ *
+ * A room thread can still hold messages for a client whose LEAVE is queued
+ * behind them; members are ConnectionHandles, so once the client is closed
+ * those sends are rejected even if its fd number was already reused.
+ *
+ * federate() joins the handler to a ChatFederation: rooms with local
+ * members subscribe at the peer nodes, chat lines said here are relayed
+ * to the nodes subscribed to the room, and lines relayed from other nodes
+ * are numbered and fanned out here like local ones (but not relayed on).
+ *
+ * replicate_to() streams nicknames, rooms and numbered messages to a hot
+ * standby (see ChatReplicator); follow() is the standby's side. A client
+ * that comes back to the standby under a replicated nickname is put back
+ * into its room, and its /resume finds the same sequence numbers.
+ *
+ * snapshot_to() does the same across a restart of one process: it loads
+ * the last snapshot file (sessions, room numbers, recent messages) and
+ * then rewrites it periodically in the background (see MappedSnapshot).
+ *
+ * moderate() blocks chat lines containing a word of a list (see
+ * KeywordFilter). The check runs on the sender's thread before the line
+ * is numbered, so a blocked line is never fanned out, recorded,
+ * replicated or relayed; the sender is told instead. Private messages
+ * (/msg) are checked the same way, and a nickname (at login or /nick)
+ * that contains a listed word is refused like a taken one. The list is
+ * reloaded when its file changes, and the compiled filter is swapped like
+ * a member snapshot: one atomic pointer, read inside an epoch guard.
+*/
+class BroadCastChatHandler: public IClientHandler
+{
+  public:
+    // history_dir empty: history is kept in memory only. `retention` bounds
+    // the logs in history_dir (see HistoryRetention).
+    explicit BroadCastChatHandler(size_t shards = 0,
+      const std::string& history_dir = "", RetentionPolicy retention = {});
+    ~BroadCastChatHandler();
+
+    // Relays rooms with the nodes in `peers` (see ChatFederation); `self`
+    // is this node's relay "host:port". Call before the server runs.
+    void federate(const std::string& self, const std::vector<std::string>& peers);
+    // Streams session changes and messages to the standby listening on the
+    // unix socket `socket_path`. Call before the server runs.
+    void replicate_to(const std::string& socket_path);
+    // Standby: mirrors the primary replicating to `socket_path` and returns
+    // once it has gone away. Call before the server runs.
+    void follow(const std::string& socket_path);
+    // Restores the state saved in the snapshot at `path`, if there is one,
+    // then saves a new one every interval_ms. Call before the server runs.
+    void snapshot_to(const std::string& path, unsigned interval_ms = 10000);
+    // Stops the periodic snapshots and writes a last one. Call after the
+    // server stopped but before it disconnects its clients.
+    bool save_snapshot();
+    // Blocks chat lines, private messages and nicknames containing a word
+    // listed in the file at `path`, rereading it when it changes. Throws if it can not be read. Call
+    // before the server runs.
+    void moderate(const std::string& path);
+
+    void on_client_data(ConnectionHandle conn, const char* data, ssize_t len) override;
+    void on_client_connect(ConnectionHandle conn) override;
+    void on_client_disconnect(ConnectionHandle conn) override;
+
+  private:
+    struct RoomCommand
+    {
+      // SAY is a numbered chat line, NOTICE is not recorded.
+      enum class Kind { JOIN, LEAVE, SAY, NOTICE };
+      Kind kind = Kind::SAY;
+      ConnectionHandle conn;
+      std::string room;
+      std::string text;               // delivered to the other members
+      bool sequenced = false;         // JOIN: member wants "#<seq> " lines
+      uint64_t resume_after = 0;      // JOIN: replay history after this seq
+      bool relayed = false;           // SAY: came from a peer node
+    };
+
+    struct Member
+    {
+      ConnectionHandle conn;
+      bool sequenced;
+      uint64_t live_after = 0;        // gets numbered lines after this seq
+    };
+
+    using Members = std::vector<Member>;
+
+    // Numbered in the history, not yet handed to the members.
+    struct Outgoing
+    {
+      ConnectionHandle conn;          // the sender, or the replay's receiver
+      uint64_t seq = 0;               // 0: `replay` for `conn`
+      std::string text;
+      std::vector<std::string> replay;
+    };
+
+    struct Room
+    {
+      std::shared_ptr<RoomHistory> history;  // shared with the HistoryStore
+      // Current snapshot; replaced, never modified in place.
+      std::atomic<const Members*> members{new Members()};
+      // Filled in sequence order under the history's mutex, sent outside
+      // it by one thread at a time.
+      std::mutex outbox_mutex;
+      std::vector<Outgoing> outbox;
+      bool draining = false;
+      ~Room() { delete members.load(); }
+    };
+
+    using RoomMap = std::unordered_map<std::string, std::unique_ptr<Room>>;
+
+    struct Shard
+    {
+      MpscMailbox<RoomCommand> mailbox;
+      RoomMap rooms;                  // owned by `worker`
+      std::thread worker;
+    };
+
+    struct Session
+    {
+      bool named = false;
+      std::string nick;
+      std::string room;
+      bool sequenced = false;         // has used /resume
+      Room* joined = nullptr;         // inline mode: the room of `room`
+    };
+
+    struct SessionStripe
+    {
+      std::mutex mutex;
+      std::unordered_map<ConnectionHandle, Session> sessions;
+    };
+
+    struct NickStripe
+    {
+      std::mutex mutex;
+      std::unordered_map<std::string, ConnectionHandle> owners;
+    };
+
+    static const size_t SESSION_STRIPES = 16;
+
+    HistoryStore history;             // outlives the rooms below
+    std::vector<std::unique_ptr<Shard>> shards;
+    RoomMap inline_rooms;             // used when there are no shards
+    std::mutex _mutex;                // serializes inline joins and leaves
+    EpochDomain epoch;                // reclaims member snapshots and rooms
+    SessionStripe session_stripes[SESSION_STRIPES];
+    NickStripe nick_stripes[SESSION_STRIPES];
+    std::unique_ptr<ChatFederation> federation;
+    // Sessions inherited from a primary, by nickname; taken on login.
+    std::mutex restored_mutex;
+    std::unordered_map<std::string, ReplicatedSession> restored;
+    // Declared last: their threads read the members above.
+    std::unique_ptr<ChatReplicator> replicator;
+    std::unique_ptr<SnapshotWriter> snapshots;
+    std::atomic<const KeywordFilter*> moderation{nullptr};
+    std::unique_ptr<KeywordListWatcher> moderation_watcher;
+
+    SessionStripe& stripe_of(ConnectionHandle conn);
+    static uint64_t session_id(ConnectionHandle conn);
+    NickStripe& nick_stripe_of(const std::string& nick);
+    // False if `nick` is taken, not a valid nickname or blocked().
+    bool claim_nick(const std::string& nick, ConnectionHandle conn);
+    void release_nick(const std::string& nick, ConnectionHandle conn);
+    // "/msg <nick> <text>": straight to the owner of <nick>.
+    void direct_message(ConnectionHandle conn, const std::string& from,
+      std::string_view args);
+    // "/join", "/part" and "/resume": records the room, then switches.
+    void enter_room(ConnectionHandle conn, const std::string& nick,
+      const std::string& room, const std::string& target, bool sequenced,
+      bool resume, uint64_t resume_after);
+    void rename(ConnectionHandle conn, const std::string& nick,
+      const std::string& room, Room* joined, std::string_view args);
+    // Scans the sessions: rare, and needs no per-room index.
+    void who(ConnectionHandle conn, const std::string& room);
+    // "/history [count]" and "/history since <age>": the newest lines, at
+    // most one ring's worth.
+    void recent_history(ConnectionHandle conn, const std::string& room,
+      std::string_view args);
+    // True if the moderation list blocks `line`.
+    bool blocked(const std::string& line);
+    // Leaves `from` and enters `to`, keeping the session's joined room.
+    void switch_room(ConnectionHandle conn, const std::string& nick,
+      const std::string& from, const std::string& to, bool sequenced,
+      uint64_t resume_after);
+    void replicate_session(ConnectionHandle conn);
+    void snapshot(std::string& out);
+    SnapshotData capture();
+    // Inline mode: returns the room a JOIN entered.
+    Room* post(RoomCommand cmd);
+    Room* apply(RoomMap& rooms, const RoomCommand& cmd);
+    // SAY: lock-free fan-out when `joined` is known, else through post().
+    void say(Room* joined, RoomCommand cmd);
+    void shard_loop(Shard& shard);
+    // SAY: number, record and fan out; NOTICE: fan out.
+    void deliver(Room& room, const RoomCommand& cmd);
+    // Caller holds the room history's mutex.
+    void enqueue(Room& room, Outgoing out);
+    // Sends the outbox unless another thread already is.
+    void drain(Room& room);
+    void add_member(Room& room, Member member);
+    void remove_member(Room& room, ConnectionHandle conn);
+    // seq != 0: sequenced members get the "#<seq> " form, members that
+    // joined after seq nothing.
+    void broadcast(const Room& room, ConnectionHandle sender,
+      const std::string& msg, uint64_t seq = 0);
+};
+
+#endif
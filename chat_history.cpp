@@ -0,0 +1,328 @@
+#include "chat_history.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+
+using namespace std;
+
+RoomHistory::RoomHistory(std::unique_ptr<ChatLog> p_log, size_t ring_capacity) :
+  log(std::move(p_log)), ring(std::max<size_t>(ring_capacity, 1))
+{
+  if(log)
+  {
+    // Numbering continues where the previous run stopped.
+    next_seq = log->last_seq() + 1;
+  }
+}
+
+uint64_t RoomHistory::append(std::string text, uint64_t time_us)
+{
+  if(count == ring.size())
+  {
+    spill(std::min(SPILL_BATCH, count));
+  }
+
+  ChatRecord& rec = ring[(head + count) % ring.size()];
+  rec.seq = next_seq++;
+  rec.time_us = time_us;
+  rec.text = std::move(text);
+  ++count;
+  return rec.seq;
+}
+
+void RoomHistory::flush()
+{
+  std::lock_guard<std::mutex> log_lk(log_lock);
+  std::vector<ChatRecord> batch;
+  {
+    std::lock_guard<std::mutex> lk(sequence_mutex);
+    batch.swap(spilled);
+  }
+  // Readers wait for log_lock, so the batch is never out of sight.
+  if(!log || batch.empty() || log->append(batch))
+  {
+    return;
+  }
+  // The log could not take it (disk full): what it did not store goes back
+  // in front of the queue, still replayable, and the next flush retries.
+  const uint64_t stored = log->last_seq();
+  batch.erase(batch.begin(), std::find_if(batch.begin(), batch.end(),
+    [stored](const ChatRecord& rec) { return rec.seq > stored; }));
+  std::lock_guard<std::mutex> lk(sequence_mutex);
+  batch.insert(batch.end(), std::make_move_iterator(spilled.begin()),
+    std::make_move_iterator(spilled.end()));
+  spilled.swap(batch);
+}
+
+size_t RoomHistory::replay_after(uint64_t after_seq,
+  const std::function<void(const ChatRecord&)>& fn) const
+{
+  size_t delivered = 0;
+  const uint64_t memory_first = !spilled.empty() ? spilled.front().seq
+    : count == 0 ? next_seq : at(0).seq;
+
+  // Older than the ring: from disk first.
+  if(log && after_seq + 1 < memory_first)
+  {
+    delivered += log->read_after(after_seq, memory_first - after_seq - 1, fn);
+  }
+
+  for(const ChatRecord& rec : spilled)
+  {
+    if(rec.seq > after_seq)
+    {
+      fn(rec);
+      ++delivered;
+    }
+  }
+  for(size_t i = 0; i < count; ++i)
+  {
+    const ChatRecord& rec = at(i);
+    if(rec.seq > after_seq)
+    {
+      fn(rec);
+      ++delivered;
+    }
+  }
+  return delivered;
+}
+
+size_t RoomHistory::replay_between(uint64_t from_us, uint64_t to_us, size_t limit,
+  const std::function<void(const ChatRecord&)>& fn) const
+{
+  size_t delivered = 0;
+  const uint64_t memory_first_us = !spilled.empty() ? spilled.front().time_us
+    : count == 0 ? UINT64_MAX : at(0).time_us;
+  if(log && memory_first_us >= from_us)
+  {
+    delivered += log->read_time_range(from_us, to_us, limit, fn);
+  }
+
+  for(size_t i = 0; i < spilled.size() && delivered < limit; ++i)
+  {
+    const ChatRecord& rec = spilled[i];
+    if(rec.time_us >= from_us && rec.time_us < to_us)
+    {
+      fn(rec);
+      ++delivered;
+    }
+  }
+  for(size_t i = 0; i < count && delivered < limit; ++i)
+  {
+    const ChatRecord& rec = at(i);
+    if(rec.time_us >= from_us && rec.time_us < to_us)
+    {
+      fn(rec);
+      ++delivered;
+    }
+  }
+  return delivered;
+}
+
+bool RoomHistory::restore(const ChatRecord& rec)
+{
+  if(rec.seq < next_seq)
+  {
+    return false;
+  }
+  // Gaps (messages the standby never saw) are fine for ring and log.
+  next_seq = rec.seq;
+  append(rec.text, rec.time_us);
+  return true;
+}
+
+void RoomHistory::spill_all()
+{
+  // Memory only: nothing to move the ring to, keep it.
+  if(log)
+  {
+    {
+      std::lock_guard<std::mutex> lk(sequence_mutex);
+      spill(count);
+    }
+    flush();
+  }
+}
+
+void RoomHistory::spill(size_t n)
+{
+  if(log)
+  {
+    for(size_t i = 0; i < n; ++i)
+    {
+      spilled.push_back(std::move(ring[(head + i) % ring.size()]));
+    }
+  }
+  head = (head + n) % ring.size();
+  count -= n;
+}
+
+HistoryStore::HistoryStore(std::string dir, size_t ring_capacity,
+  RetentionPolicy retention_policy) :
+  dir(std::move(dir)), ring_capacity(ring_capacity)
+{
+  if(this->dir.empty())
+  {
+    return;
+  }
+
+  std::error_code ec;
+  for(const auto& entry : std::filesystem::directory_iterator(this->dir, ec))
+  {
+    std::string name;
+    if(entry.is_directory(ec) && room_name(entry.path().filename().string(), name)
+      && valid_room_name(name) && !room(name))
+    {
+      break;                          // full
+    }
+  }
+  std::cout << "history: logging to " << this->dir << ", retention: "
+            << retention_policy.describe() << "\n";
+  if(retention_policy.enabled())
+  {
+    retention = std::make_unique<HistoryRetention>(*this, retention_policy);
+  }
+}
+
+HistoryStore::~HistoryStore()
+{
+  // The retention thread walks the rooms; it has to be gone first.
+  retention.reset();
+  for(auto& entry : rooms)
+  {
+    entry.second.history->spill_all();
+  }
+}
+
+bool HistoryStore::valid_room_name(const std::string& name)
+{
+  if(name.empty() || name.size() > MAX_ROOM_NAME)
+  {
+    return false;
+  }
+  return std::all_of(name.begin(), name.end(),
+    [](char c) { return c > ' ' && c < 0x7f; });
+}
+
+std::shared_ptr<RoomHistory> HistoryStore::room(const std::string& name)
+{
+  if(!valid_room_name(name))
+  {
+    return nullptr;
+  }
+
+  std::lock_guard<std::mutex> lk(rooms_mutex);
+  const auto now = std::chrono::steady_clock::now();
+  auto it = rooms.find(name);
+  if(it == rooms.end())
+  {
+    if(rooms.size() >= MAX_ROOMS)
+    {
+      evict_idle();
+      if(rooms.size() >= MAX_ROOMS)
+      {
+        return nullptr;
+      }
+    }
+    std::unique_ptr<ChatLog> log;
+    if(!dir.empty())
+    {
+      log = std::make_unique<ChatLog>(dir + "/" + directory_name(name));
+    }
+    it = rooms.emplace(name,
+      Entry{std::make_shared<RoomHistory>(std::move(log), ring_capacity), now}).first;
+  }
+  it->second.last_used = now;
+  return it->second.history;
+}
+
+void HistoryStore::evict_idle()
+{
+  const auto idle_since = std::chrono::steady_clock::now()
+    - std::chrono::seconds(ROOM_IDLE_SEC);
+  for(auto it = rooms.begin(); it != rooms.end();)
+  {
+    // References are only handed out under rooms_mutex, so an unshared
+    // history stays unshared until it is gone. It is spilled under the
+    // lock too: a room() for the same name must not open its log twice.
+    if(it->second.history.use_count() == 1 && it->second.last_used < idle_since)
+    {
+      it->second.history->spill_all();
+      it = rooms.erase(it);
+    }
+    else
+    {
+      ++it;
+    }
+  }
+}
+
+std::vector<std::shared_ptr<RoomHistory>> HistoryStore::all_rooms()
+{
+  std::lock_guard<std::mutex> lk(rooms_mutex);
+  std::vector<std::shared_ptr<RoomHistory>> out;
+  out.reserve(rooms.size());
+  for(auto& entry : rooms)
+  {
+    out.push_back(entry.second.history);
+  }
+  return out;
+}
+
+std::vector<std::pair<std::string, std::shared_ptr<RoomHistory>>> HistoryStore::named_rooms()
+{
+  std::lock_guard<std::mutex> lk(rooms_mutex);
+  std::vector<std::pair<std::string, std::shared_ptr<RoomHistory>>> out;
+  out.reserve(rooms.size());
+  for(auto& entry : rooms)
+  {
+    out.emplace_back(entry.first, entry.second.history);
+  }
+  return out;
+}
+
+std::string HistoryStore::directory_name(const std::string& room)
+{
+  // Percent-encode everything but [A-Za-z0-9_-]; "." and ".." can not occur.
+  std::string out;
+  for(unsigned char c : room)
+  {
+    if(isalnum(c) || c == '_' || c == '-')
+    {
+      out += static_cast<char>(c);
+    }
+    else
+    {
+      char hex[4];
+      snprintf(hex, sizeof(hex), "%%%02X", c);
+      out += hex;
+    }
+  }
+  return out.empty() ? "%" : out;
+}
+
+bool HistoryStore::room_name(const std::string& directory, std::string& room)
+{
+  room.clear();
+  for(size_t i = 0; i < directory.size(); ++i)
+  {
+    if(directory[i] == '%' && i + 2 < directory.size()
+      && isxdigit(static_cast<unsigned char>(directory[i + 1]))
+      && isxdigit(static_cast<unsigned char>(directory[i + 2])))
+    {
+      room += static_cast<char>(std::stoi(directory.substr(i + 1, 2), nullptr, 16));
+      i += 2;
+    }
+    else
+    {
+      room += directory[i];
+    }
+  }
+  // Anything else in the directory (bad escapes, foreign names) is left alone.
+  return !room.empty() && directory_name(room) == directory;
+}
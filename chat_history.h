@@ -0,0 +1,168 @@
+#ifndef CHAT_HISTORY_H
+#define CHAT_HISTORY_H
+
+#include "chat_log.h"
+#include "history_retention.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/* Per-room message history for resume-after-reconnect.
+ * Every chat message of a room gets the next sequence number of that room.
+ * A client that remembers the last number it saw can come back and ask for
+ * everything after it instead of starting over.
+ *
+  | Tier        | Holds                      | Cost of a resume               |
+  | ----------- | -------------------------- | ------------------------------ |
+  | ring        | the last ring_capacity     | memory copy                    |
+  | ChatLog     | everything spilled before  | segment file reads             |
+ *
+ * New messages go into a fixed size ring. When it is full, the oldest
+ * SPILL_BATCH records are appended to the room's ChatLog in one write and
+ * dropped from memory, so the disk is touched once per batch, not per
+ * message. Without a log directory the history is memory only and older
+ * messages are simply lost.
+ *
+ * RoomHistory is not locked internally; it has two locks for its users.
+ * mutex() is the room's sequencing lock: ring and numbering. Whoever
+ * assigns a number queues the message for fan-out before releasing it, so
+ * two senders can not deliver 6 before 5, but the sending happens after.
+ * log_mutex() guards the ChatLog, whose writes and reads touch the disk.
+ * A full ring does not write under mutex(): append() moves the oldest
+ * batch to a spill queue, still replayable from memory, and whoever
+ * appended calls flush() once it has released mutex(). Readers that reach
+ * into the log take both (ReadLock), log_mutex() first, so they never see
+ * a batch that has left the queue but is not in the log yet.
+*/
+
+class RoomHistory
+{
+  public:
+    static constexpr size_t SPILL_BATCH = 256;
+
+    // `log` may be null (memory only).
+    RoomHistory(std::unique_ptr<ChatLog> log, size_t ring_capacity);
+
+    // log_mutex() and mutex(), in that order.
+    class ReadLock
+    {
+      public:
+        explicit ReadLock(RoomHistory& history) :
+          log_lk(history.log_lock), sequence_lk(history.sequence_mutex) {}
+
+      private:
+        std::lock_guard<std::mutex> log_lk;
+        std::lock_guard<std::mutex> sequence_lk;
+    };
+
+    std::mutex& mutex() { return sequence_mutex; }
+    std::mutex& log_mutex() { return log_lock; }
+
+    // Caller holds mutex(), and calls flush() after releasing it. Returns
+    // the sequence number of the message.
+    uint64_t append(std::string text, uint64_t time_us);
+    // Caller holds neither lock. Writes the spill queue to the log; what a
+    // failed write did not store stays queued for the next flush().
+    void flush();
+    // Caller holds a ReadLock. Calls fn for every stored record with
+    // seq > after_seq, oldest first; returns how many.
+    size_t replay_after(uint64_t after_seq,
+      const std::function<void(const ChatRecord&)>& fn) const;
+    // Caller holds a ReadLock. Up to `limit` records with from_us <= time_us <
+    // to_us, oldest first; the log part goes through its time index.
+    size_t replay_between(uint64_t from_us, uint64_t to_us, size_t limit,
+      const std::function<void(const ChatRecord&)>& fn) const;
+    // Caller holds mutex(), and calls flush() after releasing it. Appends a
+    // record numbered elsewhere (a standby following its primary); false
+    // if it is not newer than last_seq().
+    bool restore(const ChatRecord& rec);
+    // Caller holds neither lock. Moves the whole ring to the log (if any).
+    void spill_all();
+
+    // Caller holds mutex().
+    uint64_t last_seq() const { return next_seq - 1; }
+    // Caller holds log_mutex(); null when memory only.
+    ChatLog* chat_log() { return log.get(); }
+
+  private:
+    std::mutex log_lock;
+    std::mutex sequence_mutex;
+    std::unique_ptr<ChatLog> log;
+    std::vector<ChatRecord> spilled;  // left the ring, not in the log yet
+    std::vector<ChatRecord> ring;     // circular, `count` records from `head`
+    size_t head = 0;
+    size_t count = 0;
+    uint64_t next_seq = 1;
+
+    const ChatRecord& at(size_t i) const { return ring[(head + i) % ring.size()]; }
+    // Moves the oldest n ring records to `spilled`.
+    void spill(size_t n);
+};
+
+/* The room histories of a server, by room name.
+ * Room names are user input, so a name is checked (valid_room_name())
+ * before it becomes a map key or a directory, and at most MAX_ROOMS
+ * histories are open at once. Histories are shared: a room that has
+ * members keeps its own reference. When the table is full, room() first
+ * closes the histories nobody references that were last used more than
+ * ROOM_IDLE_SEC ago, spilling their rings to the log; with a history
+ * directory a closed room is reopened from its log when it is used again,
+ * without one its history is gone. If that frees nothing, no new room is
+ * opened until some room goes idle.
+*/
+class HistoryStore
+{
+  public:
+    static const size_t DEFAULT_RING_CAPACITY = 1024;
+    static constexpr size_t MAX_ROOMS = 4096;
+    static constexpr size_t MAX_ROOM_NAME = 64;
+    static constexpr unsigned ROOM_IDLE_SEC = 60;
+
+    // Empty `dir`: memory only. Rooms already logged in `dir` are opened
+    // right away (up to MAX_ROOMS), so `retention` also covers rooms nobody
+    // joins any more.
+    explicit HistoryStore(std::string dir = "",
+      size_t ring_capacity = DEFAULT_RING_CAPACITY,
+      RetentionPolicy retention = {});
+    // Stops retention, then spills every ring to disk.
+    ~HistoryStore();
+
+    // 1 to MAX_ROOM_NAME printable ASCII characters, no spaces.
+    static bool valid_room_name(const std::string& name);
+
+    // History of a room, opened (and its log recovered) on first use. Null
+    // if the name is not valid or MAX_ROOMS rooms are open and in use.
+    std::shared_ptr<RoomHistory> room(const std::string& name);
+    // Every room open right now.
+    std::vector<std::shared_ptr<RoomHistory>> all_rooms();
+    std::vector<std::pair<std::string, std::shared_ptr<RoomHistory>>> named_rooms();
+
+  private:
+    struct Entry
+    {
+      std::shared_ptr<RoomHistory> history;
+      std::chrono::steady_clock::time_point last_used;
+    };
+
+    const std::string dir;
+    const size_t ring_capacity;
+    std::mutex rooms_mutex;
+    std::unordered_map<std::string, Entry> rooms;
+    std::unique_ptr<HistoryRetention> retention;  // declared last, stopped first
+
+    // Caller holds rooms_mutex. Closes idle rooms nobody references.
+    void evict_idle();
+    // Room names are user input: keep them to one safe path component.
+    static std::string directory_name(const std::string& room);
+    // Inverse of directory_name(); false for names it can not produce.
+    static bool room_name(const std::string& directory, std::string& room);
+};
+
+#endif
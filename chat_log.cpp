@@ -0,0 +1,697 @@
+#include "chat_log.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace
+{
+  const size_t RECORD_HEADER = sizeof(uint32_t) + 2 * sizeof(uint64_t);
+  // Records longer than this are taken as garbage when recovering.
+  const uint32_t MAX_RECORD_TEXT = 1 << 20;
+  const size_t READ_CHUNK = 64 * 1024;
+
+  void put(std::string& out, const void* p, size_t n)
+  {
+    out.append(static_cast<const char*>(p), n);
+  }
+
+  bool write_all(int fd, const char* data, size_t len)
+  {
+    size_t done = 0;
+    while(done < len)
+    {
+      auto nb = write(fd, data + done, len - done);
+      if(nb < 0)
+      {
+        if(errno == EINTR)
+        {
+          continue;
+        }
+        return false;
+      }
+      done += nb;
+    }
+    return true;
+  }
+
+  void encode(std::string& out, const ChatRecord& rec)
+  {
+    const uint32_t length = static_cast<uint32_t>(rec.text.size());
+    put(out, &length, sizeof(length));
+    put(out, &rec.seq, sizeof(rec.seq));
+    put(out, &rec.time_us, sizeof(rec.time_us));
+    out += rec.text;
+  }
+
+  // Parses the record at `pos`; false at the end or on a torn record.
+  bool parse_record(const std::string& data, size_t& pos, ChatRecord& rec)
+  {
+    if(data.size() - pos < RECORD_HEADER)
+    {
+      return false;
+    }
+    uint32_t length;
+    std::memcpy(&length, &data[pos], sizeof(length));
+    if(length > MAX_RECORD_TEXT || data.size() - pos - RECORD_HEADER < length)
+    {
+      return false;
+    }
+    std::memcpy(&rec.seq, &data[pos + 4], sizeof(rec.seq));
+    std::memcpy(&rec.time_us, &data[pos + 12], sizeof(rec.time_us));
+    rec.text.assign(data, pos + RECORD_HEADER, length);
+    pos += RECORD_HEADER + length;
+    return true;
+  }
+}
+
+ChatLog::ChatLog(std::string dir, size_t segment_bytes) :
+  dir(std::move(dir)), segment_bytes(segment_bytes), active_fd(-1),
+  active_index_fd(-1), bytes_since_index(0), max_time_us(0), last(0)
+{
+  std::error_code ec;
+  std::filesystem::create_directories(this->dir, ec);
+  if(ec)
+  {
+    throw std::runtime_error("ChatLog: can not create " + this->dir + ": " + ec.message());
+  }
+  recover();
+}
+
+ChatLog::~ChatLog()
+{
+  for(const auto& segment : segments)
+  {
+    unmap(segment);
+  }
+  if(active_fd >= 0)
+  {
+    close(active_fd);
+  }
+  if(active_index_fd >= 0)
+  {
+    close(active_index_fd);
+  }
+}
+
+uint64_t ChatLog::first_seq() const
+{
+  return segments.empty() || last == 0 ? 0 : segments.front().first_seq;
+}
+
+void ChatLog::recover()
+{
+  finish_compactions();
+  for(const auto& entry : std::filesystem::directory_iterator(dir))
+  {
+    const std::string name = entry.path().filename().string();
+    if(entry.path().extension() != ".log")
+    {
+      continue;
+    }
+    char* end = nullptr;
+    const uint64_t first = std::strtoull(name.c_str(), &end, 10);
+    if(end == name.c_str() || std::string(end) != ".log")
+    {
+      continue;
+    }
+    std::error_code ec;
+    const uint64_t size = std::filesystem::file_size(entry.path(), ec);
+    segments.push_back({first, entry.path().string(), ec ? 0 : size});
+  }
+  std::sort(segments.begin(), segments.end(),
+    [](const Segment& a, const Segment& b) { return a.first_seq < b.first_seq; });
+
+  if(segments.empty())
+  {
+    return;
+  }
+
+  // Only the active (last) segment can have a torn tail; walk it to find the
+  // last complete record, cut off the rest and rebuild its index on the way.
+  Segment& active = segments.back();
+  last = active.first_seq - 1;
+  uint64_t end = 0;
+  scan(active.path, UINT64_MAX, 0, [this, &end](const ChatRecord& rec) {
+    max_time_us = std::max(max_time_us, rec.time_us);
+    if(active_index.empty() || bytes_since_index >= INDEX_INTERVAL)
+    {
+      active_index.push_back({rec.seq, max_time_us, end});
+      bytes_since_index = 0;
+    }
+    const uint64_t size = RECORD_HEADER + rec.text.size();
+    bytes_since_index += size;
+    end += size;
+    last = rec.seq;
+    return true;
+  });
+  if(truncate(active.path.c_str(), end) < 0)
+  {
+    perror("ChatLog: truncate");
+  }
+  active.bytes = end;
+  active.index_checked = true;
+
+  active_fd = open(active.path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+  active_index_fd = open(index_path(active.path).c_str(),
+    O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+  if(active_fd < 0 || active_index_fd < 0)
+  {
+    throw std::runtime_error("ChatLog: can not open " + active.path);
+  }
+  if(!active_index.empty() && !write_all(active_index_fd,
+    reinterpret_cast<const char*>(active_index.data()),
+    active_index.size() * sizeof(IndexEntry)))
+  {
+    perror("ChatLog: index write");
+  }
+}
+
+void ChatLog::seal_active()
+{
+  if(active_fd >= 0)
+  {
+    close(active_fd);
+    active_fd = -1;
+  }
+  if(active_index_fd >= 0)
+  {
+    close(active_index_fd);
+    active_index_fd = -1;
+  }
+  if(!segments.empty())
+  {
+    // From now on the index is read through mmap().
+    segments.back().index_checked = false;
+  }
+  active_index.clear();
+}
+
+void ChatLog::start_segment(uint64_t first_seq)
+{
+  seal_active();
+  const std::string path = segment_path(first_seq);
+  active_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  active_index_fd = open(index_path(path).c_str(),
+    O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+  if(active_fd < 0 || active_index_fd < 0)
+  {
+    throw std::runtime_error("ChatLog: can not create " + path);
+  }
+  segments.push_back({first_seq, path, 0});
+  segments.back().index_checked = true;
+  bytes_since_index = 0;
+}
+
+std::string ChatLog::segment_path(uint64_t first_seq) const
+{
+  char name[32];
+  snprintf(name, sizeof(name), "%020llu.log", static_cast<unsigned long long>(first_seq));
+  return dir + "/" + name;
+}
+
+std::string ChatLog::index_path(const std::string& log_path)
+{
+  return log_path.substr(0, log_path.size() - 4) + ".idx";
+}
+
+bool ChatLog::append(const std::vector<ChatRecord>& records)
+{
+  std::string buffer;
+  std::string index_buffer;
+  // The state matching what is on disk; a failed write rolls back to it.
+  uint64_t kept_last, kept_max_time_us, kept_since_index;
+  size_t kept_entries;
+  auto mark = [&]() {
+    kept_last = last;
+    kept_max_time_us = max_time_us;
+    kept_since_index = bytes_since_index;
+    kept_entries = active_index.size();
+  };
+  mark();
+  auto flush = [&]() {
+    Segment& active = segments.back();
+    const bool written = write_all(active_fd, buffer.data(), buffer.size())
+      && write_all(active_index_fd, index_buffer.data(), index_buffer.size());
+    const size_t batch_bytes = buffer.size();
+    buffer.clear();
+    index_buffer.clear();
+    if(!written)
+    {
+      // Disk full or similar: cut off whatever part of the batch made it,
+      // so both files end on a whole record, and leave the records from
+      // here on to the caller.
+      perror("ChatLog: write");
+      if(ftruncate(active_fd, active.bytes) < 0
+        || ftruncate(active_index_fd, kept_entries * sizeof(IndexEntry)) < 0)
+      {
+        perror("ChatLog: ftruncate");
+      }
+      active_index.resize(kept_entries);
+      bytes_since_index = kept_since_index;
+      max_time_us = kept_max_time_us;
+      last = kept_last;
+      return false;
+    }
+    active.bytes += batch_bytes;
+    mark();
+    return true;
+  };
+
+  for(const auto& rec : records)
+  {
+    if(rec.seq <= last)
+    {
+      continue;
+    }
+    if(active_fd < 0 || segments.back().bytes + buffer.size() >= segment_bytes)
+    {
+      if(!buffer.empty() && !flush())
+      {
+        return false;
+      }
+      start_segment(rec.seq);
+      mark();
+    }
+
+    max_time_us = std::max(max_time_us, rec.time_us);
+    if(active_index.empty() || bytes_since_index >= INDEX_INTERVAL)
+    {
+      const IndexEntry entry{rec.seq, max_time_us, segments.back().bytes + buffer.size()};
+      active_index.push_back(entry);
+      put(index_buffer, &entry, sizeof(entry));
+      bytes_since_index = 0;
+    }
+
+    encode(buffer, rec);
+    bytes_since_index += RECORD_HEADER + rec.text.size();
+    last = rec.seq;
+  }
+
+  return buffer.empty() || flush();
+}
+
+size_t ChatLog::read_after(uint64_t after_seq, size_t limit, const RecordFn& fn) const
+{
+  if(segments.empty() || after_seq >= last || limit == 0)
+  {
+    return 0;
+  }
+
+  // Last segment starting at or before the first wanted record.
+  auto it = std::upper_bound(segments.begin(), segments.end(), after_seq + 1,
+    [](uint64_t seq, const Segment& s) { return seq < s.first_seq; });
+  size_t i = it == segments.begin() ? 0 : it - segments.begin() - 1;
+
+  // Inside it: last index entry at or before the first wanted record.
+  uint64_t offset = 0;
+  auto index = index_of(i);
+  auto entry = std::upper_bound(index.first, index.first + index.second, after_seq + 1,
+    [](uint64_t seq, const IndexEntry& e) { return seq < e.seq; });
+  if(entry != index.first)
+  {
+    offset = (entry - 1)->offset;
+  }
+
+  size_t delivered = 0;
+  for(; i < segments.size() && delivered < limit; ++i, offset = 0)
+  {
+    scan(segments[i].path, segments[i].bytes, offset, [&](const ChatRecord& rec) {
+      if(rec.seq > after_seq)
+      {
+        fn(rec);
+        ++delivered;
+      }
+      return delivered < limit;
+    });
+  }
+  return delivered;
+}
+
+size_t ChatLog::read_time_range(uint64_t from_us, uint64_t to_us, size_t limit,
+  const RecordFn& fn) const
+{
+  if(segments.empty() || from_us >= to_us || limit == 0)
+  {
+    return 0;
+  }
+
+  // Last segment whose first record is older than from_us.
+  size_t lo = 0, hi = segments.size();
+  while(hi - lo > 1)
+  {
+    const size_t mid = (lo + hi) / 2;
+    auto index = index_of(mid);
+    if(index.second > 0 && index.first[0].time_us < from_us)
+    {
+      lo = mid;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+
+  uint64_t offset = 0;
+  auto index = index_of(lo);
+  auto entry = std::lower_bound(index.first, index.first + index.second, from_us,
+    [](const IndexEntry& e, uint64_t t) { return e.time_us < t; });
+  if(entry != index.first)
+  {
+    offset = (entry - 1)->offset;
+  }
+
+  size_t delivered = 0;
+  uint64_t newest = 0;
+  for(size_t i = lo; i < segments.size() && delivered < limit; ++i, offset = 0)
+  {
+    scan(segments[i].path, segments[i].bytes, offset, [&](const ChatRecord& rec) {
+      newest = std::max(newest, rec.time_us);
+      if(newest >= to_us)
+      {
+        return false;
+      }
+      if(rec.time_us >= from_us)
+      {
+        fn(rec);
+        ++delivered;
+      }
+      return delivered < limit;
+    });
+    if(newest >= to_us)
+    {
+      break;
+    }
+  }
+  return delivered;
+}
+
+std::pair<const ChatLog::IndexEntry*, size_t> ChatLog::index_of(size_t i) const
+{
+  const Segment& segment = segments[i];
+  if(i + 1 == segments.size() && active_fd >= 0)
+  {
+    return {active_index.data(), active_index.size()};
+  }
+
+  if(!segment.index_checked)
+  {
+    segment.index_checked = true;
+    unmap(segment);
+
+    const std::string path = index_path(segment.path);
+    for(int attempt = 0; attempt < 2 && segment.mapped == nullptr; ++attempt)
+    {
+      int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      struct stat st;
+      if(fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0 &&
+        st.st_size % sizeof(IndexEntry) == 0)
+      {
+        void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if(p != MAP_FAILED)
+        {
+          const auto* entries = static_cast<const IndexEntry*>(p);
+          const size_t n = st.st_size / sizeof(IndexEntry);
+          // Sanity, without touching more than two pages: the first entry
+          // is the segment's first record, the last one lies inside it and
+          // does not come before the first (a zeroed file fails here).
+          const IndexEntry& head = entries[0];
+          const IndexEntry& tail = entries[n - 1];
+          if(head.offset == 0 && head.seq == segment.first_seq &&
+            tail.offset < segment.bytes && tail.seq >= head.seq &&
+            tail.time_us >= head.time_us)
+          {
+            segment.mapped = entries;
+            segment.mapped_entries = n;
+          }
+          else
+          {
+            munmap(p, st.st_size);
+          }
+        }
+      }
+      if(fd >= 0)
+      {
+        close(fd);
+      }
+      if(segment.mapped == nullptr && attempt == 0)
+      {
+        rebuild_index(segment.path);
+      }
+    }
+  }
+  return {segment.mapped, segment.mapped_entries};
+}
+
+void ChatLog::unmap(const Segment& segment) const
+{
+  if(segment.mapped != nullptr)
+  {
+    munmap(const_cast<IndexEntry*>(segment.mapped),
+      segment.mapped_entries * sizeof(IndexEntry));
+    segment.mapped = nullptr;
+    segment.mapped_entries = 0;
+  }
+}
+
+void ChatLog::scan(const std::string& path, uint64_t bytes, uint64_t offset,
+  const std::function<bool(const ChatRecord&)>& fn)
+{
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if(fd < 0)
+  {
+    return;
+  }
+
+  // Chunked pread from `offset`: only the part after the index entry is read.
+  std::string data;
+  size_t pos = 0;
+  ChatRecord rec;
+  bool more = true;
+  while(more && offset < bytes)
+  {
+    data.erase(0, pos);
+    pos = 0;
+    const size_t want = std::min<uint64_t>(READ_CHUNK, bytes - offset);
+    const size_t old_size = data.size();
+    data.resize(old_size + want);
+    auto nb = pread(fd, &data[old_size], want, offset);
+    if(nb <= 0)
+    {
+      data.resize(old_size);
+      break;
+    }
+    data.resize(old_size + nb);
+    offset += nb;
+
+    while(more && parse_record(data, pos, rec))
+    {
+      more = fn(rec);
+    }
+  }
+  close(fd);
+}
+
+void ChatLog::rebuild_index(const std::string& log_path)
+{
+  // Sealed segments are at most segment_bytes: read it in one go.
+  int fd = open(log_path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if(fd < 0 || fstat(fd, &st) < 0)
+  {
+    if(fd >= 0)
+    {
+      close(fd);
+    }
+    return;
+  }
+  std::string data(st.st_size, '\0');
+  auto nb = pread(fd, &data[0], data.size(), 0);
+  close(fd);
+  data.resize(nb > 0 ? nb : 0);
+
+  std::string out;
+  uint64_t offset = 0, since = 0, max_time = 0;
+
+  size_t pos = 0;
+  ChatRecord rec;
+  while(parse_record(data, pos, rec))
+  {
+    max_time = std::max(max_time, rec.time_us);
+    if(offset == 0 || since >= INDEX_INTERVAL)
+    {
+      const IndexEntry entry{rec.seq, max_time, offset};
+      put(out, &entry, sizeof(entry));
+      since = 0;
+    }
+    const uint64_t size = RECORD_HEADER + rec.text.size();
+    since += size;
+    offset += size;
+  }
+
+  const std::string path = index_path(log_path);
+  fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if(fd < 0 || !write_all(fd, out.data(), out.size()))
+  {
+    perror("ChatLog: rebuild index");
+  }
+  if(fd >= 0)
+  {
+    close(fd);
+  }
+}
+
+void ChatLog::finish_compactions()
+{
+  for(const auto& entry : std::filesystem::directory_iterator(dir))
+  {
+    if(entry.path().extension() != ".compact")
+    {
+      continue;
+    }
+    std::string old_log = entry.path().string();
+    old_log = old_log.substr(0, old_log.size() - 8) + ".log";
+    std::error_code ec;
+    if(std::filesystem::exists(old_log, ec))
+    {
+      // Crashed before the commit point: the old segment is still valid.
+      std::filesystem::remove(entry.path(), ec);
+      continue;
+    }
+
+    // Crashed after it: finish the rename.
+    uint64_t first = 0;
+    scan(entry.path().string(), UINT64_MAX, 0, [&first](const ChatRecord& rec) {
+      first = rec.seq;
+      return false;
+    });
+    if(first == 0)
+    {
+      std::filesystem::remove(entry.path(), ec);
+      continue;
+    }
+    std::filesystem::rename(entry.path(), segment_path(first), ec);
+  }
+}
+
+uint64_t ChatLog::total_bytes() const
+{
+  uint64_t total = 0;
+  for(const auto& segment : segments)
+  {
+    total += segment.bytes;
+  }
+  return total;
+}
+
+std::vector<ChatLog::SegmentInfo> ChatLog::sealed_segments() const
+{
+  std::vector<SegmentInfo> sealed;
+  for(size_t i = 0; i + 1 < segments.size(); ++i)
+  {
+    sealed.push_back({segments[i].first_seq, segments[i + 1].first_seq - 1,
+      segments[i].bytes, segments[i].path});
+  }
+  return sealed;
+}
+
+std::vector<std::string> ChatLog::drop_through(uint64_t seq)
+{
+  std::vector<std::string> files;
+  size_t n = 0;
+  while(n + 1 < segments.size() && segments[n + 1].first_seq - 1 <= seq)
+  {
+    unmap(segments[n]);
+    files.push_back(segments[n].path);
+    files.push_back(index_path(segments[n].path));
+    ++n;
+  }
+  segments.erase(segments.begin(), segments.begin() + n);
+  return files;
+}
+
+bool ChatLog::replace_oldest(const std::string& compact)
+{
+  if(segments.size() < 2)
+  {
+    return false;
+  }
+  Segment& oldest = segments.front();
+  if(compact != compact_path(oldest.path))
+  {
+    return false;
+  }
+
+  uint64_t first = 0;
+  scan(compact, UINT64_MAX, 0, [&first](const ChatRecord& rec) {
+    first = rec.seq;
+    return false;
+  });
+  std::error_code ec;
+  const uint64_t bytes = std::filesystem::file_size(compact, ec);
+  if(first <= oldest.first_seq || first >= segments[1].first_seq || ec)
+  {
+    std::filesystem::remove(compact, ec);
+    return false;
+  }
+
+  // Commit point: the old segment goes away, then the copy takes its place.
+  unmap(oldest);
+  unlink(index_path(oldest.path).c_str());
+  unlink(oldest.path.c_str());
+  const std::string path = segment_path(first);
+  if(rename(compact.c_str(), path.c_str()) < 0)
+  {
+    perror("ChatLog: rename compacted segment");
+  }
+  oldest.first_seq = first;
+  oldest.path = path;
+  oldest.bytes = bytes;
+  oldest.index_checked = false;      // rebuilt on first use
+  return true;
+}
+
+std::string ChatLog::compact_path(const std::string& log_path)
+{
+  return log_path.substr(0, log_path.size() - 4) + ".compact";
+}
+
+bool ChatLog::write_compacted(const std::string& log_path, uint64_t after_seq)
+{
+  std::string out;
+  scan(log_path, UINT64_MAX, 0, [&out, after_seq](const ChatRecord& rec) {
+    if(rec.seq > after_seq)
+    {
+      encode(out, rec);
+    }
+    return true;
+  });
+  if(out.empty())
+  {
+    return false;
+  }
+
+  const std::string path = compact_path(log_path);
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if(fd < 0)
+  {
+    return false;
+  }
+  // The copy must be complete on disk before the original is unlinked.
+  const bool ok = write_all(fd, out.data(), out.size()) && fsync(fd) == 0;
+  close(fd);
+  if(!ok)
+  {
+    unlink(path.c_str());
+  }
+  return ok;
+}
@@ -0,0 +1,172 @@
+#ifndef CHAT_LOG_H
+#define CHAT_LOG_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+/* Persistent, append-only message log of one chat room.
+ * The log is a directory of segment files; each segment is named after the
+ * sequence number of its first record and holds records in sequence order:
+ *
+ *   <dir>/00000000000000000001.log
+ *   <dir>/00000000000000000001.idx   <- sparse index of that segment
+ *   <dir>/00000000000000004711.log   <- active segment, appended to
+ *   <dir>/00000000000000004711.idx
+ *
+ *   record: | length u32 | seq u64 | time_us u64 | text (length bytes) |
+ *   index:  | seq u64 | time_us u64 | offset u64 |  (one per INDEX_INTERVAL)
+ *
+ * Integers are stored in host byte order: the log is local to the machine.
+ * A new segment starts once the active one reaches segment_bytes, so old
+ * history can later be dropped a whole file at a time.
+ *
+ * Sparse index: whenever INDEX_INTERVAL bytes of records were written since
+ * the last entry, the next record gets an index entry. Lookups binary-search
+ * the entries and then read forward from the entry's offset, so finding a
+ * sequence number or a point in time costs O(log entries) in memory plus at
+ * most INDEX_INTERVAL bytes of scanning, whatever the size of the log:
+ *
+  | Lookup            | Segment            | Inside the segment              |
+  | ----------------- | ------------------ | ------------------------------- |
+  | seq > S           | by file name       | last entry with seq <= S + 1    |
+  | time >= T         | first entry of each| last entry with time < T        |
+ *
+ * Index files of sealed segments are mmap()ed read-only on first use and the
+ * kernel pages them in on demand; the active segment keeps its entries in
+ * memory as well as appending them to its file. Timestamps in the index are
+ * the running maximum of the records' times, so they never go backwards even
+ * if the wall clock does. A missing or damaged index file is rebuilt from
+ * its segment.
+ *
+ * Appends are plain write()s without fsync: a crash can lose what the
+ * kernel had not written back yet, and a torn record at the end of the
+ * active segment is cut off when the log is opened again. A write that
+ * fails (disk full) is cut off at once and append() reports it.
+ *
+ * Retention (HistoryRetention) drops whole sealed segments, and compaction
+ * replaces the oldest kept segment with a copy that starts later. The copy
+ * is written as <old first seq>.compact. The old files are then unlinked
+ * and the copy is renamed to <new first seq>.log. The unlink is the commit
+ * point. When the log is opened, a .compact file whose .log still exists
+ * is discarded, and one without it is finished.
+ *
+ * Not thread-safe; the owner (RoomHistory) serializes access. Sealed
+ * segment files never change, so they may be read without that lock.
+*/
+
+struct ChatRecord
+{
+  uint64_t seq = 0;
+  uint64_t time_us = 0;               // wall clock, microseconds since epoch
+  std::string text;
+};
+
+class ChatLog
+{
+  public:
+    static const size_t DEFAULT_SEGMENT_BYTES = 4 << 20;
+    static const size_t INDEX_INTERVAL = 4096;
+
+    using RecordFn = std::function<void(const ChatRecord&)>;
+
+    struct SegmentInfo
+    {
+      uint64_t first_seq;
+      uint64_t last_seq;
+      uint64_t bytes;
+      std::string path;
+    };
+
+    // Opens (creating if needed) the log in `dir` and recovers its tail.
+    explicit ChatLog(std::string dir, size_t segment_bytes = DEFAULT_SEGMENT_BYTES);
+    ~ChatLog();
+
+    ChatLog(const ChatLog&) = delete;
+    ChatLog& operator=(const ChatLog&) = delete;
+
+    // Highest sequence number written, 0 for an empty log.
+    uint64_t last_seq() const { return last; }
+    // Lowest sequence number still stored, 0 for an empty log.
+    uint64_t first_seq() const;
+
+    // Records must continue the sequence (seq > last_seq()); older ones are
+    // skipped. False if a write failed: the records after last_seq() were
+    // not stored and the files are as they were before them.
+    bool append(const std::vector<ChatRecord>& records);
+
+    // Calls fn for up to `limit` records with seq > after_seq, in order.
+    // Returns how many were delivered.
+    size_t read_after(uint64_t after_seq, size_t limit, const RecordFn& fn) const;
+    // Calls fn for up to `limit` records with from_us <= time_us < to_us,
+    // in sequence order. Returns how many were delivered.
+    size_t read_time_range(uint64_t from_us, uint64_t to_us, size_t limit,
+      const RecordFn& fn) const;
+
+    // Maintenance, for HistoryRetention.
+    uint64_t total_bytes() const;
+    // Sealed segments, oldest first; the active one is never listed.
+    std::vector<SegmentInfo> sealed_segments() const;
+    // Forgets the sealed segments with last_seq <= seq and returns their
+    // files; the caller unlinks them (outside any lock).
+    std::vector<std::string> drop_through(uint64_t seq);
+    // Installs the compacted copy of the oldest sealed segment. `compact`
+    // must hold a suffix of its records, written by write_compacted().
+    bool replace_oldest(const std::string& compact);
+
+    // Where the compacted copy of the segment at `log_path` is written.
+    static std::string compact_path(const std::string& log_path);
+    // Writes the records of the sealed segment at `log_path` with
+    // seq > after_seq to compact_path(); false if nothing would be left.
+    static bool write_compacted(const std::string& log_path, uint64_t after_seq);
+
+  private:
+    struct IndexEntry
+    {
+      uint64_t seq;
+      uint64_t time_us;
+      uint64_t offset;
+    };
+
+    struct Segment
+    {
+      uint64_t first_seq;
+      std::string path;               // .log
+      uint64_t bytes;
+      // Sealed segments: the mmap()ed index file, mapped on first use.
+      mutable const IndexEntry* mapped = nullptr;
+      mutable size_t mapped_entries = 0;
+      mutable bool index_checked = false;
+    };
+
+    const std::string dir;
+    const size_t segment_bytes;
+    std::vector<Segment> segments;    // sorted by first_seq
+    int active_fd;
+    int active_index_fd;
+    std::vector<IndexEntry> active_index;
+    uint64_t bytes_since_index;
+    uint64_t max_time_us;
+    uint64_t last;
+
+    void recover();
+    void start_segment(uint64_t first_seq);
+    void seal_active();
+    std::string segment_path(uint64_t first_seq) const;
+    static std::string index_path(const std::string& log_path);
+
+    // Index entries of segment i (mapping or rebuilding it if needed).
+    std::pair<const IndexEntry*, size_t> index_of(size_t i) const;
+    void unmap(const Segment& segment) const;
+    // Scans a segment file from `offset` up to `bytes`, calling fn until
+    // it returns false.
+    static void scan(const std::string& path, uint64_t bytes, uint64_t offset,
+      const std::function<bool(const ChatRecord&)>& fn);
+    void finish_compactions();
+    // Writes a fresh index for a sealed segment from its records.
+    static void rebuild_index(const std::string& log_path);
+};
+
+#endif
@@ -0,0 +1,329 @@
+#include <algorithm>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include "chat_log.h"
+
+/* Model check of ChatLog, including its crash recovery.
+ * Every round appends random batches to a log with small segments and
+ * keeps the same records in a plain vector. Between batches it damages the
+ * files the way a crash (or a disk) would, reopens the log and compares
+ * read_after() and read_time_range() with the vector:
+ *
+  | Damage                         | Expected after reopening               |
+  | ------------------------------ | -------------------------------------- |
+  | active segment cut mid-record  | records up to the cut, appends go on   |
+  | sealed .idx deleted            | rebuilt from the segment               |
+  | sealed .idx cut, zeroed or junk| rebuilt from the segment               |
+  | active .idx deleted or junk    | rewritten by recovery                  |
+  | .compact next to its .log      | discarded, nothing lost                |
+  | .compact without its .log      | installed: that segment starts later   |
+ *
+ * Times never go backwards here: read_time_range() is exact only for a
+ * clock that does not (see the index notes in chat_log.h).
+ *
+ * usage: chat_log_check [rounds] [seed] [dir]   (default 40, 7, /tmp/chat_log_check.<pid>)
+ * Prints the first mismatches; exit code 1 if there were any.
+*/
+
+using namespace std;
+
+namespace
+{
+  const int MAX_REPORTED = 5;
+  const size_t RECORD_HEADER = 20;
+  const int STEPS_PER_ROUND = 30;
+
+  struct Checker
+  {
+    std::mt19937 rng;
+    std::string dir;
+    size_t segment_bytes = 0;
+    std::vector<ChatRecord> model;    // what the log must hold, in order
+    std::unique_ptr<ChatLog> log;
+    uint64_t next_seq = 1;
+    uint64_t clock_us = 1000000;
+    unsigned long checks = 0;
+    unsigned long mismatches = 0;
+
+    void fail(const std::string& what)
+    {
+      if(++mismatches <= MAX_REPORTED)
+      {
+        std::cout << "mismatch: " << what << "\n";
+      }
+    }
+
+    void reopen()
+    {
+      log.reset();
+      log = std::make_unique<ChatLog>(dir, segment_bytes);
+    }
+
+    void append_batch()
+    {
+      std::vector<ChatRecord> batch(1 + rng() % 40);
+      for(ChatRecord& rec : batch)
+      {
+        rec.seq = next_seq++;
+        // Ties are common: several messages in one microsecond.
+        clock_us += rng() % 4 == 0 ? 0 : rng() % 3000;
+        rec.time_us = clock_us;
+        rec.text.assign(rng() % 300, static_cast<char>('a' + rec.seq % 26));
+      }
+      if(!log->append(batch))
+      {
+        fail("append failed");
+      }
+      model.insert(model.end(), batch.begin(), batch.end());
+    }
+
+    void compare(const std::string& what, const std::vector<ChatRecord>& expected,
+      const std::vector<ChatRecord>& got)
+    {
+      ++checks;
+      bool same = expected.size() == got.size();
+      for(size_t i = 0; same && i < got.size(); ++i)
+      {
+        same = expected[i].seq == got[i].seq && expected[i].time_us == got[i].time_us
+          && expected[i].text == got[i].text;
+      }
+      if(!same)
+      {
+        fail(what + ": expected " + std::to_string(expected.size()) + " records from #" +
+          (expected.empty() ? "-" : std::to_string(expected.front().seq)) + ", got " +
+          std::to_string(got.size()) + " from #" +
+          (got.empty() ? "-" : std::to_string(got.front().seq)));
+      }
+    }
+
+    void check_reads()
+    {
+      const uint64_t last = model.empty() ? 0 : model.back().seq;
+      if(log->last_seq() != last)
+      {
+        fail("last_seq " + std::to_string(log->last_seq()) + ", expected " +
+          std::to_string(last));
+      }
+      const uint64_t first = model.empty() ? 0 : model.front().seq;
+      if(log->first_seq() != first)
+      {
+        fail("first_seq " + std::to_string(log->first_seq()) + ", expected " +
+          std::to_string(first));
+      }
+
+      for(int i = 0; i < 8; ++i)
+      {
+        const uint64_t after = rng() % (next_seq + 2);
+        const size_t limit = rng() % 2 ? SIZE_MAX : 1 + rng() % 50;
+        std::vector<ChatRecord> expected, got;
+        for(const ChatRecord& rec : model)
+        {
+          if(rec.seq > after && expected.size() < limit)
+          {
+            expected.push_back(rec);
+          }
+        }
+        log->read_after(after, limit, [&got](const ChatRecord& rec) { got.push_back(rec); });
+        compare("read_after(" + std::to_string(after) + ", " + std::to_string(limit) + ")",
+          expected, got);
+      }
+
+      for(int i = 0; i < 8; ++i)
+      {
+        const uint64_t span = clock_us - 1000000 + 2000;
+        const uint64_t from_us = 1000000 - 1000 + rng() % span;
+        const uint64_t to_us = from_us + rng() % (span / 2 + 1);
+        const size_t limit = rng() % 2 ? SIZE_MAX : 1 + rng() % 50;
+        std::vector<ChatRecord> expected, got;
+        for(const ChatRecord& rec : model)
+        {
+          if(rec.time_us >= from_us && rec.time_us < to_us && expected.size() < limit)
+          {
+            expected.push_back(rec);
+          }
+        }
+        log->read_time_range(from_us, to_us, limit,
+          [&got](const ChatRecord& rec) { got.push_back(rec); });
+        compare("read_time_range(" + std::to_string(from_us) + ", " +
+          std::to_string(to_us) + ", " + std::to_string(limit) + ")", expected, got);
+      }
+    }
+
+    // Segment files, oldest first.
+    std::vector<std::string> segment_files()
+    {
+      std::vector<std::string> files;
+      for(const auto& entry : std::filesystem::directory_iterator(dir))
+      {
+        if(entry.path().extension() == ".log")
+        {
+          files.push_back(entry.path().string());
+        }
+      }
+      std::sort(files.begin(), files.end());
+      return files;
+    }
+
+    static std::string index_file(const std::string& log_path)
+    {
+      return log_path.substr(0, log_path.size() - 4) + ".idx";
+    }
+
+    void tear_active()
+    {
+      log.reset();
+      const auto files = segment_files();
+      if(files.empty())
+      {
+        return;
+      }
+      const std::string& active = files.back();
+      const uint64_t first = std::strtoull(
+        std::filesystem::path(active).filename().c_str(), nullptr, 10);
+      const uint64_t size = std::filesystem::file_size(active);
+      const uint64_t cut = size == 0 ? 0 : rng() % size;
+      if(truncate(active.c_str(), cut) < 0)
+      {
+        fail("truncate " + active);
+      }
+
+      // Keep the records that still end before the cut.
+      uint64_t end = 0;
+      auto it = std::find_if(model.begin(), model.end(),
+        [first](const ChatRecord& rec) { return rec.seq >= first; });
+      while(it != model.end() && end + RECORD_HEADER + it->text.size() <= cut)
+      {
+        end += RECORD_HEADER + it->text.size();
+        ++it;
+      }
+      model.erase(it, model.end());
+      next_seq = model.empty() ? first : std::max(first, model.back().seq + 1);
+      reopen();
+    }
+
+    void damage_index(bool sealed)
+    {
+      log.reset();
+      const auto files = segment_files();
+      if(files.size() < (sealed ? 2 : 1))
+      {
+        reopen();
+        return;
+      }
+      const std::string index = index_file(sealed ? files[rng() % (files.size() - 1)]
+        : files.back());
+      const uint64_t size = std::filesystem::exists(index) ? std::filesystem::file_size(index) : 0;
+      switch(rng() % 4)
+      {
+        case 0:
+          std::filesystem::remove(index);
+          break;
+        case 1:
+          if(truncate(index.c_str(), size == 0 ? 0 : rng() % size) < 0)
+          {
+            fail("truncate " + index);
+          }
+          break;
+        case 2:
+        {
+          std::ofstream out(index, std::ios::binary | std::ios::trunc);
+          out << std::string(size, '\0');
+          break;
+        }
+        default:
+        {
+          std::ofstream out(index, std::ios::binary | std::ios::trunc);
+          for(uint64_t i = 0; i < size; ++i)
+          {
+            out.put(static_cast<char>(rng()));
+          }
+          break;
+        }
+      }
+      reopen();
+    }
+
+    void crash_compaction(bool committed)
+    {
+      const auto sealed = log->sealed_segments();
+      if(sealed.empty())
+      {
+        return;
+      }
+      const ChatLog::SegmentInfo& oldest = sealed.front();
+      // Keep at least the segment's last record.
+      const uint64_t after = oldest.first_seq + rng() % (oldest.last_seq - oldest.first_seq + 1) - 1;
+      log.reset();
+      if(!ChatLog::write_compacted(oldest.path, after))
+      {
+        fail("write_compacted " + oldest.path);
+        reopen();
+        return;
+      }
+      if(committed)
+      {
+        // The crash came right after the commit point (the unlink).
+        std::filesystem::remove(index_file(oldest.path));
+        std::filesystem::remove(oldest.path);
+        model.erase(std::remove_if(model.begin(), model.end(),
+          [after](const ChatRecord& rec) { return rec.seq <= after; }), model.end());
+      }
+      reopen();
+      if(std::filesystem::exists(ChatLog::compact_path(oldest.path)))
+      {
+        fail("compaction of " + oldest.path + " left behind");
+      }
+    }
+
+    void run_round()
+    {
+      std::filesystem::remove_all(dir);
+      model.clear();
+      next_seq = 1;
+      segment_bytes = 1024 << (rng() % 5);
+      reopen();
+      for(int step = 0; step < STEPS_PER_ROUND; ++step)
+      {
+        append_batch();
+        switch(rng() % 10)
+        {
+          case 0: tear_active(); break;
+          case 1: damage_index(true); break;
+          case 2: damage_index(false); break;
+          case 3: crash_compaction(false); break;
+          case 4: crash_compaction(true); break;
+          case 5: reopen(); break;
+          default: break;
+        }
+        check_reads();
+      }
+      log.reset();
+    }
+  };
+}
+
+int main(int argc, char* argv[])
+{
+  const unsigned long rounds = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 40;
+  const unsigned long seed = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 7;
+
+  Checker checker;
+  checker.rng.seed(seed);
+  checker.dir = argc > 3 ? argv[3] : "/tmp/chat_log_check." + std::to_string(getpid());
+  for(unsigned long i = 0; i < rounds; ++i)
+  {
+    checker.run_round();
+  }
+  std::filesystem::remove_all(checker.dir);
+  std::cout << rounds << " rounds, " << checker.checks << " reads, "
+    << checker.mismatches << " mismatches\n";
+  return checker.mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
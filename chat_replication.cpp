@@ -0,0 +1,439 @@
+#include "chat_replication.h"
+
+#include "chat_history.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace
+{
+  enum class RecordType : uint8_t { RESET = 1, SESSION, CLOSE, MESSAGE };
+
+  const size_t HEADER_BYTES = sizeof(uint8_t) + sizeof(uint32_t);
+  // Anything bigger is a broken stream.
+  const uint32_t MAX_PAYLOAD = 1 << 24;
+  const size_t SEND_BATCH_BYTES = 64 * 1024;
+  const size_t READ_CHUNK = 64 * 1024;
+  const int RECONNECT_MS = 500;
+  const int LIVENESS_MS = 200;
+  // Encoded records queued for the standby before they are dropped.
+  const size_t OUTBOX_LIMIT = 16 << 20;
+
+  template <typename T>
+  void put(std::string& out, T value)
+  {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+
+  void put_str(std::string& out, const std::string& s)
+  {
+    put<uint32_t>(out, s.size());
+    out += s;
+  }
+
+  // Starts a record; finish() fills in its payload length.
+  size_t begin(std::string& out, RecordType type)
+  {
+    put<uint8_t>(out, static_cast<uint8_t>(type));
+    put<uint32_t>(out, 0);
+    return out.size();
+  }
+
+  void finish(std::string& out, size_t payload_start)
+  {
+    const uint32_t length = out.size() - payload_start;
+    memcpy(&out[payload_start - sizeof(length)], &length, sizeof(length));
+  }
+
+  // Bounds-checked reads from one record's payload.
+  struct Reader
+  {
+    const char* p;
+    const char* end;
+    bool ok = true;
+
+    template <typename T>
+    T get()
+    {
+      T value{};
+      if(end - p < static_cast<ptrdiff_t>(sizeof(T)))
+      {
+        ok = false;
+        return value;
+      }
+      memcpy(&value, p, sizeof(T));
+      p += sizeof(T);
+      return value;
+    }
+
+    std::string get_str()
+    {
+      const uint32_t n = get<uint32_t>();
+      if(!ok || static_cast<size_t>(end - p) < n)
+      {
+        ok = false;
+        return std::string();
+      }
+      std::string s(p, n);
+      p += n;
+      return s;
+    }
+  };
+
+  sockaddr_un unix_address(const std::string& path)
+  {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(address.sun_path))
+    {
+      throw std::invalid_argument("socket path too long: " + path);
+    }
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return address;
+  }
+
+  // The socket has SO_SNDTIMEO set: a standby that stops reading is waited
+  // for, but `stop` is checked between the timeouts.
+  bool send_all(int fd, const std::string& data, const std::function<bool()>& stop)
+  {
+    size_t sent = 0;
+    while(sent < data.size())
+    {
+      const ssize_t n = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+      if(n < 0)
+      {
+        if(errno == EINTR || ((errno == EAGAIN || errno == EWOULDBLOCK) && !stop()))
+        {
+          continue;
+        }
+        return false;
+      }
+      sent += n;
+    }
+    return true;
+  }
+}
+
+ChatReplicator::ChatReplicator(std::string socket_path, SnapshotFn snapshot) :
+  socket_path(std::move(socket_path)), snapshot(std::move(snapshot))
+{
+  unix_address(this->socket_path);    // throws if unusable
+  worker = std::thread(&ChatReplicator::loop, this);
+}
+
+ChatReplicator::~ChatReplicator()
+{
+  {
+    std::lock_guard<std::mutex> lk(stop_mutex);
+    stopping = true;
+  }
+  stop_cv.notify_all();
+  outbox.close();
+  worker.join();
+}
+
+void ChatReplicator::session(uint64_t id, const ReplicatedSession& session)
+{
+  if(connected.load(std::memory_order_acquire))
+  {
+    std::string record;
+    encode_session(record, id, session);
+    push(std::move(record));
+  }
+}
+
+void ChatReplicator::session_closed(uint64_t id)
+{
+  if(connected.load(std::memory_order_acquire))
+  {
+    std::string record;
+    const size_t start = begin(record, RecordType::CLOSE);
+    put<uint64_t>(record, id);
+    finish(record, start);
+    push(std::move(record));
+  }
+}
+
+void ChatReplicator::message(const std::string& room, uint64_t seq, uint64_t time_us,
+  const std::string& text)
+{
+  if(connected.load(std::memory_order_acquire))
+  {
+    std::string record;
+    encode_message(record, room, seq, time_us, text);
+    push(std::move(record));
+  }
+}
+
+void ChatReplicator::encode_session(std::string& out, uint64_t id,
+  const ReplicatedSession& session)
+{
+  const size_t start = begin(out, RecordType::SESSION);
+  put<uint64_t>(out, id);
+  put<uint8_t>(out, session.sequenced);
+  put_str(out, session.nick);
+  put_str(out, session.room);
+  finish(out, start);
+}
+
+void ChatReplicator::encode_message(std::string& out, const std::string& room,
+  uint64_t seq, uint64_t time_us, const std::string& text)
+{
+  const size_t start = begin(out, RecordType::MESSAGE);
+  put<uint64_t>(out, seq);
+  put<uint64_t>(out, time_us);
+  put_str(out, room);
+  put_str(out, text);
+  finish(out, start);
+}
+
+void ChatReplicator::push(std::string record)
+{
+  // Over the limit the record is dropped and the loop resynchronizes the
+  // standby; the chat path never waits for it.
+  const size_t size = record.size();
+  if(queued_bytes.fetch_add(size, std::memory_order_relaxed) + size > OUTBOX_LIMIT)
+  {
+    queued_bytes.fetch_sub(size, std::memory_order_relaxed);
+    overflowed.store(true, std::memory_order_release);
+    return;
+  }
+  outbox.push(std::move(record));
+}
+
+bool ChatReplicator::pop(std::string& record, bool wait)
+{
+  const bool popped = wait
+    ? outbox.wait_pop_for(record, std::chrono::milliseconds(LIVENESS_MS))
+    : outbox.try_pop(record);
+  if(popped)
+  {
+    queued_bytes.fetch_sub(record.size(), std::memory_order_relaxed);
+  }
+  return popped;
+}
+
+void ChatReplicator::loop()
+{
+  const sockaddr_un address = unix_address(socket_path);
+  while(true)
+  {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd >= 0 && connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0)
+    {
+      close(fd);
+      fd = -1;
+    }
+    if(fd < 0)
+    {
+      std::unique_lock<std::mutex> lk(stop_mutex);
+      if(stop_cv.wait_for(lk, std::chrono::milliseconds(RECONNECT_MS),
+        [this] { return stopping; }))
+      {
+        return;
+      }
+      continue;
+    }
+
+    timeval timeout{0, LIVENESS_MS * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    auto stop = [this] { return outbox.is_closed(); };
+
+    // Changes from now on are queued; the snapshot goes out before them.
+    overflowed.store(false, std::memory_order_relaxed);
+    connected.store(true, std::memory_order_release);
+    std::string batch;
+    const size_t start = begin(batch, RecordType::RESET);
+    finish(batch, start);
+    snapshot(batch);
+
+    bool ok = send_all(fd, batch, stop);
+    std::string next;
+    while(ok)
+    {
+      // Records were dropped: what is queued is stale, start over on the
+      // same link. Dropping the link instead would make the standby take
+      // over.
+      if(overflowed.exchange(false, std::memory_order_acquire))
+      {
+        while(pop(next, false))
+        {
+        }
+        std::cerr << "replication: standby fell behind, resending the snapshot\n";
+        batch.clear();
+        const size_t reset = begin(batch, RecordType::RESET);
+        finish(batch, reset);
+        snapshot(batch);
+        ok = send_all(fd, batch, stop);
+        continue;
+      }
+      if(!pop(next, true))
+      {
+        if(outbox.is_closed())
+        {
+          break;
+        }
+        // The standby never writes: readable means it is gone.
+        pollfd pfd{fd, POLLIN, 0};
+        ok = poll(&pfd, 1, 0) == 0;
+        continue;
+      }
+      batch = std::move(next);
+      while(batch.size() < SEND_BATCH_BYTES && pop(next, false))
+      {
+        batch += next;
+      }
+      ok = send_all(fd, batch, stop);
+    }
+
+    connected.store(false, std::memory_order_release);
+    while(pop(next, false))
+    {
+    }
+    close(fd);
+    if(ok || outbox.is_closed())
+    {
+      return;                         // closed: stopping
+    }
+    std::cerr << "replication: standby lost, reconnecting\n";
+  }
+}
+
+ChatStandby::ChatStandby(std::string socket_path) :
+  socket_path(std::move(socket_path))
+{
+}
+
+std::unordered_map<uint64_t, ReplicatedSession> ChatStandby::follow(HistoryStore& history)
+{
+  const sockaddr_un address = unix_address(socket_path);
+  const int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(listen_fd < 0)
+  {
+    throw std::runtime_error("standby: socket creation failed");
+  }
+  unlink(socket_path.c_str());
+  if(bind(listen_fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0
+    || listen(listen_fd, 1) < 0)
+  {
+    close(listen_fd);
+    throw std::runtime_error("standby: can not listen on " + socket_path);
+  }
+
+  std::unordered_map<uint64_t, ReplicatedSession> sessions;
+  int fd;
+  while((fd = accept(listen_fd, nullptr, nullptr)) < 0)
+  {
+    if(errno != EINTR)
+    {
+      close(listen_fd);
+      throw std::runtime_error("standby: accept failed");
+    }
+  }
+  // Only one primary: nobody else may connect while we follow it.
+  close(listen_fd);
+  unlink(socket_path.c_str());
+
+  std::string buffer;
+  char chunk[READ_CHUNK];
+  bool broken = false;
+  while(!broken)
+  {
+    const ssize_t n = read(fd, chunk, sizeof(chunk));
+    if(n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if(n <= 0)
+    {
+      break;                          // the primary is gone
+    }
+    buffer.append(chunk, n);
+
+    size_t pos = 0;
+    while(buffer.size() - pos >= HEADER_BYTES)
+    {
+      const uint8_t type = buffer[pos];
+      uint32_t length;
+      memcpy(&length, buffer.data() + pos + 1, sizeof(length));
+      if(length > MAX_PAYLOAD)
+      {
+        std::cerr << "standby: broken replication stream\n";
+        broken = true;
+        break;
+      }
+      if(buffer.size() - pos < HEADER_BYTES + length)
+      {
+        break;
+      }
+
+      Reader in{buffer.data() + pos + HEADER_BYTES, buffer.data() + pos + HEADER_BYTES + length};
+      switch(static_cast<RecordType>(type))
+      {
+        case RecordType::RESET:
+          sessions.clear();
+          break;
+        case RecordType::SESSION:
+        {
+          const uint64_t id = in.get<uint64_t>();
+          ReplicatedSession session;
+          session.sequenced = in.get<uint8_t>() != 0;
+          session.nick = in.get_str();
+          session.room = in.get_str();
+          if(in.ok)
+          {
+            sessions[id] = std::move(session);
+          }
+          break;
+        }
+        case RecordType::CLOSE:
+        {
+          const uint64_t id = in.get<uint64_t>();
+          if(in.ok)
+          {
+            sessions.erase(id);
+          }
+          break;
+        }
+        case RecordType::MESSAGE:
+        {
+          ChatRecord rec;
+          rec.seq = in.get<uint64_t>();
+          rec.time_us = in.get<uint64_t>();
+          const std::string room = in.get_str();
+          rec.text = in.get_str();
+          if(in.ok)
+          {
+            const std::shared_ptr<RoomHistory> room_history = history.room(room);
+            if(room_history)
+            {
+              {
+                std::lock_guard<std::mutex> lk(room_history->mutex());
+                room_history->restore(rec);
+              }
+              room_history->flush();
+            }
+          }
+          break;
+        }
+        default:
+          break;                      // newer primary: skip what we do not know
+      }
+      pos += HEADER_BYTES + length;
+    }
+    buffer.erase(0, pos);
+  }
+  close(fd);
+  return sessions;
+}
@@ -0,0 +1,124 @@
+#ifndef CHAT_REPLICATION_H
+#define CHAT_REPLICATION_H
+
+#include "chat_log.h"
+#include "mpsc_mailbox.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+class HistoryStore;
+
+/* Hot standby for the chat server.
+ * A standby process follows the primary over a unix socket and keeps a copy
+ * of what a restarted server would otherwise lose: who was logged in as
+ * which nickname in which room, and the rooms' recent, numbered messages.
+ * When the primary goes away the standby starts serving on its own, with
+ * the same sequence numbers, so clients reconnect to it and /resume.
+ *
+ *   primary                                         standby
+ *   handler --push--> mailbox --batch--> socket --> ChatStandby::follow()
+ *   (never blocks)                                  -> HistoryStore, sessions
+ *
+ * The primary side is asynchronous: the chat path encodes a change record
+ * and pushes it into an MPSC mailbox; one replication thread writes the
+ * queued records in batches of up to 64 KiB. A standby that is slow or
+ * not there costs the chat path nothing. While no standby is connected
+ * records are dropped; a connecting standby first receives a snapshot:
+ * RESET, every named session, and the last SNAPSHOT_MESSAGES messages of
+ * every room. Records are upserts, and messages are applied by sequence
+ * number, so changes racing with the snapshot may arrive twice without
+ * harm.
+ *
+ * The queue is bounded (16 MiB of records). A standby that reads slower
+ * than the chat changes fills it; further records are then dropped, and
+ * once the thread gets to write again it discards the queue and sends a
+ * fresh RESET and snapshot on the same link. The link itself is kept:
+ * the standby takes over as soon as it closes.
+ *
+  | Record   | Fields                                    | On the standby    |
+  | -------- | ----------------------------------------- | ----------------- |
+  | RESET    | -                                         | forget sessions   |
+  | SESSION  | id u64, sequenced u8, nick str, room str  | upsert session    |
+  | CLOSE    | id u64                                    | drop session      |
+  | MESSAGE  | seq u64, time_us u64, room str, text str  | append if newer   |
+ *
+ *   record: | type u8 | payload length u32 | payload |     str: | u32 | bytes |
+ *
+ * Integers are in host byte order: both ends are on one machine. A session
+ * id is the connection's handle; only named sessions are replicated.
+*/
+
+struct ReplicatedSession
+{
+  std::string nick;
+  std::string room;
+  bool sequenced = false;
+};
+
+class ChatReplicator
+{
+  public:
+    static constexpr size_t SNAPSHOT_MESSAGES = 1024;
+
+    // Appends the snapshot records to `out`, with the encode_* helpers.
+    using SnapshotFn = std::function<void(std::string& out)>;
+
+    // Connects to the standby at `socket_path` (retrying in the background).
+    ChatReplicator(std::string socket_path, SnapshotFn snapshot);
+    ~ChatReplicator();
+
+    ChatReplicator(const ChatReplicator&) = delete;
+    ChatReplicator& operator=(const ChatReplicator&) = delete;
+
+    // Safe from any thread; never block on the standby.
+    void session(uint64_t id, const ReplicatedSession& session);
+    void session_closed(uint64_t id);
+    void message(const std::string& room, uint64_t seq, uint64_t time_us,
+      const std::string& text);
+
+    static void encode_session(std::string& out, uint64_t id,
+      const ReplicatedSession& session);
+    static void encode_message(std::string& out, const std::string& room,
+      uint64_t seq, uint64_t time_us, const std::string& text);
+
+  private:
+    const std::string socket_path;
+    const SnapshotFn snapshot;
+    MpscMailbox<std::string> outbox;
+    std::atomic<size_t> queued_bytes{0};
+    std::atomic<bool> overflowed{false};
+    std::atomic<bool> connected{false};
+    std::mutex stop_mutex;
+    std::condition_variable stop_cv;
+    bool stopping = false;
+    std::thread worker;
+
+    void push(std::string record);
+    // Takes a record off the outbox, waiting up to LIVENESS_MS if `wait`.
+    bool pop(std::string& record, bool wait);
+    void loop();
+};
+
+class ChatStandby
+{
+  public:
+    explicit ChatStandby(std::string socket_path);
+
+    // Listens on the socket and applies the primary's stream to `history`
+    // until the primary has connected and gone away again. Returns the
+    // sessions that were open at that point, by session id.
+    std::unordered_map<uint64_t, ReplicatedSession> follow(HistoryStore& history);
+
+  private:
+    const std::string socket_path;
+};
+
+#endif
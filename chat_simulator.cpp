@@ -0,0 +1,508 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <stdexcept>
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/poll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "workload_profile.h"
+
+/* Chat user simulator.
+ * Drives BroadCastChatHandler the way people do: every simulated user
+ * connects, answers the nickname prompt, optionally joins a room and then
+ * chats with think times drawn from a WorkloadProfile.
+ *
+ * Phases:
+ * 1. login    : connect all users, send "user<N>\n" as the nickname.
+ * 2. join     : with --rooms > 1 every user sends "/join room<R>\n". Room R is
+ *               drawn from a Zipf distribution, so room 0 is the big one.
+ * 3. chat     : each user sends lines until --duration runs out.
+ * 4. drain    : keep reading until every expected copy arrived or nothing
+ *               arrived for --drain-ms.
+ * 5. verify   : compare what each user received with what it should have.
+ *
+ * Between phases the simulator sleeps --settle-ms, because the handler treats
+ * the first line as the nickname and must not see it glued to the next one.
+ *
+ * Chat bodies carry a tag "<sender.seq.send_us>". The receiver uses it to
+ * check that every message reached every other member of the room exactly
+ * once, that messages of one sender arrive in the order they were sent, and
+ * to measure the delivery latency. Several tags may share a line when the
+ * server coalesced two reads, so all tags of a line are parsed.
+ *
+  | Option           | Default         | Meaning                                |
+  | ---------------- | --------------- | -------------------------------------- |
+  | `--host`/`--port`| 127.0.0.1:9000  | Server                                 |
+  | `--users`        | 100             | Simulated users                        |
+  | `--threads`      | 4               | Worker threads, users split evenly     |
+  | `--rooms`        | 1               | Rooms (1 = no /join is sent)           |
+  | `--room-zipf`    | 1.0             | Room size skew                         |
+  | `--duration`     | 10              | Chat phase in seconds                  |
+  | `--size`         | lognormal:24:0.8:512 | Chat line size distribution       |
+  | `--think`        | exponential:1000| Think time in ms (1 msg/s per user)    |
+  | `--zipf`         | 0               | Per-user activity skew                 |
+  | `--settle-ms`    | 500             | Pause between phases                   |
+  | `--drain-ms`     | 2000            | Quiet period that ends the drain phase |
+  | `--seed`         | 1               | RNG seed                               |
+*/
+
+using namespace std;
+using Clock = std::chrono::steady_clock;
+
+struct SimOptions
+{
+  std::string host = "127.0.0.1";
+  int port = 9000;
+  size_t users = 100;
+  size_t threads = 4;
+  size_t rooms = 1;
+  double room_zipf = 1.0;
+  double duration_sec = 10;
+  int settle_ms = 500;
+  int drain_ms = 2000;
+  uint64_t seed = 1;
+  WorkloadProfile profile = WorkloadProfile::defaults();
+};
+
+struct SimUser
+{
+  size_t id = 0;
+  int fd = -1;
+  size_t room = 0;
+  double activity = 1.0;
+  Clock::time_point next_send;
+  std::string out;
+  size_t out_offset = 0;
+  std::string in;
+  uint64_t sent = 0;
+  // last sequence number seen from every sender (-1 = none yet).
+  std::vector<int64_t> last_seq;
+};
+
+struct SimReport
+{
+  uint64_t sent = 0;
+  uint64_t received = 0;
+  uint64_t out_of_order = 0;
+  uint64_t errors = 0;
+  std::vector<uint32_t> latency_us;
+};
+
+enum class SimPhase { LOGIN, JOIN, CHAT, DRAIN, DONE };
+
+static std::atomic<SimPhase> phase{SimPhase::LOGIN};
+static std::atomic<uint64_t> rx_total{0};
+static Clock::time_point sim_start;
+
+static SimOptions parse_options(int argc, char* argv[])
+{
+  SimOptions opts;
+  opts.profile.message_size = parse_distribution("lognormal:24:0.8:512");
+  opts.profile.think_time_ms = parse_distribution("exponential:1000");
+
+  for(int i = 1; i < argc; ++i)
+  {
+    const std::string arg = argv[i];
+    auto value = [&]() -> std::string {
+      if(i + 1 >= argc)
+      {
+        throw std::invalid_argument(arg + " needs a value");
+      }
+      return argv[++i];
+    };
+
+    if(arg == "--host") opts.host = value();
+    else if(arg == "--port") opts.port = std::stoi(value());
+    else if(arg == "--users") opts.users = std::stoul(value());
+    else if(arg == "--threads") opts.threads = std::stoul(value());
+    else if(arg == "--rooms") opts.rooms = std::stoul(value());
+    else if(arg == "--room-zipf") opts.room_zipf = std::stod(value());
+    else if(arg == "--duration") opts.duration_sec = std::stod(value());
+    else if(arg == "--size") opts.profile.message_size = parse_distribution(value());
+    else if(arg == "--think") opts.profile.think_time_ms = parse_distribution(value());
+    else if(arg == "--zipf") opts.profile.zipf_s = std::stod(value());
+    else if(arg == "--settle-ms") opts.settle_ms = std::stoi(value());
+    else if(arg == "--drain-ms") opts.drain_ms = std::stoi(value());
+    else if(arg == "--seed") opts.seed = std::stoull(value());
+    else throw std::invalid_argument("unknown option " + arg);
+  }
+
+  if(opts.users < 2 || opts.threads == 0 || opts.rooms == 0)
+  {
+    throw std::invalid_argument("need at least 2 users, 1 thread and 1 room");
+  }
+  opts.threads = std::min(opts.threads, opts.users);
+  return opts;
+}
+
+static void raise_fd_limit(size_t wanted)
+{
+  rlimit lim{};
+  if(getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < wanted)
+  {
+    lim.rlim_cur = std::min<rlim_t>(lim.rlim_max, wanted);
+    setrlimit(RLIMIT_NOFILE, &lim);
+  }
+}
+
+static uint64_t now_us()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    Clock::now() - sim_start).count();
+}
+
+// Queues a line and tries to write it right away.
+static void queue_line(SimUser& user, const std::string& line)
+{
+  user.out.erase(0, user.out_offset);
+  user.out_offset = 0;
+  user.out += line;
+}
+
+static void flush(SimUser& user, SimReport& report)
+{
+  while(user.fd >= 0 && user.out_offset < user.out.size())
+  {
+    auto nb = send(user.fd, user.out.data() + user.out_offset,
+      user.out.size() - user.out_offset, MSG_NOSIGNAL);
+    if(nb < 0)
+    {
+      if(errno != EAGAIN && errno != EWOULDBLOCK)
+      {
+        ++report.errors;
+        close(user.fd);
+        user.fd = -1;
+      }
+      return;
+    }
+    user.out_offset += nb;
+  }
+}
+
+static std::string chat_line(
+  const SimOptions& opts, SimUser& user, std::mt19937_64& rng)
+{
+  std::string line = "<" + std::to_string(user.id) + "." +
+    std::to_string(user.sent) + "." + std::to_string(now_us()) + ">";
+  const size_t size = opts.profile.sample_size(rng);
+  while(line.size() + 1 < size)
+  {
+    line += " lorem ipsum dolor sit amet";
+  }
+  if(line.size() + 1 > size && size > 0)
+  {
+    // Never cut into the tag, it is what verification relies on.
+    line.resize(std::max(line.find('>') + 1, size - 1));
+  }
+  return line + "\n";
+}
+
+// Parses every "<sender.seq.us>" tag of one received line.
+static void on_line(const std::string& line, SimUser& user, SimReport& report)
+{
+  size_t pos = 0;
+  while((pos = line.find('<', pos)) != std::string::npos)
+  {
+    const size_t end = line.find('>', pos);
+    if(end == std::string::npos)
+    {
+      return;
+    }
+
+    unsigned long long sender = 0, seq = 0, sent_us = 0;
+    if(sscanf(line.c_str() + pos, "<%llu.%llu.%llu>", &sender, &seq, &sent_us) == 3 &&
+      sender < user.last_seq.size())
+    {
+      ++report.received;
+      if(static_cast<int64_t>(seq) <= user.last_seq[sender])
+      {
+        ++report.out_of_order;
+      }
+      user.last_seq[sender] = static_cast<int64_t>(seq);
+      report.latency_us.push_back(static_cast<uint32_t>(now_us() - sent_us));
+    }
+    pos = end + 1;
+  }
+}
+
+static void read_all(SimUser& user, SimReport& report, std::vector<char>& buffer)
+{
+  while(user.fd >= 0)
+  {
+    auto nb = recv(user.fd, buffer.data(), buffer.size(), 0);
+    if(nb == 0 || (nb < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+    {
+      ++report.errors;
+      close(user.fd);
+      user.fd = -1;
+      return;
+    }
+    if(nb < 0)
+    {
+      return;
+    }
+
+    rx_total.fetch_add(1, std::memory_order_relaxed);
+    user.in.append(buffer.data(), nb);
+    size_t start = 0, nl;
+    while((nl = user.in.find('\n', start)) != std::string::npos)
+    {
+      on_line(user.in.substr(start, nl - start), user, report);
+      start = nl + 1;
+    }
+    user.in.erase(0, start);
+  }
+}
+
+static void worker(const SimOptions& opts, std::vector<SimUser>& users,
+  size_t first, size_t last, SimReport& report, uint64_t seed)
+{
+  std::mt19937_64 rng(seed);
+  std::vector<pollfd> fds(last - first);
+  std::vector<char> buffer(64 * 1024);
+  SimPhase seen = SimPhase::LOGIN;
+
+  while(true)
+  {
+    const SimPhase now_phase = phase.load();
+    if(now_phase == SimPhase::DONE)
+    {
+      break;
+    }
+
+    // Entering a phase queues that phase's one-off line for every user.
+    if(now_phase != seen)
+    {
+      seen = now_phase;
+      for(size_t i = first; i < last; ++i)
+      {
+        if(seen == SimPhase::JOIN && opts.rooms > 1)
+        {
+          queue_line(users[i], "/join room" + std::to_string(users[i].room) + "\n");
+        }
+        if(seen == SimPhase::CHAT)
+        {
+          const double think = opts.profile.think_time_ms->sample(rng);
+          users[i].next_send = Clock::now() + std::chrono::microseconds(
+            static_cast<int64_t>(think * 1000 / users[i].activity));
+        }
+      }
+    }
+
+    const auto now = Clock::now();
+    auto wake_at = now + std::chrono::milliseconds(50);
+    for(size_t i = first; i < last; ++i)
+    {
+      SimUser& user = users[i];
+      if(seen == SimPhase::CHAT && user.fd >= 0)
+      {
+        if(user.next_send <= now)
+        {
+          queue_line(user, chat_line(opts, user, rng));
+          ++user.sent;
+          ++report.sent;
+          const double think = opts.profile.think_time_ms->sample(rng);
+          user.next_send = now + std::chrono::microseconds(
+            static_cast<int64_t>(think * 1000 / user.activity));
+        }
+        wake_at = std::min(wake_at, user.next_send);
+      }
+      flush(user, report);
+
+      auto& pfd = fds[i - first];
+      pfd.fd = user.fd;
+      pfd.events = POLLIN | (user.out_offset < user.out.size() ? POLLOUT : 0);
+      pfd.revents = 0;
+    }
+
+    const auto wait_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+      wake_at - Clock::now()).count();
+    if(poll(fds.data(), fds.size(), static_cast<int>(std::max<int64_t>(wait_ms, 0))) < 0)
+    {
+      if(errno == EINTR)
+      {
+        continue;
+      }
+      perror("poll");
+      break;
+    }
+
+    for(size_t i = first; i < last; ++i)
+    {
+      if(fds[i - first].revents & (POLLIN | POLLHUP | POLLERR))
+      {
+        read_all(users[i], report, buffer);
+      }
+      if(fds[i - first].revents & POLLOUT)
+      {
+        flush(users[i], report);
+      }
+    }
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  SimOptions opts;
+  try
+  {
+    opts = parse_options(argc, argv);
+  }
+  catch(const std::exception& e)
+  {
+    std::cerr << e.what() << "\n";
+    return EXIT_FAILURE;
+  }
+
+  raise_fd_limit(opts.users + 64);
+  sim_start = Clock::now();
+
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(opts.port);
+  if(inet_pton(AF_INET, opts.host.c_str(), &address.sin_addr) <= 0)
+  {
+    std::cerr << "Invalid address / Address not supported\n";
+    return EXIT_FAILURE;
+  }
+
+  // Room membership and activity are decided up front so the expected
+  // delivery counts are known before the first message is sent.
+  std::mt19937_64 rng(opts.seed);
+  ZipfSampler room_sampler(opts.rooms, opts.room_zipf);
+  ZipfSampler activity(opts.users, opts.profile.zipf_s);
+  std::vector<SimUser> users(opts.users);
+  std::vector<size_t> room_size(opts.rooms, 0);
+  for(size_t i = 0; i < users.size(); ++i)
+  {
+    users[i].id = i;
+    users[i].room = opts.rooms > 1 ? room_sampler.sample(rng) : 0;
+    users[i].activity = activity.weight(i) * users.size();
+    users[i].last_seq.assign(users.size(), -1);
+    ++room_size[users[i].room];
+  }
+
+  // step 1: login. Connect blocking, then hand the socket to the workers.
+  for(auto& user : users)
+  {
+    user.fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(user.fd < 0 ||
+      connect(user.fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0)
+    {
+      perror("connect");
+      return EXIT_FAILURE;
+    }
+    int yes = 1;
+    setsockopt(user.fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    fcntl(user.fd, F_SETFL, fcntl(user.fd, F_GETFL, 0) | O_NONBLOCK);
+    user.out = "user" + std::to_string(user.id) + "\n";
+  }
+  std::cout << "logged in " << users.size() << " users, largest room has "
+            << *std::max_element(room_size.begin(), room_size.end())
+            << " members\n";
+
+  std::vector<SimReport> reports(opts.threads);
+  std::vector<std::thread> workers;
+  const size_t per_thread = (users.size() + opts.threads - 1) / opts.threads;
+  for(size_t t = 0; t < opts.threads; ++t)
+  {
+    const size_t first = t * per_thread;
+    const size_t last = std::min(users.size(), first + per_thread);
+    workers.emplace_back(worker, std::cref(opts), std::ref(users), first, last,
+      std::ref(reports[t]), opts.seed + t + 1);
+  }
+
+  auto settle = [&]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(opts.settle_ms));
+  };
+
+  // step 2..4: join, chat, drain.
+  settle();
+  phase = SimPhase::JOIN;
+  settle();
+  phase = SimPhase::CHAT;
+  std::this_thread::sleep_for(std::chrono::microseconds(
+    static_cast<int64_t>(opts.duration_sec * 1e6)));
+  phase = SimPhase::DRAIN;
+
+  uint64_t last_rx = rx_total.load();
+  auto quiet_since = Clock::now();
+  while(Clock::now() - quiet_since < std::chrono::milliseconds(opts.drain_ms))
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    if(rx_total.load() != last_rx)
+    {
+      last_rx = rx_total.load();
+      quiet_since = Clock::now();
+    }
+  }
+  phase = SimPhase::DONE;
+  for(auto& w : workers)
+  {
+    w.join();
+  }
+
+  // step 5: verify.
+  SimReport total;
+  uint64_t expected = 0;
+  for(const auto& user : users)
+  {
+    expected += user.sent * (room_size[user.room] - 1);
+  }
+  for(auto& r : reports)
+  {
+    total.sent += r.sent;
+    total.received += r.received;
+    total.out_of_order += r.out_of_order;
+    total.errors += r.errors;
+    total.latency_us.insert(total.latency_us.end(),
+      r.latency_us.begin(), r.latency_us.end());
+  }
+  for(auto& user : users)
+  {
+    if(user.fd >= 0)
+    {
+      close(user.fd);
+    }
+  }
+
+  std::sort(total.latency_us.begin(), total.latency_us.end());
+  auto pct = [&](double p) -> uint32_t {
+    return total.latency_us.empty() ? 0 :
+      total.latency_us[static_cast<size_t>(p * (total.latency_us.size() - 1))];
+  };
+
+  const int64_t missing = static_cast<int64_t>(expected) -
+    static_cast<int64_t>(total.received);
+  std::cout << "sent " << total.sent << " messages, delivered "
+            << total.received << " of " << expected << " expected copies\n";
+  std::cout << "missing " << std::max<int64_t>(missing, 0)
+            << ", extra " << std::max<int64_t>(-missing, 0)
+            << ", out of order " << total.out_of_order
+            << ", socket errors " << total.errors << "\n";
+  std::cout << "delivery latency us: p50 " << pct(0.50) << " p99 " << pct(0.99)
+            << " max " << pct(1.0) << "\n";
+  std::cout << "RESULT users=" << users.size()
+            << " sent=" << total.sent
+            << " delivered=" << total.received
+            << " expected=" << expected
+            << " out_of_order=" << total.out_of_order
+            << " errors=" << total.errors
+            << " p50_us=" << pct(0.50)
+            << " p99_us=" << pct(0.99) << endl;
+
+  const bool ok = missing == 0 && total.out_of_order == 0 && total.errors == 0;
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
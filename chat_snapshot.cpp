@@ -0,0 +1,352 @@
+#include "chat_snapshot.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace
+{
+  const char MAGIC[8] = {'C', 'H', 'A', 'T', 'S', 'N', 'P', '1'};
+
+  struct StringRef
+  {
+    uint64_t offset;                  // into the string area
+    uint32_t length;
+    uint32_t unused;
+  };
+
+  struct Header
+  {
+    char magic[8];
+    uint32_t header_bytes;
+    uint32_t session_entry_bytes;
+    uint32_t room_entry_bytes;
+    uint32_t record_entry_bytes;
+    uint64_t session_count;
+    uint64_t room_count;
+    uint64_t record_count;
+    uint64_t sessions_offset;
+    uint64_t rooms_offset;
+    uint64_t records_offset;
+    uint64_t strings_offset;
+    uint64_t strings_bytes;
+    uint64_t created_us;
+  };
+
+  struct SessionEntry
+  {
+    uint64_t id;
+    StringRef nick;
+    StringRef room;
+    uint8_t sequenced;
+    uint8_t unused[7];
+  };
+
+  struct RoomEntry
+  {
+    StringRef name;
+    uint64_t last_seq;
+    uint64_t first_record;
+    uint64_t record_count;
+  };
+
+  struct RecordEntry
+  {
+    uint64_t seq;
+    uint64_t time_us;
+    StringRef text;
+  };
+
+  template <typename T>
+  const T* table(const char* base, uint64_t offset)
+  {
+    return reinterpret_cast<const T*>(base + offset);
+  }
+
+  // offset + count * size <= bytes, without overflowing.
+  bool fits(uint64_t offset, uint64_t count, uint64_t size, uint64_t bytes)
+  {
+    return offset <= bytes && count <= (bytes - offset) / size;
+  }
+
+  bool write_all(int fd, const char* data, size_t len)
+  {
+    size_t done = 0;
+    while(done < len)
+    {
+      const ssize_t n = ::write(fd, data + done, len - done);
+      if(n < 0)
+      {
+        if(errno == EINTR)
+        {
+          continue;
+        }
+        return false;
+      }
+      done += n;
+    }
+    return true;
+  }
+}
+
+MappedSnapshot::MappedSnapshot(const std::string& path)
+{
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if(fd < 0)
+  {
+    return;
+  }
+
+  struct stat st;
+  if(fstat(fd, &st) == 0 && st.st_size >= static_cast<off_t>(sizeof(Header)))
+  {
+    void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(p != MAP_FAILED)
+    {
+      base = static_cast<const char*>(p);
+      bytes = st.st_size;
+    }
+  }
+  close(fd);
+
+  if(base != nullptr && !validate())
+  {
+    munmap(const_cast<char*>(base), bytes);
+    base = nullptr;
+    bytes = 0;
+  }
+}
+
+MappedSnapshot::~MappedSnapshot()
+{
+  if(base != nullptr)
+  {
+    munmap(const_cast<char*>(base), bytes);
+  }
+}
+
+size_t MappedSnapshot::session_count() const
+{
+  return ok() ? table<Header>(base, 0)->session_count : 0;
+}
+
+size_t MappedSnapshot::room_count() const
+{
+  return ok() ? table<Header>(base, 0)->room_count : 0;
+}
+
+MappedSnapshot::Session MappedSnapshot::session(size_t i) const
+{
+  const SessionEntry& e = table<SessionEntry>(base, table<Header>(base, 0)->sessions_offset)[i];
+  return {e.id, string_at(e.nick.offset, e.nick.length),
+    string_at(e.room.offset, e.room.length), e.sequenced != 0};
+}
+
+MappedSnapshot::Room MappedSnapshot::room(size_t i) const
+{
+  const RoomEntry& e = table<RoomEntry>(base, table<Header>(base, 0)->rooms_offset)[i];
+  return {string_at(e.name.offset, e.name.length), e.last_seq,
+    static_cast<size_t>(e.first_record), static_cast<size_t>(e.record_count)};
+}
+
+MappedSnapshot::Record MappedSnapshot::record(size_t i) const
+{
+  const RecordEntry& e = table<RecordEntry>(base, table<Header>(base, 0)->records_offset)[i];
+  return {e.seq, e.time_us, string_at(e.text.offset, e.text.length)};
+}
+
+std::string_view MappedSnapshot::string_at(uint64_t offset, uint32_t length) const
+{
+  return std::string_view(base + table<Header>(base, 0)->strings_offset + offset, length);
+}
+
+bool MappedSnapshot::validate() const
+{
+  const Header& h = *table<Header>(base, 0);
+  if(memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 || h.header_bytes != sizeof(Header)
+    || h.session_entry_bytes != sizeof(SessionEntry)
+    || h.room_entry_bytes != sizeof(RoomEntry)
+    || h.record_entry_bytes != sizeof(RecordEntry))
+  {
+    return false;
+  }
+  if(!fits(h.sessions_offset, h.session_count, sizeof(SessionEntry), bytes)
+    || !fits(h.rooms_offset, h.room_count, sizeof(RoomEntry), bytes)
+    || !fits(h.records_offset, h.record_count, sizeof(RecordEntry), bytes)
+    || !fits(h.strings_offset, h.strings_bytes, 1, bytes)
+    || h.sessions_offset % 8 || h.rooms_offset % 8 || h.records_offset % 8)
+  {
+    return false;
+  }
+
+  // One pass over the references, so the accessors need no checks.
+  auto string_ok = [&h](const StringRef& ref) {
+    return fits(ref.offset, ref.length, 1, h.strings_bytes);
+  };
+  const SessionEntry* sessions = table<SessionEntry>(base, h.sessions_offset);
+  for(uint64_t i = 0; i < h.session_count; ++i)
+  {
+    if(!string_ok(sessions[i].nick) || !string_ok(sessions[i].room))
+    {
+      return false;
+    }
+  }
+  const RoomEntry* rooms = table<RoomEntry>(base, h.rooms_offset);
+  for(uint64_t i = 0; i < h.room_count; ++i)
+  {
+    if(!string_ok(rooms[i].name)
+      || !fits(rooms[i].first_record, rooms[i].record_count, 1, h.record_count))
+    {
+      return false;
+    }
+  }
+  const RecordEntry* records = table<RecordEntry>(base, h.records_offset);
+  for(uint64_t i = 0; i < h.record_count; ++i)
+  {
+    if(!string_ok(records[i].text))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool MappedSnapshot::write(const std::string& path, const SnapshotData& data)
+{
+  size_t record_count = 0;
+  for(const auto& room : data.rooms)
+  {
+    record_count += room.records.size();
+  }
+
+  Header h{};
+  memcpy(h.magic, MAGIC, sizeof(MAGIC));
+  h.header_bytes = sizeof(Header);
+  h.session_entry_bytes = sizeof(SessionEntry);
+  h.room_entry_bytes = sizeof(RoomEntry);
+  h.record_entry_bytes = sizeof(RecordEntry);
+  h.session_count = data.sessions.size();
+  h.room_count = data.rooms.size();
+  h.record_count = record_count;
+  h.sessions_offset = sizeof(Header);
+  h.rooms_offset = h.sessions_offset + h.session_count * sizeof(SessionEntry);
+  h.records_offset = h.rooms_offset + h.room_count * sizeof(RoomEntry);
+  h.strings_offset = h.records_offset + h.record_count * sizeof(RecordEntry);
+  h.created_us = std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
+
+  std::string tables;
+  std::string strings;
+  tables.reserve(h.strings_offset - sizeof(Header));
+  auto add_string = [&strings](const std::string& s) {
+    StringRef ref{strings.size(), static_cast<uint32_t>(s.size()), 0};
+    strings += s;
+    return ref;
+  };
+  auto add_entry = [&tables](const auto& entry) {
+    tables.append(reinterpret_cast<const char*>(&entry), sizeof(entry));
+  };
+
+  for(const auto& session : data.sessions)
+  {
+    SessionEntry e{};
+    e.id = session.first;
+    e.nick = add_string(session.second.nick);
+    e.room = add_string(session.second.room);
+    e.sequenced = session.second.sequenced;
+    add_entry(e);
+  }
+  uint64_t next_record = 0;
+  for(const auto& room : data.rooms)
+  {
+    RoomEntry e{};
+    e.name = add_string(room.name);
+    e.last_seq = room.last_seq;
+    e.first_record = next_record;
+    e.record_count = room.records.size();
+    next_record += room.records.size();
+    add_entry(e);
+  }
+  for(const auto& room : data.rooms)
+  {
+    for(const auto& rec : room.records)
+    {
+      RecordEntry e{};
+      e.seq = rec.seq;
+      e.time_us = rec.time_us;
+      e.text = add_string(rec.text);
+      add_entry(e);
+    }
+  }
+  h.strings_bytes = strings.size();
+
+  const std::string tmp = path + ".tmp";
+  const int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if(fd < 0)
+  {
+    return false;
+  }
+  const bool ok = write_all(fd, reinterpret_cast<const char*>(&h), sizeof(h))
+    && write_all(fd, tables.data(), tables.size())
+    && write_all(fd, strings.data(), strings.size())
+    && fsync(fd) == 0;
+  close(fd);
+  if(!ok || rename(tmp.c_str(), path.c_str()) < 0)
+  {
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+SnapshotWriter::SnapshotWriter(std::string path, unsigned interval_ms, CaptureFn capture) :
+  path(std::move(path)), interval_ms(interval_ms), capture(std::move(capture))
+{
+  worker = std::thread(&SnapshotWriter::loop, this);
+}
+
+SnapshotWriter::~SnapshotWriter()
+{
+  stop();
+}
+
+void SnapshotWriter::stop()
+{
+  {
+    std::lock_guard<std::mutex> lk(stop_mutex);
+    stopping = true;
+  }
+  stop_cv.notify_one();
+  if(worker.joinable())
+  {
+    worker.join();
+  }
+}
+
+bool SnapshotWriter::write_now()
+{
+  std::lock_guard<std::mutex> lk(write_mutex);
+  return MappedSnapshot::write(path, capture());
+}
+
+void SnapshotWriter::loop()
+{
+  std::unique_lock<std::mutex> lk(stop_mutex);
+  while(!stop_cv.wait_for(lk, std::chrono::milliseconds(interval_ms),
+    [this] { return stopping; }))
+  {
+    lk.unlock();
+    if(!write_now())
+    {
+      perror(("snapshot: writing " + path).c_str());
+    }
+    lk.lock();
+  }
+}
@@ -0,0 +1,142 @@
+#ifndef CHAT_SNAPSHOT_H
+#define CHAT_SNAPSHOT_H
+
+#include "chat_log.h"
+#include "chat_replication.h"
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/* Point-in-time image of the chat handler's state, for fast restarts.
+ * A snapshot holds the named sessions (nick, room), every room's sequence
+ * number and its most recent messages. It is one file laid out so that
+ * loading it is mmap() plus a header check: every table has fixed-size
+ * entries, and strings are (offset, length) pairs into a string area, used
+ * in place without parsing or copying.
+ *
+ *   | Header | SessionEntry[] | RoomEntry[] | RecordEntry[] | strings |
+ *
+  | Table   | Entry                                                        |
+  | ------- | ------------------------------------------------------------ |
+  | session | id, nick, room, sequenced                                    |
+  | room    | name, last_seq, first record, record count                   |
+  | record  | seq, time_us, text  (grouped by room, oldest first)          |
+ *
+ * Integers are in host byte order and the header records the entry sizes,
+ * so a file from another build or machine is rejected, not misread.
+ * Writing goes to <path>.tmp, is fsync()ed and then renamed over <path>:
+ * a crash leaves the previous snapshot or the new one, never half of one.
+ *
+ * SnapshotWriter takes a snapshot every interval on a background thread.
+ * The capture copies the state under the same short per-stripe and
+ * per-room locks the chat path uses; encoding and disk I/O happen after
+ * they are released. A fork()ed writer would get the copy for free from
+ * copy-on-write, but forking a process with reactor, shard and relay
+ * threads running is only safe up to the next exec, so a thread is used.
+*/
+
+struct SnapshotRoom
+{
+  std::string name;
+  uint64_t last_seq = 0;
+  std::vector<ChatRecord> records;    // oldest first
+};
+
+struct SnapshotData
+{
+  std::vector<std::pair<uint64_t, ReplicatedSession>> sessions;
+  std::vector<SnapshotRoom> rooms;
+};
+
+// A loaded snapshot file. Views stay valid while it is alive.
+class MappedSnapshot
+{
+  public:
+    struct Session
+    {
+      uint64_t id;
+      std::string_view nick;
+      std::string_view room;
+      bool sequenced;
+    };
+
+    struct Room
+    {
+      std::string_view name;
+      uint64_t last_seq;
+      size_t first_record;
+      size_t record_count;
+    };
+
+    struct Record
+    {
+      uint64_t seq;
+      uint64_t time_us;
+      std::string_view text;
+    };
+
+    // Maps `path`; ok() is false if it is missing or not a valid snapshot.
+    explicit MappedSnapshot(const std::string& path);
+    ~MappedSnapshot();
+
+    MappedSnapshot(const MappedSnapshot&) = delete;
+    MappedSnapshot& operator=(const MappedSnapshot&) = delete;
+
+    bool ok() const { return base != nullptr; }
+    size_t session_count() const;
+    size_t room_count() const;
+    Session session(size_t i) const;
+    Room room(size_t i) const;
+    Record record(size_t i) const;
+
+    // Writes `data` to `path` atomically; false (and errno) on failure.
+    static bool write(const std::string& path, const SnapshotData& data);
+
+  private:
+    const char* base = nullptr;
+    size_t bytes = 0;
+
+    std::string_view string_at(uint64_t offset, uint32_t length) const;
+    bool validate() const;
+};
+
+class SnapshotWriter
+{
+  public:
+    using CaptureFn = std::function<SnapshotData()>;
+
+    SnapshotWriter(std::string path, unsigned interval_ms, CaptureFn capture);
+    // Calls stop().
+    ~SnapshotWriter();
+
+    SnapshotWriter(const SnapshotWriter&) = delete;
+    SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+    // Ends the periodic snapshots; does not write a last one (write_now()).
+    void stop();
+
+    // Captures and writes on the calling thread.
+    bool write_now();
+
+  private:
+    const std::string path;
+    const unsigned interval_ms;
+    const CaptureFn capture;
+    std::mutex write_mutex;           // one writer of <path>.tmp at a time
+    std::mutex stop_mutex;
+    std::condition_variable stop_cv;
+    bool stopping = false;
+    std::thread worker;
+
+    void loop();
+};
+
+#endif
@@ -0,0 +1,336 @@
+#include "connection_table.h"
+
+#include <cerrno>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std;
+
+ConnectionTable& ConnectionTable::global()
+{
+  static ConnectionTable table;
+  return table;
+}
+
+ConnectionTable::ConnectionTable()
+{
+  for(auto& chunk : chunks)
+  {
+    chunk.store(nullptr, std::memory_order_relaxed);
+  }
+}
+
+ConnectionTable::~ConnectionTable()
+{
+  for(auto& chunk : chunks)
+  {
+    delete[] chunk.load(std::memory_order_relaxed);
+  }
+}
+
+ConnectionHandle ConnectionTable::open(int fd)
+{
+  if(fd < 0 || static_cast<size_t>(fd) >= MAX_SLOTS)
+  {
+    throw std::out_of_range("ConnectionTable: fd out of range");
+  }
+
+  Slot& slot = get_or_create(fd);
+  std::lock_guard<std::mutex> lk(slot.mutex);
+  uint32_t generation = slot.generation.load(std::memory_order_relaxed);
+  if(generation % 2 == 1)
+  {
+    // The previous owner of this number never went through close(): its
+    // handles must still die.
+    ++generation;
+  }
+  ++generation;
+  slot.framing.store(Framing::RAW, std::memory_order_relaxed);
+  slot.transport.reset();
+  slot.generation.store(generation, std::memory_order_release);
+  return ConnectionHandle{static_cast<uint32_t>(fd), generation};
+}
+
+bool ConnectionTable::close(ConnectionHandle conn)
+{
+  Slot* slot = find(conn.slot);
+  if(slot == nullptr)
+  {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lk(slot->mutex);
+  if(slot->generation.load(std::memory_order_relaxed) != conn.generation)
+  {
+    return false;
+  }
+  // Retire the handle before the number is released.
+  slot->generation.store(conn.generation + 1, std::memory_order_release);
+  slot->transport.reset();
+  ::close(static_cast<int>(conn.slot));
+  return true;
+}
+
+ssize_t ConnectionTable::send(ConnectionHandle conn, const void* data, size_t len, int flags)
+{
+  Slot* slot = find(conn.slot);
+  // Unlocked check first: stale handles are the common failure and cost
+  // nothing but a load.
+  if(slot == nullptr ||
+    slot->generation.load(std::memory_order_acquire) != conn.generation)
+  {
+    errno = EBADF;
+    return -1;
+  }
+
+  std::lock_guard<std::mutex> lk(slot->mutex);
+  if(slot->generation.load(std::memory_order_relaxed) != conn.generation)
+  {
+    errno = EBADF;
+    return -1;
+  }
+  if(slot->transport)
+  {
+    iovec iov{const_cast<void*>(data), len};
+    return slot->transport->write(static_cast<int>(conn.slot), &iov, 1);
+  }
+  return ::send(static_cast<int>(conn.slot), data, len, flags);
+}
+
+ssize_t ConnectionTable::sendv(ConnectionHandle conn, const iovec* iov, int count, int flags)
+{
+  Slot* slot = find(conn.slot);
+  if(slot == nullptr ||
+    slot->generation.load(std::memory_order_acquire) != conn.generation)
+  {
+    errno = EBADF;
+    return -1;
+  }
+
+  msghdr msg{};
+  msg.msg_iov = const_cast<iovec*>(iov);
+  msg.msg_iovlen = count;
+  std::lock_guard<std::mutex> lk(slot->mutex);
+  if(slot->generation.load(std::memory_order_relaxed) != conn.generation)
+  {
+    errno = EBADF;
+    return -1;
+  }
+  if(slot->transport)
+  {
+    return slot->transport->write(static_cast<int>(conn.slot), iov, count);
+  }
+  return ::sendmsg(static_cast<int>(conn.slot), &msg, flags);
+}
+
+ssize_t ConnectionTable::splice_from(ConnectionHandle conn, int pipe_fd, size_t len)
+{
+  Slot* slot = find(conn.slot);
+  if(slot == nullptr ||
+    slot->generation.load(std::memory_order_acquire) != conn.generation)
+  {
+    errno = EBADF;
+    return -1;
+  }
+
+  std::lock_guard<std::mutex> lk(slot->mutex);
+  if(slot->generation.load(std::memory_order_relaxed) != conn.generation)
+  {
+    errno = EBADF;
+    return -1;
+  }
+  if(slot->transport)
+  {
+    errno = EINVAL;                   // the bytes must pass through it
+    return -1;
+  }
+  // All of it under one lock, like one send(): other senders must not
+  // interleave with a partial chunk.
+  size_t moved = 0;
+  while(moved < len)
+  {
+    const ssize_t n = ::splice(pipe_fd, nullptr, static_cast<int>(conn.slot), nullptr,
+      len - moved, SPLICE_F_MOVE);
+    if(n < 0)
+    {
+      if(errno == EINTR)
+      {
+        continue;
+      }
+      return moved > 0 ? static_cast<ssize_t>(moved) : -1;
+    }
+    if(n == 0)
+    {
+      break;
+    }
+    moved += n;
+  }
+  return moved;
+}
+
+bool ConnectionTable::shutdown(ConnectionHandle conn)
+{
+  Slot* slot = find(conn.slot);
+  if(slot == nullptr)
+  {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lk(slot->mutex);
+  if(slot->generation.load(std::memory_order_relaxed) != conn.generation)
+  {
+    return false;
+  }
+  return ::shutdown(static_cast<int>(conn.slot), SHUT_RDWR) == 0;
+}
+
+bool ConnectionTable::reset(ConnectionHandle conn)
+{
+  Slot* slot = find(conn.slot);
+  if(slot == nullptr)
+  {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lk(slot->mutex);
+  if(slot->generation.load(std::memory_order_relaxed) != conn.generation)
+  {
+    return false;
+  }
+  const int fd = static_cast<int>(conn.slot);
+  const linger abort{1, 0};
+  return setsockopt(fd, SOL_SOCKET, SO_LINGER, &abort, sizeof(abort)) == 0 &&
+    ::shutdown(fd, SHUT_RD) == 0;
+}
+
+bool ConnectionTable::set_transport(ConnectionHandle conn,
+  std::shared_ptr<ConnectionTransport> transport)
+{
+  Slot* slot = find(conn.slot);
+  if(slot == nullptr)
+  {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lk(slot->mutex);
+  if(slot->generation.load(std::memory_order_relaxed) != conn.generation)
+  {
+    return false;
+  }
+  slot->transport = std::move(transport);
+  return true;
+}
+
+bool ConnectionTable::has_transport(ConnectionHandle conn) const
+{
+  Slot* slot = find(conn.slot);
+  if(slot == nullptr)
+  {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lk(slot->mutex);
+  return slot->generation.load(std::memory_order_relaxed) == conn.generation &&
+    slot->transport != nullptr;
+}
+
+bool ConnectionTable::with_socket(ConnectionHandle conn, const std::function<void(int fd)>& fn)
+{
+  Slot* slot = find(conn.slot);
+  if(slot == nullptr)
+  {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lk(slot->mutex);
+  if(slot->generation.load(std::memory_order_relaxed) != conn.generation)
+  {
+    return false;
+  }
+  fn(static_cast<int>(conn.slot));
+  return true;
+}
+
+ConnectionTable::Framing ConnectionTable::framing(ConnectionHandle conn) const
+{
+  Slot* slot = find(conn.slot);
+  if(slot == nullptr ||
+    slot->generation.load(std::memory_order_acquire) != conn.generation)
+  {
+    return Framing::RAW;
+  }
+  return slot->framing.load(std::memory_order_relaxed);
+}
+
+bool ConnectionTable::set_framing(ConnectionHandle conn, Framing framing)
+{
+  Slot* slot = find(conn.slot);
+  if(slot == nullptr)
+  {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lk(slot->mutex);
+  if(slot->generation.load(std::memory_order_relaxed) != conn.generation)
+  {
+    return false;
+  }
+  slot->framing.store(framing, std::memory_order_relaxed);
+  return true;
+}
+
+bool ConnectionTable::is_open(ConnectionHandle conn) const
+{
+  Slot* slot = find(conn.slot);
+  return slot != nullptr && conn.generation % 2 == 1 &&
+    slot->generation.load(std::memory_order_acquire) == conn.generation;
+}
+
+ConnectionHandle ConnectionTable::handle_of(int fd) const
+{
+  Slot* slot = fd < 0 ? nullptr : find(fd);
+  if(slot == nullptr)
+  {
+    return ConnectionHandle();
+  }
+  const uint32_t generation = slot->generation.load(std::memory_order_acquire);
+  if(generation % 2 == 0)
+  {
+    return ConnectionHandle();
+  }
+  return ConnectionHandle{static_cast<uint32_t>(fd), generation};
+}
+
+int ConnectionTable::fd_of(ConnectionHandle conn) const
+{
+  return is_open(conn) ? static_cast<int>(conn.slot) : -1;
+}
+
+ConnectionTable::Slot* ConnectionTable::find(size_t slot) const
+{
+  if(slot >= MAX_SLOTS)
+  {
+    return nullptr;
+  }
+  Slot* chunk = chunks[slot / CHUNK_SLOTS].load(std::memory_order_acquire);
+  return chunk == nullptr ? nullptr : &chunk[slot % CHUNK_SLOTS];
+}
+
+ConnectionTable::Slot& ConnectionTable::get_or_create(size_t slot)
+{
+  std::atomic<Slot*>& chunk = chunks[slot / CHUNK_SLOTS];
+  Slot* slots = chunk.load(std::memory_order_acquire);
+  if(slots == nullptr)
+  {
+    std::lock_guard<std::mutex> lk(grow_mutex);
+    slots = chunk.load(std::memory_order_relaxed);
+    if(slots == nullptr)
+    {
+      slots = new Slot[CHUNK_SLOTS];
+      chunk.store(slots, std::memory_order_release);
+    }
+  }
+  return slots[slot % CHUNK_SLOTS];
+}
@@ -0,0 +1,150 @@
+#ifndef CONNECTION_TABLE_H
+#define CONNECTION_TABLE_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+/* Connection handles.
+ * Handlers used to address clients by raw fd. An fd number is reused by the
+ * kernel as soon as it is closed, so anything that still holds the number
+ * (a room thread with queued messages, a timer, another reactor) would write
+ * to whichever client got it next.
+ *
+ * A ConnectionHandle is (slot, generation). The slot is the fd number, which
+ * keeps the table dense and the lookup a plain index; the generation is
+ * bumped every time the slot is closed, so a handle of a closed connection
+ * never matches again, even after the fd number was reused.
+ *
+  | Call                   | Stale handle                | Cost               |
+  | ---------------------- | --------------------------- | ------------------ |
+  | ConnectionTable::send  | rejected, -1 / errno EBADF  | one compare + lock |
+  | ConnectionTable::close | ignored, returns false      | one compare + lock |
+ *
+ * All closes of client sockets must go through the table: close() takes the
+ * slot lock, so a send that passed the generation check finishes on the
+ * right socket before the number can be handed out again. The same lock
+ * keeps sends from different threads to one client from interleaving.
+ *
+ * Each open slot also records how the bytes handlers send are framed on
+ * the wire: RAW for plain TCP, or WebSocket text frames once a gateway has
+ * upgraded the connection (see WireMessage). A slot can also carry a
+ * ConnectionTransport that turns every send into something else, such as
+ * TLS records made in user space; it runs under the slot lock, so it sees
+ * one sender at a time. Opening and closing a slot reset both.
+ *
+ * Handles are small values; copy them freely and keep them as map keys.
+*/
+
+struct ConnectionHandle
+{
+  uint32_t slot = UINT32_MAX;
+  uint32_t generation = 0;
+
+  bool operator==(const ConnectionHandle& o) const
+  {
+    return slot == o.slot && generation == o.generation;
+  }
+  bool operator!=(const ConnectionHandle& o) const { return !(*this == o); }
+};
+
+namespace std
+{
+  template <>
+  struct hash<ConnectionHandle>
+  {
+    size_t operator()(const ConnectionHandle& h) const
+    {
+      return std::hash<uint64_t>()((uint64_t(h.generation) << 32) | h.slot);
+    }
+  };
+}
+
+// Rewrites what is sent on a connection (see TlsGateway).
+class ConnectionTransport
+{
+  public:
+    virtual ~ConnectionTransport() = default;
+    // Called under the slot lock. Returns the bytes of `iov` taken, or -1.
+    virtual ssize_t write(int fd, const iovec* iov, int count) = 0;
+};
+
+class ConnectionTable
+{
+  public:
+    enum class Framing : uint8_t { RAW, WEBSOCKET, WEBSOCKET_DEFLATE };
+
+    // fds above this are refused.
+    static const size_t MAX_SLOTS = 1 << 20;
+
+    // The process wide table used by all servers and handlers.
+    static ConnectionTable& global();
+
+    ConnectionTable();
+    ~ConnectionTable();
+
+    ConnectionTable(const ConnectionTable&) = delete;
+    ConnectionTable& operator=(const ConnectionTable&) = delete;
+
+    // Registers a connected socket. Throws if fd is out of range.
+    ConnectionHandle open(int fd);
+    // Closes the socket if the handle is current. Returns false if stale.
+    bool close(ConnectionHandle conn);
+    // send(2) on the handle's socket; -1 with errno EBADF if stale.
+    ssize_t send(ConnectionHandle conn, const void* data, size_t len, int flags = 0);
+    // sendmsg(2) of `count` buffers as one write; -1 / EBADF if stale.
+    ssize_t sendv(ConnectionHandle conn, const iovec* iov, int count, int flags = 0);
+    // splice(2)s `len` bytes from the pipe `pipe_fd` into the handle's
+    // socket, blocking like send(). Returns the bytes moved, -1 on error.
+    ssize_t splice_from(ConnectionHandle conn, int pipe_fd, size_t len);
+    // Shuts the socket down (both ways) if the handle is current. The owning
+    // server sees end of file and closes it as usual.
+    bool shutdown(ConnectionHandle conn);
+
+    // Makes the socket's close send RST instead of FIN and shuts reading
+    // down, so the owning server closes it. For fault injection.
+    bool reset(ConnectionHandle conn);
+
+    // Sends go through `transport` until the slot is closed. Returns false
+    // if the handle is stale.
+    bool set_transport(ConnectionHandle conn, std::shared_ptr<ConnectionTransport> transport);
+    bool has_transport(ConnectionHandle conn) const;
+    // Runs fn(fd) under the slot lock: serialized with every send.
+    bool with_socket(ConnectionHandle conn, const std::function<void(int fd)>& fn);
+
+    // RAW for stale handles.
+    Framing framing(ConnectionHandle conn) const;
+    bool set_framing(ConnectionHandle conn, Framing framing);
+
+    bool is_open(ConnectionHandle conn) const;
+    // Current handle of an open fd, or an invalid handle.
+    ConnectionHandle handle_of(int fd) const;
+    // fd of an open handle, -1 if stale. Only for the owning server: the
+    // number can be reused as soon as another thread closes the handle.
+    int fd_of(ConnectionHandle conn) const;
+
+  private:
+    static const size_t CHUNK_SLOTS = 4096;
+
+    struct Slot
+    {
+      std::mutex mutex;
+      // Odd while open: open and close both increment it.
+      std::atomic<uint32_t> generation{0};
+      std::atomic<Framing> framing{Framing::RAW};
+      std::shared_ptr<ConnectionTransport> transport;   // under `mutex`
+    };
+
+    std::atomic<Slot*> chunks[MAX_SLOTS / CHUNK_SLOTS];
+    std::mutex grow_mutex;
+
+    Slot* find(size_t slot) const;
+    Slot& get_or_create(size_t slot);
+};
+
+#endif
@@ -0,0 +1,132 @@
+#include "epoch_reclaimer.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std;
+
+namespace
+{
+  // Process-wide slot indices, shared by all domains.
+  std::mutex index_mutex;
+  std::vector<size_t> free_indices;
+  size_t next_index = 0;
+  // Slots at or above this index were never handed out; writers skip them.
+  std::atomic<size_t> used_indices{0};
+
+  struct ThreadIndex
+  {
+    size_t value;
+
+    ThreadIndex()
+    {
+      std::lock_guard<std::mutex> lk(index_mutex);
+      if(!free_indices.empty())
+      {
+        value = free_indices.back();
+        free_indices.pop_back();
+      }
+      else if(next_index < EpochDomain::MAX_THREADS)
+      {
+        value = next_index++;
+        used_indices.store(next_index, std::memory_order_seq_cst);
+      }
+      else
+      {
+        throw std::runtime_error("EpochDomain: too many threads");
+      }
+    }
+
+    ~ThreadIndex()
+    {
+      std::lock_guard<std::mutex> lk(index_mutex);
+      free_indices.push_back(value);
+    }
+  };
+
+  size_t thread_index()
+  {
+    thread_local ThreadIndex index;
+    return index.value;
+  }
+}
+
+EpochDomain::EpochDomain()
+{
+}
+
+EpochDomain::~EpochDomain()
+{
+  // No reader may be left at this point.
+  for(auto& r : retired)
+  {
+    r.free_fn();
+  }
+}
+
+void EpochDomain::enter()
+{
+  Slot& slot = slots[thread_index()];
+  if(slot.depth++ > 0)
+  {
+    return;
+  }
+
+  // seq_cst: the announcement must be visible before any load of the
+  // protected pointers, otherwise a writer could miss this reader.
+  slot.epoch.store(global_epoch.load(std::memory_order_seq_cst),
+    std::memory_order_seq_cst);
+}
+
+void EpochDomain::leave()
+{
+  Slot& slot = slots[thread_index()];
+  if(--slot.depth > 0)
+  {
+    return;
+  }
+  slot.epoch.store(QUIESCENT, std::memory_order_release);
+}
+
+void EpochDomain::retire_fn(std::function<void()> free_fn)
+{
+  std::lock_guard<std::mutex> lk(retire_mutex);
+  retired.push_back({global_epoch.load(std::memory_order_seq_cst),
+    std::move(free_fn)});
+  try_advance();
+  collect();
+}
+
+size_t EpochDomain::pending() const
+{
+  std::lock_guard<std::mutex> lk(retire_mutex);
+  return retired.size();
+}
+
+bool EpochDomain::try_advance()
+{
+  const uint64_t epoch = global_epoch.load(std::memory_order_seq_cst);
+  const size_t used = used_indices.load(std::memory_order_seq_cst);
+  for(size_t i = 0; i < used; ++i)
+  {
+    const uint64_t seen = slots[i].epoch.load(std::memory_order_seq_cst);
+    if(seen != QUIESCENT && seen != epoch)
+    {
+      return false;
+    }
+  }
+  global_epoch.store(epoch + 1, std::memory_order_seq_cst);
+  return true;
+}
+
+void EpochDomain::collect()
+{
+  const uint64_t epoch = global_epoch.load(std::memory_order_seq_cst);
+  auto keep = std::partition(retired.begin(), retired.end(),
+    [epoch](const Retired& r) { return r.epoch + 2 > epoch; });
+  for(auto it = keep; it != retired.end(); ++it)
+  {
+    it->free_fn();
+  }
+  retired.erase(keep, retired.end());
+}
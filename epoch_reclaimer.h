@@ -0,0 +1,116 @@
+#ifndef EPOCH_RECLAIMER_H
+#define EPOCH_RECLAIMER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+/* Epoch based reclamation (EBR).
+ * Lets readers walk a shared structure without any lock while writers
+ * replace parts of it: a writer publishes a new version with one atomic
+ * pointer store and hands the old one to retire(); it is freed once no
+ * reader can still be looking at it.
+ *
+ *   reader                          writer
+ *   ------                          ------
+ *   EpochGuard g(domain);           new_v = copy(old_v) + change
+ *   v = ptr.load(acquire);          ptr.store(new_v, release)
+ *   ... use v ...                   domain.retire(old_v)
+ *   (g goes out of scope)
+ *
+ * A global epoch counter only moves forward when every thread inside a
+ * guard has seen the current value. Something retired in epoch E was
+ * unlinked before E, so once the global epoch reached E + 2 every reader
+ * that could have loaded it has left its guard and it can be freed.
+ *
+  | Operation      | Cost                                           |
+  | -------------- | ---------------------------------------------- |
+  | enter / leave  | two stores into a thread-private cache line    |
+  | retire         | mutex + scan of the slots of live threads      |
+ *
+ * Readers never wait and never write shared cache lines, which is what makes
+ * this cheaper than a reader/writer lock or shared_ptr reference counts on a
+ * hot fan-out path. The price is that memory is freed late: a reader stuck
+ * in a guard holds back all reclamation, and garbage is only collected on the
+ * next retire() (or when the domain is destroyed).
+ *
+ * Each thread gets a slot index the first time it enters any domain; the
+ * index is returned when the thread ends. At most MAX_THREADS threads may
+ * use epoch guards at the same time.
+*/
+
+class EpochDomain
+{
+  public:
+    static const size_t MAX_THREADS = 256;
+
+    EpochDomain();
+    ~EpochDomain();
+
+    EpochDomain(const EpochDomain&) = delete;
+    EpochDomain& operator=(const EpochDomain&) = delete;
+
+    // Reader side; guards nest. Prefer EpochGuard.
+    void enter();
+    void leave();
+
+    // Frees `p` once all current readers are gone.
+    template <typename T>
+    void retire(const T* p)
+    {
+      retire_fn([p] { delete p; });
+    }
+    void retire_fn(std::function<void()> free_fn);
+
+    // Objects retired but not freed yet.
+    size_t pending() const;
+
+  private:
+    static const uint64_t QUIESCENT = ~uint64_t(0);
+
+    struct alignas(64) Slot
+    {
+      std::atomic<uint64_t> epoch{QUIESCENT};
+      unsigned depth = 0;             // owner thread only
+    };
+
+    struct Retired
+    {
+      uint64_t epoch;
+      std::function<void()> free_fn;
+    };
+
+    std::atomic<uint64_t> global_epoch{0};
+    Slot slots[MAX_THREADS];
+    mutable std::mutex retire_mutex;
+    std::vector<Retired> retired;     // guarded by retire_mutex
+
+    bool try_advance();
+    void collect();
+};
+
+class EpochGuard
+{
+  public:
+    explicit EpochGuard(EpochDomain& d) : domain(d)
+    {
+      domain.enter();
+    }
+
+    ~EpochGuard()
+    {
+      domain.leave();
+    }
+
+    EpochGuard(const EpochGuard&) = delete;
+    EpochGuard& operator=(const EpochGuard&) = delete;
+
+  private:
+    EpochDomain& domain;
+};
+
+#endif
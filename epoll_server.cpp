@@ -0,0 +1,529 @@
+#include "epoll_server.h"
+
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <cerrno>
+#include <cstdint>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* epoll api.
+ * Unlike poll(), the interest list lives in the kernel: fds are added once
+ * with epoll_ctl() and epoll_wait() only returns the ready ones, so the cost
+ * of a wakeup does not grow with the number of idle connections.
+ *
+  | Flag             | Meaning                                                  |
+  | ---------------- | -------------------------------------------------------- |
+  | `EPOLLIN`        | Data to read (or a connection to accept)                 |
+  | `EPOLLONESHOT`   | Disarm the fd after one event, re-arm with EPOLL_CTL_MOD |
+  | `EPOLLEXCLUSIVE` | Several epoll sets watch the fd, wake only one of them   |
+*/
+
+namespace
+{
+  // Accepting more than this per wakeup starves the connections we already have.
+  const int ACCEPT_BATCH = 32;
+  const int EVENT_BATCH = 64;
+
+  // Load balancing between LOOP_PER_THREAD reactors.
+  const auto BALANCE_INTERVAL = std::chrono::milliseconds(250);
+  // Below this share of a window spent busy, a reactor never gives work away.
+  const double MIN_BUSY_SHARE = 0.2;
+  // Migrate only if busier than the least loaded reactor by this factor.
+  const double IMBALANCE_FACTOR = 1.5;
+  // At most this many connections leave a reactor per window.
+  const size_t MAX_MIGRATIONS_PER_WINDOW = 4;
+
+  // The server whose worker is running on this thread, if any.
+  thread_local const EpollTcpServer* loop_owner = nullptr;
+
+  uint64_t elapsed_ns(std::chrono::steady_clock::time_point since)
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - since).count();
+  }
+}
+
+EpollTcpServer::EpollTcpServer(int port, std::shared_ptr<IClientHandler> p_handler,
+  size_t threads, ThreadingMode mode) :
+  server_fd(-1), port(port), pHandler(p_handler),
+  thread_count(threads == 0 ? 1 : threads), mode(mode), stop_fd(-1)
+{
+  if(p_handler == nullptr)
+  {
+    throw std::runtime_error("client handle can not be null");
+  }
+
+  setup_socket();
+  setup_epoll();
+}
+
+EpollTcpServer::~EpollTcpServer()
+{
+  ConnectionTable& table = ConnectionTable::global();
+  for(const auto& reactor : reactors)
+  {
+    // Connections still in flight between reactors land in `connections`.
+    reactor->tasks.run_pending();
+  }
+  for(const auto& reactor : reactors)
+  {
+    // The workers are gone: whoever is still connected is told now, as
+    // close_client() would have.
+    for(const auto& entry : reactor->connections)
+    {
+      const ConnectionHandle conn = table.handle_of(entry.first);
+      pHandler->on_client_disconnect(conn);
+      table.close(conn);
+    }
+    close(reactor->epoll_fd);
+  }
+  close(stop_fd);
+  close(server_fd);
+}
+
+void EpollTcpServer::run()
+{
+  std::vector<std::thread> workers;
+  for(size_t i = 0; i < thread_count; ++i)
+  {
+    if(mode == ThreadingMode::LEADER_FOLLOWER)
+    {
+      workers.emplace_back(&EpollTcpServer::leader_follower, this);
+    }
+    else
+    {
+      workers.emplace_back(&EpollTcpServer::loop_per_thread, this,
+        std::ref(*reactors[i]));
+    }
+  }
+
+  for(auto& worker : workers)
+  {
+    worker.join();
+  }
+}
+
+void EpollTcpServer::stop()
+{
+  stopping = true;
+  // The eventfd stays readable (nobody reads it), so every thread sees it.
+  const uint64_t one = 1;
+  auto nb = write(stop_fd, &one, sizeof(one));
+  (void)nb;
+}
+
+void EpollTcpServer::post(LoopTaskQueue::Task task)
+{
+  const size_t next = next_task_reactor.fetch_add(1, std::memory_order_relaxed);
+  reactors[next % reactors.size()]->tasks.post(std::move(task));
+}
+
+void EpollTcpServer::run_in_loop(LoopTaskQueue::Task task)
+{
+  if(loop_owner == this)
+  {
+    task();
+    return;
+  }
+  post(std::move(task));
+}
+
+void EpollTcpServer::setup_socket()
+{
+  server_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if(server_fd < 0)
+  {
+    throw std::runtime_error("Socket Creation failed");
+  }
+
+  int reuse = 1;
+  if(setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0)
+  {
+    throw std::runtime_error("setsockopt failed");
+  }
+
+  struct sockaddr_in address;
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  if(bind(server_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0)
+  {
+    throw std::runtime_error("Socket binding failed");
+  }
+
+  if(listen(server_fd, SOMAXCONN) < 0)
+  {
+    throw std::runtime_error("Socket listening failed");
+  }
+
+  // Several threads accept from it; a connection another thread already
+  // took must give EAGAIN, not block us.
+  fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL, 0) | O_NONBLOCK);
+
+  std::cout << "Epoll Tcp Server is ready for Listen on port " << port << std::endl;
+}
+
+void EpollTcpServer::setup_epoll()
+{
+  stop_fd = eventfd(0, EFD_NONBLOCK);
+  if(stop_fd < 0)
+  {
+    throw std::runtime_error("eventfd failed");
+  }
+
+  const size_t sets = mode == ThreadingMode::LEADER_FOLLOWER ? 1 : thread_count;
+  for(size_t i = 0; i < sets; ++i)
+  {
+    auto reactor = std::make_unique<Reactor>();
+    reactor->epoll_fd = epoll_create1(0);
+    if(reactor->epoll_fd < 0)
+    {
+      throw std::runtime_error("epoll_create1 failed");
+    }
+    const int epoll_fd = reactor->epoll_fd;
+
+    epoll_event ev{};
+    ev.data.fd = stop_fd;
+    ev.events = EPOLLIN;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_fd, &ev);
+
+    // One-shot under leader/follower: the queue has a single consumer.
+    ev.data.fd = reactor->tasks.fd();
+    ev.events = mode == ThreadingMode::LEADER_FOLLOWER ?
+      EPOLLIN | EPOLLONESHOT : EPOLLIN;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, reactor->tasks.fd(), &ev);
+
+    ev.data.fd = server_fd;
+    ev.events = mode == ThreadingMode::LEADER_FOLLOWER ?
+      EPOLLIN | EPOLLONESHOT : EPOLLIN | EPOLLEXCLUSIVE;
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) < 0)
+    {
+      throw std::runtime_error("epoll_ctl(listen socket) failed");
+    }
+    reactors.push_back(std::move(reactor));
+  }
+}
+
+void EpollTcpServer::loop_per_thread(Reactor& reactor)
+{
+  epoll_event events[EVENT_BATCH];
+  loop_owner = this;
+  reactor.window_start = std::chrono::steady_clock::now();
+  while(!stopping)
+  {
+    const auto window_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+      BALANCE_INTERVAL - std::chrono::nanoseconds(elapsed_ns(reactor.window_start)));
+    const int timeout = migration_enabled ?
+      static_cast<int>(std::max<int64_t>(window_ms.count(), 0)) : -1;
+
+    int n = epoll_wait(reactor.epoll_fd, events, EVENT_BATCH, timeout);
+    if(n < 0)
+    {
+      if(errno == EINTR)
+      {
+        continue;
+      }
+      perror("epoll_wait");
+      break;
+    }
+
+    bool tasks_ready = false;
+    for(int i = 0; i < n; ++i)
+    {
+      const int fd = events[i].data.fd;
+      if(fd == stop_fd)
+      {
+        return;
+      }
+      if(fd == server_fd)
+      {
+        accept_new_clients(reactor, EPOLLIN);
+        continue;
+      }
+      if(fd == reactor.tasks.fd())
+      {
+        tasks_ready = true;
+        continue;
+      }
+      handle_client_read(reactor, fd);
+    }
+
+    // After the batch: a task may add or drop connections of this batch.
+    if(tasks_ready)
+    {
+      reactor.tasks.run_pending();
+    }
+
+    if(elapsed_ns(reactor.window_start) >=
+      static_cast<uint64_t>(std::chrono::nanoseconds(BALANCE_INTERVAL).count()))
+    {
+      rebalance(reactor);
+    }
+  }
+}
+
+void EpollTcpServer::leader_follower()
+{
+  Reactor& reactor = *reactors[0];
+  const int epoll_fd = reactor.epoll_fd;
+  loop_owner = this;
+  while(!stopping)
+  {
+    epoll_event ev{};
+    int n;
+    {
+      // Only the leader waits in epoll_wait(); followers queue on the mutex.
+      std::lock_guard<std::mutex> leader(leader_mutex);
+      n = epoll_wait(epoll_fd, &ev, 1, -1);
+    }
+    // Releasing the mutex promoted the next follower to leader, so from here
+    // on this thread is just a worker processing one event.
+
+    if(n < 0)
+    {
+      if(errno == EINTR)
+      {
+        continue;
+      }
+      perror("epoll_wait");
+      break;
+    }
+    if(n == 0)
+    {
+      continue;
+    }
+
+    const int fd = ev.data.fd;
+    if(fd == stop_fd)
+    {
+      return;
+    }
+
+    if(fd == reactor.tasks.fd())
+    {
+      reactor.tasks.run_pending();
+      epoll_event rearm{};
+      rearm.data.fd = fd;
+      rearm.events = EPOLLIN | EPOLLONESHOT;
+      epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &rearm);
+      continue;
+    }
+
+    if(fd == server_fd)
+    {
+      accept_new_clients(reactor, EPOLLIN | EPOLLONESHOT);
+      epoll_event rearm{};
+      rearm.data.fd = server_fd;
+      rearm.events = EPOLLIN | EPOLLONESHOT;
+      epoll_ctl(epoll_fd, EPOLL_CTL_MOD, server_fd, &rearm);
+      continue;
+    }
+
+    // The fd stays disarmed until this returns: per-connection serialization.
+    if(handle_client_read(reactor, fd))
+    {
+      epoll_event rearm{};
+      rearm.data.fd = fd;
+      rearm.events = EPOLLIN | EPOLLONESHOT;
+      epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &rearm);
+    }
+  }
+}
+
+void EpollTcpServer::accept_new_clients(Reactor& reactor, uint32_t client_events)
+{
+  for(int i = 0; i < ACCEPT_BATCH; ++i)
+  {
+    int client_fd = accept(server_fd, nullptr, nullptr);
+    if(client_fd < 0)
+    {
+      if(errno != EAGAIN && errno != EWOULDBLOCK)
+      {
+        perror("accept");
+      }
+      return;
+    }
+
+    // Connect callback first: no data event can reach the handler before it.
+    const ConnectionHandle conn = ConnectionTable::global().open(client_fd);
+    pHandler->on_client_connect(conn);
+
+    // Listed before it is watched: under leader/follower another thread
+    // may close it as soon as it is in the epoll set.
+    {
+      std::lock_guard<std::mutex> lk(reactor.connections_mutex);
+      reactor.connections[client_fd] = std::make_unique<Connection>(Connection{client_fd});
+    }
+    epoll_event ev{};
+    ev.data.fd = client_fd;
+    ev.events = client_events;
+    if(epoll_ctl(reactor.epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0)
+    {
+      perror("epoll_ctl");
+      {
+        std::lock_guard<std::mutex> lk(reactor.connections_mutex);
+        reactor.connections.erase(client_fd);
+      }
+      pHandler->on_client_disconnect(conn);
+      ConnectionTable::global().close(conn);
+    }
+  }
+}
+
+bool EpollTcpServer::handle_client_read(Reactor& reactor, int client_fd)
+{
+  // Leader/follower threads share one Reactor: no per-connection accounting.
+  const bool track = mode == ThreadingMode::LOOP_PER_THREAD;
+  const auto start = std::chrono::steady_clock::now();
+
+  char buffer[16 * 1024];
+  auto nb = recv(client_fd, buffer, sizeof(buffer), 0);
+  if(nb <= 0)
+  {
+    close_client(reactor, client_fd);
+    return false;
+  }
+
+  pHandler->on_client_data(ConnectionTable::global().handle_of(client_fd), buffer, nb);
+
+  if(track)
+  {
+    // Wall time inside read + handler; equal to CPU time unless the handler
+    // blocked in send(), and much cheaper to take than the thread CPU clock.
+    const uint64_t spent = elapsed_ns(start);
+    auto it = reactor.connections.find(client_fd);
+    if(it != reactor.connections.end())
+    {
+      it->second->busy_ns += spent;
+    }
+    reactor.window_busy_ns += spent;
+  }
+  return true;
+}
+
+void EpollTcpServer::close_client(Reactor& reactor, int client_fd)
+{
+  epoll_ctl(reactor.epoll_fd, EPOLL_CTL_DEL, client_fd, nullptr);
+  {
+    std::lock_guard<std::mutex> lk(reactor.connections_mutex);
+    reactor.connections.erase(client_fd);
+  }
+  // Tell the handler before the table closes the socket: once the number is
+  // released another thread may accept a new client with the same fd, which
+  // gets a new handle; sends to the old one are rejected from now on.
+  ConnectionTable& table = ConnectionTable::global();
+  const ConnectionHandle conn = table.handle_of(client_fd);
+  pHandler->on_client_disconnect(conn);
+  table.close(conn);
+}
+
+void EpollTcpServer::adopt_migrated(Reactor& reactor, int client_fd)
+{
+  epoll_event ev{};
+  ev.data.fd = client_fd;
+  ev.events = EPOLLIN;
+  // Level-triggered: whatever arrived during the hand-over is reported by
+  // the next epoll_wait() on this reactor.
+  if(epoll_ctl(reactor.epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0)
+  {
+    perror("epoll_ctl(migrated)");
+    ConnectionTable& table = ConnectionTable::global();
+    const ConnectionHandle handle = table.handle_of(client_fd);
+    pHandler->on_client_disconnect(handle);
+    table.close(handle);
+    return;
+  }
+  reactor.connections[client_fd] = std::make_unique<Connection>(Connection{client_fd});
+}
+
+void EpollTcpServer::rebalance(Reactor& reactor)
+{
+  const uint64_t window = elapsed_ns(reactor.window_start);
+  uint64_t my_load = reactor.window_busy_ns;
+  reactor.load_ns = my_load;
+
+  Reactor* target = nullptr;
+  for(const auto& other : reactors)
+  {
+    if(other.get() != &reactor && (!target || other->load_ns < target->load_ns))
+    {
+      target = other.get();
+    }
+  }
+
+  const bool overloaded = target && migration_enabled &&
+    my_load > MIN_BUSY_SHARE * window &&
+    my_load > IMBALANCE_FACTOR * target->load_ns;
+
+  if(overloaded)
+  {
+    // Hottest first. Moving a connection that costs more than half the gap
+    // would only swap which reactor is overloaded.
+    std::vector<Connection*> hot;
+    for(const auto& entry : reactor.connections)
+    {
+      if(entry.second->busy_ns > 0)
+      {
+        hot.push_back(entry.second.get());
+      }
+    }
+    std::sort(hot.begin(), hot.end(), [](const Connection* a, const Connection* b) {
+      return a->busy_ns > b->busy_ns;
+    });
+
+    size_t moved = 0;
+    for(Connection* conn : hot)
+    {
+      const uint64_t target_load = target->load_ns;
+      if(moved == MAX_MIGRATIONS_PER_WINDOW || my_load <= target_load)
+      {
+        break;
+      }
+      if(conn->busy_ns * 2 > my_load - target_load)
+      {
+        continue;
+      }
+
+      const uint64_t cost = conn->busy_ns;
+      // Account for it right away so other reactors balancing in the same
+      // window do not all pick the same target.
+      target->load_ns += cost;
+      my_load -= cost;
+      migrate(reactor, conn->fd, *target);
+      ++moved;
+    }
+  }
+
+  for(auto& entry : reactor.connections)
+  {
+    entry.second->busy_ns = 0;
+  }
+  reactor.window_busy_ns = 0;
+  reactor.window_start = std::chrono::steady_clock::now();
+}
+
+void EpollTcpServer::migrate(Reactor& from, int client_fd, Reactor& to)
+{
+  auto it = from.connections.find(client_fd);
+  if(it == from.connections.end())
+  {
+    return;
+  }
+
+  // We are on from's thread between two events, so nobody is reading this
+  // socket right now; after the DEL nobody will until `to` adds it.
+  epoll_ctl(from.epoll_fd, EPOLL_CTL_DEL, client_fd, nullptr);
+  from.connections.erase(it);
+
+  Reactor* target = &to;
+  to.tasks.post([this, target, client_fd] { adopt_migrated(*target, client_fd); });
+  ++migration_count;
+}
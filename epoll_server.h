@@ -0,0 +1,131 @@
+#ifndef EPOLL_SERVER_H
+#define EPOLL_SERVER_H
+
+#include "tcp_server.h"
+#include "loop_task_queue.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/* Multi-threaded epoll server core.
+ * Runs the same IClientHandler as TcpServer, but on several threads.
+ *
+  | Mode              | epoll sets         | Who waits                  | Balancing          |
+  | ----------------- | ------------------ | -------------------------- | ------------------ |
+  | LOOP_PER_THREAD   | one per thread     | every thread on its own    | accept + migration |
+  | LEADER_FOLLOWER   | one, shared        | one thread (the leader)    | per event          |
+ *
+ * LOOP_PER_THREAD: the listening socket is in every thread's epoll set with
+ * EPOLLEXCLUSIVE, so the kernel wakes one thread per new connection and that
+ * thread owns the connection for its whole life. Cheap, but a few hot
+ * connections can pin one thread while the others idle.
+ *
+ * LEADER_FOLLOWER: all sockets are in a single epoll set with EPOLLONESHOT.
+ * Threads take turns being the leader: the leader is the only thread in
+ * epoll_wait(); when it gets an event it hands leadership to the next
+ * follower and processes the event itself. EPOLLONESHOT disarms the fd when
+ * its event is delivered and it is only re-armed after the handler returned,
+ * so one connection is never processed by two threads at once, while
+ * consecutive events of a hot connection can land on whichever thread is
+ * free. No dispatcher thread and no queues are involved.
+ *
+ * Migration (LOOP_PER_THREAD only): every reactor measures how long it spends
+ * in each connection's read + handler call, summed over windows of
+ * BALANCE_INTERVAL. At the end of a window a reactor that is clearly busier
+ * than the least loaded one hands its hottest connections over: it removes
+ * the fd from its own epoll set (between two events, so the connection is
+ * not being processed) and posts a task to the target's LoopTaskQueue; the
+ * target adds the fd to its set when it runs the task.
+ * Nothing is lost in between: unread bytes wait in the socket's receive
+ * buffer and the level-triggered registration on the target reports them
+ * right away. Handler state is keyed by ConnectionHandle, not by thread, so
+ * it needs no transfer. A connection only moves if its cost is below half the load gap,
+ * which keeps a single hot connection from ping-ponging between reactors.
+ *
+ * Client sockets stay blocking, exactly like in TcpServer, so handlers can
+ * keep calling send() directly. The handler is called from several threads
+ * and must be thread-safe across connections (BroadCastChatHandler locks,
+ * EchoHandler has no state).
+*/
+
+class EpollTcpServer
+{
+  public:
+    enum class ThreadingMode { LOOP_PER_THREAD, LEADER_FOLLOWER };
+
+    EpollTcpServer(int port, std::shared_ptr<IClientHandler> p_handler,
+      size_t threads = std::thread::hardware_concurrency(),
+      ThreadingMode mode = ThreadingMode::LOOP_PER_THREAD);
+    ~EpollTcpServer();
+
+    // Starts the worker threads and blocks until stop().
+    void run();
+    // Async-signal-safe.
+    void stop();
+
+    // Runs `task` on one of the worker threads (round robin over the
+    // reactors); callable from any thread, bursts share one wakeup. Tasks
+    // run between event batches, never inside a handler callback.
+    void post(LoopTaskQueue::Task task);
+    // Runs `task` right away when called on a worker thread, else post()s it.
+    void run_in_loop(LoopTaskQueue::Task task);
+
+    // Connection migration between LOOP_PER_THREAD reactors, on by default.
+    void set_migration(bool enabled) { migration_enabled = enabled; }
+    uint64_t migrations() const { return migration_count; }
+
+  private:
+    struct Connection
+    {
+      int fd;
+      uint64_t busy_ns = 0;           // time spent on it in this window
+    };
+
+    struct Reactor
+    {
+      int epoll_fd = -1;
+      LoopTaskQueue tasks;            // posted work, incl. migrated connections
+      // Owned by the reactor thread. The leader/follower threads share one
+      // reactor and add and remove under connections_mutex.
+      std::unordered_map<int, std::unique_ptr<Connection>> connections;
+      std::mutex connections_mutex;
+      uint64_t window_busy_ns = 0;
+      std::chrono::steady_clock::time_point window_start;
+      // Busy time of the last window, read by the other reactors.
+      std::atomic<uint64_t> load_ns{0};
+    };
+
+    int server_fd;
+    const int port;
+    const std::shared_ptr<IClientHandler> pHandler;
+    const size_t thread_count;
+    const ThreadingMode mode;
+    int stop_fd;                      // eventfd, readable once stop() ran
+    std::vector<std::unique_ptr<Reactor>> reactors;  // one per thread, or one shared
+    std::mutex leader_mutex;          // held by the current leader
+    std::atomic<bool> stopping{false};
+    std::atomic<bool> migration_enabled{true};
+    std::atomic<uint64_t> migration_count{0};
+    std::atomic<size_t> next_task_reactor{0};
+
+  private:
+    void setup_socket();
+    void setup_epoll();
+    void loop_per_thread(Reactor& reactor);
+    void leader_follower();
+    void accept_new_clients(Reactor& reactor, uint32_t client_events);
+    // Returns false when the client is gone (and already closed).
+    bool handle_client_read(Reactor& reactor, int client_fd);
+    void close_client(Reactor& reactor, int client_fd);
+    void adopt_migrated(Reactor& reactor, int client_fd);
+    void rebalance(Reactor& reactor);
+    void migrate(Reactor& from, int client_fd, Reactor& to);
+};
+
+#endif
@@ -0,0 +1,194 @@
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <cstdio>
+#include <cstdlib>
+#include <csignal>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <thread>
+
+#include "epoll_server.h"
+#include "chat_handlers.h"
+#include "proxy_handler.h"
+#include "server_options.h"
+#include "tls_gateway.h"
+#include "websocket_gateway.h"
+
+/* epoll based multi-threaded chat server.
+ * The event loops live in epoll_server.cpp (EpollTcpServer), the handlers in
+ * chat_handlers.cpp.
+ *
+ * usage: epoll_tcp_server [echo|chat|chat-inline|proxy] [port] [threads] [loop|static|lf]
+ *                         [--option=value ...]
+ *   threads  worker threads, default: number of cores
+ *   loop     one epoll loop per thread, hot connections migrate (default)
+ *   static   one epoll loop per thread, connections stay where accepted
+ *   lf       leader/follower over one shared epoll set
+ * Chat options, anywhere on the command line (see ServerOptions):
+ *   --history-dir=<dir>      where chat rooms log their history, default:
+ *                            memory only; logs older than a week or beyond
+ *                            1 GiB in total are dropped, unless:
+ *   --retain-age=<seconds>   drop logs older than this (0: keep)
+ *   --retain-bytes=<bytes>   drop the oldest logs beyond this (0: no limit)
+ *   --retain-last=<count>    compact each room to its last count messages
+ *   --no-retention           keep all history; later --retain-* still apply
+ *   --relay-self=<host:port> this node's relay; federates the chat rooms
+ *   --relay-nodes=<list>     comma separated relay host:port of every node
+ *   --replicate-to=<socket>  stream sessions and messages to a hot standby
+ *   --standby-of=<socket>    be that standby: mirror the primary, and serve
+ *                            the port only once it has gone away
+ *   --snapshot=<file>        restore sessions and recent messages from the
+ *                            file, save them to it every 10 s and on exit
+ *   --moderate=<file>        block lines containing a word listed in the
+ *                            file (one per line); reread when it changes
+ * Proxy options (see ProxyHandler; one pump thread per worker thread):
+ *   --backends=<host:port,...>  the backend pool
+ *   --balance=rr|least|hash     round robin (default), least connections,
+ *                               or consistent hash of the client's IP
+ * Any mode:
+ *   --websocket              serve browsers: WebSocket instead of raw TCP
+ *   --tls-cert=<pem>         serve over TLS with this certificate chain,
+ *   --tls-key=<pem>          and this key (default: the certificate file);
+ *                            kernel TLS where available (see TlsGateway)
+ * In chat mode the rooms are sharded over as many room threads as there are
+ * worker threads. chat-inline fans out on the worker threads themselves,
+ * reading lock-free member snapshots.
+*/
+
+using namespace std;
+
+static EpollTcpServer* running_server = nullptr;
+
+// SIGINT/SIGTERM end run() normally so destructors (and, in PGO training
+// builds, the profile dump at exit) still run.
+static void on_stop_signal(int)
+{
+  if(running_server)
+  {
+    running_server->stop();
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  ServerOptions options;
+  try
+  {
+    options = ServerOptions::parse(argc, argv);
+  }
+  catch(const std::invalid_argument& e)
+  {
+    std::cerr << e.what() << "\n";
+    return EXIT_FAILURE;
+  }
+
+  const std::vector<std::string>& args = options.positional;
+  if(args.size() > 4)
+  {
+    std::cerr << "unexpected argument " << args[4] << "\n";
+    return EXIT_FAILURE;
+  }
+  const std::string mode = args.size() > 0 ? args[0] : "chat";
+  const int port = args.size() > 1 ? std::atoi(args[1].c_str()) : 9000;
+  const size_t threads = args.size() > 2 ? std::strtoul(args[2].c_str(), nullptr, 10) :
+    std::thread::hardware_concurrency();
+  const std::string threading = args.size() > 3 ? args[3] : "loop";
+
+  try
+  {
+    std::shared_ptr<IClientHandler> p_handler;
+    std::shared_ptr<BroadCastChatHandler> chat;
+    if(mode == "echo")
+    {
+      p_handler = std::make_shared<EchoHandler>();
+    }
+    else if(mode == "chat" || mode == "chat-inline")
+    {
+      // chat: one room shard per reactor thread.
+      const size_t shards = mode == "chat" ? std::max<size_t>(threads, 1) : 0;
+      chat = std::make_shared<BroadCastChatHandler>(shards, options.history_dir,
+        options.retention);
+      if(!options.snapshot_path.empty())
+      {
+        chat->snapshot_to(options.snapshot_path);
+      }
+      if(!options.moderation_list.empty())
+      {
+        chat->moderate(options.moderation_list);
+      }
+      if(!options.standby_of.empty())
+      {
+        chat->follow(options.standby_of);
+      }
+      if(!options.relay_self.empty())
+      {
+        chat->federate(options.relay_self,
+          ServerOptions::split_list(options.relay_nodes));
+      }
+      if(!options.replicate_to.empty())
+      {
+        chat->replicate_to(options.replicate_to);
+      }
+      p_handler = chat;
+    }
+    else if(mode == "proxy")
+    {
+      p_handler = std::make_shared<ProxyHandler>(ServerOptions::split_list(options.backends),
+        ProxyHandler::parse_balance(options.balance), std::max<size_t>(threads, 1));
+    }
+    else
+    {
+      std::cerr << "unknown handler " << mode << ", use echo, chat, chat-inline or proxy\n";
+      return EXIT_FAILURE;
+    }
+
+    if(options.websocket)
+    {
+      p_handler = std::make_shared<WebSocketGateway>(p_handler);
+    }
+    // Outermost: TLS carries whatever the handlers inside speak.
+    if(!options.tls_cert.empty() || !options.tls_key.empty())
+    {
+      p_handler = std::make_shared<TlsGateway>(p_handler, options.tls_cert,
+        options.tls_key.empty() ? options.tls_cert : options.tls_key);
+    }
+
+    if(threading != "loop" && threading != "static" && threading != "lf")
+    {
+      std::cerr << "unknown threading mode " << threading
+                << ", use loop, static or lf\n";
+      return EXIT_FAILURE;
+    }
+
+    EpollTcpServer server(port, p_handler, threads, threading == "lf" ?
+      EpollTcpServer::ThreadingMode::LEADER_FOLLOWER :
+      EpollTcpServer::ThreadingMode::LOOP_PER_THREAD);
+    running_server = &server;
+
+    // A client that disconnects while we send to it must not kill the server.
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction sa = {};
+    sa.sa_handler = on_stop_signal;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+
+    server.set_migration(threading == "loop");
+    server.run();
+    running_server = nullptr;
+    // While the clients are still connected: their sessions are saved too.
+    if(chat && !options.snapshot_path.empty() && !chat->save_snapshot())
+    {
+      perror(("snapshot: writing " + options.snapshot_path).c_str());
+    }
+    std::cout << "connections migrated between threads: "
+              << server.migrations() << "\n";
+  }
+  catch(const std::exception& e)
+  {
+    std::cerr << "Server error: " << e.what() << "\n";
+    return EXIT_FAILURE;
+  }
+  return 0;
+}
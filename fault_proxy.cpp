@@ -0,0 +1,666 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <unordered_map>
+#include <stdexcept>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/socket.h>
+#include <sys/poll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+
+#include "tcp_server.h"
+
+/* Fault-injecting TCP proxy.
+ * Loopback never drops, delays or throttles anything, so a server's
+ * slow-consumer handling and its tail latency can not be seen locally.
+ * This proxy sits between clients and a server and makes the path between
+ * them bad, per direction and per connection:
+ *
+ *   client --> [TcpServer] --up queue--> fault loop --> server
+ *   client <-- send()  <--down queue-- fault loop <-- server
+ *
+ * Every chunk read in either direction is put on the direction's queue
+ * with a due time; the fault loop delivers chunks once they are due, the
+ * direction's token bucket has the bytes and it is not stalled. The loop
+ * reads the server side only while the down queue is short, so a throttled
+ * or stalled client makes the server's socket buffers fill up exactly as a
+ * slow consumer on a real network would.
+ *
+ * The up direction has no such backpressure: clients are read by the
+ * reactor, which does not stop reading one of them. A client more than
+ * UP_QUEUE_LIMIT bytes ahead of its up path is reset both ways instead, its
+ * queue dropped (counted as an overrun). When a client goes away, what is still queued
+ * up is delivered first and only then is the server's side shut down for
+ * writing; the server's answers are read and dropped until it closes.
+ *
+  | Option               | Meaning                                           |
+  | -------------------- | ------------------------------------------------- |
+  | `--delay <ms>`       | one-way latency added to every chunk              |
+  | `--jitter <ms>`      | plus a uniform 0..jitter, order is kept           |
+  | `--rate <bytes/s>`   | bandwidth cap (k/m/g suffixes), 0 = none          |
+  | `--stall-every <ms>` | mean time between stalls (exponential), 0 = none  |
+  | `--stall <ms>`       | how long a stall delivers nothing                 |
+  | `--reorder <p>`      | chance a chunk is held back `--reorder-ms`, with  |
+  | `--reorder-ms <ms>`  | everything after it: reordering as TCP shows it   |
+  | `--segment <bytes>`  | re-cut chunks into random pieces of 1..bytes      |
+  | `--reset <p>`        | chance a connection is reset (RST both ways) ...  |
+  | `--reset-after <ms>` | ... at a uniform time within this window          |
+  | `--seed <n>`         | RNG seed                                          |
+ *
+ * Every option sets both directions; `--up-<option>` (client to server)
+ * and `--down-<option>` (server to client) set one. TCP never hands the
+ * application reordered bytes: a reordered or lost segment shows up as a
+ * pause until the gap is filled and then a burst, which is what --reorder
+ * produces. --segment changes where reads split the stream, which finds
+ * line parsers that assume one read is one line.
+ *
+ * usage: fault_proxy <listen_port> <server_host:port> [options]
+*/
+
+using namespace std;
+using Clock = std::chrono::steady_clock;
+
+struct FaultSpec
+{
+  double delay_ms = 0;
+  double jitter_ms = 0;
+  double rate = 0;                    // bytes per second, 0: unlimited
+  double stall_every_ms = 0;
+  double stall_ms = 0;
+  double reorder = 0;
+  double reorder_ms = 200;
+  size_t segment = 0;
+};
+
+struct FaultOptions
+{
+  int port = 0;
+  std::string server;
+  FaultSpec up;
+  FaultSpec down;
+  double reset = 0;
+  double reset_after_ms = 10000;
+  uint64_t seed = 1;
+};
+
+// Chunks a direction holds before the loop stops reading its source.
+static const size_t QUEUE_LIMIT = 256 * 1024;
+// Queued client bytes before the client is disconnected.
+static const size_t UP_QUEUE_LIMIT = 64 * QUEUE_LIMIT;
+static const size_t READ_CHUNK = 64 * 1024;
+
+static int64_t now_us()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    Clock::now().time_since_epoch()).count();
+}
+
+static double parse_rate(const std::string& text)
+{
+  size_t used = 0;
+  double value = std::stod(text, &used);
+  const std::string suffix = text.substr(used);
+  if(suffix == "k" || suffix == "K")
+  {
+    value *= 1e3;
+  }
+  else if(suffix == "m" || suffix == "M")
+  {
+    value *= 1e6;
+  }
+  else if(suffix == "g" || suffix == "G")
+  {
+    value *= 1e9;
+  }
+  else if(!suffix.empty())
+  {
+    throw std::invalid_argument("bad rate " + text);
+  }
+  return value;
+}
+
+static FaultOptions parse_options(int argc, char* argv[])
+{
+  if(argc < 3)
+  {
+    throw std::invalid_argument(
+      "usage: fault_proxy <listen_port> <server_host:port> [options]");
+  }
+  FaultOptions opts;
+  opts.port = std::atoi(argv[1]);
+  opts.server = argv[2];
+
+  for(int i = 3; i < argc; ++i)
+  {
+    std::string arg = argv[i];
+    auto value = [&]() -> std::string {
+      if(i + 1 >= argc)
+      {
+        throw std::invalid_argument(arg + " needs a value");
+      }
+      return argv[++i];
+    };
+
+    if(arg == "--reset") opts.reset = std::stod(value());
+    else if(arg == "--reset-after") opts.reset_after_ms = std::stod(value());
+    else if(arg == "--seed") opts.seed = std::stoull(value());
+    else
+    {
+      // Direction options: --x sets both, --up-x / --down-x one.
+      std::vector<FaultSpec*> specs = {&opts.up, &opts.down};
+      if(arg.compare(0, 5, "--up-") == 0)
+      {
+        specs = {&opts.up};
+        arg = "--" + arg.substr(5);
+      }
+      else if(arg.compare(0, 7, "--down-") == 0)
+      {
+        specs = {&opts.down};
+        arg = "--" + arg.substr(7);
+      }
+      const std::string v = value();
+      for(FaultSpec* spec : specs)
+      {
+        if(arg == "--delay") spec->delay_ms = std::stod(v);
+        else if(arg == "--jitter") spec->jitter_ms = std::stod(v);
+        else if(arg == "--rate") spec->rate = parse_rate(v);
+        else if(arg == "--stall-every") spec->stall_every_ms = std::stod(v);
+        else if(arg == "--stall") spec->stall_ms = std::stod(v);
+        else if(arg == "--reorder") spec->reorder = std::stod(v);
+        else if(arg == "--reorder-ms") spec->reorder_ms = std::stod(v);
+        else if(arg == "--segment") spec->segment = std::stoul(v);
+        else throw std::invalid_argument(std::string("unknown option ") + argv[i - 1]);
+      }
+    }
+  }
+  return opts;
+}
+
+// One direction of one connection.
+struct FaultPath
+{
+  struct Chunk
+  {
+    int64_t due_us;
+    std::string data;
+  };
+
+  const FaultSpec* spec = nullptr;
+  std::deque<Chunk> queue;
+  size_t queued_bytes = 0;
+  size_t offset = 0;                  // of the front chunk already delivered
+  int64_t last_due_us = 0;            // keeps the queue in order
+  double tokens = 0;
+  int64_t refill_us = 0;
+  int64_t stalled_until_us = 0;
+  int64_t next_stall_us = 0;
+  bool source_closed = false;
+
+  bool stalled(int64_t now) const { return now < stalled_until_us; }
+
+  // Queues what was read from the source; `rng` is locked by the caller.
+  void push(const char* data, size_t len, int64_t now, std::mt19937_64& rng)
+  {
+    int64_t due = now + static_cast<int64_t>(spec->delay_ms * 1000);
+    if(spec->jitter_ms > 0)
+    {
+      due += static_cast<int64_t>(std::uniform_real_distribution<double>(0,
+        spec->jitter_ms * 1000)(rng));
+    }
+    if(spec->reorder > 0 && std::bernoulli_distribution(spec->reorder)(rng))
+    {
+      due += static_cast<int64_t>(spec->reorder_ms * 1000);
+    }
+    // Nothing overtakes an earlier chunk: a held back one delays the rest.
+    due = std::max(due, last_due_us);
+    last_due_us = due;
+
+    size_t done = 0;
+    while(done < len)
+    {
+      size_t piece = len - done;
+      if(spec->segment > 0)
+      {
+        piece = std::min(piece, std::uniform_int_distribution<size_t>(1, spec->segment)(rng));
+      }
+      queue.push_back({due, std::string(data + done, piece)});
+      done += piece;
+    }
+    queued_bytes += len;
+  }
+
+  // Bytes that may go out now; 0 with `wake_us` set when the path waits.
+  size_t ready(int64_t now, int64_t& wake_us, std::mt19937_64& rng)
+  {
+    if(spec->stall_every_ms > 0)
+    {
+      if(next_stall_us == 0)
+      {
+        next_stall_us = now + draw_stall_gap(rng);
+      }
+      if(now >= next_stall_us)
+      {
+        stalled_until_us = now + static_cast<int64_t>(spec->stall_ms * 1000);
+        next_stall_us = stalled_until_us + draw_stall_gap(rng);
+      }
+    }
+    if(queue.empty())
+    {
+      return 0;
+    }
+    if(stalled(now))
+    {
+      wake_us = std::min(wake_us, stalled_until_us);
+      return 0;
+    }
+    if(queue.front().due_us > now)
+    {
+      wake_us = std::min(wake_us, queue.front().due_us);
+      return 0;
+    }
+
+    const size_t left = queue.front().data.size() - offset;
+    if(spec->rate <= 0)
+    {
+      return left;
+    }
+    // Token bucket holding up to 10 ms of traffic (at least one segment).
+    const double burst = std::max(spec->rate / 100, 1460.0);
+    if(refill_us == 0)
+    {
+      refill_us = now;
+      tokens = burst;
+    }
+    tokens = std::min(burst, tokens + spec->rate * (now - refill_us) / 1e6);
+    refill_us = now;
+    const size_t allowed = std::min<size_t>(left, static_cast<size_t>(tokens));
+    if(allowed == 0)
+    {
+      wake_us = std::min(wake_us, now + static_cast<int64_t>(
+        (1 - tokens) * 1e6 / spec->rate) + 1);
+    }
+    return allowed;
+  }
+
+  void consumed(size_t n)
+  {
+    tokens -= n;
+    offset += n;
+    queued_bytes -= n;
+    if(offset == queue.front().data.size())
+    {
+      queue.pop_front();
+      offset = 0;
+    }
+  }
+
+  int64_t draw_stall_gap(std::mt19937_64& rng) const
+  {
+    return static_cast<int64_t>(std::exponential_distribution<double>(
+      1.0 / spec->stall_every_ms)(rng) * 1000) + 1;
+  }
+};
+
+class FaultProxyHandler : public IClientHandler
+{
+  public:
+    explicit FaultProxyHandler(const FaultOptions& opts) : opts(opts), rng(opts.seed)
+    {
+      const std::string& server = opts.server;
+      const size_t colon = server.rfind(':');
+      addrinfo hints{};
+      hints.ai_socktype = SOCK_STREAM;
+      if(colon == std::string::npos || getaddrinfo(server.substr(0, colon).c_str(),
+        server.substr(colon + 1).c_str(), &hints, &server_address) != 0)
+      {
+        throw std::invalid_argument("server \"" + server + "\" is not a reachable host:port");
+      }
+      wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if(wake_fd < 0)
+      {
+        throw std::runtime_error("eventfd failed");
+      }
+      worker = std::thread(&FaultProxyHandler::loop, this);
+    }
+
+    ~FaultProxyHandler()
+    {
+      stopping = true;
+      wake();
+      worker.join();
+      close(wake_fd);
+      freeaddrinfo(server_address);
+    }
+
+    void on_client_connect(ConnectionHandle conn) override
+    {
+      const int fd = socket(server_address->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if(fd < 0 || connect(fd, server_address->ai_addr, server_address->ai_addrlen) < 0)
+      {
+        perror("fault_proxy: connect to server");
+        if(fd >= 0)
+        {
+          close(fd);
+        }
+        ConnectionTable::global().shutdown(conn);
+        return;
+      }
+      // Non-blocking from here: the loop never waits on one socket.
+      set_nonblocking(fd);
+
+      auto session = std::make_shared<Session>();
+      session->conn = conn;
+      session->server_fd = fd;
+      session->up.spec = &opts.up;
+      session->down.spec = &opts.down;
+      {
+        std::lock_guard<std::mutex> lk(mutex);
+        if(opts.reset > 0 && std::bernoulli_distribution(opts.reset)(rng))
+        {
+          session->reset_at_us = now_us() + static_cast<int64_t>(
+            std::uniform_real_distribution<double>(0, opts.reset_after_ms * 1000)(rng));
+        }
+        sessions[conn] = session;
+      }
+      ++connections;
+      wake();
+    }
+
+    void on_client_data(ConnectionHandle conn, const char* data, ssize_t len) override
+    {
+      {
+        std::lock_guard<std::mutex> lk(mutex);
+        auto it = sessions.find(conn);
+        if(it == sessions.end() || len <= 0)
+        {
+          return;
+        }
+        Session& session = *it->second;
+        if(session.overrun)
+        {
+          return;
+        }
+        if(session.up.queued_bytes + len > UP_QUEUE_LIMIT)
+        {
+          session.overrun = true;
+          ++overruns;
+          ConnectionTable::global().reset(conn);
+          return;
+        }
+        session.up.push(data, len, now_us(), rng);
+      }
+      wake();
+    }
+
+    void on_client_disconnect(ConnectionHandle conn) override
+    {
+      {
+        std::lock_guard<std::mutex> lk(mutex);
+        auto it = sessions.find(conn);
+        if(it != sessions.end())
+        {
+          it->second->client_gone = true;
+        }
+      }
+      wake();
+    }
+
+    void print_stats() const
+    {
+      std::cout << "connections " << connections << ", bytes up " << bytes_up
+                << ", down " << bytes_down << ", resets " << resets
+                << ", overruns " << overruns << "\n";
+    }
+
+  private:
+    struct Session
+    {
+      ConnectionHandle conn;
+      int server_fd = -1;
+      FaultPath up;                   // client -> server
+      FaultPath down;                 // server -> client
+      int64_t reset_at_us = 0;        // 0: never
+      bool client_gone = false;
+      bool server_write_closed = false;
+      bool overrun = false;           // client disconnected, ignore its data
+
+      ~Session() { close(server_fd); }
+    };
+
+    const FaultOptions opts;
+    addrinfo* server_address = nullptr;
+    // Guards the sessions and their paths; the RNG too.
+    std::mutex mutex;
+    std::mt19937_64 rng;
+    std::unordered_map<ConnectionHandle, std::shared_ptr<Session>> sessions;
+    int wake_fd = -1;
+    std::atomic<bool> stopping{false};
+    std::atomic<uint64_t> connections{0}, bytes_up{0}, bytes_down{0}, resets{0},
+      overruns{0};
+    std::thread worker;
+
+    static void set_nonblocking(int fd)
+    {
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    }
+
+    void wake()
+    {
+      const uint64_t one = 1;
+      if(write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+      {
+        perror("fault_proxy: eventfd write");
+      }
+    }
+
+    // Delivers what is due on both paths; returns false once the session
+    // is over. Called with `mutex` held.
+    bool service(Session& s, int64_t now, int64_t& wake_us, bool& want_write)
+    {
+      if(s.overrun || (s.reset_at_us != 0 && now >= s.reset_at_us))
+      {
+        // RST both ways: the server sees its client reset, the client its
+        // server. The reactor closes the client side.
+        const linger abort{1, 0};
+        setsockopt(s.server_fd, SOL_SOCKET, SO_LINGER, &abort, sizeof(abort));
+        ConnectionTable::global().reset(s.conn);
+        resets += !s.overrun;
+        return false;
+      }
+      if(s.reset_at_us != 0)
+      {
+        wake_us = std::min(wake_us, s.reset_at_us);
+      }
+
+      // Up: to the server, never blocking.
+      while(size_t n = s.up.ready(now, wake_us, rng))
+      {
+        const ssize_t sent = ::send(s.server_fd, s.up.queue.front().data.data() + s.up.offset,
+          n, MSG_NOSIGNAL);
+        if(sent < 0)
+        {
+          if(errno == EAGAIN || errno == EWOULDBLOCK)
+          {
+            want_write = true;
+            break;
+          }
+          ConnectionTable::global().shutdown(s.conn);
+          return false;
+        }
+        s.up.consumed(sent);
+        bytes_up += sent;
+      }
+
+      if(s.client_gone)
+      {
+        s.down.queue.clear();         // nobody to deliver it to
+        s.down.queued_bytes = 0;
+        s.down.offset = 0;
+        // Everything the client sent is out: pass its FIN on, then wait
+        // for the server to close its side.
+        if(s.up.queue.empty() && !s.server_write_closed)
+        {
+          shutdown(s.server_fd, SHUT_WR);
+          s.server_write_closed = true;
+        }
+        return !s.down.source_closed;
+      }
+
+      // Down: to the client, never blocking either. The client's fd
+      // belongs to the server, so a full socket is retried after 1 ms.
+      while(size_t n = s.down.ready(now, wake_us, rng))
+      {
+        const ssize_t sent = ConnectionTable::global().send(s.conn,
+          s.down.queue.front().data.data() + s.down.offset, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if(sent < 0)
+        {
+          if(errno == EAGAIN || errno == EWOULDBLOCK)
+          {
+            wake_us = std::min(wake_us, now + 1000);
+            break;
+          }
+          return false;
+        }
+        s.down.consumed(sent);
+        bytes_down += sent;
+      }
+      if(s.down.source_closed && s.down.queue.empty())
+      {
+        ConnectionTable::global().shutdown(s.conn);
+        return false;
+      }
+      return true;
+    }
+
+    void loop()
+    {
+      std::vector<pollfd> fds;
+      std::vector<std::shared_ptr<Session>> polled;
+      char buffer[READ_CHUNK];
+      while(!stopping)
+      {
+        fds.assign(1, pollfd{wake_fd, POLLIN, 0});
+        polled.clear();
+        int64_t wake_us = INT64_MAX;
+        {
+          std::lock_guard<std::mutex> lk(mutex);
+          const int64_t now = now_us();
+          for(auto it = sessions.begin(); it != sessions.end();)
+          {
+            Session& s = *it->second;
+            bool want_write = false;
+            if(!service(s, now, wake_us, want_write))
+            {
+              it = sessions.erase(it);
+              continue;
+            }
+            // Read the server only while the client keeps up.
+            short events = want_write ? POLLOUT : 0;
+            if(!s.down.source_closed && s.down.queued_bytes < QUEUE_LIMIT)
+            {
+              events |= POLLIN;
+            }
+            if(events != 0)
+            {
+              fds.push_back(pollfd{s.server_fd, events, 0});
+              polled.push_back(it->second);
+            }
+            ++it;
+          }
+        }
+
+        int timeout_ms = -1;
+        if(wake_us != INT64_MAX)
+        {
+          timeout_ms = static_cast<int>(std::max<int64_t>(0, (wake_us - now_us() + 999) / 1000));
+        }
+        if(poll(fds.data(), fds.size(), timeout_ms) < 0 && errno != EINTR)
+        {
+          perror("fault_proxy: poll");
+          return;
+        }
+        if(fds[0].revents & POLLIN)
+        {
+          uint64_t count;
+          if(read(wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+          {
+            perror("fault_proxy: eventfd read");
+          }
+        }
+
+        std::lock_guard<std::mutex> lk(mutex);
+        const int64_t now = now_us();
+        for(size_t i = 1; i < fds.size(); ++i)
+        {
+          Session& s = *polled[i - 1];
+          if(!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)) || s.down.source_closed)
+          {
+            continue;
+          }
+          const ssize_t n = read(s.server_fd, buffer, sizeof(buffer));
+          if(n > 0)
+          {
+            if(!s.client_gone)
+            {
+              s.down.push(buffer, n, now, rng);
+            }
+          }
+          else if(n == 0 || (errno != EAGAIN && errno != EINTR))
+          {
+            s.down.source_closed = true;
+          }
+        }
+      }
+    }
+};
+
+static TcpServer* running_server = nullptr;
+
+static void on_stop_signal(int)
+{
+  if(running_server)
+  {
+    running_server->stop();
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  try
+  {
+    const FaultOptions opts = parse_options(argc, argv);
+    auto handler = std::make_shared<FaultProxyHandler>(opts);
+    TcpServer server(opts.port, handler);
+    running_server = &server;
+
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction sa = {};
+    sa.sa_handler = on_stop_signal;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+
+    server.run();
+    running_server = nullptr;
+    handler->print_stats();
+  }
+  catch(const std::exception& e)
+  {
+    std::cerr << e.what() << "\n";
+    return EXIT_FAILURE;
+  }
+  return 0;
+}
@@ -0,0 +1,125 @@
+#include "handler_harness.h"
+
+#include <cerrno>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+HandlerHarness::HandlerHarness(std::shared_ptr<IClientHandler> handler) :
+  tcp_server(handler), scratch(64 * 1024)
+{
+}
+
+HandlerHarness::~HandlerHarness()
+{
+  for(const auto fd : peers)
+  {
+    if(fd >= 0)
+    {
+      close(fd);
+    }
+  }
+}
+
+size_t HandlerHarness::connect_client()
+{
+  int sv[2];
+  if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+  {
+    throw std::runtime_error("socketpair failed");
+  }
+
+  // Only the client side is non-blocking: the handlers use blocking send()
+  // on the server side exactly as they do on a TCP socket.
+  fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL, 0) | O_NONBLOCK);
+
+  peers.push_back(sv[0]);
+  tcp_server.add_client(sv[1]);
+  return peers.size() - 1;
+}
+
+void HandlerHarness::disconnect_client(size_t client)
+{
+  int& fd = peers.at(client);
+  if(fd >= 0)
+  {
+    // Unread data would turn the close into a reset, and the server
+    // would report it as a socket error.
+    discard(client);
+    close(fd);
+    fd = -1;
+  }
+}
+
+void HandlerHarness::send(size_t client, const std::string& data)
+{
+  send(client, data.data(), data.size());
+}
+
+void HandlerHarness::send(size_t client, const char* data, size_t len)
+{
+  const int fd = peers.at(client);
+  size_t done = 0;
+  while(done < len)
+  {
+    auto nb = ::send(fd, data + done, len - done, MSG_NOSIGNAL);
+    if(nb < 0)
+    {
+      // The server side is full: let the loop consume some of it.
+      if((errno != EAGAIN && errno != EWOULDBLOCK) || step() < 0)
+      {
+        throw std::runtime_error("harness send failed");
+      }
+      continue;
+    }
+    done += nb;
+  }
+}
+
+std::string HandlerHarness::receive(size_t client)
+{
+  std::string out;
+  const int fd = peers.at(client);
+  while(fd >= 0)
+  {
+    auto nb = recv(fd, scratch.data(), scratch.size(), 0);
+    if(nb <= 0)
+    {
+      break;
+    }
+    out.append(scratch.data(), nb);
+  }
+  return out;
+}
+
+size_t HandlerHarness::discard(size_t client)
+{
+  size_t total = 0;
+  const int fd = peers.at(client);
+  while(fd >= 0)
+  {
+    auto nb = recv(fd, scratch.data(), scratch.size(), 0);
+    if(nb <= 0)
+    {
+      break;
+    }
+    total += nb;
+  }
+  return total;
+}
+
+int HandlerHarness::step()
+{
+  return tcp_server.poll_once(0);
+}
+
+size_t HandlerHarness::run_until_idle()
+{
+  size_t steps = 0;
+  while(step() > 0)
+  {
+    ++steps;
+  }
+  return steps;
+}
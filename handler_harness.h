@@ -0,0 +1,60 @@
+#ifndef HANDLER_HARNESS_H
+#define HANDLER_HARNESS_H
+
+#include "tcp_server.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+/* In-process harness for IClientHandler implementations.
+ * Every "client" is one end of an AF_UNIX socketpair(); the other end is
+ * handed to a detached TcpServer, so the handler runs through the same poll
+ * loop as in production but without TCP, ports or a second process.
+ *
+ * Scheduling is deterministic: nothing runs until step()/run_until_idle() is
+ * called, and those poll with a zero timeout on the calling thread. Data
+ * written with send() is readable on the other end before send() returns,
+ * so "write, run_until_idle, read" always observes the handler's complete
+ * reaction to the write.
+*/
+
+class HandlerHarness
+{
+  public:
+    explicit HandlerHarness(std::shared_ptr<IClientHandler> handler);
+    ~HandlerHarness();
+
+    HandlerHarness(const HandlerHarness&) = delete;
+    HandlerHarness& operator=(const HandlerHarness&) = delete;
+
+    // Creates a client; returns its index. The handler sees on_client_connect
+    // immediately.
+    size_t connect_client();
+    // Drops what the client has not read and closes its side; the handler
+    // sees the disconnect on the next step.
+    void disconnect_client(size_t client);
+
+    void send(size_t client, const std::string& data);
+    void send(size_t client, const char* data, size_t len);
+
+    // Reads whatever the server has sent to the client so far.
+    std::string receive(size_t client);
+    // Same as receive() but only counts the bytes; cheaper in benchmarks.
+    size_t discard(size_t client);
+
+    // One loop iteration; returns the number of ready fds.
+    int step();
+    // Steps until a poll finds nothing to do; returns the number of steps.
+    size_t run_until_idle();
+
+    size_t client_count() const { return peers.size(); }
+    TcpServer& server() { return tcp_server; }
+
+  private:
+    TcpServer tcp_server;
+    std::vector<int> peers;             // client side fds, -1 once closed
+    std::vector<char> scratch;
+};
+
+#endif
@@ -0,0 +1,99 @@
+#include "hash_ring.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace
+{
+  const std::string NO_OWNER;
+}
+
+HashRing::HashRing(unsigned vnodes) : vnodes(std::max(vnodes, 1u))
+{
+}
+
+void HashRing::add(const std::string& node)
+{
+  if(contains(node))
+  {
+    return;
+  }
+
+  const uint32_t index = nodes.size();
+  nodes.push_back(node);
+  for(unsigned i = 0; i < vnodes; ++i)
+  {
+    points.push_back({hash(node + "#" + std::to_string(i)), index});
+  }
+  sort_points();
+}
+
+void HashRing::remove(const std::string& node)
+{
+  auto it = std::find(nodes.begin(), nodes.end(), node);
+  if(it == nodes.end())
+  {
+    return;
+  }
+
+  const uint32_t index = it - nodes.begin();
+  nodes.erase(it);
+  points.erase(std::remove_if(points.begin(), points.end(),
+    [index](const Point& point) { return point.node == index; }), points.end());
+  for(auto& point : points)
+  {
+    if(point.node > index)
+    {
+      --point.node;
+    }
+  }
+}
+
+bool HashRing::contains(const std::string& node) const
+{
+  return std::find(nodes.begin(), nodes.end(), node) != nodes.end();
+}
+
+const std::string& HashRing::owner(const std::string& key) const
+{
+  if(points.empty())
+  {
+    return NO_OWNER;
+  }
+
+  const uint64_t h = hash(key);
+  auto it = std::lower_bound(points.begin(), points.end(), h,
+    [](const Point& point, uint64_t value) { return point.hash < value; });
+  if(it == points.end())
+  {
+    it = points.begin();
+  }
+  return nodes[it->node];
+}
+
+uint64_t HashRing::hash(const std::string& key)
+{
+  // FNV-1a
+  uint64_t h = 14695981039346656037ull;
+  for(unsigned char c : key)
+  {
+    h ^= c;
+    h *= 1099511628211ull;
+  }
+  // MurmurHash3 fmix64: FNV alone clusters similar keys ("room1", "room2").
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+void HashRing::sort_points()
+{
+  // Ties (practically never) go by name, so every process agrees.
+  std::sort(points.begin(), points.end(), [this](const Point& a, const Point& b) {
+    return a.hash != b.hash ? a.hash < b.hash : nodes[a.node] < nodes[b.node];
+  });
+}
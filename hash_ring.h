@@ -0,0 +1,59 @@
+#ifndef HASH_RING_H
+#define HASH_RING_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/* Consistent hash ring.
+ * Every node is hashed onto a 64-bit circle at `vnodes` points (virtual
+ * nodes); a key belongs to the node of the first point at or after the
+ * key's own hash, wrapping around at the end:
+ *
+ *        key
+ *         |
+ *   --A---+----B-----A--C------B---C---A---->  (wraps)
+ *              ^ owner of key
+ *
+ * Adding a node only moves the keys that fall just before its points, about
+ * 1/N of them, all to the new node; removing one moves only its own keys,
+ * spread over the others. With one point per node the shares would be very
+ * uneven; with 128 they stay within a few percent of 1/N.
+ *
+ * The hash is FNV-1a with a 64-bit finalizer, not std::hash, because every
+ * process must place keys the same way whatever standard library it was
+ * built with.
+*/
+class HashRing
+{
+  public:
+    static const unsigned DEFAULT_VNODES = 128;
+
+    explicit HashRing(unsigned vnodes = DEFAULT_VNODES);
+
+    // No-ops if the node is already in / not in the ring.
+    void add(const std::string& node);
+    void remove(const std::string& node);
+    bool contains(const std::string& node) const;
+    size_t size() const { return nodes.size(); }
+
+    // The node owning `key`; an empty string if the ring is empty.
+    const std::string& owner(const std::string& key) const;
+
+    static uint64_t hash(const std::string& key);
+
+  private:
+    struct Point
+    {
+      uint64_t hash;
+      uint32_t node;                  // index into `nodes`
+    };
+
+    unsigned vnodes;
+    std::vector<std::string> nodes;
+    std::vector<Point> points;        // sorted by hash, then node name
+
+    void sort_points();
+};
+
+#endif
@@ -0,0 +1,258 @@
+#include "history_retention.h"
+
+#include "chat_history.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace
+{
+  // <linux/ioprio.h> is not always installed; the ABI values are stable.
+  const int IOPRIO_CLASS_IDLE = 3;
+  const int IOPRIO_CLASS_SHIFT = 13;
+  const int IOPRIO_WHO_PROCESS = 1;
+
+  void lower_own_priority()
+  {
+    // who = 0 means the calling thread for both calls on Linux.
+    if(syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+      IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) < 0)
+    {
+      perror("ioprio_set");
+    }
+    if(setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), 19) < 0)
+    {
+      perror("setpriority");
+    }
+  }
+
+  uint64_t remove_files(const std::vector<std::string>& files)
+  {
+    uint64_t removed = 0;
+    for(const auto& file : files)
+    {
+      struct stat st;
+      if(stat(file.c_str(), &st) == 0)
+      {
+        removed += st.st_size;
+      }
+      unlink(file.c_str());
+    }
+    return removed;
+  }
+
+  time_t modified(const std::string& path)
+  {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? st.st_mtime : 0;
+  }
+
+  struct Candidate
+  {
+    std::shared_ptr<RoomHistory> room;
+    uint64_t last_seq;
+    time_t mtime;
+  };
+}
+
+RetentionPolicy RetentionPolicy::defaults()
+{
+  RetentionPolicy policy;
+  policy.max_age_sec = 7 * 24 * 3600;
+  policy.max_total_bytes = uint64_t(1) << 30;
+  return policy;
+}
+
+std::string RetentionPolicy::describe() const
+{
+  if(!enabled())
+  {
+    return "off";
+  }
+  std::string rules;
+  auto add = [&rules](const std::string& rule)
+  {
+    rules += (rules.empty() ? "" : ", ") + rule;
+  };
+  if(max_age_sec)
+  {
+    add("max age " + std::to_string(max_age_sec) + " s");
+  }
+  if(max_total_bytes)
+  {
+    add("max " + std::to_string(max_total_bytes) + " bytes in total");
+  }
+  if(keep_last)
+  {
+    add("last " + std::to_string(keep_last) + " messages per room");
+  }
+  return rules;
+}
+
+HistoryRetention::HistoryRetention(HistoryStore& store, RetentionPolicy policy) :
+  store(store), policy(policy)
+{
+  worker = std::thread(&HistoryRetention::loop, this);
+}
+
+HistoryRetention::~HistoryRetention()
+{
+  {
+    std::lock_guard<std::mutex> lk(stop_mutex);
+    stopping = true;
+  }
+  stop_cv.notify_one();
+  worker.join();
+}
+
+void HistoryRetention::loop()
+{
+  if(policy.idle_io)
+  {
+    lower_own_priority();
+  }
+
+  std::unique_lock<std::mutex> lk(stop_mutex);
+  while(!stop_cv.wait_for(lk, std::chrono::milliseconds(policy.interval_ms),
+    [this] { return stopping; }))
+  {
+    lk.unlock();
+    run_once();
+    lk.lock();
+  }
+}
+
+uint64_t HistoryRetention::run_once()
+{
+  const time_t now = time(nullptr);
+  uint64_t removed = 0;
+  uint64_t total = 0;
+  std::vector<Candidate> candidates;
+
+  for(const std::shared_ptr<RoomHistory>& room : store.all_rooms())
+  {
+    std::vector<ChatLog::SegmentInfo> segments;
+    uint64_t last;
+    {
+      RoomHistory::ReadLock lk(*room);
+      if(room->chat_log() == nullptr)
+      {
+        continue;
+      }
+      segments = room->chat_log()->sealed_segments();
+      last = room->last_seq();
+    }
+
+    // Everything with last_seq <= drop_seq goes; it only ever grows.
+    uint64_t drop_seq = 0;
+    const ChatLog::SegmentInfo* straddling = nullptr;
+    uint64_t cutoff = 0;
+    if(policy.keep_last && last > policy.keep_last)
+    {
+      cutoff = last - policy.keep_last;
+      for(const auto& segment : segments)
+      {
+        if(segment.last_seq <= cutoff)
+        {
+          drop_seq = segment.last_seq;
+        }
+        else
+        {
+          straddling = segment.first_seq <= cutoff ? &segment : nullptr;
+          break;
+        }
+      }
+    }
+    if(policy.max_age_sec)
+    {
+      for(const auto& segment : segments)
+      {
+        if(segment.last_seq <= drop_seq)
+        {
+          continue;
+        }
+        if(modified(segment.path) + static_cast<time_t>(policy.max_age_sec) > now)
+        {
+          break;
+        }
+        drop_seq = segment.last_seq;
+        straddling = nullptr;
+      }
+    }
+
+    if(drop_seq)
+    {
+      std::vector<std::string> files;
+      {
+        std::lock_guard<std::mutex> lk(room->log_mutex());
+        files = room->chat_log()->drop_through(drop_seq);
+      }
+      removed += remove_files(files);
+    }
+
+    // Compaction: the copy is written without the lock, only the swap
+    // takes it.
+    if(straddling && ChatLog::write_compacted(straddling->path, cutoff))
+    {
+      const std::string compact = ChatLog::compact_path(straddling->path);
+      struct stat st;
+      const uint64_t after = stat(compact.c_str(), &st) == 0 ? st.st_size : 0;
+      bool replaced;
+      {
+        std::lock_guard<std::mutex> lk(room->log_mutex());
+        replaced = room->chat_log()->replace_oldest(compact);
+      }
+      if(replaced)
+      {
+        removed += straddling->bytes - std::min(straddling->bytes, after);
+      }
+      else
+      {
+        unlink(compact.c_str());
+      }
+    }
+
+    {
+      std::lock_guard<std::mutex> lk(room->log_mutex());
+      total += room->chat_log()->total_bytes();
+      segments = room->chat_log()->sealed_segments();
+    }
+    for(const auto& segment : segments)
+    {
+      candidates.push_back({room, segment.last_seq, modified(segment.path)});
+    }
+  }
+
+  if(policy.max_total_bytes && total > policy.max_total_bytes)
+  {
+    // Oldest first across all rooms. Dropping through a segment also drops
+    // the older ones of its room, which are older still.
+    std::stable_sort(candidates.begin(), candidates.end(),
+      [](const Candidate& a, const Candidate& b) { return a.mtime < b.mtime; });
+    for(const auto& candidate : candidates)
+    {
+      if(total <= policy.max_total_bytes)
+      {
+        break;
+      }
+      std::vector<std::string> files;
+      {
+        std::lock_guard<std::mutex> lk(candidate.room->log_mutex());
+        files = candidate.room->chat_log()->drop_through(candidate.last_seq);
+      }
+      const uint64_t freed = remove_files(files);
+      removed += freed;
+      total -= std::min(total, freed);
+    }
+  }
+  return removed;
+}
@@ -0,0 +1,77 @@
+#ifndef HISTORY_RETENTION_H
+#define HISTORY_RETENTION_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+class HistoryStore;
+
+/* Bounded chat history.
+ * A background thread walks the room logs of a HistoryStore every
+ * interval_ms and removes old history, one sealed segment at a time:
+ *
+  | Rule             | Drops                                              |
+  | ---------------- | -------------------------------------------------- |
+  | keep_last        | messages older than a room's newest keep_last      |
+  | max_age_sec      | segments last written more than max_age_sec ago    |
+  | max_total_bytes  | oldest segments of any room until the store fits   |
+ *
+ * keep_last is compaction: segments entirely older than the cutoff go away,
+ * and the segment the cutoff falls into is rewritten without its older
+ * records. Age and size only ever drop whole segments. Active segments
+ * are never touched, so the newest history of every room survives any
+ * limit.
+ *
+ * The thread stays off the chat path. Reading and writing segment data
+ * happens without the room's log lock; it is only taken to list segments
+ * and to swap them, which is a vector edit and, for compaction, an unlink
+ * and a rename. The thread also lowers its own priority: idle I/O class
+ * (ioprio_set) and nice 19. Its disk traffic then only uses bandwidth the
+ * chat log appends leave unused.
+*/
+
+struct RetentionPolicy
+{
+  uint64_t max_age_sec = 0;           // 0: keep forever
+  uint64_t max_total_bytes = 0;       // 0: no size limit
+  uint64_t keep_last = 0;             // 0: no compaction
+  unsigned interval_ms = 30000;
+  bool idle_io = true;                // idle I/O class and nice 19
+
+  bool enabled() const { return max_age_sec || max_total_bytes || keep_last; }
+
+  // "off", or the rules in force; logged at startup.
+  std::string describe() const;
+
+  // A week, 1 GiB, no compaction.
+  static RetentionPolicy defaults();
+};
+
+class HistoryRetention
+{
+  public:
+    HistoryRetention(HistoryStore& store, RetentionPolicy policy);
+    // Stops and joins the thread.
+    ~HistoryRetention();
+
+    HistoryRetention(const HistoryRetention&) = delete;
+    HistoryRetention& operator=(const HistoryRetention&) = delete;
+
+    // One pass on the calling thread; returns the bytes removed.
+    uint64_t run_once();
+
+  private:
+    HistoryStore& store;
+    const RetentionPolicy policy;
+    std::mutex stop_mutex;
+    std::condition_variable stop_cv;
+    bool stopping = false;
+    std::thread worker;
+
+    void loop();
+};
+
+#endif
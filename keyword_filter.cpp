@@ -0,0 +1,371 @@
+#include "keyword_filter.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <queue>
+#include <stdexcept>
+
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KEYWORD_FILTER_X86 1
+#endif
+
+using namespace std;
+
+namespace
+{
+  unsigned char fold(unsigned char c)
+  {
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+  }
+
+#ifdef KEYWORD_FILTER_X86
+  // First position >= from where all `m` rows keep a common bucket bit, or
+  // where the 16-wide steps stopped fitting into the text.
+  __attribute__((target("ssse3")))
+  size_t teddy_ssse3(const uint8_t low[][16], const uint8_t high[][16], size_t m,
+    const char* text, size_t len, size_t from)
+  {
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i lo[3];
+    __m128i hi[3];
+    for(size_t k = 0; k < m; ++k)
+    {
+      lo[k] = _mm_load_si128(reinterpret_cast<const __m128i*>(low[k]));
+      hi[k] = _mm_load_si128(reinterpret_cast<const __m128i*>(high[k]));
+    }
+
+    size_t i = from;
+    for(; i + 16 + m - 1 <= len; i += 16)
+    {
+      // Row k looks at byte k of a word starting at each of the 16
+      // positions, so loading at i + k lines the rows up without shifts.
+      __m128i acc = _mm_set1_epi8(-1);
+      for(size_t k = 0; k < m; ++k)
+      {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i + k));
+        const __m128i l = _mm_shuffle_epi8(lo[k], _mm_and_si128(v, nibble));
+        const __m128i h = _mm_shuffle_epi8(hi[k], _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+        acc = _mm_and_si128(acc, _mm_and_si128(l, h));
+      }
+      const unsigned candidates = ~_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) & 0xffff;
+      if(candidates != 0)
+      {
+        return i + __builtin_ctz(candidates);
+      }
+    }
+    return i;
+  }
+#endif
+}
+
+KeywordFilter::KeywordFilter(const std::vector<std::string>& words)
+{
+  std::vector<std::string> used;
+  for(const std::string& word : words)
+  {
+    if(!word.empty())
+    {
+      used.push_back(word);
+    }
+  }
+  word_count = used.size();
+  if(used.empty())
+  {
+    return;
+  }
+  build_automaton(used);
+  build_prefilter(used);
+}
+
+std::unique_ptr<KeywordFilter> KeywordFilter::load(const std::string& path)
+{
+  std::ifstream in(path);
+  if(!in)
+  {
+    throw std::runtime_error("keyword list: can not read " + path);
+  }
+  std::vector<std::string> words;
+  std::string line;
+  while(std::getline(in, line))
+  {
+    const size_t end = line.find_last_not_of(" \t\r");
+    if(end == std::string::npos || line[0] == '#')
+    {
+      continue;
+    }
+    words.push_back(line.substr(0, end + 1));
+  }
+  if(in.bad())
+  {
+    throw std::runtime_error("keyword list: error reading " + path);
+  }
+  return std::make_unique<KeywordFilter>(words);
+}
+
+void KeywordFilter::build_automaton(const std::vector<std::string>& words)
+{
+  // One class per distinct byte of the words, upper case sharing the
+  // class of lower case; class 0 is every byte no word contains.
+  for(const std::string& word : words)
+  {
+    for(char c : word)
+    {
+      uint8_t& cls = classes[fold(static_cast<unsigned char>(c))];
+      if(cls == 0)
+      {
+        if(class_count == 256)
+        {
+          throw std::length_error("keyword list: too many distinct bytes");
+        }
+        cls = static_cast<uint8_t>(class_count++);
+      }
+    }
+  }
+  for(int b = 'A'; b <= 'Z'; ++b)
+  {
+    classes[b] = classes[fold(static_cast<unsigned char>(b))];
+  }
+
+  // The trie; edge 0 means "none", as nothing points back at the root.
+  const size_t width = class_count;
+  std::vector<uint32_t> next(width, 0);
+  std::vector<char> terminal(1, 0);
+  for(const std::string& word : words)
+  {
+    uint32_t state = 0;
+    for(char c : word)
+    {
+      const size_t edge = state * width + classes[static_cast<unsigned char>(c)];
+      if(next[edge] == 0)
+      {
+        next[edge] = static_cast<uint32_t>(terminal.size());
+        terminal.push_back(0);
+        next.resize(terminal.size() * width, 0);
+      }
+      state = next[edge];
+    }
+    terminal[state] = 1;
+  }
+  if(next.size() >= MATCH)
+  {
+    throw std::length_error("keyword list: automaton too large");
+  }
+
+  // Breadth first, so a state's failure state is complete before it is:
+  // missing edges become the failure state's edges, and a state matches if
+  // its failure state does (a word ends inside it).
+  std::vector<uint32_t> fail(terminal.size(), 0);
+  std::queue<uint32_t> pending;
+  for(size_t cls = 0; cls < width; ++cls)
+  {
+    if(next[cls] != 0)
+    {
+      pending.push(next[cls]);
+    }
+  }
+  while(!pending.empty())
+  {
+    const uint32_t state = pending.front();
+    pending.pop();
+    terminal[state] |= terminal[fail[state]];
+    for(size_t cls = 0; cls < width; ++cls)
+    {
+      uint32_t& edge = next[state * width + cls];
+      const uint32_t fallback = next[fail[state] * width + cls];
+      if(edge != 0)
+      {
+        fail[edge] = fallback;
+        pending.push(edge);
+      }
+      else
+      {
+        edge = fallback;
+      }
+    }
+  }
+
+  // Store offsets instead of state numbers: a step is one add and one load.
+  delta.resize(next.size());
+  for(size_t i = 0; i < next.size(); ++i)
+  {
+    delta[i] = static_cast<uint32_t>(next[i] * width) | (terminal[next[i]] ? MATCH : 0);
+  }
+}
+
+void KeywordFilter::build_prefilter(const std::vector<std::string>& words)
+{
+#ifdef KEYWORD_FILTER_X86
+  if(words.size() > PREFILTER_MAX_WORDS || !__builtin_cpu_supports("ssse3"))
+  {
+    return;
+  }
+
+  prefix_len = MAX_PREFIX;
+  for(const std::string& word : words)
+  {
+    prefix_len = std::min(prefix_len, word.size());
+  }
+
+  // Words with similar prefixes share a bucket, so a bucket's nibble sets
+  // stay small.
+  std::vector<std::string> prefixes;
+  for(const std::string& word : words)
+  {
+    std::string prefix = word.substr(0, prefix_len);
+    std::transform(prefix.begin(), prefix.end(), prefix.begin(),
+      [](char c) { return static_cast<char>(fold(static_cast<unsigned char>(c))); });
+    prefixes.push_back(std::move(prefix));
+  }
+  std::sort(prefixes.begin(), prefixes.end());
+
+  for(size_t i = 0; i < prefixes.size(); ++i)
+  {
+    const uint8_t bit = static_cast<uint8_t>(1u << (i * BUCKETS / prefixes.size()));
+    for(size_t k = 0; k < prefix_len; ++k)
+    {
+      const unsigned char c = prefixes[i][k];
+      low_nibbles[k][c & 0x0f] |= bit;
+      high_nibbles[k][c >> 4] |= bit;
+      if(c >= 'a' && c <= 'z')
+      {
+        high_nibbles[k][(c - ('a' - 'A')) >> 4] |= bit;
+      }
+    }
+  }
+  prefilter = true;
+#else
+  (void)words;
+#endif
+}
+
+size_t KeywordFilter::next_candidate(const char* text, size_t len, size_t from) const
+{
+  size_t i = from;
+#ifdef KEYWORD_FILTER_X86
+  i = teddy_ssse3(low_nibbles, high_nibbles, prefix_len, text, len, from);
+#endif
+  // The tail, and a candidate the vector loop stopped at, byte by byte.
+  for(; i + prefix_len <= len; ++i)
+  {
+    uint8_t buckets = 0xff;
+    for(size_t k = 0; k < prefix_len; ++k)
+    {
+      const unsigned char c = text[i + k];
+      buckets &= low_nibbles[k][c & 0x0f] & high_nibbles[k][c >> 4];
+    }
+    if(buckets != 0)
+    {
+      return i;
+    }
+  }
+  return len;
+}
+
+bool KeywordFilter::matches(const char* text, size_t len) const
+{
+  if(delta.empty())
+  {
+    return false;
+  }
+
+  const uint32_t* table = delta.data();
+  uint32_t state = 0;
+  if(!prefilter)
+  {
+    for(size_t i = 0; i < len; ++i)
+    {
+      state = table[state + classes[static_cast<unsigned char>(text[i])]];
+      if(state & MATCH)
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Back at the root no word is in progress, so the prefilter can skip
+  // ahead to the next place one might start.
+  size_t i = 0;
+  while(i < len)
+  {
+    if(state == 0)
+    {
+      i = next_candidate(text, len, i);
+      if(i >= len)
+      {
+        return false;
+      }
+    }
+    state = table[state + classes[static_cast<unsigned char>(text[i])]];
+    if(state & MATCH)
+    {
+      return true;
+    }
+    ++i;
+  }
+  return false;
+}
+
+KeywordListWatcher::KeywordListWatcher(std::string path, unsigned interval_ms,
+  PublishFn publish) :
+  path(std::move(path)), interval_ms(interval_ms), publish(std::move(publish))
+{
+  changed();
+  this->publish(KeywordFilter::load(this->path));
+  worker = std::thread(&KeywordListWatcher::loop, this);
+}
+
+KeywordListWatcher::~KeywordListWatcher()
+{
+  {
+    std::lock_guard<std::mutex> lk(stop_mutex);
+    stopping = true;
+  }
+  stop_cv.notify_one();
+  if(worker.joinable())
+  {
+    worker.join();
+  }
+}
+
+bool KeywordListWatcher::changed()
+{
+  struct stat st;
+  if(stat(path.c_str(), &st) != 0)
+  {
+    return false;                     // gone for now: keep the last list
+  }
+  const bool differs = st.st_mtim.tv_sec != mtime.tv_sec
+    || st.st_mtim.tv_nsec != mtime.tv_nsec || st.st_size != size;
+  mtime = st.st_mtim;
+  size = st.st_size;
+  return differs;
+}
+
+void KeywordListWatcher::loop()
+{
+  std::unique_lock<std::mutex> lk(stop_mutex);
+  while(!stop_cv.wait_for(lk, std::chrono::milliseconds(interval_ms),
+    [this] { return stopping; }))
+  {
+    lk.unlock();
+    if(changed())
+    {
+      try
+      {
+        publish(KeywordFilter::load(path));
+      }
+      catch(const std::exception& e)
+      {
+        std::cerr << "moderation: " << e.what() << ", keeping the previous list\n";
+      }
+    }
+    lk.lock();
+  }
+}
@@ -0,0 +1,107 @@
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "keyword_filter.h"
+
+/* Differential check of KeywordFilter.
+ * Builds a filter from a random word list, matches a random line against
+ * it and compares the answer with a plain case-folded substring search,
+ * for many cases. Words and lines are drawn from a small alphabet, so
+ * overlapping words, shared prefixes and partial matches are common:
+ *
+  | Bytes        | Why                                                    |
+  | ------------ | ------------------------------------------------------ |
+  | a b A B      | the same letters in both cases                         |
+  | x y Z c      | more letters, so not every position is a candidate     |
+  | ' ' '.'      | punctuation, including the separator of chat words     |
+  | 0x80         | a byte outside ASCII, never case folded                |
+ *
+ * Word lists of 1-40 words exercise both the prefilter (up to
+ * KeywordFilter::PREFILTER_MAX_WORDS words) and the bare automaton.
+ *
+ * usage: keyword_filter_check [cases] [seed]    (default 200000, 7)
+ * Prints the first mismatches; exit code 1 if there were any.
+*/
+
+using namespace std;
+
+namespace
+{
+  const char ALPHABET[] = "abAB c.xyZ\x80";
+  const size_t ALPHABET_SIZE = sizeof(ALPHABET) - 1;
+  const int MAX_REPORTED = 5;
+
+  std::string fold(std::string text)
+  {
+    for(char& c : text)
+    {
+      if(c >= 'A' && c <= 'Z')
+      {
+        c += 'a' - 'A';
+      }
+    }
+    return text;
+  }
+
+  std::string random_text(std::mt19937& rng, size_t len)
+  {
+    std::string text(len, ' ');
+    for(char& c : text)
+    {
+      c = ALPHABET[rng() % ALPHABET_SIZE];
+    }
+    return text;
+  }
+
+  bool naive_matches(const std::vector<std::string>& words, const std::string& line)
+  {
+    const std::string folded = fold(line);
+    for(const std::string& word : words)
+    {
+      if(folded.find(fold(word)) != std::string::npos)
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  const unsigned long cases = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 200000;
+  const unsigned long seed = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 7;
+
+  std::mt19937 rng(seed);
+  unsigned long mismatches = 0;
+  for(unsigned long i = 0; i < cases; ++i)
+  {
+    std::vector<std::string> words(1 + rng() % 40);
+    for(std::string& word : words)
+    {
+      word = random_text(rng, 1 + rng() % 5);
+    }
+    const std::string line = random_text(rng, rng() % 80);
+
+    const KeywordFilter filter(words);
+    const bool expected = naive_matches(words, line);
+    if(filter.matches(line) == expected)
+    {
+      continue;
+    }
+    if(++mismatches <= MAX_REPORTED)
+    {
+      std::cout << "mismatch in case " << i << ": words";
+      for(const std::string& word : words)
+      {
+        std::cout << " [" << word << "]";
+      }
+      std::cout << ", line [" << line << "], expected " << expected << "\n";
+    }
+  }
+  std::cout << cases << " cases, " << mismatches << " mismatches\n";
+  return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
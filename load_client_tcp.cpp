@@ -0,0 +1,402 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "workload_profile.h"
+
+/* Load generator.
+ * client_tcp.cpp opens one connection and sends one fixed string. This client
+ * opens many non-blocking connections and drives them from a single poll()
+ * loop according to a WorkloadProfile --
+ * 1. message sizes drawn from a distribution (tiny chat lines + rare big ones)
+ * 2. think time between two messages of the same connection
+ * 3. Zipf-skewed activity: connection k thinks 1/weight(k) times longer than
+ *    the average, so a few connections produce most of the traffic.
+ *
+  | Option             | Default        | Meaning                                  |
+  | ------------------ | -------------- | ---------------------------------------- |
+  | `--host`           | 127.0.0.1      | Server address                           |
+  | `--port`           | 9000           | Server port                              |
+  | `--connections`    | 1              | Number of concurrent connections         |
+  | `--duration`       | 10             | Seconds to run                           |
+  | `--messages`       | 0 (unlimited)  | Stop after this many messages in total   |
+  | `--size`           | fixed:21       | Message size distribution (bytes)        |
+  | `--think`          | none           | Think time distribution (milliseconds)   |
+  | `--zipf`           | 0              | Activity skew exponent                   |
+  | `--echo`           | off            | Wait for the echo, measure latency       |
+  | `--seed`           | 1              | RNG seed, runs are reproducible          |
+ *
+ * Every message is a line ending in '\n' so it also works against the chat
+ * handlers. Without --echo the client does not wait for replies; whatever the
+ * server sends back (broadcasts) is read and counted.
+ *
+ * The last line of output is "RESULT key=value ..." for scripts.
+*/
+
+using namespace std;
+using Clock = std::chrono::steady_clock;
+
+struct LoadOptions
+{
+  std::string host = "127.0.0.1";
+  int port = 9000;
+  size_t connections = 1;
+  double duration_sec = 10;
+  uint64_t max_messages = 0;
+  bool echo = false;
+  uint64_t seed = 1;
+  WorkloadProfile profile = WorkloadProfile::defaults();
+};
+
+struct LoadConnection
+{
+  int fd = -1;
+  double activity = 1.0;              // think time is divided by this
+  Clock::time_point next_send;
+  std::string out;                    // unsent part of the current message
+  size_t out_offset = 0;
+  uint64_t bytes_sent = 0;
+  uint64_t bytes_received = 0;
+  // echo mode: stream offset at which the pending reply is complete.
+  std::deque<std::pair<uint64_t, Clock::time_point>> pending;
+};
+
+struct LoadStats
+{
+  uint64_t messages = 0;
+  uint64_t bytes_sent = 0;
+  uint64_t bytes_received = 0;
+  uint64_t errors = 0;
+  std::vector<uint32_t> latency_us;
+};
+
+static void usage()
+{
+  std::cerr << "usage: load_client_tcp [--host H] [--port P] [--connections N]"
+               " [--duration S] [--messages M] [--size SPEC] [--think SPEC]"
+               " [--zipf S] [--echo] [--seed N]\n";
+}
+
+static LoadOptions parse_options(int argc, char* argv[])
+{
+  LoadOptions opts;
+  for(int i = 1; i < argc; ++i)
+  {
+    const std::string arg = argv[i];
+    auto value = [&]() -> std::string {
+      if(i + 1 >= argc)
+      {
+        throw std::invalid_argument(arg + " needs a value");
+      }
+      return argv[++i];
+    };
+
+    if(arg == "--host") opts.host = value();
+    else if(arg == "--port") opts.port = std::stoi(value());
+    else if(arg == "--connections") opts.connections = std::stoul(value());
+    else if(arg == "--duration") opts.duration_sec = std::stod(value());
+    else if(arg == "--messages") opts.max_messages = std::stoull(value());
+    else if(arg == "--size") opts.profile.message_size = parse_distribution(value());
+    else if(arg == "--think") opts.profile.think_time_ms = parse_distribution(value());
+    else if(arg == "--zipf") opts.profile.zipf_s = std::stod(value());
+    else if(arg == "--echo") opts.echo = true;
+    else if(arg == "--seed") opts.seed = std::stoull(value());
+    else throw std::invalid_argument("unknown option " + arg);
+  }
+
+  if(opts.connections == 0)
+  {
+    throw std::invalid_argument("--connections must be at least 1");
+  }
+  return opts;
+}
+
+static int connect_nonblocking(const sockaddr_in& address)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if(fd < 0)
+  {
+    return -1;
+  }
+
+  // Connect blocking (simpler error handling), then switch to non-blocking.
+  if(connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0)
+  {
+    close(fd);
+    return -1;
+  }
+
+  // Small messages are the common case; don't let Nagle batch them.
+  int yes = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  return fd;
+}
+
+// Builds one chat line of exactly `size` bytes (at least one: the '\n').
+static void make_message(std::string& out, size_t size, uint64_t seq)
+{
+  static const std::string filler =
+    "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 ";
+
+  size = std::max<size_t>(size, 1);
+  out.clear();
+  out.reserve(size);
+  out += "m" + std::to_string(seq) + " ";
+  while(out.size() < size - 1)
+  {
+    out.append(filler, 0, std::min(filler.size(), size - 1 - out.size()));
+  }
+  out.resize(size - 1);
+  out += '\n';
+}
+
+static Clock::time_point next_send_time(
+  const LoadOptions& opts, const LoadConnection& conn, std::mt19937_64& rng)
+{
+  const double think_ms = opts.profile.think_time_ms->sample(rng) / conn.activity;
+  return Clock::now() + std::chrono::microseconds(
+    static_cast<int64_t>(think_ms * 1000));
+}
+
+static uint32_t percentile(const std::vector<uint32_t>& sorted, double p)
+{
+  if(sorted.empty())
+  {
+    return 0;
+  }
+  size_t idx = static_cast<size_t>(p * (sorted.size() - 1));
+  return sorted[idx];
+}
+
+int main(int argc, char* argv[])
+{
+  LoadOptions opts;
+  try
+  {
+    opts = parse_options(argc, argv);
+  }
+  catch(const std::exception& e)
+  {
+    std::cerr << e.what() << "\n";
+    usage();
+    return EXIT_FAILURE;
+  }
+
+  std::cout << "workload: " << opts.profile.describe() << "\n";
+
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(opts.port);
+  if(inet_pton(AF_INET, opts.host.c_str(), &address.sin_addr) <= 0)
+  {
+    std::cerr << "Invalid address / Address not supported\n";
+    return EXIT_FAILURE;
+  }
+
+  std::mt19937_64 rng(opts.seed);
+  ZipfSampler zipf(opts.connections, opts.profile.zipf_s);
+
+  // step 1: open all connections.
+  std::vector<LoadConnection> conns(opts.connections);
+  for(size_t i = 0; i < conns.size(); ++i)
+  {
+    conns[i].fd = connect_nonblocking(address);
+    if(conns[i].fd < 0)
+    {
+      perror("connect");
+      return EXIT_FAILURE;
+    }
+    // Normalised so the average activity is 1 whatever the skew.
+    conns[i].activity = zipf.weight(i) * conns.size();
+    conns[i].next_send = next_send_time(opts, conns[i], rng);
+  }
+  std::cout << "connected " << conns.size() << " clients\n";
+
+  // step 2: drive them until the time or message budget runs out.
+  LoadStats stats;
+  std::vector<pollfd> fds(conns.size());
+  std::vector<char> buffer(64 * 1024);
+  const auto start = Clock::now();
+  const auto deadline = start + std::chrono::microseconds(
+    static_cast<int64_t>(opts.duration_sec * 1e6));
+  uint64_t seq = 0;
+
+  while(Clock::now() < deadline)
+  {
+    const auto now = Clock::now();
+    auto wake_at = deadline;
+    const bool budget_left =
+      opts.max_messages == 0 || stats.messages < opts.max_messages;
+
+    for(size_t i = 0; i < conns.size(); ++i)
+    {
+      auto& conn = conns[i];
+      const bool idle = conn.out_offset == conn.out.size() &&
+        (!opts.echo || conn.pending.empty());
+
+      if(idle && budget_left && conn.fd >= 0)
+      {
+        if(conn.next_send <= now)
+        {
+          make_message(conn.out, opts.profile.sample_size(rng), seq++);
+          conn.out_offset = 0;
+          ++stats.messages;
+          if(opts.echo)
+          {
+            conn.pending.emplace_back(conn.bytes_sent + conn.out.size(), now);
+          }
+        }
+        else
+        {
+          wake_at = std::min(wake_at, conn.next_send);
+        }
+      }
+
+      fds[i].fd = conn.fd;
+      fds[i].events = POLLIN;
+      if(conn.out_offset < conn.out.size())
+      {
+        fds[i].events |= POLLOUT;
+      }
+      fds[i].revents = 0;
+    }
+
+    if(!budget_left && std::all_of(conns.begin(), conns.end(),
+        [](const LoadConnection& c) { return c.pending.empty() &&
+          c.out_offset == c.out.size(); }))
+    {
+      break;
+    }
+
+    const auto wait_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+      wake_at - Clock::now()).count();
+    if(poll(fds.data(), fds.size(), static_cast<int>(std::max<int64_t>(wait_ms, 0))) < 0)
+    {
+      if(errno == EINTR)
+      {
+        continue;
+      }
+      perror("poll");
+      break;
+    }
+
+    for(size_t i = 0; i < conns.size(); ++i)
+    {
+      auto& conn = conns[i];
+      const short revents = fds[i].revents;
+      if(conn.fd < 0 || revents == 0)
+      {
+        continue;
+      }
+
+      if(revents & (POLLERR | POLLHUP | POLLNVAL))
+      {
+        ++stats.errors;
+        close(conn.fd);
+        conn.fd = -1;
+        conn.out_offset = conn.out.size();
+        conn.pending.clear();
+        continue;
+      }
+
+      if(revents & POLLOUT)
+      {
+        auto nb = send(conn.fd, conn.out.data() + conn.out_offset,
+          conn.out.size() - conn.out_offset, MSG_NOSIGNAL);
+        if(nb > 0)
+        {
+          conn.out_offset += nb;
+          conn.bytes_sent += nb;
+          stats.bytes_sent += nb;
+          if(conn.out_offset == conn.out.size() && !opts.echo)
+          {
+            conn.next_send = next_send_time(opts, conn, rng);
+          }
+        }
+      }
+
+      if(revents & POLLIN)
+      {
+        auto nb = recv(conn.fd, buffer.data(), buffer.size(), 0);
+        if(nb <= 0)
+        {
+          ++stats.errors;
+          close(conn.fd);
+          conn.fd = -1;
+          conn.out_offset = conn.out.size();
+          conn.pending.clear();
+          continue;
+        }
+
+        conn.bytes_received += nb;
+        stats.bytes_received += nb;
+
+        // A reply is complete once the received stream reaches the offset
+        // at which its request ended (the echo preserves byte order).
+        const auto now_rx = Clock::now();
+        while(!conn.pending.empty() &&
+          conn.bytes_received >= conn.pending.front().first)
+        {
+          auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+            now_rx - conn.pending.front().second).count();
+          stats.latency_us.push_back(static_cast<uint32_t>(us));
+          conn.pending.pop_front();
+          conn.next_send = next_send_time(opts, conn, rng);
+        }
+      }
+    }
+  }
+
+  const double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+  // step 3: close sockets and report.
+  for(auto& conn : conns)
+  {
+    if(conn.fd >= 0)
+    {
+      close(conn.fd);
+    }
+  }
+
+  std::sort(stats.latency_us.begin(), stats.latency_us.end());
+  const double msgs_per_sec = stats.messages / elapsed;
+  const double mb_per_sec = stats.bytes_sent / elapsed / (1024 * 1024);
+
+  std::cout << "messages sent: " << stats.messages
+            << " (" << msgs_per_sec << " msg/s, " << mb_per_sec << " MiB/s)\n";
+  std::cout << "bytes sent: " << stats.bytes_sent
+            << ", bytes received: " << stats.bytes_received
+            << ", errors: " << stats.errors << "\n";
+  if(opts.echo)
+  {
+    std::cout << "echo latency us: p50 " << percentile(stats.latency_us, 0.50)
+              << " p99 " << percentile(stats.latency_us, 0.99)
+              << " max " << percentile(stats.latency_us, 1.0) << "\n";
+  }
+
+  std::cout << "RESULT elapsed_sec=" << elapsed
+            << " messages=" << stats.messages
+            << " msgs_per_sec=" << msgs_per_sec
+            << " bytes_sent=" << stats.bytes_sent
+            << " bytes_received=" << stats.bytes_received
+            << " errors=" << stats.errors
+            << " p50_us=" << percentile(stats.latency_us, 0.50)
+            << " p99_us=" << percentile(stats.latency_us, 0.99) << endl;
+
+  return stats.errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
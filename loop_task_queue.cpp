@@ -0,0 +1,60 @@
+#include "loop_task_queue.h"
+
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+using namespace std;
+
+LoopTaskQueue::LoopTaskQueue()
+{
+  event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(event_fd < 0)
+  {
+    throw std::runtime_error("eventfd failed");
+  }
+}
+
+LoopTaskQueue::~LoopTaskQueue()
+{
+  close(event_fd);
+}
+
+void LoopTaskQueue::post(Task task)
+{
+  tasks.push(std::move(task));
+  ++posted_count;
+
+  // seq_cst against the clear in run_pending(): either the loop clears the
+  // flag after our push (and its drain sees the task) or we see it clear
+  // and write.
+  if(!wakeup_pending.exchange(true, std::memory_order_seq_cst))
+  {
+    ++wakeup_count;
+    wake();
+  }
+}
+
+void LoopTaskQueue::wake()
+{
+  const uint64_t one = 1;
+  auto nb = write(event_fd, &one, sizeof(one));
+  (void)nb;
+}
+
+size_t LoopTaskQueue::run_pending()
+{
+  uint64_t count;
+  auto nb = read(event_fd, &count, sizeof(count));
+  (void)nb;
+  wakeup_pending.store(false, std::memory_order_seq_cst);
+
+  size_t ran = 0;
+  Task task;
+  while(tasks.try_pop(task))
+  {
+    task();
+    ++ran;
+  }
+  return ran;
+}
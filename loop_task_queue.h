@@ -0,0 +1,67 @@
+#ifndef LOOP_TASK_QUEUE_H
+#define LOOP_TASK_QUEUE_H
+
+#include "mpsc_mailbox.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+/* Cross-thread task posting into an event loop.
+ * Any thread may post() a task; the loop thread runs it. The queue owns an
+ * eventfd that the loop registers in its poll/epoll set next to the sockets,
+ * so a post wakes a loop blocked in poll()/epoll_wait() without signals or
+ * timeouts.
+ *
+ *   any thread                      loop thread
+ *   ----------                      -----------
+ *   post(task)                      fd() readable
+ *     push onto MPSC queue            run_pending():
+ *     first post since last drain?      clear wakeup flag, read eventfd
+ *       write(eventfd, 1)               pop and run tasks until empty
+ *
+ * Batching: only the post that finds the wakeup flag clear writes the
+ * eventfd; everything posted until the loop drains rides on that one
+ * wakeup. A burst of N posts costs one write(), one loop wakeup and one
+ * read() instead of N of each.
+ *
+ * Tasks run on the loop thread in posting order per producer. A task runs
+ * outside any handler callback, so it may touch the loop's own state (add
+ * clients, look at connections) exactly like the loop itself.
+*/
+
+class LoopTaskQueue
+{
+  public:
+    using Task = std::function<void()>;
+
+    LoopTaskQueue();
+    ~LoopTaskQueue();
+
+    LoopTaskQueue(const LoopTaskQueue&) = delete;
+    LoopTaskQueue& operator=(const LoopTaskQueue&) = delete;
+
+    // Register for POLLIN / EPOLLIN.
+    int fd() const { return event_fd; }
+
+    // Any thread.
+    void post(Task task);
+    // Wakes the loop without a task. Async-signal-safe.
+    void wake();
+
+    // Loop thread only. Runs everything posted so far; returns the count.
+    size_t run_pending();
+
+    uint64_t posted() const { return posted_count; }
+    uint64_t wakeups() const { return wakeup_count; }
+
+  private:
+    int event_fd;
+    MpscMailbox<Task> tasks;
+    std::atomic<bool> wakeup_pending{false};
+    std::atomic<uint64_t> posted_count{0};
+    std::atomic<uint64_t> wakeup_count{0};
+};
+
+#endif
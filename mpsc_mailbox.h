@@ -0,0 +1,151 @@
+#ifndef MPSC_MAILBOX_H
+#define MPSC_MAILBOX_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <utility>
+
+/* Multi-producer single-consumer mailbox.
+ * Any thread may push(); exactly one thread (the owner) pops. This is the
+ * intrusive queue by D. Vyukov: a push is one atomic exchange plus one store,
+ * no locks and no CAS loop, so producers never wait for each other or for
+ * the consumer.
+ *
+ *   head --> [newest] ... [oldest] <-- tail (a consumed dummy node)
+ *
+ * A producer that exchanged `head` but has not linked `next` yet makes the
+ * queue look empty for a moment; the consumer just sees the message a little
+ * later, when that producer's notify arrives.
+ *
+ * The consumer blocks on a condition variable when the mailbox is empty. The
+ * mutex is only touched when the consumer actually sleeps, never on the
+ * message path while it is busy.
+*/
+
+template <typename T>
+class MpscMailbox
+{
+  public:
+    MpscMailbox() : head(new Node), tail(head.load())
+    {
+    }
+
+    ~MpscMailbox()
+    {
+      T discard;
+      while(try_pop(discard))
+      {
+      }
+      delete tail;
+    }
+
+    MpscMailbox(const MpscMailbox&) = delete;
+    MpscMailbox& operator=(const MpscMailbox&) = delete;
+
+    void push(T value)
+    {
+      Node* node = new Node(std::move(value));
+      Node* prev = head.exchange(node, std::memory_order_acq_rel);
+      // seq_cst pairs with the consumer's seq_cst `sleeping` store / empty()
+      // load: either it sees this node or we see it sleeping.
+      prev->next.store(node, std::memory_order_seq_cst);
+
+      if(sleeping.load(std::memory_order_seq_cst))
+      {
+        std::lock_guard<std::mutex> lk(sleep_mutex);
+        wakeup.notify_one();
+      }
+    }
+
+    // Consumer only.
+    bool try_pop(T& out)
+    {
+      Node* next = tail->next.load(std::memory_order_acquire);
+      if(next == nullptr)
+      {
+        return false;
+      }
+      out = std::move(next->value);
+      delete tail;
+      tail = next;
+      return true;
+    }
+
+    // Consumer only. Blocks until a message arrives; false once closed and
+    // drained.
+    bool wait_pop(T& out)
+    {
+      while(true)
+      {
+        if(try_pop(out))
+        {
+          return true;
+        }
+
+        std::unique_lock<std::mutex> lk(sleep_mutex);
+        sleeping.store(true, std::memory_order_seq_cst);
+        wakeup.wait(lk, [this] { return !empty() || closed; });
+        sleeping.store(false, std::memory_order_relaxed);
+        if(empty() && closed)
+        {
+          return false;
+        }
+      }
+    }
+
+    // Consumer only. Like wait_pop(), but also gives up after `timeout`;
+    // closed() tells the two cases apart.
+    template <typename Rep, typename Period>
+    bool wait_pop_for(T& out, std::chrono::duration<Rep, Period> timeout)
+    {
+      if(try_pop(out))
+      {
+        return true;
+      }
+
+      std::unique_lock<std::mutex> lk(sleep_mutex);
+      sleeping.store(true, std::memory_order_seq_cst);
+      wakeup.wait_for(lk, timeout, [this] { return !empty() || closed; });
+      sleeping.store(false, std::memory_order_relaxed);
+      return try_pop(out);
+    }
+
+    bool is_closed()
+    {
+      std::lock_guard<std::mutex> lk(sleep_mutex);
+      return closed;
+    }
+
+    // Wakes the consumer for good; wait_pop() returns false once drained.
+    void close()
+    {
+      std::lock_guard<std::mutex> lk(sleep_mutex);
+      closed = true;
+      wakeup.notify_one();
+    }
+
+  private:
+    struct Node
+    {
+      Node() : next(nullptr), value() {}
+      explicit Node(T v) : next(nullptr), value(std::move(v)) {}
+      std::atomic<Node*> next;
+      T value;
+    };
+
+    bool empty() const
+    {
+      return tail->next.load(std::memory_order_seq_cst) == nullptr;
+    }
+
+    std::atomic<Node*> head;
+    Node* tail;
+    std::atomic<bool> sleeping{false};
+    bool closed = false;
+    std::mutex sleep_mutex;
+    std::condition_variable wakeup;
+};
+
+#endif
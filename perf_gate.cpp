@@ -0,0 +1,686 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <cmath>
+#include <ctime>
+#include <cerrno>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Performance regression gate.
+ * Runs a fixed benchmark suite against every server binary, stores the raw
+ * samples together with a fingerprint of the machine, and compares them with
+ * a stored baseline.
+ *
+  | Benchmark          | Driver                         | Metric                | Better |
+  | ------------------ | ------------------------------ | --------------------- | ------ |
+  | echo_throughput    | load_client_tcp --echo         | messages / second     | higher |
+  | broadcast_fanout   | chat_simulator                 | delivered copies / s  | higher |
+  | connection_rate    | connect()+close() in a loop    | connections / second  | higher |
+  | idle_memory        | 500 idle connections, VmRSS    | KiB per connection    | lower  |
+ *
+ * Every benchmark runs --runs times against a freshly started server (on a
+ * fresh port, so TIME_WAIT never gets in the way). A metric regresses when
+ * both hold --
+ * 1. the one-sided Mann-Whitney U test says the new samples are worse than
+ *    the baseline samples with p < --alpha (exact distribution, so it is
+ *    valid for the small sample counts used here), and
+ * 2. the medians moved by more than --threshold in the bad direction,
+ *    which keeps statistically real but irrelevant shifts from failing.
+ *
+ * With n runs on each side the smallest p the exact test can produce is
+ * 1/C(2n,n), so --runs is refused unless that is below --alpha (at least 5
+ * runs for the default 0.01); fewer runs could never fail the gate.
+ *
+ * Baselines recorded on a different machine are still compared, but only
+ * reported: a different fingerprint never fails the gate.
+ *
+ * perf_gate --server ./poll_tcp_server --server ./select_tcp_server
+ * perf_gate --update-baseline     (accept the current numbers)
+ *
+ * Exit code: 0 = no regression, 1 = regression, 2 = could not run.
+*/
+
+using namespace std;
+using Clock = std::chrono::steady_clock;
+
+struct GateOptions
+{
+  std::vector<std::string> servers;
+  std::string load_client;
+  std::string simulator;
+  std::string baseline_dir = "perf_baselines";
+  std::string results_dir = "perf_results";
+  int runs = 5;
+  int base_port = 19000;
+  double alpha = 0.01;
+  double threshold = 0.05;
+  bool update_baseline = false;
+};
+
+struct Metric
+{
+  std::string name;
+  std::string unit;
+  bool higher_is_better = true;
+  std::vector<double> samples;
+};
+
+struct SuiteResult
+{
+  std::string server;
+  std::string fingerprint;
+  std::string timestamp;
+  std::vector<Metric> metrics;
+};
+
+static int next_port = 0;
+
+static std::string dirname_of(const std::string& path)
+{
+  const auto slash = path.rfind('/');
+  return slash == std::string::npos ? "." : path.substr(0, slash);
+}
+
+static std::string basename_of(const std::string& path)
+{
+  const auto slash = path.rfind('/');
+  return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+static std::string read_first_match(const std::string& path, const std::string& key)
+{
+  std::ifstream in(path);
+  std::string line;
+  while(std::getline(in, line))
+  {
+    if(line.compare(0, key.size(), key) == 0)
+    {
+      auto colon = line.find(':');
+      auto value = colon == std::string::npos ? line : line.substr(colon + 1);
+      value.erase(0, value.find_first_not_of(" \t"));
+      return value;
+    }
+  }
+  return "unknown";
+}
+
+// Everything that makes numbers from two machines incomparable.
+static std::string machine_fingerprint()
+{
+  utsname un{};
+  uname(&un);
+  std::string fp = "cpu=" + read_first_match("/proc/cpuinfo", "model name");
+  fp += ";cores=" + std::to_string(std::thread::hardware_concurrency());
+  fp += ";mem=" + read_first_match("/proc/meminfo", "MemTotal");
+  fp += ";kernel=" + std::string(un.release);
+  fp += ";arch=" + std::string(un.machine);
+  std::replace(fp.begin(), fp.end(), ' ', '_');
+  return fp;
+}
+
+static std::string timestamp_now()
+{
+  char buf[32];
+  const std::time_t t = std::time(nullptr);
+  std::strftime(buf, sizeof(buf), "%Y%m%dT%H%M%S", std::gmtime(&t));
+  return buf;
+}
+
+static int connect_local(int port)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if(fd >= 0 && connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0)
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Starts a child with stdout/stderr discarded or captured into `out_fd`.
+static pid_t spawn(const std::vector<std::string>& argv, int* out_fd)
+{
+  int pipefd[2] = {-1, -1};
+  if(out_fd && pipe(pipefd) < 0)
+  {
+    return -1;
+  }
+
+  pid_t pid = fork();
+  if(pid == 0)
+  {
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(out_fd ? pipefd[1] : devnull, STDOUT_FILENO);
+    dup2(devnull, STDERR_FILENO);
+    if(out_fd)
+    {
+      close(pipefd[0]);
+    }
+
+    std::vector<char*> args;
+    for(const auto& a : argv)
+    {
+      args.push_back(const_cast<char*>(a.c_str()));
+    }
+    args.push_back(nullptr);
+    execv(args[0], args.data());
+    _exit(127);
+  }
+
+  if(out_fd)
+  {
+    close(pipefd[1]);
+    *out_fd = pipefd[0];
+  }
+  return pid;
+}
+
+// Runs a driver to completion and returns the key=value pairs of its RESULT line.
+static std::map<std::string, double> run_driver(const std::vector<std::string>& argv)
+{
+  int out_fd = -1;
+  const pid_t pid = spawn(argv, &out_fd);
+  if(pid < 0)
+  {
+    throw std::runtime_error("cannot start " + argv[0]);
+  }
+
+  std::string output;
+  char buf[4096];
+  ssize_t nb;
+  while((nb = read(out_fd, buf, sizeof(buf))) > 0)
+  {
+    output.append(buf, nb);
+  }
+  close(out_fd);
+  int status = 0;
+  waitpid(pid, &status, 0);
+
+  std::map<std::string, double> result;
+  const auto pos = output.rfind("RESULT ");
+  if(pos == std::string::npos)
+  {
+    throw std::runtime_error(argv[0] + " produced no RESULT line");
+  }
+  std::istringstream fields(output.substr(pos + 7));
+  std::string field;
+  while(fields >> field)
+  {
+    const auto eq = field.find('=');
+    if(eq != std::string::npos)
+    {
+      result[field.substr(0, eq)] = std::stod(field.substr(eq + 1));
+    }
+  }
+  if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+  {
+    throw std::runtime_error(argv[0] + " reported a failed run");
+  }
+  return result;
+}
+
+class ServerProcess
+{
+  public:
+    ServerProcess(const std::string& binary, const std::string& mode) :
+      port(next_port++)
+    {
+      pid = spawn({binary, mode, std::to_string(port)}, nullptr);
+      for(int i = 0; i < 300; ++i)
+      {
+        int fd = connect_local(port);
+        if(fd >= 0)
+        {
+          close(fd);
+          // Let the server process that probe connection before measuring.
+          std::this_thread::sleep_for(std::chrono::milliseconds(50));
+          return;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+      // The destructor does not run for a throwing constructor.
+      stop();
+      throw std::runtime_error(binary + " did not start listening");
+    }
+
+    ~ServerProcess()
+    {
+      stop();
+    }
+
+    long rss_kib() const
+    {
+      const auto value = read_first_match(
+        "/proc/" + std::to_string(pid) + "/status", "VmRSS");
+      return std::atol(value.c_str());
+    }
+
+    pid_t pid = -1;
+    const int port;
+
+  private:
+    void stop()
+    {
+      if(pid > 0)
+      {
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+        pid = -1;
+      }
+    }
+};
+
+static double bench_echo(const GateOptions& opts, const std::string& server)
+{
+  ServerProcess proc(server, "echo");
+  auto r = run_driver({opts.load_client, "--port", std::to_string(proc.port),
+    "--connections", "16", "--duration", "3", "--echo",
+    "--size", "lognormal:48:1.0:4096"});
+  return r.at("msgs_per_sec");
+}
+
+static double bench_fanout(const GateOptions& opts, const std::string& server)
+{
+  ServerProcess proc(server, "chat");
+  const double duration = 3;
+  auto r = run_driver({opts.simulator, "--port", std::to_string(proc.port),
+    "--users", "64", "--threads", "2", "--duration", std::to_string(duration),
+    "--think", "exponential:50", "--settle-ms", "200", "--drain-ms", "500"});
+  return r.at("delivered") / duration;
+}
+
+static double bench_connect(const GateOptions&, const std::string& server)
+{
+  ServerProcess proc(server, "echo");
+  const auto start = Clock::now();
+  const auto until = start + std::chrono::seconds(2);
+  uint64_t count = 0;
+  while(Clock::now() < until)
+  {
+    int fd = connect_local(proc.port);
+    if(fd < 0)
+    {
+      throw std::runtime_error("connect failed during connection_rate");
+    }
+    // RST instead of FIN so the client side leaves no TIME_WAIT behind.
+    linger lg{1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    close(fd);
+    ++count;
+  }
+  return count / std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static double bench_idle_memory(const GateOptions&, const std::string& server)
+{
+  const int idle = 500;
+  ServerProcess proc(server, "chat");
+  const long before = proc.rss_kib();
+
+  std::vector<int> fds;
+  for(int i = 0; i < idle; ++i)
+  {
+    int fd = connect_local(proc.port);
+    if(fd < 0)
+    {
+      throw std::runtime_error("connect failed during idle_memory");
+    }
+    fds.push_back(fd);
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  const long after = proc.rss_kib();
+  for(const int fd : fds)
+  {
+    close(fd);
+  }
+  return static_cast<double>(after - before) / idle;
+}
+
+static SuiteResult run_suite(const GateOptions& opts, const std::string& server)
+{
+  struct Bench
+  {
+    const char* name;
+    const char* unit;
+    bool higher_is_better;
+    double (*run)(const GateOptions&, const std::string&);
+  };
+  static const Bench suite[] = {
+    {"echo_throughput", "msgs_per_sec", true, bench_echo},
+    {"broadcast_fanout", "deliveries_per_sec", true, bench_fanout},
+    {"connection_rate", "conns_per_sec", true, bench_connect},
+    {"idle_memory", "kib_per_conn", false, bench_idle_memory},
+  };
+
+  SuiteResult result;
+  result.server = basename_of(server);
+  result.fingerprint = machine_fingerprint();
+  result.timestamp = timestamp_now();
+  for(const auto& bench : suite)
+  {
+    Metric metric{bench.name, bench.unit, bench.higher_is_better, {}};
+    for(int run = 0; run < opts.runs; ++run)
+    {
+      metric.samples.push_back(bench.run(opts, server));
+      std::cout << "  " << result.server << " " << bench.name << " run "
+                << run + 1 << "/" << opts.runs << ": "
+                << metric.samples.back() << " " << bench.unit << "\n";
+    }
+    result.metrics.push_back(metric);
+  }
+  return result;
+}
+
+static void save(const SuiteResult& result, const std::string& path)
+{
+  std::ofstream out(path);
+  out << "# perf_gate results, one metric per line: "
+         "name unit higher|lower samples...\n";
+  out << "server " << result.server << "\n";
+  out << "timestamp " << result.timestamp << "\n";
+  out << "fingerprint " << result.fingerprint << "\n";
+  out.precision(10);
+  for(const auto& m : result.metrics)
+  {
+    out << "metric " << m.name << " " << m.unit << " "
+        << (m.higher_is_better ? "higher" : "lower");
+    for(const double s : m.samples)
+    {
+      out << " " << s;
+    }
+    out << "\n";
+  }
+}
+
+static bool load(const std::string& path, SuiteResult& result)
+{
+  std::ifstream in(path);
+  if(!in)
+  {
+    return false;
+  }
+
+  std::string line;
+  while(std::getline(in, line))
+  {
+    std::istringstream fields(line);
+    std::string kind;
+    fields >> kind;
+    if(kind == "server") fields >> result.server;
+    else if(kind == "timestamp") fields >> result.timestamp;
+    else if(kind == "fingerprint") fields >> result.fingerprint;
+    else if(kind == "metric")
+    {
+      Metric m;
+      std::string better;
+      fields >> m.name >> m.unit >> better;
+      m.higher_is_better = better == "higher";
+      double s;
+      while(fields >> s)
+      {
+        m.samples.push_back(s);
+      }
+      result.metrics.push_back(m);
+    }
+  }
+  return true;
+}
+
+static double median(std::vector<double> v)
+{
+  std::sort(v.begin(), v.end());
+  const size_t n = v.size();
+  return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+// 1 / C(2n, n): the p-value of the most extreme outcome with n vs n samples.
+static double smallest_p(int n)
+{
+  double p = 1;
+  for(int i = 1; i <= n; ++i)
+  {
+    p *= static_cast<double>(i) / (n + i);
+  }
+  return p;
+}
+
+/* One-sided Mann-Whitney U test: p-value for "b tends to be larger than a".
+ * For the sample sizes used here the exact null distribution of U is cheap to
+ * count (number of ways to reach each U with m of the n+m ranks), so no normal
+ * approximation is needed. Ties get half credit.
+*/
+static double mann_whitney_greater(const std::vector<double>& a,
+  const std::vector<double>& b)
+{
+  const size_t n = a.size(), m = b.size();
+  double u = 0;
+  for(const double y : b)
+  {
+    for(const double x : a)
+    {
+      u += y > x ? 1.0 : (y == x ? 0.5 : 0.0);
+    }
+  }
+
+  // ways[i][j][k]: arrangements of i a's and j b's with U = k.
+  const size_t max_u = n * m;
+  std::vector<std::vector<std::vector<double>>> ways(n + 1,
+    std::vector<std::vector<double>>(m + 1, std::vector<double>(max_u + 1, 0)));
+  for(size_t i = 0; i <= n; ++i)
+  {
+    for(size_t j = 0; j <= m; ++j)
+    {
+      if(i == 0 || j == 0)
+      {
+        ways[i][j][0] = 1;
+        continue;
+      }
+      for(size_t k = 0; k <= max_u; ++k)
+      {
+        // Largest element is a b (beats all i a's) or an a (beats nothing).
+        ways[i][j][k] = (k >= i ? ways[i][j - 1][k - i] : 0) + ways[i - 1][j][k];
+      }
+    }
+  }
+
+  double total = 0, tail = 0;
+  for(size_t k = 0; k <= max_u; ++k)
+  {
+    total += ways[n][m][k];
+    if(k >= std::ceil(u - 1e-9))
+    {
+      tail += ways[n][m][k];
+    }
+  }
+  return tail / total;
+}
+
+// Returns the number of regressions found.
+static int compare(const GateOptions& opts, const SuiteResult& base,
+  const SuiteResult& cur)
+{
+  const bool same_machine = base.fingerprint == cur.fingerprint;
+  if(!same_machine)
+  {
+    std::cout << "  baseline was recorded on a different machine, "
+                 "differences are reported but not enforced\n"
+              << "    baseline: " << base.fingerprint << "\n"
+              << "    current : " << cur.fingerprint << "\n";
+  }
+
+  int regressions = 0;
+  for(const auto& m : cur.metrics)
+  {
+    auto it = std::find_if(base.metrics.begin(), base.metrics.end(),
+      [&](const Metric& b) { return b.name == m.name; });
+    if(it == base.metrics.end() || it->samples.empty() || m.samples.empty())
+    {
+      std::cout << "  " << m.name << ": no baseline\n";
+      continue;
+    }
+
+    const double old_med = median(it->samples);
+    const double new_med = median(m.samples);
+    const double change = old_med != 0 ? (new_med - old_med) / std::fabs(old_med) : 0;
+    const double worse = m.higher_is_better ? -change : change;
+    // "Worse" means lower for throughput, higher for memory.
+    const double p = m.higher_is_better ?
+      mann_whitney_greater(m.samples, it->samples) :
+      mann_whitney_greater(it->samples, m.samples);
+
+    const bool regressed = p < opts.alpha && worse > opts.threshold;
+    std::cout << "  " << m.name << ": " << old_med << " -> " << new_med << " "
+              << m.unit << " (" << (change >= 0 ? "+" : "") << change * 100
+              << "%, p=" << p << ")"
+              << (regressed ? (same_machine ? "  REGRESSION" : "  regression?") : "")
+              << "\n";
+    if(regressed && same_machine)
+    {
+      ++regressions;
+    }
+  }
+  return regressions;
+}
+
+static GateOptions parse_options(int argc, char* argv[])
+{
+  GateOptions opts;
+  const std::string dir = dirname_of(argv[0]);
+  opts.load_client = dir + "/load_client_tcp";
+  opts.simulator = dir + "/chat_simulator";
+
+  for(int i = 1; i < argc; ++i)
+  {
+    const std::string arg = argv[i];
+    auto value = [&]() -> std::string {
+      if(i + 1 >= argc)
+      {
+        throw std::invalid_argument(arg + " needs a value");
+      }
+      return argv[++i];
+    };
+
+    if(arg == "--server") opts.servers.push_back(value());
+    else if(arg == "--load-client") opts.load_client = value();
+    else if(arg == "--simulator") opts.simulator = value();
+    else if(arg == "--baseline-dir") opts.baseline_dir = value();
+    else if(arg == "--results-dir") opts.results_dir = value();
+    else if(arg == "--runs") opts.runs = std::stoi(value());
+    else if(arg == "--port") opts.base_port = std::stoi(value());
+    else if(arg == "--alpha") opts.alpha = std::stod(value());
+    else if(arg == "--threshold") opts.threshold = std::stod(value());
+    else if(arg == "--update-baseline") opts.update_baseline = true;
+    else throw std::invalid_argument("unknown option " + arg);
+  }
+
+  if(opts.servers.empty())
+  {
+    opts.servers = {dir + "/poll_tcp_server", dir + "/select_tcp_server",
+      dir + "/epoll_tcp_server"};
+  }
+  if(opts.alpha <= 0 || opts.alpha >= 1)
+  {
+    throw std::invalid_argument("--alpha must be between 0 and 1");
+  }
+  // With n samples on each side the smallest p the exact test can give is
+  // 1 / C(2n, n); at or above alpha no regression could ever be found.
+  if(opts.runs < 2 || smallest_p(opts.runs) >= opts.alpha)
+  {
+    int needed = 2;
+    while(smallest_p(needed) >= opts.alpha)
+    {
+      ++needed;
+    }
+    std::ostringstream msg;
+    msg << "--runs must be at least " << needed << " for --alpha " << opts.alpha
+        << ": with fewer the smallest possible p-value, 1/C(2n,n), is not below"
+        << " alpha and the gate could never fail";
+    throw std::invalid_argument(msg.str());
+  }
+  return opts;
+}
+
+int main(int argc, char* argv[])
+{
+  GateOptions opts;
+  try
+  {
+    opts = parse_options(argc, argv);
+  }
+  catch(const std::exception& e)
+  {
+    std::cerr << e.what() << "\n";
+    return 2;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  rlimit lim{};
+  if(getrlimit(RLIMIT_NOFILE, &lim) == 0)
+  {
+    lim.rlim_cur = lim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &lim);
+  }
+  next_port = opts.base_port;
+  mkdir(opts.results_dir.c_str(), 0755);
+  mkdir(opts.baseline_dir.c_str(), 0755);
+
+  int regressions = 0;
+  for(const auto& server : opts.servers)
+  {
+    std::cout << "== " << server << "\n";
+    SuiteResult current;
+    try
+    {
+      current = run_suite(opts, server);
+    }
+    catch(const std::exception& e)
+    {
+      std::cerr << "  " << e.what() << "\n";
+      return 2;
+    }
+
+    save(current, opts.results_dir + "/" + current.timestamp + "-" +
+      current.server + ".txt");
+
+    const std::string baseline_path =
+      opts.baseline_dir + "/" + current.server + ".txt";
+    SuiteResult baseline;
+    if(opts.update_baseline)
+    {
+      save(current, baseline_path);
+      std::cout << "  baseline updated: " << baseline_path << "\n";
+    }
+    else if(!load(baseline_path, baseline))
+    {
+      std::cout << "  no baseline at " << baseline_path
+                << ", run with --update-baseline to record one\n";
+    }
+    else
+    {
+      regressions += compare(opts, baseline, current);
+    }
+  }
+
+  std::cout << (regressions ? "FAILED: " : "OK: ") << regressions
+            << " regression(s)\n";
+  return regressions ? 1 : 0;
+}
@@ -0,0 +1,64 @@
+#!/bin/sh
+# Profile guided build of the servers.
+#
+# 1. configure + build with PGO_MODE=GENERATE (instrumented binaries)
+# 2. train: run every server under the load generators with the workloads we
+#    care about (echo with a realistic size mix, chat broadcast fan-out)
+# 3. reconfigure the same build directory with PGO_MODE=USE and rebuild
+#
+# usage: ./pgo_build.sh [build-dir]     (default: build-pgo)
+
+set -eu
+
+SRC_DIR=$(cd "$(dirname "$0")" && pwd)
+BUILD_DIR=${1:-"$SRC_DIR/build-pgo"}
+PROFILE_DIR="$BUILD_DIR/pgo-profiles"
+PORT=${PGO_PORT:-19500}
+
+echo "== instrumented build"
+rm -rf "$PROFILE_DIR"
+cmake -S "$SRC_DIR" -B "$BUILD_DIR" -DCMAKE_BUILD_TYPE=Release \
+  -DPGO_MODE=GENERATE -DPGO_PROFILE_DIR="$PROFILE_DIR" >/dev/null
+cmake --build "$BUILD_DIR" -j"$(nproc)"
+CXX_ID=$(sed -n 's/^set(CMAKE_CXX_COMPILER_ID "\(.*\)")/\1/p' \
+  "$BUILD_DIR"/CMakeFiles/*/CMakeCXXCompiler.cmake | head -n 1)
+
+# run_server <binary> <echo|chat> <driver command...>
+run_server() {
+  server=$1; mode=$2; shift 2
+  PORT=$((PORT + 1))
+  "$BUILD_DIR/$server" "$mode" "$PORT" >/dev/null 2>&1 &
+  pid=$!
+  sleep 0.3
+  "$@" --port "$PORT" >/dev/null || echo "   training run reported errors"
+  # SIGTERM lets the server return from main() and write its profile.
+  kill -TERM "$pid"
+  wait "$pid" || true
+}
+
+echo "== training"
+for server in poll_tcp_server select_tcp_server epoll_tcp_server; do
+  echo "-- $server"
+  # Mostly tiny lines with the occasional large payload, skewed activity.
+  run_server "$server" echo "$BUILD_DIR/load_client_tcp" --echo \
+    --connections 32 --duration 5 --size lognormal:40:1.2:65536 --zipf 1.0
+  # Closed-loop small messages: the per-message overhead path.
+  run_server "$server" echo "$BUILD_DIR/load_client_tcp" --echo \
+    --connections 8 --duration 3 --size fixed:21
+  # Broadcast fan-out with logins, chatter and logouts.
+  run_server "$server" chat "$BUILD_DIR/chat_simulator" \
+    --users 200 --threads 2 --duration 5 --think exponential:200 \
+    --settle-ms 300 --drain-ms 500
+done
+
+case "$CXX_ID" in
+  *Clang*)
+    llvm-profdata merge -output="$PROFILE_DIR/merged.profdata" "$PROFILE_DIR"/*.profraw
+    ;;
+esac
+
+echo "== optimized build"
+cmake -S "$SRC_DIR" -B "$BUILD_DIR" -DPGO_MODE=USE \
+  -DPGO_PROFILE_DIR="$PROFILE_DIR" >/dev/null
+cmake --build "$BUILD_DIR" -j"$(nproc)"
+echo "PGO binaries are in $BUILD_DIR"
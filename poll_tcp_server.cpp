@@ -1,423 +1,155 @@
 #include <iostream>
-#include <string>
-#include <sys/socket.h>
-#include <sys/poll.h>
-#include <arpa/inet.h>
-#include <netinet/in.h>
-#include <unistd.h>
-#include <mutex>
-#include <algorithm>
+#include <memory>
+#include <cstdio>
+#include <cstdlib>
+#include <csignal>
 #include <stdexcept>
-#include <unordered_map>
-#include <unordered_set>
+#include <string>
 #include <vector>
-#include <memory>
-
-/* poll() api.
- * it is also an I/O multiplexing mechanism. but it is more scable and flexible
- * alternative to select().
- * poll lets us to monitor many FDs to see if --
- * 1. Data is ready to read.
- * 2. you can write.
- * 3. There is an error or disconnect.
-*/
-
-/* int poll(struct pollfd fds[], nfds_t nfds, int timeout);
-  | Parameter | Meaning                                                |
-  | --------- | ------------------------------------------------------ |
-  | `fds[]`   | Array of `pollfd` structs (one per socket)             |
-  | `nfds`    | Number of elements in `fds`                            |
-  | `timeout` | Milliseconds: `0` = non-blocking, `-1` = block forever |
-
-
-  struct pollfd {
-      int   fd;       // File descriptor to monitor
-      short events;   // What to monitor (POLLIN, POLLOUT, etc.)
-      short revents;  // What actually happened (set by poll)
-  };
 
-  | Flag       | Meaning               |
-  | ---------- | --------------------- |
-  | `POLLIN`   | Data to read          |
-  | `POLLOUT`  | Socket ready to write |
-  | `POLLERR`  | Error occurred        |
-  | `POLLHUP`  | Hang up (disconnect)  |
-  | `POLLNVAL` | Invalid FD            |
+#include "tcp_server.h"
+#include "chat_handlers.h"
+#include "proxy_handler.h"
+#include "server_options.h"
+#include "tls_gateway.h"
+#include "websocket_gateway.h"
+
+/* poll() based chat server.
+ * The event loop lives in tcp_server.cpp (TcpServer), the handlers in
+ * chat_handlers.cpp. The first argument picks the handler (echo, chat or
+ * proxy, default chat), the second the port (default 9000). Everything
+ * else is a named option, anywhere on the command line (see
+ * ServerOptions): --history-dir=<dir> logs the chat history there
+ * (default: in memory only), kept to a week and 1 GiB unless
+ * --retain-age=<s>, --retain-bytes=<n>, --retain-last=<n> or
+ * --no-retention say otherwise (see RetentionPolicy).
+ * --relay-self=<host:port> with --relay-nodes=<host:port,...> federate
+ * the chat rooms with other servers: this node's relay address and all
+ * nodes' (see ChatFederation).
+ * --replicate-to=<socket> and --standby-of=<socket> pair a primary with a
+ * hot standby (see ChatReplicator); --snapshot=<file> restores the
+ * sessions and recent messages saved in the file at startup and saves them
+ * every 10 s and on exit (see MappedSnapshot); --moderate=<file> blocks
+ * chat lines containing a word listed in the file, reread when it changes
+ * (see KeywordFilter). --websocket serves the handler to browsers over
+ * WebSocket instead of raw TCP (see WebSocketGateway), and
+ * --tls-cert=<pem> with --tls-key=<pem> serve it over TLS, kernel TLS
+ * where available (see TlsGateway). The proxy forwards to
+ * --backends=<host:port,...>, balanced by --balance=rr|least|hash (see
+ * ProxyHandler).
 */
 
 using namespace std;
 
-//Client Handler Interface
+static TcpServer* running_server = nullptr;
 
-class IClientHandler
+// SIGINT/SIGTERM end run() normally so destructors (and, in PGO training
+// builds, the profile dump at exit) still run.
+static void on_stop_signal(int)
 {
-  public:
-    virtual void on_client_connect(int client_fd) = 0;
-    virtual void on_client_data(
-      int client_fd, const char* data, ssize_t len) = 0;
-    virtual void on_client_disconnect(int client_fd) = 0;
-};
-
-class TcpServer
-{
-  public:
-    TcpServer(const int port, std::shared_ptr<IClientHandler> p_handler);
-    ~TcpServer();
-    void run();
-
-  private:
-    int server_fd;
-    const int port;
-    const std::shared_ptr<IClientHandler> pHandler;
-    std::vector<pollfd> fds;
-    std::unordered_set<int> new_clients;
-    std::unordered_set<int> remove_clients;
-  private:
-    void setup_socket();
-    int accept_new_client();
-    int handle_existing_client_read(int client_fd);
-    void handle_existing_client_write(int client_fd);
-    void close_clients();
-    void add_new_clients();
-};
-
-TcpServer::TcpServer(const int port, std::shared_ptr<IClientHandler> p_handler):
-  port(port), pHandler(p_handler), server_fd(-1)
-{
-  if(p_handler == nullptr)
+  if(running_server)
   {
-    throw std::runtime_error("client handle can not be null");
+    running_server->stop();
   }
-
-  setup_socket();
 }
 
-TcpServer::~TcpServer()
+int main(int argc, char* argv[])
 {
-  close(server_fd);
-  std::for_each(fds.begin(), fds.end(), [](const pollfd& e){
-    close(e.fd);
-  });
-}
+  ServerOptions options;
+  try
+  {
+    options = ServerOptions::parse(argc, argv);
+  }
+  catch(const std::invalid_argument& e)
+  {
+    std::cerr << e.what() << "\n";
+    return EXIT_FAILURE;
+  }
 
+  // usage: poll_tcp_server [echo|chat|proxy] [port] [--option=value ...]
+  const std::vector<std::string>& args = options.positional;
+  if(args.size() > 2)
+  {
+    std::cerr << "unexpected argument " << args[2] << "\n";
+    return EXIT_FAILURE;
+  }
+  const std::string mode = args.size() > 0 ? args[0] : "chat";
+  const int port = args.size() > 1 ? std::atoi(args[1].c_str()) : 9000;
 
-void TcpServer::run()
-{
-  while (true)
+  try
   {
-    auto polled_fds = poll(fds.data(), fds.size(), -1);
-    if(polled_fds < 0)
+    std::shared_ptr<IClientHandler> p_handler;
+    std::shared_ptr<BroadCastChatHandler> chat;
+    if(mode == "echo")
     {
-      perror("nothing to poll");
-      break;
+      p_handler = std::make_shared<EchoHandler>();
     }
-
-    remove_clients.clear();
-    new_clients.clear();
-
-    for(size_t i = 0; i < fds.size(); ++i)
+    else if(mode == "chat")
     {
-      pollfd& pfd = fds[i];
-
-      if(pfd.revents & POLLNVAL)
+      chat = std::make_shared<BroadCastChatHandler>(0, options.history_dir,
+        options.retention);
+      if(!options.snapshot_path.empty())
       {
-        std::cerr << "Invalid socket fd" << endl;
-        // why we have not close invalid fd? I mean close(pfd);
-        // If an FD is already invalid (e.g. closed elsewhere or not opened properly),
-        // trying to close it again can lead to undefined behavior or even close a
-        // new FD that reused the same number.
-
-        /* POLLNVAL is set when:
-         * 1. The fd is negative.
-         * 2. The fd is not open.
-         * 3. The fd was already closed, but not removed from the poll array.
-        */
+        chat->snapshot_to(options.snapshot_path);
       }
-
-      /*
-        | Flag      | Meaning                             | When It Happens                               | How to Handle                                       |
-        | --------- | ----------------------------------- | --------------------------------------------- | --------------------------------------------------- |
-        | `POLLHUP` | **Peer has disconnected (hang up)** | - Remote side **closed** the connection       | - Log it<br>- `close(fd)`                           |
-        | `POLLERR` | **A socket-level error occurred**   | - Unexpected socket error (I/O, buffer, etc.) | - Use `getsockopt()` to get reason<br>- `close(fd)` |
-
-      */
-
-      if(pfd.revents & POLLERR)
+      if(!options.moderation_list.empty())
       {
-        /* POLLERR — Error : A low-level socket error occurred
-        * 1. Invalid buffer
-        * 2. Network failure
-        * 3. Connection reset
-        * 4. Unrecoverable protocol error
-        */
-
-        int err = 0;
-        socklen_t len = sizeof(err);
-        if(getsockopt(pfd.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
-        {
-          std::cerr << "Get socket option for failed";
-        }
-        else
-        {
-          std::cerr << "Socket error: " << std::to_string(err) << "\n";
-        }
+        chat->moderate(options.moderation_list);
       }
-
-      if(pfd.revents & POLLHUP)
+      if(!options.standby_of.empty())
       {
-        std::cout << "peer hang up" << endl;
+        chat->follow(options.standby_of);
       }
-
-      if(pfd.revents & POLLIN)
+      if(!options.relay_self.empty())
       {
-        if(pfd.fd == server_fd)
-        {
-          auto new_fd = accept_new_client();
-          if(new_fd >= 0)
-          {
-            new_clients.insert(new_fd);
-          }
-        }
-        else
-        {
-          if(handle_existing_client_read(pfd.fd) < 0)
-          {
-            remove_clients.insert(pfd.fd);
-          }
-        }
+        chat->federate(options.relay_self,
+          ServerOptions::split_list(options.relay_nodes));
       }
-
-      if(pfd.revents & POLLOUT)
+      if(!options.replicate_to.empty())
       {
-        handle_existing_client_write(pfd.fd);
+        chat->replicate_to(options.replicate_to);
       }
+      p_handler = chat;
     }
-
-    close_clients();
-    add_new_clients();
-  }
-  close(server_fd);
-  return;
-}
-
-void TcpServer::setup_socket()
-{
-  server_fd = socket(AF_INET, SOCK_STREAM, 0);
-  if(server_fd < 0)
-  {
-    throw std::runtime_error("Socket Creation failed");
-  }
-
-  struct sockaddr_in address;
-  address.sin_family = AF_INET;
-  address.sin_port = htons(port);
-  address.sin_addr.s_addr = htonl(INADDR_ANY);
-
-  if(bind(server_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0)
-  {
-    throw std::runtime_error("Socket binding failed");
-  }
-
-  if(listen(server_fd, SOMAXCONN) < 0)
-  {
-    throw std::runtime_error("Socket listening failed");
-  }
-
-  fds.push_back({server_fd, POLLIN, 0});
-
-  std::cout << "Tcp Server is ready for Listen on port " << port << endl;
-}
-
-int TcpServer::accept_new_client()
-{
-  auto client_fd  = accept(server_fd, nullptr, nullptr);
-  if(client_fd < 0)
-  {
-    perror("accept");
-    return -1;
-  }
-
-  // This will cause the problem because it is changing the container while using
-  // it.
-  // fds.push_back({client_fd, POLLIN, 0});
-  pHandler->on_client_connect(client_fd);
-  return client_fd;
-}
-
-int TcpServer::handle_existing_client_read(int client_fd)
-{
-  char buffer[1024];
-  auto nb = recv(client_fd, buffer, sizeof(buffer), 0);
-  if(nb <= 0)
-  {
-    return -1;
-  }
-
-  pHandler->on_client_data(client_fd, buffer, nb);
-  return 0;
-}
-
-void TcpServer::handle_existing_client_write(int client_fd)
-{
-  std::cout << "FD " << client_fd << " is ready to write\n";
-}
-
-void TcpServer::close_clients()
-{
-  for(auto it = fds.begin(); it != fds.end();)
-  {
-    auto find_it = remove_clients.find(it->fd);
-    if(find_it != remove_clients.end())
+    else if(mode == "proxy")
     {
-      if(!(it->revents & POLLNVAL))
-      {
-        close(it->fd);
-      }
-      pHandler->on_client_disconnect(it->fd);
-      it = fds.erase(it);
+      p_handler = std::make_shared<ProxyHandler>(ServerOptions::split_list(options.backends),
+        ProxyHandler::parse_balance(options.balance), 1);
     }
     else
     {
-      ++it;
+      std::cerr << "unknown handler " << mode << ", use echo, chat or proxy\n";
+      return EXIT_FAILURE;
     }
-  }
-}
-
-void TcpServer::add_new_clients()
-{
-  for(const auto fd : new_clients)
-  {
-    fds.push_back({fd, POLLIN, 0});
-  }
-}
-
-// Echo chat server
-class EchoHandler : public IClientHandler
-{
-  public:
-    void on_client_data(int client_fd, const char* data, ssize_t len) override;
-    void on_client_connect(int client_fd) override;
-    void on_client_disconnect(int client_fd) override;
-};
-
-void EchoHandler::on_client_data(int client_fd, const char* data, ssize_t len)
-{
-  std::string msg(data, len);
-  std::cout << "Client " << client_fd << ": " << msg;
-  send(client_fd, data, len, 0);
-}
-
-void EchoHandler::on_client_connect(int client_fd)
-{
-  std::cout << "Client connected: FD = " << client_fd << "\n";
-}
-
-void EchoHandler::on_client_disconnect(int client_fd)
-{
-  std::cout << "Client disconnected: FD = " << client_fd<< "\n";
-}
-
-// BroadCast chat handler class
-class BroadCastChatHandler: public IClientHandler
-{
-  public:
-    void on_client_data(int client_fd, const char* data, ssize_t len) override;
-    void on_client_connect(int client_fd) override;
-    void on_client_disconnect(int client_fd) override;
-
-  private:
-    std::unordered_set<int> clients;
-    std::unordered_map<int, std::string> nick_names;
-    std::mutex _mutex;
-    void broadcast(int sender_fd, const std::string& msg);
-};
-
-void BroadCastChatHandler::on_client_connect(int client_fd)
-{
-  std::lock_guard<std::mutex> lk(_mutex);
-  clients.insert(client_fd);
-
-  const std::string& msg = " Enter your nickname: ";
-  //std::cout << msg;
-
-  send(client_fd, msg.c_str(), msg.length(), 0);
-}
-
-void BroadCastChatHandler::on_client_data(
-  int client_fd, const char* data, ssize_t len)
-{
-  std::lock_guard<std::mutex> lk(_mutex);
-  std::string msg(data, len);
-
-  msg.erase(std::remove(msg.begin(), msg.end(), '\r'), msg.end());
-  msg.erase(std::remove(msg.begin(), msg.end(), '\n'), msg.end());
-
-  // check if nickname already set.
-  if(nick_names.find(client_fd) == nick_names.end())
-  {
-    nick_names[client_fd] = msg;
-    const std::string& join_msg = msg + " joined the chat\n";
-    broadcast(client_fd, join_msg);
-    cout << join_msg;
-    return;
-  }
-
-  // normal message
-  const std::string& full_msg = nick_names[client_fd] + ": " + msg + "\n";
-  broadcast(client_fd, full_msg);
-  std::cout << full_msg;
-}
-
-void BroadCastChatHandler::on_client_disconnect(int client_fd)
-{
-  std::lock_guard<std::mutex> lk(_mutex);
 
-  const std::string& name =
-    nick_names.count(client_fd) ? nick_names[client_fd] :
-      "Client " + std::to_string(client_fd);
-
-  clients.erase(client_fd);
-  nick_names.erase(client_fd);
-
-  std::string msg = name + " left the chat\n";
-  broadcast(client_fd, msg);
-  cout << msg;
-}
-
-void BroadCastChatHandler::broadcast(int sender_fd, const std::string &msg)
-{
-  for(auto const fd: clients)
-  {
-    if(fd != sender_fd)
+    if(options.websocket)
     {
-      send(fd, msg.c_str(), msg.length(), 0);
+      p_handler = std::make_shared<WebSocketGateway>(p_handler);
+    }
+    // Outermost: TLS carries whatever the handlers inside speak.
+    if(!options.tls_cert.empty() || !options.tls_key.empty())
+    {
+      p_handler = std::make_shared<TlsGateway>(p_handler, options.tls_cert,
+        options.tls_key.empty() ? options.tls_cert : options.tls_key);
     }
-  }
-}
 
-int main()
-{
-/*
- try
-  {
-    std::shared_ptr<EchoHandler> p_handler =
-      std::make_shared<EchoHandler>();
-    TcpServer server(9000, p_handler);
-    server.run();
-  }
-  catch(const std::exception& e)
-  {
-    std::cerr << "Server error: " << e.what() << "\n";
-    return EXIT_FAILURE;
-  }
-*/
+    TcpServer server(port, p_handler);
+    running_server = &server;
+
+    // A client that disconnects while we send to it must not kill the server.
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction sa = {};
+    sa.sa_handler = on_stop_signal;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
 
-  try
-  {
-    std::shared_ptr<BroadCastChatHandler> p_handler =
-      std::make_shared<BroadCastChatHandler>();
-    TcpServer server(9000, p_handler);
     server.run();
+    running_server = nullptr;
+    // While the clients are still connected: their sessions are saved too.
+    if(chat && !options.snapshot_path.empty() && !chat->save_snapshot())
+    {
+      perror(("snapshot: writing " + options.snapshot_path).c_str());
+    }
   }
   catch(const std::exception& e)
   {
@@ -0,0 +1,702 @@
+#include "proxy_handler.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace
+{
+  // Bytes moved per splice() round trip: the default pipe capacity.
+  const size_t PIPE_BYTES = 64 * 1024;
+  // Rounds per readiness event, so one busy backend cannot starve the
+  // others on its pump; the level-triggered epoll brings it back.
+  const int ROUNDS_PER_EVENT = 16;
+  const int MAX_EVENTS = 64;
+  // How often a pump with connects in progress looks for overdue ones.
+  const int CONNECT_CHECK_MS = 100;
+
+  int64_t now_ms()
+  {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  sockaddr_storage resolve(const std::string& name, socklen_t& length)
+  {
+    const size_t colon = name.rfind(':');
+    if(colon == std::string::npos || colon == 0 || colon + 1 == name.size())
+    {
+      throw std::invalid_argument("backend \"" + name + "\" is not host:port");
+    }
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* res = nullptr;
+    if(getaddrinfo(name.substr(0, colon).c_str(), name.substr(colon + 1).c_str(),
+      &hints, &res) != 0)
+    {
+      throw std::invalid_argument("backend \"" + name + "\" can not be resolved");
+    }
+    sockaddr_storage address{};
+    memcpy(&address, res->ai_addr, res->ai_addrlen);
+    length = res->ai_addrlen;
+    freeaddrinfo(res);
+    return address;
+  }
+
+  std::string peer_ip(int fd)
+  {
+    sockaddr_storage address{};
+    socklen_t length = sizeof(address);
+    char text[INET6_ADDRSTRLEN] = "";
+    if(fd >= 0 && getpeername(fd, reinterpret_cast<sockaddr*>(&address), &length) == 0)
+    {
+      if(address.ss_family == AF_INET)
+      {
+        inet_ntop(AF_INET, &reinterpret_cast<sockaddr_in&>(address).sin_addr, text, sizeof(text));
+      }
+      else if(address.ss_family == AF_INET6)
+      {
+        inet_ntop(AF_INET6, &reinterpret_cast<sockaddr_in6&>(address).sin6_addr, text, sizeof(text));
+      }
+    }
+    return text;
+  }
+
+  // Empties a pipe without blocking on it.
+  void drain(int pipe_fd)
+  {
+    char discard[4096];
+    int queued = 0;
+    while(ioctl(pipe_fd, FIONREAD, &queued) == 0 && queued > 0)
+    {
+      if(read(pipe_fd, discard, std::min<size_t>(queued, sizeof(discard))) <= 0)
+      {
+        return;
+      }
+    }
+  }
+
+  // What the non-blocking socket takes right now; -1 if it failed.
+  ssize_t send_some(int fd, const char* data, size_t len)
+  {
+    while(true)
+    {
+      const ssize_t n = ::send(fd, data, len, MSG_NOSIGNAL);
+      if(n >= 0)
+      {
+        return n;
+      }
+      if(errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        return 0;
+      }
+      if(errno != EINTR)
+      {
+        return -1;
+      }
+    }
+  }
+}
+
+struct ProxyHandler::Backend
+{
+  std::string name;
+  sockaddr_storage address;
+  socklen_t address_length;
+  std::atomic<int> active{0};
+  std::atomic<int64_t> down_until_ms{0};
+
+  bool up() const { return down_until_ms.load(std::memory_order_relaxed) <= now_ms(); }
+};
+
+struct ProxyHandler::Pump
+{
+  int epoll_fd = -1;
+  int stop_fd = -1;
+  int pipe_fds[2] = {-1, -1};         // [0] read end, [1] write end
+  std::mutex mutex;
+  // By backend fd: what the epoll events name.
+  std::unordered_map<int, std::shared_ptr<Session>> sessions;
+  size_t connecting = 0;              // sessions with a connect deadline
+  std::thread worker;
+
+  ~Pump()
+  {
+    for(int fd : {epoll_fd, stop_fd, pipe_fds[0], pipe_fds[1]})
+    {
+      if(fd >= 0)
+      {
+        close(fd);
+      }
+    }
+  }
+};
+
+// The backend socket is closed with the last reference, so a pump that
+// is still relaying never sees its number reused.
+struct ProxyHandler::Session
+{
+  ConnectionHandle client;
+  Pump* pump = nullptr;
+  bool splice = true;                 // false: copy through a buffer
+  // Guarded by pump->mutex while connecting; fixed once connected.
+  int backend_fd = -1;
+  Backend* backend = nullptr;
+  int64_t connect_deadline_ms = 0;    // 0 once connected (or given up)
+  uint32_t events = 0;                // epoll interest of backend_fd
+
+  // Client bytes on their way to the backend, guarded by `mutex`.
+  std::mutex mutex;
+  std::condition_variable drained;
+  std::string pending;                // not taken by the backend yet
+  bool connecting = true;
+  bool ended = false;
+
+  ~Session()
+  {
+    if(backend_fd >= 0)
+    {
+      close(backend_fd);
+    }
+    if(backend != nullptr)
+    {
+      backend->active.fetch_sub(1, std::memory_order_relaxed);
+    }
+  }
+};
+
+ProxyHandler::Balance ProxyHandler::parse_balance(const std::string& name)
+{
+  if(name == "rr")
+  {
+    return Balance::ROUND_ROBIN;
+  }
+  if(name == "least")
+  {
+    return Balance::LEAST_CONNECTIONS;
+  }
+  if(name == "hash")
+  {
+    return Balance::CONSISTENT_HASH;
+  }
+  throw std::invalid_argument("unknown balance \"" + name + "\", use rr, least or hash");
+}
+
+ProxyHandler::ProxyHandler(const std::vector<std::string>& backend_names,
+  Balance balance, size_t pump_count) : balance(balance)
+{
+  if(backend_names.empty())
+  {
+    throw std::invalid_argument("proxy: no backends");
+  }
+  for(const auto& name : backend_names)
+  {
+    auto backend = std::make_unique<Backend>();
+    backend->name = name;
+    backend->address = resolve(name, backend->address_length);
+    ring.add(name);
+    backends.push_back(std::move(backend));
+  }
+
+  for(size_t i = 0; i < std::max<size_t>(pump_count, 1); ++i)
+  {
+    auto pump = std::make_unique<Pump>();
+    pump->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    pump->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(pump->epoll_fd < 0 || pump->stop_fd < 0 || pipe2(pump->pipe_fds, O_CLOEXEC) < 0)
+    {
+      throw std::runtime_error("proxy: epoll, eventfd or pipe creation failed");
+    }
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = pump->stop_fd;
+    epoll_ctl(pump->epoll_fd, EPOLL_CTL_ADD, pump->stop_fd, &ev);
+    pumps.push_back(std::move(pump));
+  }
+  for(auto& pump : pumps)
+  {
+    pump->worker = std::thread(&ProxyHandler::pump_loop, this, std::ref(*pump));
+  }
+}
+
+ProxyHandler::~ProxyHandler()
+{
+  for(auto& pump : pumps)
+  {
+    const uint64_t one = 1;
+    if(write(pump->stop_fd, &one, sizeof(one)) < 0)
+    {
+      perror("proxy: eventfd write");
+    }
+  }
+  for(auto& pump : pumps)
+  {
+    pump->worker.join();
+  }
+}
+
+ProxyHandler::Stripe& ProxyHandler::stripe_of(ConnectionHandle conn)
+{
+  return stripes[conn.slot % STRIPES];
+}
+
+std::shared_ptr<ProxyHandler::Session> ProxyHandler::find(ConnectionHandle conn)
+{
+  Stripe& stripe = stripe_of(conn);
+  std::lock_guard<std::mutex> lk(stripe.mutex);
+  auto it = stripe.sessions.find(conn);
+  return it == stripe.sessions.end() ? nullptr : it->second;
+}
+
+ProxyHandler::Backend* ProxyHandler::least_loaded(const Backend* except)
+{
+  Backend* best = nullptr;
+  for(auto& backend : backends)
+  {
+    if(backend.get() == except || !backend->up())
+    {
+      continue;
+    }
+    if(best == nullptr || backend->active.load(std::memory_order_relaxed) <
+      best->active.load(std::memory_order_relaxed))
+    {
+      best = backend.get();
+    }
+  }
+  return best;
+}
+
+ProxyHandler::Backend* ProxyHandler::pick(const std::string& client_ip)
+{
+  switch(balance)
+  {
+    case Balance::ROUND_ROBIN:
+      for(size_t tries = 0; tries < backends.size(); ++tries)
+      {
+        Backend* backend = backends[next_backend.fetch_add(1, std::memory_order_relaxed)
+          % backends.size()].get();
+        if(backend->up())
+        {
+          return backend;
+        }
+      }
+      return nullptr;
+
+    case Balance::LEAST_CONNECTIONS:
+      return least_loaded(nullptr);
+
+    case Balance::CONSISTENT_HASH:
+    {
+      // The ring keeps every backend: a down one is bypassed, not removed,
+      // so its clients come back to it once it is up again.
+      const std::string& owner = ring.owner(client_ip);
+      for(auto& backend : backends)
+      {
+        if(backend->name == owner && backend->up())
+        {
+          return backend.get();
+        }
+      }
+      return least_loaded(nullptr);
+    }
+  }
+  return nullptr;
+}
+
+int ProxyHandler::start_connect(Backend& backend)
+{
+  const int fd = socket(backend.address.ss_family,
+    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if(fd < 0)
+  {
+    return -1;
+  }
+  if(connect(fd, reinterpret_cast<const sockaddr*>(&backend.address),
+    backend.address_length) == 0 || errno == EINPROGRESS)
+  {
+    return fd;
+  }
+  close(fd);
+  backend.down_until_ms.store(now_ms() + DOWN_MS, std::memory_order_relaxed);
+  return -1;
+}
+
+bool ProxyHandler::connect_session(Pump& pump, const std::shared_ptr<Session>& session,
+  Backend* backend)
+{
+  for(; backend != nullptr; backend = least_loaded(backend))
+  {
+    const int fd = start_connect(*backend);
+    if(fd < 0)
+    {
+      continue;
+    }
+    session->backend_fd = fd;
+    session->backend = backend;
+    session->connect_deadline_ms = now_ms() + CONNECT_TIMEOUT_MS;
+    session->events = EPOLLOUT;
+    backend->active.fetch_add(1, std::memory_order_relaxed);
+    ++pump.connecting;
+    pump.sessions[fd] = session;
+    epoll_event ev{};
+    ev.events = session->events;
+    ev.data.fd = fd;
+    epoll_ctl(pump.epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    return true;
+  }
+  return false;
+}
+
+void ProxyHandler::connected(Pump& pump, Session& session)
+{
+  {
+    std::lock_guard<std::mutex> lk(pump.mutex);
+    if(session.connect_deadline_ms == 0)
+    {
+      return;                         // ended meanwhile
+    }
+    session.connect_deadline_ms = 0;
+    --pump.connecting;
+  }
+  bool ok;
+  {
+    std::lock_guard<std::mutex> lk(session.mutex);
+    session.connecting = false;
+    ok = send_pending(session);
+  }
+  if(!ok)
+  {
+    end_session(pump, session);
+    ConnectionTable::global().shutdown(session.client);
+  }
+}
+
+void ProxyHandler::connect_failed(Pump& pump, const std::shared_ptr<Session>& session)
+{
+  bool reconnecting;
+  {
+    std::lock_guard<std::mutex> lk(pump.mutex);
+    if(session->connect_deadline_ms == 0)
+    {
+      return;
+    }
+    session->connect_deadline_ms = 0;
+    --pump.connecting;
+    epoll_ctl(pump.epoll_fd, EPOLL_CTL_DEL, session->backend_fd, nullptr);
+    pump.sessions.erase(session->backend_fd);
+    close(session->backend_fd);
+    session->backend_fd = -1;
+
+    Backend* failed = session->backend;
+    failed->down_until_ms.store(now_ms() + DOWN_MS, std::memory_order_relaxed);
+    failed->active.fetch_sub(1, std::memory_order_relaxed);
+    session->backend = nullptr;
+    reconnecting = connect_session(pump, session, least_loaded(failed));
+  }
+  if(!reconnecting)
+  {
+    std::cerr << "proxy: no backend reachable\n";
+    {
+      std::lock_guard<std::mutex> lk(session->mutex);
+      session->ended = true;
+    }
+    session->drained.notify_all();
+    ConnectionTable::global().shutdown(session->client);
+  }
+}
+
+bool ProxyHandler::send_pending(Session& session)
+{
+  size_t sent = 0;
+  while(sent < session.pending.size())
+  {
+    const ssize_t n = send_some(session.backend_fd, session.pending.data() + sent,
+      session.pending.size() - sent);
+    if(n < 0)
+    {
+      return false;
+    }
+    if(n == 0)
+    {
+      break;
+    }
+    sent += n;
+  }
+  session.pending.erase(0, sent);
+  session.drained.notify_all();
+
+  // Watch for room only while something is waiting for it.
+  const uint32_t events = EPOLLIN | EPOLLRDHUP | (session.pending.empty() ? 0 : EPOLLOUT);
+  if(events != session.events)
+  {
+    session.events = events;
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = session.backend_fd;
+    epoll_ctl(session.pump->epoll_fd, EPOLL_CTL_MOD, session.backend_fd, &ev);
+  }
+  return true;
+}
+
+void ProxyHandler::on_client_connect(ConnectionHandle conn)
+{
+  // Called on the accepting thread, which owns the fd.
+  const std::string client_ip = balance == Balance::CONSISTENT_HASH ?
+    peer_ip(ConnectionTable::global().fd_of(conn)) : std::string();
+
+  auto session = std::make_shared<Session>();
+  session->client = conn;
+  session->pump = pumps[next_pump.fetch_add(1, std::memory_order_relaxed) % pumps.size()].get();
+  Stripe& stripe = stripe_of(conn);
+  {
+    std::lock_guard<std::mutex> lk(stripe.mutex);
+    stripe.sessions[conn] = session;
+  }
+
+  Backend* backend = pick(client_ip);
+  bool started;
+  {
+    std::lock_guard<std::mutex> lk(session->pump->mutex);
+    started = backend != nullptr && connect_session(*session->pump, session, backend);
+  }
+  if(!started)
+  {
+    std::cerr << "proxy: no backend reachable\n";
+    {
+      std::lock_guard<std::mutex> lk(stripe.mutex);
+      stripe.sessions.erase(conn);
+    }
+    ConnectionTable::global().shutdown(conn);
+  }
+}
+
+void ProxyHandler::on_client_data(ConnectionHandle conn, const char* data, ssize_t len)
+{
+  std::shared_ptr<Session> session = find(conn);
+  if(!session || len <= 0)
+  {
+    return;
+  }
+
+  std::unique_lock<std::mutex> lk(session->mutex);
+  session->pending.append(data, len);
+  bool ok = session->connecting || send_pending(*session);
+  // Backpressure: past MAX_PENDING_BYTES this reactor waits for the pump
+  // to write to the backend, as a pump waits for a slow client.
+  ok = ok && session->drained.wait_for(lk, std::chrono::milliseconds(SEND_TIMEOUT_MS),
+    [&session]() { return session->ended || session->pending.size() <= MAX_PENDING_BYTES; });
+  if(!ok)
+  {
+    ConnectionTable::global().shutdown(conn);
+  }
+}
+
+void ProxyHandler::on_client_disconnect(ConnectionHandle conn)
+{
+  std::shared_ptr<Session> session;
+  {
+    Stripe& stripe = stripe_of(conn);
+    std::lock_guard<std::mutex> lk(stripe.mutex);
+    auto it = stripe.sessions.find(conn);
+    if(it == stripe.sessions.end())
+    {
+      return;
+    }
+    session = std::move(it->second);
+    stripe.sessions.erase(it);
+  }
+  end_session(*session->pump, *session);
+}
+
+void ProxyHandler::end_session(Pump& pump, Session& session)
+{
+  {
+    std::lock_guard<std::mutex> lk(pump.mutex);
+    if(session.connect_deadline_ms != 0)
+    {
+      session.connect_deadline_ms = 0;
+      --pump.connecting;
+    }
+    auto it = pump.sessions.find(session.backend_fd);
+    if(it != pump.sessions.end() && it->second.get() == &session)
+    {
+      epoll_ctl(pump.epoll_fd, EPOLL_CTL_DEL, session.backend_fd, nullptr);
+      pump.sessions.erase(it);
+    }
+  }
+  // A reactor waiting for the pending bytes to drain gives up.
+  {
+    std::lock_guard<std::mutex> lk(session.mutex);
+    session.ended = true;
+  }
+  session.drained.notify_all();
+}
+
+void ProxyHandler::pump_loop(Pump& pump)
+{
+  epoll_event events[MAX_EVENTS];
+  while(true)
+  {
+    int timeout = -1;
+    {
+      std::lock_guard<std::mutex> lk(pump.mutex);
+      if(pump.connecting > 0)
+      {
+        timeout = CONNECT_CHECK_MS;
+      }
+    }
+    const int n = epoll_wait(pump.epoll_fd, events, MAX_EVENTS, timeout);
+    if(n < 0)
+    {
+      if(errno == EINTR)
+      {
+        continue;
+      }
+      perror("proxy: epoll_wait");
+      return;
+    }
+    for(int i = 0; i < n; ++i)
+    {
+      if(events[i].data.fd == pump.stop_fd)
+      {
+        return;
+      }
+      std::shared_ptr<Session> session;
+      bool connecting = false;
+      {
+        std::lock_guard<std::mutex> lk(pump.mutex);
+        auto it = pump.sessions.find(events[i].data.fd);
+        if(it != pump.sessions.end())
+        {
+          session = it->second;
+          connecting = session->connect_deadline_ms != 0;
+        }
+      }
+      if(!session)
+      {
+        continue;
+      }
+      const uint32_t ready = events[i].events;
+      if(connecting)
+      {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(events[i].data.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if(error != 0)
+        {
+          connect_failed(pump, session);
+        }
+        else if(ready & EPOLLOUT)
+        {
+          connected(pump, *session);
+        }
+        continue;
+      }
+      if(ready & EPOLLOUT)
+      {
+        bool ok;
+        {
+          std::lock_guard<std::mutex> lk(session->mutex);
+          ok = send_pending(*session);
+        }
+        if(!ok)
+        {
+          end_session(pump, *session);
+          ConnectionTable::global().shutdown(session->client);
+          continue;
+        }
+      }
+      if(ready & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+      {
+        relay(pump, *session);
+      }
+    }
+
+    // Connects that neither finished nor failed in time.
+    std::vector<std::shared_ptr<Session>> overdue;
+    {
+      std::lock_guard<std::mutex> lk(pump.mutex);
+      const int64_t now = now_ms();
+      for(auto it = pump.sessions.begin(); pump.connecting > 0 && it != pump.sessions.end(); ++it)
+      {
+        const int64_t deadline = it->second->connect_deadline_ms;
+        if(deadline != 0 && deadline <= now)
+        {
+          overdue.push_back(it->second);
+        }
+      }
+    }
+    for(const auto& session : overdue)
+    {
+      connect_failed(pump, session);
+    }
+  }
+}
+
+void ProxyHandler::relay(Pump& pump, Session& session)
+{
+  ConnectionTable& table = ConnectionTable::global();
+  if(session.splice && (table.framing(session.client) != ConnectionTable::Framing::RAW
+    || table.has_transport(session.client)))
+  {
+    session.splice = false;
+  }
+
+  for(int round = 0; round < ROUNDS_PER_EVENT; ++round)
+  {
+    ssize_t in;
+    bool delivered;
+    if(session.splice)
+    {
+      in = splice(session.backend_fd, nullptr, pump.pipe_fds[1], nullptr, PIPE_BYTES,
+        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if(in < 0 && errno == EINVAL)
+      {
+        session.splice = false;       // not spliceable here: copy instead
+        continue;
+      }
+      delivered = in <= 0 || table.splice_from(session.client, pump.pipe_fds[0], in) == in;
+      if(!delivered)
+      {
+        // The client went away mid-chunk: the rest must not reach the
+        // next connection this pipe serves.
+        drain(pump.pipe_fds[0]);
+      }
+    }
+    else
+    {
+      char buffer[PIPE_BYTES];
+      in = read(session.backend_fd, buffer, sizeof(buffer));
+      delivered = in <= 0 || send(session.client, buffer, in) == in;
+    }
+
+    if(in < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+      return;
+    }
+    if(in <= 0 || !delivered)
+    {
+      // Backend closed or failed, or the client is gone: stop watching
+      // the backend and let the server close the client.
+      end_session(pump, session);
+      table.shutdown(session.client);
+      return;
+    }
+  }
+}
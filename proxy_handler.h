@@ -0,0 +1,132 @@
+#ifndef PROXY_HANDLER_H
+#define PROXY_HANDLER_H
+
+#include "hash_ring.h"
+#include "tcp_server.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/* TCP reverse proxy / load balancer.
+ * Every client connection gets its own connection to one backend of a
+ * pool, and bytes are passed through unchanged in both directions:
+ *
+ *   client --server reactor--> on_client_data --send()--> backend
+ *   client <--splice()-- pipe <--splice()-- pump thread <-- backend
+ *
+ * Backend to client, usually the heavy direction, never enters user space:
+ * a pump thread waits for readable backends with epoll and moves their
+ * bytes with splice() into a pipe and from the pipe into the client's
+ * socket. Client to backend the server's reactor has already read the
+ * bytes into its buffer (that is the IClientHandler contract), so they are
+ * written with send(). When the client connection is not plain TCP (a
+ * WebSocket gateway or user space TLS in between) or the kernel refuses
+ * to splice, the pump copies through a buffer instead. Kernel TLS sockets
+ * are spliced like plain ones.
+ *
+  | Balance            | Backend picked                                      |
+  | ------------------ | --------------------------------------------------- |
+  | ROUND_ROBIN        | the next one in turn                                |
+  | LEAST_CONNECTIONS  | the one with the fewest open proxied connections    |
+  | CONSISTENT_HASH    | HashRing owner of the client's IP: a client sticks  |
+  |                    | to one backend, and a pool change moves few clients |
+ *
+ * A backend that refuses a connection, or does not accept it within
+ * CONNECT_TIMEOUT_MS, is skipped for DOWN_MS and the next candidate (the
+ * least loaded one) is tried. The reactor only starts a non-blocking
+ * connect; the pump waits for it (EPOLLOUT) and tries the next backend if
+ * it fails, so a slow backend never stalls the other clients of a reactor.
+ * If no backend can be reached the client is disconnected; when the
+ * backend closes, the client is shut down and vice versa.
+ *
+ * Client bytes the backend can not take yet (it is still connecting, or
+ * its socket buffer is full) wait in the session and the pump writes them
+ * once the socket has room. Beyond MAX_PENDING_BYTES the reactor waits for
+ * the pump to catch up, up to SEND_TIMEOUT_MS, before it drops the client:
+ * a client can not fill memory faster than its backend reads.
+ *
+ * The pipe is per pump thread, not per connection: a pump moves a chunk
+ * in and straight out again, so the pipe is empty between chunks, and a
+ * proxied connection costs one backend socket and no pipe. Moving a chunk
+ * out blocks like any handler's send(), so a slow client holds up the
+ * other connections of its pump; more pumps spread that.
+*/
+class ProxyHandler : public IClientHandler
+{
+  public:
+    enum class Balance { ROUND_ROBIN, LEAST_CONNECTIONS, CONSISTENT_HASH };
+
+    static const int CONNECT_TIMEOUT_MS = 1000;
+    static const int DOWN_MS = 5000;
+    static const int SEND_TIMEOUT_MS = 5000;
+    static const size_t MAX_PENDING_BYTES = 256 * 1024;
+
+    // "rr", "least" or "hash"; throws std::invalid_argument otherwise.
+    static Balance parse_balance(const std::string& name);
+
+    // `backends` are "host:port"; throws if empty or not resolvable.
+    ProxyHandler(const std::vector<std::string>& backends,
+      Balance balance = Balance::ROUND_ROBIN, size_t pumps = 1);
+    ~ProxyHandler();
+
+    ProxyHandler(const ProxyHandler&) = delete;
+    ProxyHandler& operator=(const ProxyHandler&) = delete;
+
+    void on_client_connect(ConnectionHandle conn) override;
+    void on_client_data(ConnectionHandle conn, const char* data, ssize_t len) override;
+    void on_client_disconnect(ConnectionHandle conn) override;
+
+  private:
+    struct Backend;
+    struct Pump;
+    struct Session;
+
+    struct Stripe
+    {
+      std::mutex mutex;
+      std::unordered_map<ConnectionHandle, std::shared_ptr<Session>> sessions;
+    };
+
+    static const size_t STRIPES = 16;
+
+    const Balance balance;
+    std::vector<std::unique_ptr<Backend>> backends;
+    HashRing ring;                    // backend names, CONSISTENT_HASH only
+    std::atomic<size_t> next_backend{0};
+    std::atomic<size_t> next_pump{0};
+    Stripe stripes[STRIPES];
+    // Declared last: their threads use the members above.
+    std::vector<std::unique_ptr<Pump>> pumps;
+
+    Stripe& stripe_of(ConnectionHandle conn);
+    std::shared_ptr<Session> find(ConnectionHandle conn);
+    Backend* pick(const std::string& client_ip);
+    Backend* least_loaded(const Backend* except);
+    // Non-blocking socket with its connect started, or -1 (and the
+    // backend marked down).
+    int start_connect(Backend& backend);
+    // Caller holds pump.mutex. Starts connecting `session` to `backend`,
+    // or to the least loaded others if that fails at once; false if no
+    // backend is left.
+    bool connect_session(Pump& pump, const std::shared_ptr<Session>& session,
+      Backend* backend);
+    // Pump thread: the backend accepted, or refused or timed out.
+    void connected(Pump& pump, Session& session);
+    void connect_failed(Pump& pump, const std::shared_ptr<Session>& session);
+    // Caller holds session.mutex, session connected. Writes what the
+    // backend takes of the pending bytes; false if the backend failed.
+    bool send_pending(Session& session);
+    void pump_loop(Pump& pump);
+    // Moves what `session`'s backend has ready to its client.
+    void relay(Pump& pump, Session& session);
+    void end_session(Pump& pump, Session& session);
+};
+
+#endif
@@ -10,6 +10,9 @@
 #include <netinet/in.h>
 #include <mutex>
 #include <unordered_map>
+#include <atomic>
+#include <csignal>
+#include <cerrno>
 
 
 using namespace std;
@@ -78,6 +81,7 @@ class TcpServer
     TcpServer(int port, IClientHandler* handler);
     ~TcpServer();
     void run();
+    void stop();
 
   private:
     int server_fd;
@@ -86,6 +90,7 @@ class TcpServer
     fd_set master_set;
     unordered_set<int> client_fds;
     IClientHandler* handler;
+    std::atomic<bool> stopping{false};
 
   private:
     void setup_socket();
@@ -115,11 +120,16 @@ TcpServer::~TcpServer()
 
 void TcpServer::run()
 {
-  while (true)
+  while (!stopping)
   {
     fd_set read_set = master_set;
     int nfreadyfds = select(max_fd + 1, &read_set, NULL, NULL, NULL);
 
+    if(nfreadyfds < 0 && errno == EINTR)
+    {
+      continue;
+    }
+
     if(nfreadyfds < 0)
     {
       perror("select");
@@ -143,6 +153,11 @@ void TcpServer::run()
   }
 }
 
+void TcpServer::stop()
+{
+  stopping = true;
+}
+
 void TcpServer::setup_socket()
 {
   server_fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -325,27 +340,55 @@ void BroadCastChatHandler::broadcast(int sender_fd, const std::string &msg)
   }
 }
 
-int main()
+static TcpServer* running_server = nullptr;
+
+// SIGINT/SIGTERM end run() normally so destructors (and, in PGO training
+// builds, the profile dump at exit) still run.
+static void on_stop_signal(int)
 {
-/*
-  try
-  {
-    EchoHandler handler;
-    TcpServer server(9000, &handler);
-    server.run();
-  }
-  catch(const std::exception& e)
+  if(running_server)
   {
-    std::cerr << "Server error: " << e.what() << "\n";
-    return EXIT_FAILURE;
+    running_server->stop();
   }
- */
+}
+
+int main(int argc, char* argv[])
+{
+  // usage: select_tcp_server [echo|chat] [port]
+  const std::string mode = argc > 1 ? argv[1] : "chat";
+  const int port = argc > 2 ? std::atoi(argv[2]) : 9000;
 
   try
   {
-    BroadCastChatHandler handler;
-    TcpServer server(9000, &handler);
+    EchoHandler echo_handler;
+    BroadCastChatHandler chat_handler;
+    IClientHandler* handler = nullptr;
+    if(mode == "echo")
+    {
+      handler = &echo_handler;
+    }
+    else if(mode == "chat")
+    {
+      handler = &chat_handler;
+    }
+    else
+    {
+      std::cerr << "unknown handler " << mode << ", use echo or chat\n";
+      return EXIT_FAILURE;
+    }
+
+    TcpServer server(port, handler);
+    running_server = &server;
+
+    // A client that disconnects while we send to it must not kill the server.
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction sa = {};
+    sa.sa_handler = on_stop_signal;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+
     server.run();
+    running_server = nullptr;
   }
   catch(const std::exception& e)
   {
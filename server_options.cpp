@@ -0,0 +1,143 @@
+#include "server_options.h"
+
+#include <algorithm>
+#include <cctype>
+#include <stdexcept>
+
+using namespace std;
+
+namespace
+{
+  struct ValueOption
+  {
+    const char* name;                 // without the "=value"
+    std::string ServerOptions::* field;
+  };
+
+  const ValueOption VALUE_OPTIONS[] = {
+    {"--history-dir", &ServerOptions::history_dir},
+    {"--relay-self", &ServerOptions::relay_self},
+    {"--relay-nodes", &ServerOptions::relay_nodes},
+    {"--replicate-to", &ServerOptions::replicate_to},
+    {"--standby-of", &ServerOptions::standby_of},
+    {"--snapshot", &ServerOptions::snapshot_path},
+    {"--moderate", &ServerOptions::moderation_list},
+    {"--backends", &ServerOptions::backends},
+    {"--balance", &ServerOptions::balance},
+    {"--tls-cert", &ServerOptions::tls_cert},
+    {"--tls-key", &ServerOptions::tls_key},
+  };
+
+  struct RetentionOption
+  {
+    const char* name;
+    uint64_t RetentionPolicy::* field;
+  };
+
+  const RetentionOption RETENTION_OPTIONS[] = {
+    {"--retain-age", &RetentionPolicy::max_age_sec},
+    {"--retain-bytes", &RetentionPolicy::max_total_bytes},
+    {"--retain-last", &RetentionPolicy::keep_last},
+  };
+
+  uint64_t parse_count(const std::string& name, const std::string& value)
+  {
+    size_t used = 0;
+    uint64_t count = 0;
+    try
+    {
+      count = std::stoull(value, &used);
+    }
+    catch(const std::exception&)
+    {
+      used = 0;
+    }
+    if(value.empty() || !isdigit(static_cast<unsigned char>(value[0])) || used != value.size())
+    {
+      throw std::invalid_argument(name + " needs a number, not \"" + value + "\"");
+    }
+    return count;
+  }
+}
+
+ServerOptions ServerOptions::parse(int argc, char* argv[])
+{
+  ServerOptions options;
+  for(int i = 1; i < argc; ++i)
+  {
+    const std::string arg = argv[i];
+    if(arg.compare(0, 2, "--") != 0)
+    {
+      options.positional.push_back(arg);
+      continue;
+    }
+
+    const size_t eq = arg.find('=');
+    const std::string name = arg.substr(0, eq);
+    if(name == "--websocket")
+    {
+      if(eq != std::string::npos)
+      {
+        throw std::invalid_argument("--websocket takes no value");
+      }
+      options.websocket = true;
+      continue;
+    }
+    if(name == "--no-retention")
+    {
+      if(eq != std::string::npos)
+      {
+        throw std::invalid_argument("--no-retention takes no value");
+      }
+      options.retention = RetentionPolicy();
+      continue;
+    }
+    bool known = false;
+    for(const ValueOption& option : VALUE_OPTIONS)
+    {
+      if(name == option.name)
+      {
+        if(eq == std::string::npos)
+        {
+          throw std::invalid_argument(name + " needs a value: " + name + "=...");
+        }
+        options.*option.field = arg.substr(eq + 1);
+        known = true;
+        break;
+      }
+    }
+    for(const RetentionOption& option : RETENTION_OPTIONS)
+    {
+      if(!known && name == option.name)
+      {
+        if(eq == std::string::npos)
+        {
+          throw std::invalid_argument(name + " needs a value: " + name + "=...");
+        }
+        options.retention.*option.field = parse_count(name, arg.substr(eq + 1));
+        known = true;
+      }
+    }
+    if(!known)
+    {
+      throw std::invalid_argument("unknown option " + arg);
+    }
+  }
+  return options;
+}
+
+std::vector<std::string> ServerOptions::split_list(const std::string& list)
+{
+  std::vector<std::string> out;
+  size_t start = 0;
+  while(start <= list.size())
+  {
+    const size_t comma = std::min(list.find(',', start), list.size());
+    if(comma > start)
+    {
+      out.push_back(list.substr(start, comma - start));
+    }
+    start = comma + 1;
+  }
+  return out;
+}
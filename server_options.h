@@ -0,0 +1,64 @@
+#ifndef SERVER_OPTIONS_H
+#define SERVER_OPTIONS_H
+
+#include "history_retention.h"
+
+#include <string>
+#include <vector>
+
+/* Command line shared by poll_tcp_server and epoll_tcp_server.
+ * Options are "--name=value" or a bare "--flag" and may appear anywhere;
+ * everything else is left in `positional`, in order, for the server to
+ * read (handler, port, and for epoll the threads). An unknown option is
+ * an error, as is "=value" after --websocket or a value option without
+ * one:
+ *
+  | Option                   | Used by     | Meaning                          |
+  | ------------------------ | ----------- | -------------------------------- |
+  | --history-dir=<dir>      | chat        | log room history there           |
+  | --retain-age=<seconds>   | chat        | drop logs older than that        |
+  | --retain-bytes=<bytes>   | chat        | drop the oldest logs beyond that |
+  | --retain-last=<count>    | chat        | keep only each room's last count |
+  | --no-retention           | chat        | keep all history                 |
+  | --relay-self=<host:port> | chat        | this node's federation relay     |
+  | --relay-nodes=<list>     | chat        | every node's relay, "a:1,b:2"    |
+  | --replicate-to=<socket>  | chat        | stream to a hot standby          |
+  | --standby-of=<socket>    | chat        | be that standby                  |
+  | --snapshot=<file>        | chat        | restore and save sessions        |
+  | --moderate=<file>        | chat        | block listed words               |
+  | --backends=<list>        | proxy       | backend pool, "a:1,b:2"          |
+  | --balance=rr|least|hash  | proxy       | backend choice                   |
+  | --websocket              | any         | WebSocket instead of raw TCP     |
+  | --tls-cert=<pem>         | any         | serve over TLS                   |
+  | --tls-key=<pem>          | any         | key, default: the cert file      |
+ *
+ * Retention starts from RetentionPolicy::defaults() (a week, 1 GiB); 0
+ * turns a rule off, and the options apply in order, so --no-retention
+ * --retain-last=1000 keeps only compaction.
+*/
+struct ServerOptions
+{
+  std::string history_dir;
+  RetentionPolicy retention = RetentionPolicy::defaults();
+  std::string relay_self;
+  std::string relay_nodes;
+  std::string replicate_to;
+  std::string standby_of;
+  std::string snapshot_path;
+  std::string moderation_list;
+  std::string backends;
+  std::string balance = "rr";
+  std::string tls_cert;
+  std::string tls_key;
+  bool websocket = false;
+  std::vector<std::string> positional;
+
+  // "a:1,b:2" -> {"a:1", "b:2"}, for --relay-nodes and --backends.
+  static std::vector<std::string> split_list(const std::string& list);
+
+  // argv[0] is skipped. Throws std::invalid_argument naming the offending
+  // argument, also for a count that is not a decimal number.
+  static ServerOptions parse(int argc, char* argv[]);
+};
+
+#endif
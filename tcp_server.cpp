@@ -0,0 +1,345 @@
+#include "tcp_server.h"
+
+#include <iostream>
+#include <string>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <stdexcept>
+#include <thread>
+
+/* poll() api.
+ * it is also an I/O multiplexing mechanism. but it is more scable and flexible
+ * alternative to select().
+ * poll lets us to monitor many FDs to see if --
+ * 1. Data is ready to read.
+ * 2. you can write.
+ * 3. There is an error or disconnect.
+*/
+
+/* int poll(struct pollfd fds[], nfds_t nfds, int timeout);
+  | Parameter | Meaning                                                |
+  | --------- | ------------------------------------------------------ |
+  | `fds[]`   | Array of `pollfd` structs (one per socket)             |
+  | `nfds`    | Number of elements in `fds`                            |
+  | `timeout` | Milliseconds: `0` = non-blocking, `-1` = block forever |
+
+
+  struct pollfd {
+      int   fd;       // File descriptor to monitor
+      short events;   // What to monitor (POLLIN, POLLOUT, etc.)
+      short revents;  // What actually happened (set by poll)
+  };
+
+  | Flag       | Meaning               |
+  | ---------- | --------------------- |
+  | `POLLIN`   | Data to read          |
+  | `POLLOUT`  | Socket ready to write |
+  | `POLLERR`  | Error occurred        |
+  | `POLLHUP`  | Hang up (disconnect)  |
+  | `POLLNVAL` | Invalid FD            |
+*/
+
+using namespace std;
+
+TcpServer::TcpServer(const int port, std::shared_ptr<IClientHandler> p_handler):
+  port(port), pHandler(p_handler), server_fd(-1)
+{
+  if(p_handler == nullptr)
+  {
+    throw std::runtime_error("client handle can not be null");
+  }
+
+  setup_socket();
+  fds.push_back({tasks.fd(), POLLIN, 0});
+}
+
+TcpServer::TcpServer(std::shared_ptr<IClientHandler> p_handler):
+  port(0), pHandler(p_handler), server_fd(-1)
+{
+  if(p_handler == nullptr)
+  {
+    throw std::runtime_error("client handle can not be null");
+  }
+  fds.push_back({tasks.fd(), POLLIN, 0});
+}
+
+TcpServer::~TcpServer()
+{
+  if(server_fd >= 0)
+  {
+    close(server_fd);
+  }
+  ConnectionTable& table = ConnectionTable::global();
+  std::for_each(fds.begin(), fds.end(), [this, &table](const pollfd& e){
+    if(e.fd != server_fd && e.fd != tasks.fd())
+    {
+      table.close(table.handle_of(e.fd));
+    }
+  });
+}
+
+void TcpServer::run()
+{
+  while (!stopping && poll_once(-1) >= 0)
+  {
+  }
+  // Stop listening now; the destructor must not close the number again,
+  // by then it may belong to someone else.
+  if(server_fd >= 0)
+  {
+    fds.erase(std::remove_if(fds.begin(), fds.end(),
+      [this](const pollfd& e) { return e.fd == server_fd; }), fds.end());
+    close(server_fd);
+    server_fd = -1;
+  }
+  return;
+}
+
+void TcpServer::stop()
+{
+  stopping = true;
+  // Get run() out of poll(-1) even when no signal interrupted it.
+  tasks.wake();
+}
+
+void TcpServer::post(LoopTaskQueue::Task task)
+{
+  tasks.post(std::move(task));
+}
+
+void TcpServer::run_in_loop(LoopTaskQueue::Task task)
+{
+  if(loop_thread.load(std::memory_order_relaxed) == std::this_thread::get_id())
+  {
+    task();
+    return;
+  }
+  post(std::move(task));
+}
+
+int TcpServer::poll_once(int timeout_ms)
+{
+  loop_thread.store(std::this_thread::get_id(), std::memory_order_relaxed);
+  auto polled_fds = poll(fds.data(), fds.size(), timeout_ms);
+  if(polled_fds < 0 && errno == EINTR)
+  {
+    // A signal, possibly stop(); let the caller look at its flags.
+    return 0;
+  }
+  if(polled_fds < 0)
+  {
+    perror("nothing to poll");
+    return -1;
+  }
+
+  remove_clients.clear();
+  new_clients.clear();
+  bool tasks_ready = false;
+
+  for(size_t i = 0; i < fds.size(); ++i)
+  {
+    pollfd& pfd = fds[i];
+
+    if(pfd.revents & POLLNVAL)
+    {
+      std::cerr << "Invalid socket fd" << endl;
+      // why we have not close invalid fd? I mean close(pfd);
+      // If an FD is already invalid (e.g. closed elsewhere or not opened properly),
+      // trying to close it again can lead to undefined behavior or even close a
+      // new FD that reused the same number.
+
+      /* POLLNVAL is set when:
+       * 1. The fd is negative.
+       * 2. The fd is not open.
+       * 3. The fd was already closed, but not removed from the poll array.
+      */
+    }
+
+    /*
+      | Flag      | Meaning                             | When It Happens                               | How to Handle                                       |
+      | --------- | ----------------------------------- | --------------------------------------------- | --------------------------------------------------- |
+      | `POLLHUP` | **Peer has disconnected (hang up)** | - Remote side **closed** the connection       | - Log it<br>- `close(fd)`                           |
+      | `POLLERR` | **A socket-level error occurred**   | - Unexpected socket error (I/O, buffer, etc.) | - Use `getsockopt()` to get reason<br>- `close(fd)` |
+
+    */
+
+    if(pfd.revents & POLLERR)
+    {
+      /* POLLERR — Error : A low-level socket error occurred
+      * 1. Invalid buffer
+      * 2. Network failure
+      * 3. Connection reset
+      * 4. Unrecoverable protocol error
+      */
+
+      int err = 0;
+      socklen_t len = sizeof(err);
+      if(getsockopt(pfd.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+      {
+        std::cerr << "Get socket option for failed";
+      }
+      else
+      {
+        std::cerr << "Socket error: " << std::to_string(err) << "\n";
+      }
+    }
+
+    if(pfd.revents & POLLHUP)
+    {
+      std::cout << "peer hang up" << endl;
+    }
+
+    if(pfd.revents & POLLIN)
+    {
+      if(pfd.fd == tasks.fd())
+      {
+        // Run after the poll set is updated: tasks may add clients.
+        tasks_ready = true;
+      }
+      else if(pfd.fd == server_fd)
+      {
+        auto new_fd = accept_new_client();
+        if(new_fd >= 0)
+        {
+          new_clients.insert(new_fd);
+        }
+      }
+      else
+      {
+        if(handle_existing_client_read(pfd.fd) < 0)
+        {
+          remove_clients.insert(pfd.fd);
+        }
+      }
+    }
+
+    if(pfd.revents & POLLOUT)
+    {
+      handle_existing_client_write(pfd.fd);
+    }
+  }
+
+  close_clients();
+  add_new_clients();
+  if(tasks_ready)
+  {
+    tasks.run_pending();
+  }
+  return polled_fds;
+}
+
+void TcpServer::setup_socket()
+{
+  server_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if(server_fd < 0)
+  {
+    throw std::runtime_error("Socket Creation failed");
+  }
+
+  // A restarted server (or relay node) must not wait for old connections
+  // to leave TIME_WAIT before it can bind again.
+  const int reuse = 1;
+  setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+  struct sockaddr_in address;
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  if(bind(server_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0)
+  {
+    throw std::runtime_error("Socket binding failed");
+  }
+
+  if(listen(server_fd, SOMAXCONN) < 0)
+  {
+    throw std::runtime_error("Socket listening failed");
+  }
+
+  fds.push_back({server_fd, POLLIN, 0});
+
+  std::cout << "Tcp Server is ready for Listen on port " << port << endl;
+}
+
+int TcpServer::accept_new_client()
+{
+  auto client_fd  = accept(server_fd, nullptr, nullptr);
+  if(client_fd < 0)
+  {
+    perror("accept");
+    return -1;
+  }
+
+  // This will cause the problem because it is changing the container while using
+  // it.
+  // fds.push_back({client_fd, POLLIN, 0});
+  pHandler->on_client_connect(ConnectionTable::global().open(client_fd));
+  return client_fd;
+}
+
+int TcpServer::handle_existing_client_read(int client_fd)
+{
+  char buffer[1024];
+  auto nb = recv(client_fd, buffer, sizeof(buffer), 0);
+  if(nb <= 0)
+  {
+    return -1;
+  }
+
+  pHandler->on_client_data(ConnectionTable::global().handle_of(client_fd), buffer, nb);
+  return 0;
+}
+
+void TcpServer::handle_existing_client_write(int client_fd)
+{
+  std::cout << "FD " << client_fd << " is ready to write\n";
+}
+
+void TcpServer::close_clients()
+{
+  for(auto it = fds.begin(); it != fds.end();)
+  {
+    auto find_it = remove_clients.find(it->fd);
+    if(find_it != remove_clients.end())
+    {
+      // Tell the handler first and close through the table: from then on
+      // the handle is dead, even if the fd number is handed out again.
+      ConnectionTable& table = ConnectionTable::global();
+      const ConnectionHandle conn = table.handle_of(it->fd);
+      pHandler->on_client_disconnect(conn);
+      if(!(it->revents & POLLNVAL))
+      {
+        table.close(conn);
+      }
+      it = fds.erase(it);
+    }
+    else
+    {
+      ++it;
+    }
+  }
+}
+
+void TcpServer::add_new_clients()
+{
+  for(const auto fd : new_clients)
+  {
+    fds.push_back({fd, POLLIN, 0});
+  }
+}
+
+void TcpServer::add_client(int client_fd)
+{
+  pHandler->on_client_connect(ConnectionTable::global().open(client_fd));
+  fds.push_back({client_fd, POLLIN, 0});
+}
+
+size_t TcpServer::client_count() const
+{
+  // Minus the task eventfd and the listening socket.
+  return server_fd < 0 ? fds.size() - 1 : fds.size() - 2;
+}
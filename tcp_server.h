@@ -0,0 +1,92 @@
+#ifndef TCP_SERVER_H
+#define TCP_SERVER_H
+
+#include "connection_table.h"
+#include "loop_task_queue.h"
+#include "websocket.h"
+
+#include <sys/types.h>
+#include <sys/poll.h>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+//Client Handler Interface
+// Clients are identified by ConnectionHandle, never by fd: a handle stays
+// unique after the connection is gone, so late sends are dropped instead of
+// reaching a new client that got the same fd number.
+
+class IClientHandler
+{
+  public:
+    virtual ~IClientHandler() = default;
+    virtual void on_client_connect(ConnectionHandle conn) = 0;
+    virtual void on_client_data(
+      ConnectionHandle conn, const char* data, ssize_t len) = 0;
+    virtual void on_client_disconnect(ConnectionHandle conn) = 0;
+
+  protected:
+    // Safe from any thread; -1 / EBADF once the client is gone. Framed
+    // for the client's transport (see WireMessage).
+    static ssize_t send(ConnectionHandle conn, const void* data, size_t len)
+    {
+      return WireMessage(static_cast<const char*>(data), len).send(conn);
+    }
+    // One message to many clients: framed once per transport.
+    static ssize_t send(ConnectionHandle conn, WireMessage& msg)
+    {
+      return msg.send(conn);
+    }
+};
+
+class TcpServer
+{
+  public:
+    TcpServer(const int port, std::shared_ptr<IClientHandler> p_handler);
+    // Detached server: no listening socket, clients are handed in with
+    // add_client(). Used to drive handlers over socketpair() in benchmarks.
+    explicit TcpServer(std::shared_ptr<IClientHandler> p_handler);
+    ~TcpServer();
+    void run();
+    // Makes run() return after the current iteration. Async-signal-safe, so
+    // it can be called from a SIGTERM handler.
+    void stop();
+
+    // One iteration of the event loop. Returns the number of ready fds,
+    // 0 on timeout, -1 on error.
+    int poll_once(int timeout_ms);
+
+    // Runs `task` on the loop thread; callable from any thread. Many posts
+    // between two loop iterations cost one wakeup. Tasks run after the
+    // iteration's events, outside handler callbacks.
+    void post(LoopTaskQueue::Task task);
+    // Runs `task` right away when called on the loop thread, else post()s it.
+    void run_in_loop(LoopTaskQueue::Task task);
+
+    // Adopts an already connected socket. Must not be called from inside a
+    // handler callback (it modifies the poll set); from a task it is fine.
+    void add_client(int client_fd);
+    size_t client_count() const;
+
+  private:
+    int server_fd;
+    const int port;
+    const std::shared_ptr<IClientHandler> pHandler;
+    std::vector<pollfd> fds;
+    std::unordered_set<int> new_clients;
+    std::unordered_set<int> remove_clients;
+    std::atomic<bool> stopping{false};
+    LoopTaskQueue tasks;
+    std::atomic<std::thread::id> loop_thread{};
+  private:
+    void setup_socket();
+    int accept_new_client();
+    int handle_existing_client_read(int client_fd);
+    void handle_existing_client_write(int client_fd);
+    void close_clients();
+    void add_new_clients();
+};
+
+#endif
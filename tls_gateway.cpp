@@ -0,0 +1,585 @@
+#include "tls_gateway.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+#include <sys/socket.h>
+
+#ifdef HAVE_OPENSSL
+#include <linux/tls.h>
+#include <openssl/bio.h>
+#include <openssl/core_names.h>
+#include <openssl/err.h>
+#include <openssl/kdf.h>
+#include <openssl/ssl.h>
+#endif
+
+using namespace std;
+
+#ifdef HAVE_OPENSSL
+
+namespace
+{
+  std::runtime_error ssl_error(const std::string& what)
+  {
+    char reason[256] = "unknown error";
+    const unsigned long err = ERR_get_error();
+    if(err != 0)
+    {
+      ERR_error_string_n(err, reason, sizeof(reason));
+    }
+    ERR_clear_error();
+    return std::runtime_error(what + ": " + reason);
+  }
+
+  // Sends what SSL_write left in the memory BIO; blocks like any send().
+  bool flush(int fd, BIO* wbio)
+  {
+    char* data = nullptr;
+    const long len = BIO_get_mem_data(wbio, &data);
+    long sent = 0;
+    while(sent < len)
+    {
+      const ssize_t n = ::send(fd, data + sent, len - sent, MSG_NOSIGNAL);
+      if(n < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      if(n <= 0)
+      {
+        break;
+      }
+      sent += n;
+    }
+    (void)BIO_reset(wbio);
+    return sent == len;
+  }
+
+  uint64_t now_ms()
+  {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  // What the kernel needs to decrypt the client's records from here on.
+  struct RxKeys
+  {
+    uint16_t version = 0;             // TLS_1_2_VERSION or TLS_1_3_VERSION
+    uint16_t cipher = 0;              // TLS_CIPHER_AES_GCM_128 or _256
+    unsigned char key[32] = {};
+    size_t key_len = 0;
+    unsigned char salt[4] = {};
+    unsigned char iv[8] = {};
+    uint64_t seq = 0;
+  };
+
+  bool derive(const char* kdf_name, OSSL_PARAM* params, unsigned char* out, size_t len)
+  {
+    EVP_KDF* kdf = EVP_KDF_fetch(nullptr, kdf_name, nullptr);
+    EVP_KDF_CTX* kctx = kdf != nullptr ? EVP_KDF_CTX_new(kdf) : nullptr;
+    const bool ok = kctx != nullptr && EVP_KDF_derive(kctx, out, len, params) == 1;
+    EVP_KDF_CTX_free(kctx);
+    EVP_KDF_free(kdf);
+    ERR_clear_error();
+    return ok;
+  }
+
+  // TLS 1.3 HKDF-Expand-Label(secret, label, "", len).
+  bool expand_label(const EVP_MD* md, const std::string& secret, const std::string& label,
+    unsigned char* out, size_t len)
+  {
+    std::string info;
+    info += static_cast<char>(len >> 8);
+    info += static_cast<char>(len);
+    info += static_cast<char>(6 + label.size());
+    info += "tls13 " + label;
+    info += '\0';                     // empty context
+    int mode = EVP_KDF_HKDF_MODE_EXPAND_ONLY;
+    OSSL_PARAM params[] = {
+      OSSL_PARAM_construct_int(OSSL_KDF_PARAM_MODE, &mode),
+      OSSL_PARAM_construct_utf8_string(OSSL_KDF_PARAM_DIGEST,
+        const_cast<char*>(EVP_MD_get0_name(md)), 0),
+      OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_KEY,
+        const_cast<char*>(secret.data()), secret.size()),
+      OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_INFO, info.data(), info.size()),
+      OSSL_PARAM_construct_end()};
+    return derive(OSSL_KDF_NAME_HKDF, params, out, len);
+  }
+
+  // The client write key and IV right after the handshake, when the only
+  // client record read under them is its Finished (TLS 1.2) or none at
+  // all (TLS 1.3, whose application secret `client_secret` comes from the
+  // key log callback). AES-GCM only, like the kernel's fast paths.
+  bool client_rx_keys(SSL* ssl, const std::string& client_secret, RxKeys& keys)
+  {
+    const SSL_CIPHER* cipher = SSL_get_current_cipher(ssl);
+    const int nid = cipher != nullptr ? SSL_CIPHER_get_cipher_nid(cipher) : NID_undef;
+    if(nid != NID_aes_128_gcm && nid != NID_aes_256_gcm)
+    {
+      return false;
+    }
+    const EVP_MD* md = SSL_CIPHER_get_handshake_digest(cipher);
+    keys.cipher = nid == NID_aes_128_gcm ? TLS_CIPHER_AES_GCM_128 : TLS_CIPHER_AES_GCM_256;
+    keys.key_len = nid == NID_aes_128_gcm ? 16 : 32;
+
+    if(SSL_version(ssl) == TLS1_3_VERSION)
+    {
+      unsigned char iv[12];
+      if(client_secret.empty() || !expand_label(md, client_secret, "key", keys.key, keys.key_len)
+        || !expand_label(md, client_secret, "iv", iv, sizeof(iv)))
+      {
+        return false;
+      }
+      keys.version = TLS_1_3_VERSION;
+      memcpy(keys.salt, iv, sizeof(keys.salt));
+      memcpy(keys.iv, iv + sizeof(keys.salt), sizeof(keys.iv));
+      keys.seq = 0;
+      return true;
+    }
+    if(SSL_version(ssl) != TLS1_2_VERSION)
+    {
+      return false;
+    }
+
+    // RFC 5246 6.3 key block, no MAC keys for AEAD: client key, server
+    // key, client IV, server IV.
+    unsigned char master[SSL_MAX_MASTER_KEY_LENGTH];
+    const size_t master_len = SSL_SESSION_get_master_key(SSL_get_session(ssl), master,
+      sizeof(master));
+    std::string seed = "key expansion";
+    unsigned char random[SSL3_RANDOM_SIZE];
+    seed.append(reinterpret_cast<char*>(random), SSL_get_server_random(ssl, random, sizeof(random)));
+    seed.append(reinterpret_cast<char*>(random), SSL_get_client_random(ssl, random, sizeof(random)));
+    unsigned char block[2 * 32 + 2 * 4];
+    OSSL_PARAM params[] = {
+      OSSL_PARAM_construct_utf8_string(OSSL_KDF_PARAM_DIGEST,
+        const_cast<char*>(EVP_MD_get0_name(md)), 0),
+      OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SECRET, master, master_len),
+      OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SEED, seed.data(), seed.size()),
+      OSSL_PARAM_construct_end()};
+    const size_t block_len = 2 * keys.key_len + 2 * sizeof(keys.salt);
+    const bool ok = master_len > 0 && derive(OSSL_KDF_NAME_TLS1_PRF, params, block, block_len);
+    OPENSSL_cleanse(master, sizeof(master));
+    if(!ok)
+    {
+      return false;
+    }
+    keys.version = TLS_1_2_VERSION;
+    memcpy(keys.key, block, keys.key_len);
+    memcpy(keys.salt, block + 2 * keys.key_len, sizeof(keys.salt));
+    OPENSSL_cleanse(block, sizeof(block));
+    keys.seq = 1;                     // 0 was the Finished
+    for(int i = 7; i >= 0; --i)
+    {
+      keys.iv[i] = static_cast<unsigned char>(keys.seq >> (8 * (7 - i)));
+    }
+    return true;
+  }
+
+  template<typename Info>
+  bool set_rx(int fd, const RxKeys& keys)
+  {
+    Info info{};
+    info.info.version = keys.version;
+    info.info.cipher_type = keys.cipher;
+    memcpy(info.key, keys.key, sizeof(info.key));
+    memcpy(info.salt, keys.salt, sizeof(info.salt));
+    memcpy(info.iv, keys.iv, sizeof(info.iv));
+    for(int i = 7; i >= 0; --i)
+    {
+      info.rec_seq[i] = static_cast<unsigned char>(keys.seq >> (8 * (7 - i)));
+    }
+    const bool ok = setsockopt(fd, SOL_TLS, TLS_RX, &info, sizeof(info)) == 0;
+    OPENSSL_cleanse(&info, sizeof(info));
+    return ok;
+  }
+
+  // The tls ULP is already on the socket: OpenSSL put it there for sending.
+  bool set_kernel_rx(int fd, const RxKeys& keys)
+  {
+    return keys.cipher == TLS_CIPHER_AES_GCM_128 ?
+      set_rx<tls12_crypto_info_aes_gcm_128>(fd, keys) :
+      set_rx<tls12_crypto_info_aes_gcm_256>(fd, keys);
+  }
+
+  // The client's TLS 1.3 application secret, for client_rx_keys().
+  void keylog(const SSL* ssl, const char* line)
+  {
+    static const char label[] = "CLIENT_TRAFFIC_SECRET_0 ";
+    auto* secret = static_cast<std::string*>(SSL_get_app_data(ssl));
+    if(secret == nullptr || strncmp(line, label, sizeof(label) - 1) != 0)
+    {
+      return;
+    }
+    const char* hex = strrchr(line, ' ') + 1;
+    secret->clear();
+    for(size_t i = 0; hex[i] != '\0' && hex[i + 1] != '\0'; i += 2)
+    {
+      secret->push_back(static_cast<char>(std::stoi(std::string(hex + i, 2), nullptr, 16)));
+    }
+  }
+}
+
+// One connection. As a transport it encrypts sends in user space; it is
+// owned by the gateway and, while registered, by the ConnectionTable slot,
+// so a send racing the disconnect still finds it alive.
+struct TlsGateway::Session : public ConnectionTransport
+{
+  SSL* ssl = nullptr;
+  BIO* rbio = nullptr;                // memory BIO the reactor's reads go to
+  BIO* wbio = nullptr;                // memory BIO when sending in user space
+  std::atomic<bool> handshaking{true};
+  uint64_t deadline_ms = 0;           // for the handshake
+  bool established = false;
+  bool kernel_rx = false;             // recv() returns plaintext
+  std::string client_secret;          // TLS 1.3, from the key log
+
+  ~Session() override
+  {
+    SSL_free(ssl);                    // frees the BIOs too
+    OPENSSL_cleanse(&client_secret[0], client_secret.size());
+  }
+
+  ssize_t write(int fd, const iovec* iov, int count) override
+  {
+    // One SSL_write per send: a WebSocket header and its payload go out
+    // in the same record.
+    thread_local std::string joined;
+    joined.clear();
+    for(int i = 0; i < count; ++i)
+    {
+      joined.append(static_cast<const char*>(iov[i].iov_base), iov[i].iov_len);
+    }
+    if(joined.empty())
+    {
+      return 0;
+    }
+    if(SSL_write(ssl, joined.data(), static_cast<int>(joined.size())) <= 0)
+    {
+      ERR_clear_error();
+      errno = EIO;
+      return -1;
+    }
+    return flush(fd, wbio) ? static_cast<ssize_t>(joined.size()) : -1;
+  }
+};
+
+TlsGateway::TlsGateway(std::shared_ptr<IClientHandler> inner, const std::string& cert_path,
+  const std::string& key_path) :
+  inner(std::move(inner))
+{
+  ctx = SSL_CTX_new(TLS_server_method());
+  if(ctx == nullptr)
+  {
+    throw ssl_error("tls: SSL_CTX_new");
+  }
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+  SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+  SSL_CTX_set_num_tickets(ctx, 0);
+  SSL_CTX_set_keylog_callback(ctx, keylog);
+  if(SSL_CTX_use_certificate_chain_file(ctx, cert_path.c_str()) != 1)
+  {
+    SSL_CTX_free(ctx);
+    throw ssl_error("tls: loading " + cert_path);
+  }
+  if(SSL_CTX_use_PrivateKey_file(ctx, key_path.c_str(), SSL_FILETYPE_PEM) != 1
+    || SSL_CTX_check_private_key(ctx) != 1)
+  {
+    SSL_CTX_free(ctx);
+    throw ssl_error("tls: loading " + key_path);
+  }
+  reaper = std::thread(&TlsGateway::reap_loop, this);
+}
+
+TlsGateway::~TlsGateway()
+{
+  {
+    std::lock_guard<std::mutex> lk(stop_mutex);
+    stopping = true;
+  }
+  stop_cv.notify_one();
+  if(reaper.joinable())
+  {
+    reaper.join();
+  }
+  SSL_CTX_free(ctx);
+}
+
+void TlsGateway::on_client_connect(ConnectionHandle conn)
+{
+  ConnectionTable& table = ConnectionTable::global();
+  auto session = std::make_shared<Session>();
+  session->deadline_ms = now_ms() + HANDSHAKE_TIMEOUT_MS;
+
+  // Ciphertext comes from the reactor's reads; handshake records go
+  // straight to the socket, which is where the kernel takes over sending
+  // if it can.
+  session->ssl = SSL_new(ctx);
+  BIO* socket_bio = BIO_new_socket(table.fd_of(conn), BIO_NOCLOSE);
+  session->rbio = BIO_new(BIO_s_mem());
+  if(session->ssl == nullptr || socket_bio == nullptr || session->rbio == nullptr)
+  {
+    BIO_free(socket_bio);
+    BIO_free(session->rbio);
+    session->rbio = nullptr;
+    ERR_clear_error();
+    table.shutdown(conn);
+    return;
+  }
+  SSL_set0_rbio(session->ssl, session->rbio);
+  SSL_set0_wbio(session->ssl, socket_bio);
+  SSL_set_app_data(session->ssl, &session->client_secret);
+  SSL_set_accept_state(session->ssl);
+
+  Stripe& stripe = stripe_of(conn);
+  std::lock_guard<std::mutex> lk(stripe.mutex);
+  stripe.sessions[conn] = session;
+}
+
+bool TlsGateway::handshake(ConnectionHandle conn, Session& session, const char* data, ssize_t len)
+{
+  BIO_write(session.rbio, data, static_cast<int>(len));
+  const int result = SSL_do_handshake(session.ssl);
+  if(result == 1)
+  {
+    finish_handshake(conn, session);
+    return true;
+  }
+  const bool waiting = SSL_get_error(session.ssl, result) == SSL_ERROR_WANT_READ;
+  ERR_clear_error();
+  return waiting;
+}
+
+void TlsGateway::finish_handshake(ConnectionHandle conn, Session& session)
+{
+  const int fd = ConnectionTable::global().fd_of(conn);
+  if(BIO_get_ktls_send(SSL_get_wbio(session.ssl)))
+  {
+    // Receiving moves into the kernel too, unless the reactor has already
+    // read records past the client's Finished: they are in rbio, and the
+    // kernel would start behind them.
+    RxKeys keys;
+    session.kernel_rx = BIO_ctrl_pending(session.rbio) == 0
+      && client_rx_keys(session.ssl, session.client_secret, keys) && set_kernel_rx(fd, keys);
+    OPENSSL_cleanse(&keys, sizeof(keys));
+    if(!session.kernel_rx && !rx_fallback_reported.exchange(true))
+    {
+      std::cout << "tls: kernel TLS receive unavailable, decrypting in user space\n";
+    }
+  }
+  else
+  {
+    // Sending the kernel did not take is done on a memory BIO, through
+    // the transport.
+    session.wbio = BIO_new(BIO_s_mem());
+    SSL_set0_wbio(session.ssl, session.wbio);
+    ConnectionTable::global().set_transport(conn, find(conn));
+    if(!fallback_reported.exchange(true))
+    {
+      std::cout << "tls: kernel TLS unavailable, encrypting in user space\n";
+    }
+  }
+  OPENSSL_cleanse(&session.client_secret[0], session.client_secret.size());
+  session.client_secret.clear();
+  session.established = true;
+  session.handshaking.store(false, std::memory_order_release);
+  inner->on_client_connect(conn);
+}
+
+void TlsGateway::on_client_data(ConnectionHandle conn, const char* data, ssize_t len)
+{
+  std::shared_ptr<Session> session = find(conn);
+  if(!session || len <= 0)
+  {
+    return;
+  }
+  if(session->kernel_rx)
+  {
+    inner->on_client_data(conn, data, len);
+    return;
+  }
+  if(!session->established)
+  {
+    // Nobody else writes to the connection before it is established.
+    if(!handshake(conn, *session, data, len))
+    {
+      ConnectionTable::global().shutdown(conn);
+      return;
+    }
+    if(!session->established)
+    {
+      return;
+    }
+    if(session->kernel_rx)
+    {
+      return;
+    }
+    // Records the client sent right behind its Finished are in rbio.
+    data = nullptr;
+    len = 0;
+  }
+
+  std::string plain;
+  bool failed = false;
+  auto decrypt = [&](int fd)
+  {
+    if(len > 0)
+    {
+      BIO_write(session->rbio, data, static_cast<int>(len));
+    }
+    char buffer[16 * 1024];
+    for(;;)
+    {
+      const int n = SSL_read(session->ssl, buffer, sizeof(buffer));
+      if(n > 0)
+      {
+        plain.append(buffer, n);
+        continue;
+      }
+      // WANT_READ: the rest of the record is still in flight. Anything
+      // else is close_notify or a broken record.
+      failed = SSL_get_error(session->ssl, n) != SSL_ERROR_WANT_READ;
+      ERR_clear_error();
+      break;
+    }
+    // Reading can produce records of our own (alerts, key updates).
+    if(session->wbio != nullptr)
+    {
+      flush(fd, session->wbio);
+    }
+  };
+  if(session->wbio == nullptr)
+  {
+    // Senders never touch the SSL object when the kernel encrypts, so
+    // there is nothing to lock against, and a send blocked on a slow
+    // client must not hold up this reactor. Records SSL_read writes
+    // itself (alerts) go to the socket like any other send.
+    decrypt(-1);
+  }
+  else
+  {
+    ConnectionTable::global().with_socket(conn, decrypt);
+  }
+
+  // Outside the slot lock: the inner handler sends to this connection.
+  if(!plain.empty())
+  {
+    inner->on_client_data(conn, plain.data(), plain.size());
+  }
+  if(failed)
+  {
+    ConnectionTable::global().shutdown(conn);
+  }
+}
+
+void TlsGateway::reap_loop()
+{
+  const int interval_ms = HANDSHAKE_TIMEOUT_MS / 4;
+  std::unique_lock<std::mutex> lk(stop_mutex);
+  while(!stop_cv.wait_for(lk, std::chrono::milliseconds(interval_ms),
+    [this] { return stopping; }))
+  {
+    lk.unlock();
+    const uint64_t now = now_ms();
+    std::vector<ConnectionHandle> expired;
+    for(Stripe& stripe : stripes)
+    {
+      std::lock_guard<std::mutex> stripe_lk(stripe.mutex);
+      for(const auto& entry : stripe.sessions)
+      {
+        if(entry.second->handshaking.load(std::memory_order_acquire)
+          && entry.second->deadline_ms <= now)
+        {
+          expired.push_back(entry.first);
+        }
+      }
+    }
+    // Stale handles are refused, so a connection that completed or went
+    // away meanwhile is left alone.
+    for(ConnectionHandle conn : expired)
+    {
+      ConnectionTable::global().shutdown(conn);
+    }
+    lk.lock();
+  }
+}
+
+#else
+
+struct TlsGateway::Session
+{
+  bool established = false;
+};
+
+TlsGateway::TlsGateway(std::shared_ptr<IClientHandler> inner, const std::string&,
+  const std::string&) :
+  inner(std::move(inner))
+{
+  throw std::runtime_error("tls: built without OpenSSL");
+}
+
+TlsGateway::~TlsGateway()
+{
+}
+
+bool TlsGateway::handshake(ConnectionHandle, Session&, const char*, ssize_t)
+{
+  return false;
+}
+
+void TlsGateway::finish_handshake(ConnectionHandle, Session&)
+{
+}
+
+void TlsGateway::reap_loop()
+{
+}
+
+void TlsGateway::on_client_connect(ConnectionHandle)
+{
+}
+
+void TlsGateway::on_client_data(ConnectionHandle, const char*, ssize_t)
+{
+}
+
+#endif
+
+TlsGateway::Stripe& TlsGateway::stripe_of(ConnectionHandle conn)
+{
+  return stripes[conn.slot % STRIPES];
+}
+
+std::shared_ptr<TlsGateway::Session> TlsGateway::find(ConnectionHandle conn)
+{
+  Stripe& stripe = stripe_of(conn);
+  std::lock_guard<std::mutex> lk(stripe.mutex);
+  auto it = stripe.sessions.find(conn);
+  return it == stripe.sessions.end() ? nullptr : it->second;
+}
+
+void TlsGateway::on_client_disconnect(ConnectionHandle conn)
+{
+  std::shared_ptr<Session> session;
+  {
+    Stripe& stripe = stripe_of(conn);
+    std::lock_guard<std::mutex> lk(stripe.mutex);
+    auto it = stripe.sessions.find(conn);
+    if(it == stripe.sessions.end())
+    {
+      return;
+    }
+    session = std::move(it->second);
+    stripe.sessions.erase(it);
+  }
+  // The slot keeps its reference (the transport) until the server closes
+  // it, so sends after this point are still encrypted.
+  if(session->established)
+  {
+    inner->on_client_disconnect(conn);
+  }
+}
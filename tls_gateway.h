@@ -0,0 +1,109 @@
+#ifndef TLS_GATEWAY_H
+#define TLS_GATEWAY_H
+
+#include "tcp_server.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+typedef struct ssl_ctx_st SSL_CTX;
+
+/* TLS termination in front of any handler.
+ * OpenSSL does the handshake and the record layer is handed to the
+ * kernel (kTLS) when it can take it, so after the handshake every
+ * existing send path (writev'd WebSocket frames, spliced proxy bytes) and
+ * the reactor's reads work unchanged on the socket:
+ *
+ *   client --TLS--> kernel decrypts --recv()----> inner handler
+ *   client <--TLS-- kernel encrypts <--send()---- inner handler
+ *
+  | Direction | kTLS available (tls module, AES-GCM) | Otherwise (user space)     |
+  | --------- | ------------------------------------ | -------------------------- |
+  | receive   | recv() of plaintext: the client keys | on_client_data decrypts    |
+  |           | are handed to the kernel (TLS_RX)    | with SSL_read              |
+  | send      | send() of plaintext                  | ConnectionTransport runs   |
+  |           |                                      | SSL_write, then send()     |
+ *
+ * Each fallback is chosen per connection and announced once on stdout.
+ * The handshake itself reads from memory: the reactor owns reading the
+ * socket. OpenSSL only offloads a direction whose BIO is the socket, so
+ * receiving is offloaded by hand once the handshake is done: the client
+ * write key is derived from the session (TLS 1.2 key block, TLS 1.3
+ * traffic secret from the key log callback) and set with TLS_RX. That
+ * needs sending in the kernel already and nothing read past the client's
+ * Finished; a client that sends data in the same flight is decrypted in
+ * user space.
+ *
+ * With user space sending, the SSL object is shared by the reactor thread
+ * that decrypts and every thread that sends to the connection, so both go
+ * through the ConnectionTable slot lock (with_socket() and the transport).
+ * With kernel sending, senders never touch it and SSL_read runs unlocked,
+ * so a send stuck on one slow client does not hold up the reactor.
+ * Decrypted data is passed on outside of any lock.
+ *
+ * The handshake is driven by the data the reactor reads, like any other
+ * protocol: on_client_data feeds it to SSL_do_handshake until it
+ * completes, and only then is the inner handler told about the
+ * connection. Nothing blocks on the client. A handshake that has not
+ * completed HANDSHAKE_TIMEOUT_MS after the connect, trickling bytes or
+ * not, is shut down by a reaper thread, a failed one at once; the inner
+ * handler never sees either. No session tickets are issued: a ticket is a
+ * post-handshake record the kernel would have to pass on, and clients
+ * reconnect rarely enough to pay the full handshake.
+*/
+class TlsGateway : public IClientHandler
+{
+  public:
+    static constexpr int HANDSHAKE_TIMEOUT_MS = 3000;
+
+    // PEM files; throws if they do not load or the build has no OpenSSL.
+    TlsGateway(std::shared_ptr<IClientHandler> inner, const std::string& cert_path,
+      const std::string& key_path);
+    ~TlsGateway();
+
+    TlsGateway(const TlsGateway&) = delete;
+    TlsGateway& operator=(const TlsGateway&) = delete;
+
+    void on_client_connect(ConnectionHandle conn) override;
+    void on_client_data(ConnectionHandle conn, const char* data, ssize_t len) override;
+    void on_client_disconnect(ConnectionHandle conn) override;
+
+  private:
+    struct Session;
+
+    struct Stripe
+    {
+      std::mutex mutex;
+      std::unordered_map<ConnectionHandle, std::shared_ptr<Session>> sessions;
+    };
+
+    static const size_t STRIPES = 16;
+
+    const std::shared_ptr<IClientHandler> inner;
+    SSL_CTX* ctx = nullptr;
+    std::atomic<bool> fallback_reported{false};
+    std::atomic<bool> rx_fallback_reported{false};
+    Stripe stripes[STRIPES];
+    std::mutex stop_mutex;
+    std::condition_variable stop_cv;
+    bool stopping = false;
+    // Declared last: it walks the stripes.
+    std::thread reaper;
+
+    Stripe& stripe_of(ConnectionHandle conn);
+    std::shared_ptr<Session> find(ConnectionHandle conn);
+    // Feeds `data` to the handshake; false once it failed.
+    bool handshake(ConnectionHandle conn, Session& session, const char* data, ssize_t len);
+    // Handshake done: picks kTLS or the user space transport for sending.
+    void finish_handshake(ConnectionHandle conn, Session& session);
+    // Shuts down handshakes past their deadline.
+    void reap_loop();
+};
+
+#endif
@@ -0,0 +1,376 @@
+#include "websocket.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WEBSOCKET_X86 1
+#endif
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+using namespace std;
+
+namespace
+{
+  const char* const HANDSHAKE_GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+  uint32_t rotl(uint32_t x, int n)
+  {
+    return (x << n) | (x >> (32 - n));
+  }
+
+  // SHA-1 is only used for the handshake, as RFC 6455 requires.
+  void sha1(const std::string& message, unsigned char digest[20])
+  {
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+
+    std::string data = message;
+    const uint64_t bits = uint64_t(message.size()) * 8;
+    data += '\x80';
+    while(data.size() % 64 != 56)
+    {
+      data += '\0';
+    }
+    for(int i = 7; i >= 0; --i)
+    {
+      data += static_cast<char>(bits >> (i * 8));
+    }
+
+    for(size_t block = 0; block < data.size(); block += 64)
+    {
+      uint32_t w[80];
+      for(int i = 0; i < 16; ++i)
+      {
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(&data[block + i * 4]);
+        w[i] = uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | p[3];
+      }
+      for(int i = 16; i < 80; ++i)
+      {
+        w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+      }
+
+      uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+      for(int i = 0; i < 80; ++i)
+      {
+        uint32_t f, k;
+        if(i < 20)
+        {
+          f = (b & c) | (~b & d);
+          k = 0x5A827999;
+        }
+        else if(i < 40)
+        {
+          f = b ^ c ^ d;
+          k = 0x6ED9EBA1;
+        }
+        else if(i < 60)
+        {
+          f = (b & c) | (b & d) | (c & d);
+          k = 0x8F1BBCDC;
+        }
+        else
+        {
+          f = b ^ c ^ d;
+          k = 0xCA62C1D6;
+        }
+        const uint32_t t = rotl(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rotl(b, 30);
+        b = a;
+        a = t;
+      }
+      h[0] += a;
+      h[1] += b;
+      h[2] += c;
+      h[3] += d;
+      h[4] += e;
+    }
+
+    for(int i = 0; i < 5; ++i)
+    {
+      digest[i * 4] = h[i] >> 24;
+      digest[i * 4 + 1] = h[i] >> 16;
+      digest[i * 4 + 2] = h[i] >> 8;
+      digest[i * 4 + 3] = h[i];
+    }
+  }
+
+  std::string base64(const unsigned char* data, size_t len)
+  {
+    static const char ALPHABET[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    for(size_t i = 0; i < len; i += 3)
+    {
+      const uint32_t n = uint32_t(data[i]) << 16 |
+        (i + 1 < len ? uint32_t(data[i + 1]) << 8 : 0) |
+        (i + 2 < len ? data[i + 2] : 0);
+      out += ALPHABET[(n >> 18) & 63];
+      out += ALPHABET[(n >> 12) & 63];
+      out += i + 1 < len ? ALPHABET[(n >> 6) & 63] : '=';
+      out += i + 2 < len ? ALPHABET[n & 63] : '=';
+    }
+    return out;
+  }
+
+#ifdef WEBSOCKET_X86
+  // Both return how many bytes they did: a multiple of 4, so the key
+  // stays in phase for the rest.
+  __attribute__((target("avx2")))
+  size_t unmask_avx2(char* data, size_t len, uint32_t key)
+  {
+    const __m256i k = _mm256_set1_epi32(static_cast<int>(key));
+    size_t i = 0;
+    for(; i + 32 <= len; i += 32)
+    {
+      __m256i* p = reinterpret_cast<__m256i*>(data + i);
+      _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), k));
+    }
+    return i;
+  }
+
+  __attribute__((target("sse2")))
+  size_t unmask_sse2(char* data, size_t len, uint32_t key)
+  {
+    const __m128i k = _mm_set1_epi32(static_cast<int>(key));
+    size_t i = 0;
+    for(; i + 16 <= len; i += 16)
+    {
+      __m128i* p = reinterpret_cast<__m128i*>(data + i);
+      _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), k));
+    }
+    return i;
+  }
+#endif
+
+#ifdef HAVE_ZLIB
+  // One compressor and one decompressor per thread, reset per message:
+  // without context takeover no stream outlives a message.
+  struct Deflater
+  {
+    z_stream stream{};
+    bool ok;
+    Deflater()
+    {
+      ok = deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+        Z_DEFAULT_STRATEGY) == Z_OK;
+    }
+    ~Deflater() { if(ok) deflateEnd(&stream); }
+  };
+
+  struct Inflater
+  {
+    z_stream stream{};
+    bool ok;
+    Inflater() { ok = inflateInit2(&stream, -MAX_WBITS) == Z_OK; }
+    ~Inflater() { if(ok) inflateEnd(&stream); }
+  };
+
+  // Every message ends in an empty stored block, which the frame omits.
+  const unsigned char DEFLATE_TAIL[4] = {0x00, 0x00, 0xff, 0xff};
+#endif
+}
+
+size_t WebSocket::frame_header(char* out, uint8_t opcode, uint64_t len, bool compressed)
+{
+  out[0] = static_cast<char>(0x80 | (compressed ? 0x40 : 0) | opcode);
+  if(len < 126)
+  {
+    out[1] = static_cast<char>(len);
+    return 2;
+  }
+  if(len <= 0xffff)
+  {
+    out[1] = 126;
+    out[2] = static_cast<char>(len >> 8);
+    out[3] = static_cast<char>(len);
+    return 4;
+  }
+  out[1] = 127;
+  for(int i = 0; i < 8; ++i)
+  {
+    out[2 + i] = static_cast<char>(len >> (56 - i * 8));
+  }
+  return 10;
+}
+
+std::string WebSocket::frame(uint8_t opcode, const char* data, size_t len)
+{
+  char header[MAX_HEADER];
+  std::string out(header, frame_header(header, opcode, len));
+  out.append(data, len);
+  return out;
+}
+
+void WebSocket::unmask(char* data, size_t len, const char key[4])
+{
+  // The key in memory order, repeated: XOR lines up with the payload bytes
+  // whatever the machine's byte order.
+  uint32_t key32;
+  memcpy(&key32, key, sizeof(key32));
+  size_t i = 0;
+#ifdef WEBSOCKET_X86
+  static const bool avx2 = __builtin_cpu_supports("avx2");
+  i = avx2 ? unmask_avx2(data, len, key32) : unmask_sse2(data, len, key32);
+#endif
+  const uint64_t key64 = uint64_t(key32) << 32 | key32;
+  for(; i + 8 <= len; i += 8)
+  {
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+    word ^= key64;
+    memcpy(data + i, &word, sizeof(word));
+  }
+  for(; i < len; ++i)
+  {
+    data[i] ^= key[i % 4];
+  }
+}
+
+std::string WebSocket::accept_key(const std::string& client_key)
+{
+  unsigned char digest[20];
+  sha1(client_key + HANDSHAKE_GUID, digest);
+  return base64(digest, sizeof(digest));
+}
+
+bool WebSocket::deflate_available()
+{
+#ifdef HAVE_ZLIB
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool WebSocket::deflate(const char* data, size_t len, std::string& out)
+{
+#ifdef HAVE_ZLIB
+  thread_local Deflater deflater;
+  if(!deflater.ok || deflateReset(&deflater.stream) != Z_OK)
+  {
+    return false;
+  }
+  z_stream& z = deflater.stream;
+  out.resize(deflateBound(&z, len) + 16);
+  z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+  z.avail_in = len;
+  z.next_out = reinterpret_cast<Bytef*>(&out[0]);
+  z.avail_out = out.size();
+  if(::deflate(&z, Z_SYNC_FLUSH) != Z_OK || z.avail_in != 0)
+  {
+    return false;
+  }
+  out.resize(out.size() - z.avail_out);
+  if(out.size() < sizeof(DEFLATE_TAIL) ||
+    memcmp(&out[out.size() - sizeof(DEFLATE_TAIL)], DEFLATE_TAIL, sizeof(DEFLATE_TAIL)) != 0)
+  {
+    return false;
+  }
+  out.resize(out.size() - sizeof(DEFLATE_TAIL));
+  return true;
+#else
+  (void)data;
+  (void)len;
+  (void)out;
+  return false;
+#endif
+}
+
+WebSocket::Inflated WebSocket::inflate(const char* data, size_t len, std::string& out,
+  size_t max_len)
+{
+#ifdef HAVE_ZLIB
+  thread_local Inflater inflater;
+  if(!inflater.ok || inflateReset(&inflater.stream) != Z_OK)
+  {
+    return Inflated::CORRUPT;
+  }
+  z_stream& z = inflater.stream;
+  char chunk[16 * 1024];
+  // The payload, then the tail the sender stripped.
+  const std::pair<const char*, size_t> inputs[] = {
+    {data, len}, {reinterpret_cast<const char*>(DEFLATE_TAIL), sizeof(DEFLATE_TAIL)}};
+  for(const auto& input : inputs)
+  {
+    z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.first));
+    z.avail_in = input.second;
+    // A full chunk may leave output pending even with no input left.
+    do
+    {
+      z.next_out = reinterpret_cast<Bytef*>(chunk);
+      z.avail_out = sizeof(chunk);
+      const int rc = ::inflate(&z, Z_SYNC_FLUSH);
+      if(rc != Z_OK && rc != Z_BUF_ERROR && rc != Z_STREAM_END)
+      {
+        return Inflated::CORRUPT;
+      }
+      const size_t produced = sizeof(chunk) - z.avail_out;
+      if(out.size() + produced > max_len)
+      {
+        return Inflated::TOO_BIG;
+      }
+      out.append(chunk, produced);
+      if(rc == Z_STREAM_END || (rc == Z_BUF_ERROR && produced == 0))
+      {
+        break;
+      }
+    } while(z.avail_in > 0 || z.avail_out == 0);
+  }
+  return Inflated::OK;
+#else
+  (void)data;
+  (void)len;
+  (void)out;
+  (void)max_len;
+  return Inflated::CORRUPT;
+#endif
+}
+
+ssize_t WireMessage::send(ConnectionHandle conn)
+{
+  ConnectionTable& table = ConnectionTable::global();
+  switch(table.framing(conn))
+  {
+    case ConnectionTable::Framing::RAW:
+      return table.send(conn, data, len);
+
+    case ConnectionTable::Framing::WEBSOCKET_DEFLATE:
+      if(len >= WebSocket::DEFLATE_MIN)
+      {
+        if(!deflate_tried)
+        {
+          deflate_tried = true;
+          std::string payload;
+          if(WebSocket::deflate(data, len, payload) && payload.size() < len)
+          {
+            char head[WebSocket::MAX_HEADER];
+            deflated.assign(head, WebSocket::frame_header(head, WebSocket::TEXT,
+              payload.size(), true));
+            deflated += payload;
+          }
+        }
+        if(!deflated.empty())
+        {
+          return table.send(conn, deflated.data(), deflated.size());
+        }
+      }
+      // Short or incompressible: an uncompressed frame is allowed too.
+      [[fallthrough]];
+
+    case ConnectionTable::Framing::WEBSOCKET:
+    {
+      if(header_len == 0)
+      {
+        header_len = WebSocket::frame_header(header, WebSocket::TEXT, len);
+      }
+      iovec iov[2] = {{header, header_len}, {const_cast<char*>(data), len}};
+      return table.sendv(conn, iov, 2);
+    }
+  }
+  return -1;
+}
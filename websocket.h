@@ -0,0 +1,102 @@
+#ifndef WEBSOCKET_H
+#define WEBSOCKET_H
+
+#include "connection_table.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/* WebSocket framing (RFC 6455), shared by the gateway and every handler.
+ * After the HTTP upgrade both sides exchange frames:
+ *
+ *   | FIN RSV1-3 opcode | MASK len7 | len16 / len64 | mask key | payload |
+ *        1 byte            1 byte     0, 2 or 8       0 or 4
+ *
+  | Opcode | Frame        | Handling here                                   |
+  | ------ | ------------ | ----------------------------------------------- |
+  | 0      | continuation | appended to the message in progress             |
+  | 1, 2   | text, binary | starts a message, complete when FIN is set      |
+  | 8      | close        | answered with close, then the socket is shut    |
+  | 9, 10  | ping, pong   | ping is answered with pong, pong is ignored     |
+ *
+ * Client frames are masked: the payload is XORed with a 4-byte key, which
+ * unmask() undoes 32 (AVX2) or 16 (SSE2) bytes per instruction. Server
+ * frames are not masked, so the frame for one message is the same for
+ * every recipient.
+ *
+ * permessage-deflate (RFC 7692) compresses a message's payload with raw
+ * deflate and marks the frame with RSV1. It is negotiated without context
+ * takeover in either direction: every message is compressed on its own, so
+ * one compressed frame can be sent to all members of a room, and no
+ * connection keeps a 256 KiB zlib state. It is only available when the
+ * build found zlib (HAVE_ZLIB).
+ *
+ * WireMessage is the send side for handlers. A handler sends bytes without
+ * knowing the connection's transport: RAW connections get them as they
+ * are, WEBSOCKET connections one text frame with the bytes as payload. The
+ * header, and the compressed frame, are built on first use and reused for
+ * every further recipient, so a broadcast frames (and deflates) a message
+ * once, not once per member. The header and the payload go out in one
+ * sendmsg(), without copying the payload.
+*/
+
+class WebSocket
+{
+  public:
+    enum Opcode : uint8_t
+    {
+      CONTINUATION = 0x0, TEXT = 0x1, BINARY = 0x2,
+      CLOSE = 0x8, PING = 0x9, PONG = 0xA
+    };
+
+    // Largest header of an unmasked frame.
+    static constexpr size_t MAX_HEADER = 10;
+    // Shorter messages are not worth compressing without context takeover.
+    static constexpr size_t DEFLATE_MIN = 128;
+
+    // Writes the header of an unmasked, final frame; returns its length.
+    static size_t frame_header(char* out, uint8_t opcode, uint64_t len,
+      bool compressed = false);
+    // A whole unmasked frame.
+    static std::string frame(uint8_t opcode, const char* data, size_t len);
+
+    // XORs `data` with the 4-byte masking key, in place.
+    static void unmask(char* data, size_t len, const char key[4]);
+
+    // Sec-WebSocket-Accept for a client's Sec-WebSocket-Key.
+    static std::string accept_key(const std::string& client_key);
+
+    static bool deflate_available();
+    // permessage-deflate payload of `data`; false on error.
+    static bool deflate(const char* data, size_t len, std::string& out);
+    enum class Inflated { OK, CORRUPT, TOO_BIG };
+    // Appends the decompressed payload to `out`; TOO_BIG if it would make
+    // `out` larger than max_len.
+    static Inflated inflate(const char* data, size_t len, std::string& out, size_t max_len);
+};
+
+class WireMessage
+{
+  public:
+    // The message is not copied: `data` must outlive this object.
+    WireMessage(const char* data, size_t len) : data(data), len(len) {}
+    explicit WireMessage(const std::string& text) : data(text.data()), len(text.size()) {}
+
+    WireMessage(const WireMessage&) = delete;
+    WireMessage& operator=(const WireMessage&) = delete;
+
+    // Sends the message in `conn`'s framing. Not thread safe: one
+    // WireMessage belongs to one sending thread.
+    ssize_t send(ConnectionHandle conn);
+
+  private:
+    const char* const data;
+    const size_t len;
+    char header[WebSocket::MAX_HEADER];
+    size_t header_len = 0;            // built on first WEBSOCKET send
+    std::string deflated;             // whole frame, built on first use
+    bool deflate_tried = false;
+};
+
+#endif
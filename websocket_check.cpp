@@ -0,0 +1,329 @@
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "handler_harness.h"
+#include "websocket.h"
+#include "websocket_gateway.h"
+
+/* Frame-level check of WebSocketGateway.
+ * Each case upgrades a fresh harness client (a socketpair into a real
+ * poll loop), sends handcrafted client frames and compares two things with
+ * the expectation: the lines the inner handler received and the frames the
+ * gateway sent back, written as "pong(<payload>) close(<code>)". There is
+ * at least one case per row of the table in websocket_gateway.h:
+ *
+  | Row                                | Cases                                   |
+  | ---------------------------------- | --------------------------------------- |
+  | not a WebSocket upgrade            | plain GET, wrong version                |
+  | text or binary message (any frags) | 7, 16 and 64 bit lengths, fragments,    |
+  |                                    | byte-by-byte, two messages in one write |
+  | ping                               | alone and between two fragments         |
+  | close                              | no code, 1000, 3000                     |
+  | close, 1-byte or invalid code      | 1 byte, 999, 1005, 1015, 5000           |
+  | unmasked, reserved bits, bad order | unmasked, RSV2, RSV1 undeclared, opcode |
+  |                                    | 3, stray continuation, text in a        |
+  |                                    | message, fragmented ping, 126 byte ping |
+  | compressed, does not inflate       | junk payload (valid one delivered)      |
+  | message over MAX_MESSAGE           | one frame, fragments, inflated size     |
+ *
+ * The deflate cases are skipped when the build has no zlib.
+ *
+ * usage: websocket_check
+ * Prints the failing cases; exit code 1 if there were any.
+*/
+
+using namespace std;
+
+namespace
+{
+  const char MASK[4] = {0x12, 0x34, 0x56, 0x78};
+
+  // Records what the gateway hands on, for all connections.
+  class RecordingHandler : public IClientHandler
+  {
+    public:
+      void on_client_connect(ConnectionHandle) override {}
+      void on_client_data(ConnectionHandle, const char* data, ssize_t len) override
+      {
+        lines.append(data, len);
+      }
+      void on_client_disconnect(ConnectionHandle) override {}
+
+      std::string lines;
+  };
+
+  std::string upgrade_request(bool deflate, const std::string& version = "13")
+  {
+    return "GET /chat HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\n"
+      "Connection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+      "Sec-WebSocket-Version: " + version + "\r\n" +
+      (deflate ? "Sec-WebSocket-Extensions: permessage-deflate\r\n" : "") + "\r\n";
+  }
+
+  // A client frame. `first` is FIN, RSV and opcode as they go on the wire.
+  std::string client_frame(uint8_t first, const std::string& payload, bool masked = true)
+  {
+    std::string frame(1, static_cast<char>(first));
+    const uint8_t mask_bit = masked ? 0x80 : 0;
+    const uint64_t len = payload.size();
+    if(len < 126)
+    {
+      frame += static_cast<char>(mask_bit | len);
+    }
+    else if(len <= 0xffff)
+    {
+      frame += static_cast<char>(mask_bit | 126);
+      frame += static_cast<char>(len >> 8);
+      frame += static_cast<char>(len);
+    }
+    else
+    {
+      frame += static_cast<char>(mask_bit | 127);
+      for(int shift = 56; shift >= 0; shift -= 8)
+      {
+        frame += static_cast<char>(len >> shift);
+      }
+    }
+    if(!masked)
+    {
+      return frame + payload;
+    }
+    frame.append(MASK, sizeof(MASK));
+    for(size_t i = 0; i < payload.size(); ++i)
+    {
+      frame += static_cast<char>(payload[i] ^ MASK[i % 4]);
+    }
+    return frame;
+  }
+
+  // Only the header: for lengths the gateway must refuse before the payload.
+  std::string client_header(uint8_t first, uint64_t len)
+  {
+    std::string frame(1, static_cast<char>(first));
+    frame += static_cast<char>(0x80 | 127);
+    for(int shift = 56; shift >= 0; shift -= 8)
+    {
+      frame += static_cast<char>(len >> shift);
+    }
+    return frame.append(MASK, sizeof(MASK));
+  }
+
+  std::string close_payload(uint16_t code)
+  {
+    return std::string{static_cast<char>(code >> 8), static_cast<char>(code)};
+  }
+
+  std::string deflated(const std::string& text)
+  {
+    std::string out;
+    if(!WebSocket::deflate(text.data(), text.size(), out))
+    {
+      throw std::runtime_error("deflate failed");
+    }
+    return out;
+  }
+
+  // The gateway's unmasked frames, as "pong(...) close(...)".
+  std::string describe_frames(const std::string& data)
+  {
+    std::string out;
+    size_t pos = 0;
+    while(data.size() - pos >= 2)
+    {
+      const uint8_t opcode = data[pos] & 0x0f;
+      uint64_t len = data[pos + 1] & 0x7f;
+      size_t header = 2;
+      if(len >= 126)
+      {
+        const size_t bytes = len == 126 ? 2 : 8;
+        len = 0;
+        for(size_t i = 0; i < bytes && pos + 2 + i < data.size(); ++i)
+        {
+          len = len << 8 | static_cast<unsigned char>(data[pos + 2 + i]);
+        }
+        header += bytes;
+      }
+      if(data.size() - pos < header + len)
+      {
+        return out + "torn";
+      }
+      const std::string payload = data.substr(pos + header, len);
+      pos += header + len;
+
+      out += out.empty() ? "" : " ";
+      if(opcode == WebSocket::CLOSE && payload.size() == 2)
+      {
+        out += "close(" + std::to_string(static_cast<unsigned char>(payload[0]) << 8 |
+          static_cast<unsigned char>(payload[1])) + ")";
+      }
+      else if(opcode == WebSocket::PONG)
+      {
+        out += "pong(" + payload + ")";
+      }
+      else
+      {
+        out += "op" + std::to_string(opcode) + "(" + std::to_string(len) + ")";
+      }
+    }
+    return out;
+  }
+
+  struct Case
+  {
+    std::string name;
+    std::vector<std::string> writes;  // one harness send() each
+    std::string lines;                // expected at the inner handler
+    std::string frames;               // expected back, see describe_frames()
+    bool deflate = false;             // offer permessage-deflate
+    bool upgrade = true;              // false: writes[0] is the request
+  };
+
+  std::vector<Case> cases()
+  {
+    const uint8_t FIN = 0x80, RSV1 = 0x40, RSV2 = 0x20;
+    const uint8_t TEXT = WebSocket::TEXT, BINARY = WebSocket::BINARY;
+    const uint8_t CONT = WebSocket::CONTINUATION, CLOSE = WebSocket::CLOSE;
+    const uint8_t PING = WebSocket::PING;
+    const std::string medium(300, 'm');
+    const std::string large(70000, 'l');
+    const std::string half(WebSocketGateway::MAX_MESSAGE / 2 + 1, 'h');
+    const std::string hello = client_frame(FIN | TEXT, "hello");
+
+    std::vector<Case> all = {
+      {"plain GET", {"GET / HTTP/1.1\r\nHost: x\r\n\r\n"}, "", "HTTP/1.1 400", false, false},
+      {"wrong version", {upgrade_request(false, "8")}, "", "HTTP/1.1 400", false, false},
+
+      {"7 bit length", {hello}, "hello\n", ""},
+      {"16 bit length", {client_frame(FIN | TEXT, medium)}, medium + "\n", ""},
+      {"64 bit length", {client_frame(FIN | BINARY, large)}, large + "\n", ""},
+      {"fragments", {client_frame(TEXT, "one "), client_frame(CONT, "two "),
+        client_frame(FIN | CONT, "three")}, "one two three\n", ""},
+      {"two messages in one write", {hello + client_frame(FIN | TEXT, "again\n")},
+        "hello\nagain\n", ""},
+
+      {"ping", {client_frame(FIN | PING, "are you there")}, "", "pong(are you there)"},
+      {"ping between fragments", {client_frame(TEXT, "split "),
+        client_frame(FIN | PING, "p"), client_frame(FIN | CONT, "message")},
+        "split message\n", "pong(p)"},
+
+      {"close without code", {client_frame(FIN | CLOSE, "")}, "", "close(1000)"},
+      {"close 1000", {client_frame(FIN | CLOSE, close_payload(1000) + "bye")}, "", "close(1000)"},
+      {"close 3000", {client_frame(FIN | CLOSE, close_payload(3000))}, "", "close(3000)"},
+      {"nothing after close", {client_frame(FIN | CLOSE, "") + hello}, "", "close(1000)"},
+
+      {"close 1 byte", {client_frame(FIN | CLOSE, "x")}, "", "close(1002)"},
+      {"close 999", {client_frame(FIN | CLOSE, close_payload(999))}, "", "close(1002)"},
+      {"close 1005", {client_frame(FIN | CLOSE, close_payload(1005))}, "", "close(1002)"},
+      {"close 1015", {client_frame(FIN | CLOSE, close_payload(1015))}, "", "close(1002)"},
+      {"close 5000", {client_frame(FIN | CLOSE, close_payload(5000))}, "", "close(1002)"},
+
+      {"unmasked", {client_frame(FIN | TEXT, "hello", false)}, "", "close(1002)"},
+      {"RSV2", {client_frame(FIN | RSV2 | TEXT, "hello")}, "", "close(1002)"},
+      {"RSV1 not negotiated", {client_frame(FIN | RSV1 | TEXT, "hello")}, "", "close(1002)"},
+      {"opcode 3", {client_frame(FIN | 0x3, "hello")}, "", "close(1002)"},
+      {"stray continuation", {client_frame(FIN | CONT, "hello")}, "", "close(1002)"},
+      {"text inside a message", {client_frame(TEXT, "a"), client_frame(FIN | TEXT, "b")},
+        "", "close(1002)"},
+      {"fragmented ping", {client_frame(PING, "p")}, "", "close(1002)"},
+      {"126 byte ping", {client_frame(FIN | PING, std::string(126, 'p'))}, "", "close(1002)"},
+
+      {"one frame over MAX_MESSAGE",
+        {client_header(FIN | BINARY, WebSocketGateway::MAX_MESSAGE + 1)}, "", "close(1009)"},
+      {"fragments over MAX_MESSAGE", {client_frame(TEXT, half), client_frame(FIN | CONT, half)},
+        "", "close(1009)"},
+    };
+
+    // Byte by byte: every split point of a frame header and payload.
+    Case trickle{"byte by byte", {}, "hello\n" + medium + "\n", ""};
+    for(const std::string& frame : {hello, client_frame(FIN | TEXT, medium)})
+    {
+      for(char c : frame)
+      {
+        trickle.writes.push_back(std::string(1, c));
+      }
+    }
+    all.push_back(trickle);
+
+    if(WebSocket::deflate_available())
+    {
+      const std::string text(2000, 'z');
+      all.push_back({"compressed", {client_frame(FIN | RSV1 | TEXT, deflated(text))},
+        text + "\n", "", true});
+      all.push_back({"compressed junk", {client_frame(FIN | RSV1 | TEXT, "\xff\xfe junk")},
+        "", "close(1007)", true});
+      all.push_back({"RSV1 on a continuation", {client_frame(RSV1 | TEXT, deflated(text)),
+        client_frame(FIN | RSV1 | CONT, "")}, "", "close(1002)", true});
+      all.push_back({"inflates over MAX_MESSAGE", {client_frame(FIN | RSV1 | TEXT,
+        deflated(std::string(WebSocketGateway::MAX_MESSAGE + 1, 'z')))}, "", "close(1009)", true});
+    }
+    return all;
+  }
+
+  // Runs one case; returns a description of what differed, or "".
+  std::string run(const Case& c)
+  {
+    auto inner = std::make_shared<RecordingHandler>();
+    HandlerHarness harness(std::make_shared<WebSocketGateway>(inner));
+    const size_t client = harness.connect_client();
+    if(c.upgrade)
+    {
+      harness.send(client, upgrade_request(c.deflate));
+      harness.run_until_idle();
+      const std::string response = harness.receive(client);
+      if(response.compare(0, 12, "HTTP/1.1 101") != 0)
+      {
+        return "upgrade answered with [" + response.substr(0, 12) + "]";
+      }
+    }
+
+    for(const std::string& write : c.writes)
+    {
+      try
+      {
+        harness.send(client, write);
+      }
+      catch(const std::runtime_error&)
+      {
+        break;                        // the gateway has closed: fine
+      }
+      harness.run_until_idle();
+    }
+    harness.run_until_idle();
+
+    const std::string output = harness.receive(client);
+    const std::string frames = c.upgrade ? describe_frames(output) : output.substr(0, c.frames.size());
+    std::string diff;
+    if(frames != c.frames)
+    {
+      diff += "sent back [" + frames + "], expected [" + c.frames + "]";
+    }
+    if(inner->lines != c.lines)
+    {
+      diff += std::string(diff.empty() ? "" : "; ") + "delivered " +
+        std::to_string(inner->lines.size()) + " bytes [" + inner->lines.substr(0, 40) +
+        "], expected " + std::to_string(c.lines.size());
+    }
+    return diff;
+  }
+}
+
+int main()
+{
+  const std::vector<Case> all = cases();
+  size_t failures = 0;
+  for(const Case& c : all)
+  {
+    const std::string diff = run(c);
+    if(!diff.empty())
+    {
+      ++failures;
+      std::cout << c.name << ": " << diff << "\n";
+    }
+  }
+  std::cout << all.size() << " cases, " << failures << " failures\n";
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,324 @@
+#include "websocket_gateway.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+using namespace std;
+
+namespace
+{
+  const uint16_t CLOSE_NORMAL = 1000;
+  const uint16_t CLOSE_PROTOCOL_ERROR = 1002;
+  const uint16_t CLOSE_INVALID_DATA = 1007;
+  const uint16_t CLOSE_TOO_BIG = 1009;
+
+  // Codes a close frame may carry (RFC 6455 7.4); 1005, 1006 and 1015 are
+  // only for reporting locally and never go on the wire.
+  bool valid_close_code(uint16_t code)
+  {
+    return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1014)
+      || (code >= 3000 && code <= 4999);
+  }
+
+  const char* const BAD_REQUEST =
+    "HTTP/1.1 400 Bad Request\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+
+  std::string lower(std::string s)
+  {
+    std::transform(s.begin(), s.end(), s.begin(),
+      [](unsigned char c) { return std::tolower(c); });
+    return s;
+  }
+
+  std::string trim(const std::string& s)
+  {
+    const size_t first = s.find_first_not_of(" \t");
+    if(first == std::string::npos)
+    {
+      return std::string();
+    }
+    return s.substr(first, s.find_last_not_of(" \t") - first + 1);
+  }
+
+  // Headers of the upgrade request, names in lower case.
+  std::unordered_map<std::string, std::string> parse_headers(const std::string& request)
+  {
+    std::unordered_map<std::string, std::string> headers;
+    size_t pos = request.find("\r\n");
+    while(pos != std::string::npos && pos + 2 < request.size())
+    {
+      const size_t start = pos + 2;
+      const size_t end = request.find("\r\n", start);
+      const std::string line = request.substr(start, end - start);
+      const size_t colon = line.find(':');
+      if(colon != std::string::npos)
+      {
+        std::string& value = headers[lower(trim(line.substr(0, colon)))];
+        // Repeated headers are one comma separated list.
+        value += (value.empty() ? "" : ", ") + trim(line.substr(colon + 1));
+      }
+      pos = end;
+    }
+    return headers;
+  }
+
+  // Control frames go out as they are, not through the connection's framing.
+  void send_control(ConnectionHandle conn, uint8_t opcode, const char* data, size_t len)
+  {
+    const std::string frame = WebSocket::frame(opcode, data, len);
+    ConnectionTable::global().send(conn, frame.data(), frame.size());
+  }
+}
+
+WebSocketGateway::WebSocketGateway(std::shared_ptr<IClientHandler> inner, bool allow_deflate) :
+  inner(std::move(inner)),
+  allow_deflate(allow_deflate && WebSocket::deflate_available())
+{
+}
+
+WebSocketGateway::Stripe& WebSocketGateway::stripe_of(ConnectionHandle conn)
+{
+  return stripes[conn.slot % STRIPES];
+}
+
+WebSocketGateway::Connection* WebSocketGateway::find(ConnectionHandle conn)
+{
+  Stripe& stripe = stripe_of(conn);
+  std::lock_guard<std::mutex> lk(stripe.mutex);
+  auto it = stripe.connections.find(conn);
+  return it == stripe.connections.end() ? nullptr : it->second.get();
+}
+
+void WebSocketGateway::on_client_connect(ConnectionHandle conn)
+{
+  Stripe& stripe = stripe_of(conn);
+  std::lock_guard<std::mutex> lk(stripe.mutex);
+  stripe.connections[conn] = std::make_unique<Connection>();
+}
+
+void WebSocketGateway::on_client_data(ConnectionHandle conn, const char* data, ssize_t len)
+{
+  Connection* c = find(conn);
+  if(c == nullptr || c->closing || len <= 0)
+  {
+    return;
+  }
+
+  c->in.append(data, len);
+  if(!c->upgraded)
+  {
+    handshake(conn, *c);
+  }
+  if(c->upgraded && !c->closing)
+  {
+    read_frames(conn, *c);
+  }
+}
+
+void WebSocketGateway::on_client_disconnect(ConnectionHandle conn)
+{
+  std::unique_ptr<Connection> c;
+  {
+    Stripe& stripe = stripe_of(conn);
+    std::lock_guard<std::mutex> lk(stripe.mutex);
+    auto it = stripe.connections.find(conn);
+    if(it == stripe.connections.end())
+    {
+      return;
+    }
+    c = std::move(it->second);
+    stripe.connections.erase(it);
+  }
+  if(c->upgraded)
+  {
+    inner->on_client_disconnect(conn);
+  }
+}
+
+void WebSocketGateway::handshake(ConnectionHandle conn, Connection& c)
+{
+  const size_t end = c.in.find("\r\n\r\n");
+  if(end == std::string::npos)
+  {
+    if(c.in.size() > MAX_REQUEST)
+    {
+      send(conn, BAD_REQUEST, strlen(BAD_REQUEST));
+      c.closing = true;
+      ConnectionTable::global().shutdown(conn);
+    }
+    return;
+  }
+
+  const std::string request = c.in.substr(0, end + 2);
+  c.in.erase(0, end + 4);
+  auto headers = parse_headers(request);
+  const std::string& key = headers["sec-websocket-key"];
+  if(request.compare(0, 4, "GET ") != 0
+    || lower(headers["upgrade"]).find("websocket") == std::string::npos
+    || lower(headers["connection"]).find("upgrade") == std::string::npos
+    || headers["sec-websocket-version"] != "13" || key.empty())
+  {
+    send(conn, BAD_REQUEST, strlen(BAD_REQUEST));
+    c.closing = true;
+    ConnectionTable::global().shutdown(conn);
+    return;
+  }
+
+  // Our parameters are fixed; an offer that limits our window is declined.
+  const std::string extensions = lower(headers["sec-websocket-extensions"]);
+  c.deflate = allow_deflate
+    && extensions.find("permessage-deflate") != std::string::npos
+    && extensions.find("server_max_window_bits") == std::string::npos;
+
+  std::string response =
+    "HTTP/1.1 101 Switching Protocols\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "Sec-WebSocket-Accept: " + WebSocket::accept_key(key) + "\r\n";
+  if(c.deflate)
+  {
+    response += "Sec-WebSocket-Extensions: permessage-deflate; "
+      "server_no_context_takeover; client_no_context_takeover\r\n";
+  }
+  response += "\r\n";
+  send(conn, response.data(), response.size());
+
+  ConnectionTable::global().set_framing(conn, c.deflate ?
+    ConnectionTable::Framing::WEBSOCKET_DEFLATE : ConnectionTable::Framing::WEBSOCKET);
+  c.upgraded = true;
+  inner->on_client_connect(conn);
+}
+
+void WebSocketGateway::read_frames(ConnectionHandle conn, Connection& c)
+{
+  size_t pos = 0;
+  while(!c.closing && c.in.size() - pos >= 2)
+  {
+    const unsigned char b0 = c.in[pos];
+    const unsigned char b1 = c.in[pos + 1];
+    const bool fin = b0 & 0x80;
+    const bool rsv1 = b0 & 0x40;
+    const uint8_t opcode = b0 & 0x0f;
+    const bool control = opcode & 0x08;
+    const size_t len7 = b1 & 0x7f;
+
+    // Clients must mask; RSV2/3 are never negotiated, RSV1 only with
+    // deflate and only on a message's first frame.
+    if(!(b1 & 0x80) || (b0 & 0x30) || (rsv1 && (!c.deflate || control || opcode == WebSocket::CONTINUATION))
+      || (opcode > WebSocket::BINARY && !control) || opcode > WebSocket::PONG)
+    {
+      close(conn, c, CLOSE_PROTOCOL_ERROR);
+      break;
+    }
+
+    const size_t length_bytes = len7 == 126 ? 2 : len7 == 127 ? 8 : 0;
+    const size_t header = 2 + length_bytes + 4;
+    if(c.in.size() - pos < header)
+    {
+      break;
+    }
+    uint64_t len = len7;
+    if(length_bytes > 0)
+    {
+      len = 0;
+      for(size_t i = 0; i < length_bytes; ++i)
+      {
+        len = len << 8 | static_cast<unsigned char>(c.in[pos + 2 + i]);
+      }
+    }
+    if(control && (!fin || len > 125))
+    {
+      close(conn, c, CLOSE_PROTOCOL_ERROR);
+      break;
+    }
+    if(len > MAX_MESSAGE || (!control && c.message.size() + len > MAX_MESSAGE))
+    {
+      close(conn, c, CLOSE_TOO_BIG);
+      break;
+    }
+    if(c.in.size() - pos - header < len)
+    {
+      break;
+    }
+
+    char* payload = &c.in[pos + header];
+    WebSocket::unmask(payload, len, &c.in[pos + header - 4]);
+    pos += header + len;
+
+    switch(opcode)
+    {
+      case WebSocket::PING:
+        send_control(conn, WebSocket::PONG, payload, len);
+        break;
+      case WebSocket::PONG:
+        break;
+      case WebSocket::CLOSE:
+      {
+        // Echoed, unless it is one no endpoint may send.
+        uint16_t code = CLOSE_NORMAL;
+        if(len >= 2)
+        {
+          code = static_cast<unsigned char>(payload[0]) << 8 | static_cast<unsigned char>(payload[1]);
+        }
+        close(conn, c, len == 1 || !valid_close_code(code) ? CLOSE_PROTOCOL_ERROR : code);
+        break;
+      }
+      default:
+        if((opcode == WebSocket::CONTINUATION) != c.in_message)
+        {
+          close(conn, c, CLOSE_PROTOCOL_ERROR);
+          break;
+        }
+        if(!c.in_message)
+        {
+          c.in_message = true;
+          c.compressed = rsv1;
+          c.message.clear();
+        }
+        c.message.append(payload, len);
+        if(fin)
+        {
+          c.in_message = false;
+          deliver(conn, c);
+        }
+        break;
+    }
+  }
+  c.in.erase(0, pos);
+}
+
+void WebSocketGateway::deliver(ConnectionHandle conn, Connection& c)
+{
+  std::string line;
+  if(c.compressed)
+  {
+    const WebSocket::Inflated result =
+      WebSocket::inflate(c.message.data(), c.message.size(), line, MAX_MESSAGE);
+    if(result != WebSocket::Inflated::OK)
+    {
+      close(conn, c, result == WebSocket::Inflated::TOO_BIG ? CLOSE_TOO_BIG : CLOSE_INVALID_DATA);
+      return;
+    }
+  }
+  else
+  {
+    line.swap(c.message);
+  }
+  c.message.clear();
+
+  // The inner handler reads lines; a message is one.
+  if(line.empty() || line.back() != '\n')
+  {
+    line += '\n';
+  }
+  inner->on_client_data(conn, line.data(), line.size());
+}
+
+void WebSocketGateway::close(ConnectionHandle conn, Connection& c, uint16_t code)
+{
+  const char payload[2] = {static_cast<char>(code >> 8), static_cast<char>(code)};
+  send_control(conn, WebSocket::CLOSE, payload, sizeof(payload));
+  c.closing = true;
+  ConnectionTable::global().shutdown(conn);
+}
@@ -0,0 +1,95 @@
+#ifndef WEBSOCKET_GATEWAY_H
+#define WEBSOCKET_GATEWAY_H
+
+#include "tcp_server.h"
+#include "websocket.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/* WebSocket gateway: lets browsers use any line based handler.
+ * The gateway sits between the server and an inner handler (usually
+ * BroadCastChatHandler). It answers the HTTP upgrade request, then turns
+ * every complete WebSocket message into one line for the inner handler:
+ *
+ *   browser --frames--> gateway --"<message>\n"--> inner handler
+ *   browser <--frames-- WireMessage <--send()----- inner handler
+ *
+ * The inner handler only sees the connection once the upgrade is done, so
+ * everything it sends, the first prompt included, goes out framed: the
+ * upgrade switches the connection's framing in the ConnectionTable and
+ * IClientHandler::send() frames by it (see WireMessage). A chat broadcast
+ * frames each line once and sends that frame to every browser in the room.
+ *
+  | Event                              | Reaction                            |
+  | ---------------------------------- | ----------------------------------- |
+  | not a WebSocket upgrade            | 400 Bad Request, connection shut    |
+  | text or binary message (any frags) | inner on_client_data(message + \n)  |
+  | ping                               | pong with the same payload          |
+  | close                              | close echoed, connection shut       |
+  | close with a 1-byte payload or a   | close 1002 (protocol error)         |
+  |   code no endpoint may send        |                                     |
+  | unmasked, reserved bits, bad order | close 1002 (protocol error)         |
+  | compressed message that does not   | close 1007 (invalid payload data)   |
+  |   inflate                          |                                     |
+  | message over MAX_MESSAGE           | close 1009 (message too big)        |
+ *
+ * Payloads are unmasked in place in the receive buffer. Per-connection
+ * state lives in lock stripes like the chat sessions; a connection's data
+ * is only handled by its own reactor thread, so the stripe lock is held
+ * for the lookup only.
+*/
+class WebSocketGateway : public IClientHandler
+{
+  public:
+    static constexpr size_t MAX_MESSAGE = 1 << 20;
+    static constexpr size_t MAX_REQUEST = 8 * 1024;
+
+    // allow_deflate: accept permessage-deflate if the client offers it
+    // (and the build has zlib).
+    explicit WebSocketGateway(std::shared_ptr<IClientHandler> inner,
+      bool allow_deflate = true);
+
+    void on_client_connect(ConnectionHandle conn) override;
+    void on_client_data(ConnectionHandle conn, const char* data, ssize_t len) override;
+    void on_client_disconnect(ConnectionHandle conn) override;
+
+  private:
+    struct Connection
+    {
+      bool upgraded = false;
+      bool deflate = false;
+      bool closing = false;           // close sent: ignore the rest
+      std::string in;                 // request or frames not complete yet
+      std::string message;            // fragments of the message in progress
+      bool in_message = false;
+      bool compressed = false;        // the message in progress has RSV1
+    };
+
+    struct Stripe
+    {
+      std::mutex mutex;
+      std::unordered_map<ConnectionHandle, std::unique_ptr<Connection>> connections;
+    };
+
+    static const size_t STRIPES = 16;
+
+    const std::shared_ptr<IClientHandler> inner;
+    const bool allow_deflate;
+    Stripe stripes[STRIPES];
+
+    Stripe& stripe_of(ConnectionHandle conn);
+    Connection* find(ConnectionHandle conn);
+    // Consumes the upgrade request once it is complete.
+    void handshake(ConnectionHandle conn, Connection& c);
+    // Handles every complete frame in c.in.
+    void read_frames(ConnectionHandle conn, Connection& c);
+    void deliver(ConnectionHandle conn, Connection& c);
+    void close(ConnectionHandle conn, Connection& c, uint16_t code);
+};
+
+#endif
@@ -0,0 +1,322 @@
+#include "workload_profile.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+
+namespace
+{
+  std::vector<std::string> split(const std::string& spec, char sep)
+  {
+    std::vector<std::string> parts;
+    std::stringstream ss(spec);
+    std::string part;
+    while(std::getline(ss, part, sep))
+    {
+      parts.push_back(part);
+    }
+    return parts;
+  }
+
+  double to_number(const std::string& text, const std::string& spec)
+  {
+    try
+    {
+      size_t used = 0;
+      double value = std::stod(text, &used);
+      if(used != text.size() || !std::isfinite(value) || value < 0)
+      {
+        throw std::invalid_argument(text);
+      }
+      return value;
+    }
+    catch(const std::exception&)
+    {
+      throw std::invalid_argument("bad number '" + text + "' in '" + spec + "'");
+    }
+  }
+}
+
+FixedDistribution::FixedDistribution(double value) : value(value)
+{
+}
+
+double FixedDistribution::sample(std::mt19937_64&)
+{
+  return value;
+}
+
+double FixedDistribution::mean() const
+{
+  return value;
+}
+
+std::string FixedDistribution::describe() const
+{
+  return "fixed(" + std::to_string(value) + ")";
+}
+
+UniformDistribution::UniformDistribution(double min_value, double max_value) :
+  dist(min_value, max_value)
+{
+  if(min_value > max_value)
+  {
+    throw std::invalid_argument("uniform: min is greater than max");
+  }
+}
+
+double UniformDistribution::sample(std::mt19937_64& rng)
+{
+  return std::round(dist(rng));
+}
+
+double UniformDistribution::mean() const
+{
+  return (dist.a() + dist.b()) / 2;
+}
+
+std::string UniformDistribution::describe() const
+{
+  return "uniform(" + std::to_string(dist.a()) + ", " +
+    std::to_string(dist.b()) + ")";
+}
+
+ExponentialDistribution::ExponentialDistribution(double mean_value) :
+  dist(mean_value > 0 ? 1.0 / mean_value : 1.0)
+{
+  if(mean_value <= 0)
+  {
+    throw std::invalid_argument("exponential: mean must be positive");
+  }
+}
+
+double ExponentialDistribution::sample(std::mt19937_64& rng)
+{
+  return dist(rng);
+}
+
+double ExponentialDistribution::mean() const
+{
+  return 1.0 / dist.lambda();
+}
+
+std::string ExponentialDistribution::describe() const
+{
+  return "exponential(mean " + std::to_string(mean()) + ")";
+}
+
+LogNormalDistribution::LogNormalDistribution(
+  double median, double sigma, double max_value) :
+  dist(std::log(median > 0 ? median : 1.0), sigma), median(median),
+  max_value(max_value)
+{
+  if(median <= 0)
+  {
+    throw std::invalid_argument("lognormal: median must be positive");
+  }
+}
+
+double LogNormalDistribution::sample(std::mt19937_64& rng)
+{
+  // The long right tail is the point of this distribution, but a single
+  // multi-gigabyte "message" would only measure the allocator.
+  return std::min(std::round(dist(rng)), max_value);
+}
+
+double LogNormalDistribution::mean() const
+{
+  // Mean of the unclamped distribution; good enough for reporting.
+  return std::min(std::exp(dist.m() + dist.s() * dist.s() / 2), max_value);
+}
+
+std::string LogNormalDistribution::describe() const
+{
+  return "lognormal(median " + std::to_string(median) + ", sigma " +
+    std::to_string(dist.s()) + ", max " + std::to_string(max_value) + ")";
+}
+
+EmpiricalDistribution::EmpiricalDistribution(
+  std::vector<double> values_in, const std::vector<double>& weights) :
+  values(std::move(values_in)), dist(weights.begin(), weights.end()),
+  mean_value(0)
+{
+  if(values.empty() || values.size() != weights.size())
+  {
+    throw std::invalid_argument("empirical: needs one weight per value");
+  }
+
+  const double total = std::accumulate(weights.begin(), weights.end(), 0.0);
+  if(total <= 0)
+  {
+    throw std::invalid_argument("empirical: weights sum to zero");
+  }
+
+  for(size_t i = 0; i < values.size(); ++i)
+  {
+    mean_value += values[i] * weights[i] / total;
+  }
+}
+
+double EmpiricalDistribution::sample(std::mt19937_64& rng)
+{
+  return values[dist(rng)];
+}
+
+double EmpiricalDistribution::mean() const
+{
+  return mean_value;
+}
+
+std::string EmpiricalDistribution::describe() const
+{
+  return "empirical(" + std::to_string(values.size()) + " buckets, mean " +
+    std::to_string(mean_value) + ")";
+}
+
+std::unique_ptr<EmpiricalDistribution> EmpiricalDistribution::from_file(
+  const std::string& path)
+{
+  // One sample per line: "value" or "value weight". Lines starting with '#'
+  // are comments, so a captured histogram can carry its own provenance.
+  std::ifstream in(path);
+  if(!in)
+  {
+    throw std::invalid_argument("empirical: cannot open " + path);
+  }
+
+  std::vector<double> values;
+  std::vector<double> weights;
+  std::string line;
+  while(std::getline(in, line))
+  {
+    if(line.empty() || line[0] == '#')
+    {
+      continue;
+    }
+
+    std::istringstream fields(line);
+    double value = 0;
+    double weight = 1;
+    // The weight is optional, but whatever follows the value must be one.
+    if(!(fields >> value) || (!(fields >> std::ws).eof() && !(fields >> weight))
+      || !(fields >> std::ws).eof())
+    {
+      throw std::invalid_argument("empirical: bad line '" + line + "'");
+    }
+    if(!std::isfinite(value) || value < 0)
+    {
+      throw std::invalid_argument("empirical: bad value in '" + line + "'");
+    }
+    if(!std::isfinite(weight) || weight < 0)
+    {
+      throw std::invalid_argument("empirical: bad weight in '" + line + "'");
+    }
+    values.push_back(value);
+    weights.push_back(weight);
+  }
+
+  return std::make_unique<EmpiricalDistribution>(std::move(values), weights);
+}
+
+std::unique_ptr<IDistribution> parse_distribution(const std::string& spec)
+{
+  const auto parts = split(spec, ':');
+  if(parts.empty())
+  {
+    throw std::invalid_argument("empty distribution spec");
+  }
+
+  const std::string& kind = parts[0];
+  auto arg = [&](size_t i) { return to_number(parts.at(i), spec); };
+
+  if(kind == "none" && parts.size() == 1)
+  {
+    return std::make_unique<FixedDistribution>(0);
+  }
+  if(kind == "fixed" && parts.size() == 2)
+  {
+    return std::make_unique<FixedDistribution>(arg(1));
+  }
+  if(kind == "uniform" && parts.size() == 3)
+  {
+    return std::make_unique<UniformDistribution>(arg(1), arg(2));
+  }
+  if(kind == "exponential" && parts.size() == 2)
+  {
+    return std::make_unique<ExponentialDistribution>(arg(1));
+  }
+  if(kind == "lognormal" && (parts.size() == 3 || parts.size() == 4))
+  {
+    const double max_value = parts.size() == 4 ? arg(3) : 1 << 20;
+    return std::make_unique<LogNormalDistribution>(arg(1), arg(2), max_value);
+  }
+  if(kind == "empirical" && parts.size() >= 2)
+  {
+    // Paths may contain ':' so everything after the kind is the path.
+    return EmpiricalDistribution::from_file(spec.substr(kind.size() + 1));
+  }
+
+  throw std::invalid_argument("unknown distribution spec '" + spec + "'");
+}
+
+ZipfSampler::ZipfSampler(size_t n, double s)
+{
+  if(n == 0)
+  {
+    throw std::invalid_argument("zipf: need at least one rank");
+  }
+
+  cdf.resize(n);
+  double total = 0;
+  for(size_t k = 0; k < n; ++k)
+  {
+    total += 1.0 / std::pow(static_cast<double>(k + 1), s);
+    cdf[k] = total;
+  }
+  for(auto& c : cdf)
+  {
+    c /= total;
+  }
+  cdf.back() = 1.0;
+}
+
+size_t ZipfSampler::sample(std::mt19937_64& rng) const
+{
+  std::uniform_real_distribution<double> u(0.0, 1.0);
+  auto it = std::lower_bound(cdf.begin(), cdf.end(), u(rng));
+  return std::min<size_t>(it - cdf.begin(), cdf.size() - 1);
+}
+
+double ZipfSampler::weight(size_t rank) const
+{
+  return rank == 0 ? cdf[0] : cdf[rank] - cdf[rank - 1];
+}
+
+WorkloadProfile WorkloadProfile::defaults()
+{
+  WorkloadProfile profile;
+  profile.message_size = std::make_shared<FixedDistribution>(21);
+  profile.think_time_ms = std::make_shared<FixedDistribution>(0);
+  return profile;
+}
+
+size_t WorkloadProfile::sample_size(std::mt19937_64& rng) const
+{
+  const double size = message_size->sample(rng);
+  // Also covers a NaN, which compares false with everything.
+  if(!(size > 0))
+  {
+    return 0;
+  }
+  return static_cast<size_t>(std::min(size, static_cast<double>(MAX_MESSAGE_BYTES)));
+}
+
+std::string WorkloadProfile::describe() const
+{
+  return "size=" + message_size->describe() +
+    " think_ms=" + think_time_ms->describe() +
+    " zipf_s=" + std::to_string(zipf_s);
+}
@@ -0,0 +1,144 @@
+#ifndef WORKLOAD_PROFILE_H
+#define WORKLOAD_PROFILE_H
+
+#include <cstddef>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+/* Workload profiles for the load generators.
+ * A profile describes "what the traffic looks like" independently of how it is
+ * sent, so the same mix can drive the echo load client, the chat simulator and
+ * the benchmark runner.
+ *
+  | Spec                               | Meaning                                   |
+  | ---------------------------------- | ----------------------------------------- |
+  | `fixed:V`                          | Always V                                  |
+  | `uniform:MIN:MAX`                  | Uniform integer in [MIN, MAX]             |
+  | `exponential:MEAN`                 | Exponential with mean MEAN                |
+  | `lognormal:MEDIAN:SIGMA[:MAX]`     | exp(N(ln MEDIAN, SIGMA)), clamped to MAX  |
+  | `empirical:PATH`                   | Lines "value [weight]" read from PATH     |
+  | `none`                             | Always 0 (only useful for think time)     |
+ *
+ * Sizes are in bytes, think times in milliseconds. Negative, infinite and
+ * NaN values are rejected, in specs and in empirical files alike.
+*/
+
+class IDistribution
+{
+  public:
+    virtual ~IDistribution() = default;
+    virtual double sample(std::mt19937_64& rng) = 0;
+    virtual double mean() const = 0;
+    virtual std::string describe() const = 0;
+};
+
+class FixedDistribution : public IDistribution
+{
+  public:
+    explicit FixedDistribution(double value);
+    double sample(std::mt19937_64& rng) override;
+    double mean() const override;
+    std::string describe() const override;
+
+  private:
+    const double value;
+};
+
+class UniformDistribution : public IDistribution
+{
+  public:
+    UniformDistribution(double min_value, double max_value);
+    double sample(std::mt19937_64& rng) override;
+    double mean() const override;
+    std::string describe() const override;
+
+  private:
+    std::uniform_real_distribution<double> dist;
+};
+
+class ExponentialDistribution : public IDistribution
+{
+  public:
+    explicit ExponentialDistribution(double mean_value);
+    double sample(std::mt19937_64& rng) override;
+    double mean() const override;
+    std::string describe() const override;
+
+  private:
+    std::exponential_distribution<double> dist;
+};
+
+class LogNormalDistribution : public IDistribution
+{
+  public:
+    LogNormalDistribution(double median, double sigma, double max_value);
+    double sample(std::mt19937_64& rng) override;
+    double mean() const override;
+    std::string describe() const override;
+
+  private:
+    std::lognormal_distribution<double> dist;
+    const double median;
+    const double max_value;
+};
+
+class EmpiricalDistribution : public IDistribution
+{
+  public:
+    EmpiricalDistribution(
+      std::vector<double> values, const std::vector<double>& weights);
+    double sample(std::mt19937_64& rng) override;
+    double mean() const override;
+    std::string describe() const override;
+
+    static std::unique_ptr<EmpiricalDistribution> from_file(
+      const std::string& path);
+
+  private:
+    std::vector<double> values;
+    std::discrete_distribution<size_t> dist;
+    double mean_value;
+};
+
+// Parses one of the specs from the table above; throws std::invalid_argument.
+std::unique_ptr<IDistribution> parse_distribution(const std::string& spec);
+
+/* Zipf-skewed activity.
+ * Rank k (1-based) gets weight 1 / k^s. s = 0 is uniform; s around 1 gives
+ * the usual "a few very chatty users, a long tail of quiet ones".
+*/
+class ZipfSampler
+{
+  public:
+    ZipfSampler(size_t n, double s);
+
+    size_t sample(std::mt19937_64& rng) const;   // 0-based rank
+    double weight(size_t rank) const;            // normalised, sums to 1
+    size_t size() const { return cdf.size(); }
+
+  private:
+    std::vector<double> cdf;
+};
+
+struct WorkloadProfile
+{
+  // Upper bound of a message_size sample; one bigger message would only
+  // measure the allocator.
+  static constexpr size_t MAX_MESSAGE_BYTES = size_t(1) << 30;
+
+  std::shared_ptr<IDistribution> message_size;
+  std::shared_ptr<IDistribution> think_time_ms;
+  double zipf_s = 0.0;
+
+  // Defaults reproduce client_tcp.cpp: one 21 byte line, no think time.
+  static WorkloadProfile defaults();
+
+  // A message_size sample as a byte count in [0, MAX_MESSAGE_BYTES].
+  size_t sample_size(std::mt19937_64& rng) const;
+
+  std::string describe() const;
+};
+
+#endif